@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "wg-obfuscator.h"
+#include "batch.h"
+#include "stats.h"
+#include "obfuscation.h"
+#include "pipeline.h"
+#ifdef USE_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+#ifdef USE_MMSG
+// Ancillary data of one message: the GRO segment size, the drop counter, the timestamp and the TOS byte
+// on receive, the GSO segment size or the departure time and the TOS byte on send
+#define CONTROL_SIZE    (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec)) \
+                        + CMSG_SPACE(sizeof(int)))
+#endif
+
+int batch_init(packet_batch_t *batch, int size, uint8_t udp_offload)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->raw_sock = -1;
+    batch->rx_drops = -1;
+    batch->rx_slot = -1;
+    batch->latency_histogram = -1;
+    batch->rx_tos = -1;
+    batch->tos = -1;
+    batch->size = size;
+    batch->capacity = size;
+#ifdef USE_UDP_OFFLOAD
+    if (udp_offload) {
+        batch->gro = 1;
+        batch->gso = 1;
+        // Every coalesced datagram may turn into GSO_MAX_SEGMENTS queued ones
+        batch->capacity = size * GSO_MAX_SEGMENTS;
+        batch->arena_size = OFFLOAD_ARENA_SIZE;
+        batch->arena = malloc(batch->arena_size);
+        if (!batch->arena) {
+            return -1;
+        }
+    }
+#else
+    (void)udp_offload;
+#endif
+    batch->slots = calloc((size_t)size, sizeof(*batch->slots));
+    batch->items = calloc((size_t)batch->capacity, sizeof(*batch->items));
+#ifdef USE_MMSG
+    batch->msgs = calloc((size_t)batch->capacity, sizeof(*batch->msgs));
+    batch->iovs = calloc((size_t)batch->capacity, sizeof(*batch->iovs));
+    batch->index = calloc((size_t)batch->capacity + 1, sizeof(*batch->index));
+    batch->order = calloc((size_t)batch->capacity, sizeof(*batch->order));
+    batch->control = calloc((size_t)batch->capacity, CONTROL_SIZE);
+    if (!batch->msgs || !batch->iovs || !batch->index || !batch->order || !batch->control) {
+        return -1;
+    }
+#endif
+    if (!batch->slots || !batch->items) {
+        return -1;
+    }
+    for (int i = 0; i < size; i++) {
+        batch->slots[i].data = malloc(BUFFER_SIZE + PREBUFFER_SIZE);
+        if (!batch->slots[i].data) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int batch_enable_gro(int sock)
+{
+#ifdef USE_UDP_OFFLOAD
+    int optval = 1;
+    return setsockopt(sock, SOL_UDP, UDP_GRO, &optval, sizeof(optval));
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int batch_enable_drop_counter(int sock)
+{
+#ifdef USE_RXQ_OVFL
+    int optval = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval));
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int batch_enable_timestamps(int sock)
+{
+#ifdef SO_TIMESTAMPNS
+    int optval = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval));
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int batch_enable_tos(int sock)
+{
+#ifdef IP_RECVTOS
+    int optval = 1;
+    return setsockopt(sock, IPPROTO_IP, IP_RECVTOS, &optval, sizeof(optval));
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int batch_enable_txtime(int sock)
+{
+#ifdef USE_TXTIME
+    // Without deadline mode: the fq qdisc sends the datagram at its time, or right away if it's late
+    struct sock_txtime txtime = {
+        .clockid = CLOCK_MONOTONIC,
+        .flags = 0
+    };
+    return setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int batch_recv(packet_batch_t *batch, int sock)
+{
+    batch->rx_drops = -1;
+#ifdef USE_MMSG
+    for (int i = 0; i < batch->size; i++) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        batch->iovs[i].iov_base = batch->slots[i].data + PREBUFFER_SIZE;
+        batch->iovs[i].iov_len = BUFFER_SIZE;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &batch->slots[i].addr;
+        hdr->msg_namelen = sizeof(batch->slots[i].addr);
+        hdr->msg_iov = &batch->iovs[i];
+        hdr->msg_iovlen = 1;
+        // See CONTROL_SIZE
+        hdr->msg_control = batch->control + i * CONTROL_SIZE;
+        hdr->msg_controllen = CONTROL_SIZE;
+    }
+    int n = recvmmsg(sock, batch->msgs, batch->size, MSG_TRUNC | MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        // A readiness notification does not guarantee that there is something
+        // to read by the time we get here, so an empty socket is not an error
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        rx_slot_t *slot = &batch->slots[i];
+        slot->length = batch->msgs[i].msg_len;
+        slot->gso_size = 0;
+        slot->rx_ns = 0;
+        slot->tos = -1;
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+#ifdef USE_UDP_OFFLOAD
+            if (batch->gro && cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                if (gso_size > 0 && gso_size < slot->length && slot->length <= BUFFER_SIZE) {
+                    slot->gso_size = gso_size;
+                    stats.rx_packets += (slot->length + gso_size - 1) / gso_size - 1;
+                    stats.rx_gro_packets += (slot->length + gso_size - 1) / gso_size;
+                }
+            }
+#endif
+#ifdef USE_RXQ_OVFL
+            // The counter as of when the datagram was queued, so the last one is the latest
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                batch->rx_drops = drops;
+            }
+#endif
+#ifdef SCM_TIMESTAMPNS
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                slot->rx_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+            }
+#endif
+            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+                slot->tos = *CMSG_DATA(cmsg);
+            }
+        }
+    }
+#else
+    int n = 0;
+    while (n < batch->size) {
+        rx_slot_t *slot = &batch->slots[n];
+        socklen_t addr_len = sizeof(slot->addr);
+        int length = recvfrom(sock, slot->data + PREBUFFER_SIZE, BUFFER_SIZE, MSG_TRUNC | MSG_DONTWAIT,
+            (struct sockaddr *)&slot->addr, &addr_len);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            break;
+        }
+        slot->length = length;
+        slot->gso_size = 0;
+        slot->rx_ns = 0;
+        slot->tos = -1;
+        n++;
+    }
+#endif
+    if (n > 0) {
+        stats.rx_calls++;
+        stats.rx_packets += n;
+    }
+    return n;
+}
+
+uint8_t *batch_segment(packet_batch_t *batch, rx_slot_t *slot, int offset, int *length)
+{
+    int left = slot->length - offset;
+    *length = left < slot->gso_size ? left : slot->gso_size;
+    // With the headroom and the room to grow up to a full datagram
+    if (batch->arena_used + PREBUFFER_SIZE + BUFFER_SIZE > batch->arena_size) {
+        batch_flush(batch);
+    }
+    uint8_t *segment = batch->arena + batch->arena_used + PREBUFFER_SIZE;
+    memcpy(segment, slot->data + PREBUFFER_SIZE + offset, *length);
+    return segment;
+}
+
+int batch_in_slot(const rx_slot_t *slot, const uint8_t *buffer)
+{
+    return buffer >= slot->data && buffer < slot->data + BUFFER_SIZE + PREBUFFER_SIZE;
+}
+
+void batch_queue(packet_batch_t *batch, int sock, uint8_t *buffer, int length, const struct sockaddr_in *addr, void *ctx)
+{
+    if (batch->tx_count >= batch->capacity) {
+        batch_flush(batch);
+    }
+    if (batch->arena && buffer >= batch->arena + batch->arena_used && buffer < batch->arena + batch->arena_size) {
+        // The segment from batch_segment() stays where it is, the next one goes after it
+        batch->arena_used = buffer + length - batch->arena;
+    }
+    tx_item_t *item = &batch->items[batch->tx_count++];
+    item->sock = sock;
+    item->buffer = buffer;
+    item->length = length;
+    item->has_addr = addr != NULL;
+    if (addr) {
+        item->addr = *addr;
+    }
+    item->xor_data = batch->pipeline ? xor_data_take_deferred(&item->xor_length) : NULL;
+    item->ctx = ctx;
+    item->rx_slot = batch->rx_slot >= 0 && batch_in_slot(&batch->slots[batch->rx_slot], buffer) ? batch->rx_slot : -1;
+    item->rx_ns = batch->rx_ns;
+    item->latency_histogram = batch->latency_histogram;
+    batch->latency_histogram = -1;
+    item->txtime = batch->txtime;
+    batch->txtime = 0;
+    item->tos = batch->tos;
+    batch->tos = -1;
+}
+
+/**
+ * @brief Counts the latency of the queued datagrams which came with a kernel receive timestamp.
+ */
+static void record_latency(const packet_batch_t *batch)
+{
+    uint64_t now_ns = 0;
+    for (int i = 0; i < batch->tx_count; i++) {
+        const tx_item_t *item = &batch->items[i];
+        if (item->latency_histogram < 0 || !item->rx_ns) {
+            continue;
+        }
+        if (!now_ns) {
+            now_ns = latency_realtime_ns();
+        }
+        latency_record(item->latency_histogram, item->rx_ns, now_ns);
+    }
+}
+
+/**
+ * @brief Allocates buffers for another 'backlog_limit' datagrams of the backlogs.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int backlog_grow(packet_batch_t *batch)
+{
+    int total = batch->backlog_buffers + batch->backlog_limit;
+    uint8_t **free_buffers = realloc(batch->backlog_free, total * sizeof(*free_buffers));
+    if (!free_buffers) {
+        return -1;
+    }
+    batch->backlog_free = free_buffers;
+    uint8_t *pool = malloc((size_t)batch->backlog_limit * BUFFER_SIZE);
+    if (!pool) {
+        return -1;
+    }
+    for (int i = 0; i < batch->backlog_limit; i++) {
+        batch->backlog_free[batch->backlog_free_count++] = pool + (size_t)i * BUFFER_SIZE;
+    }
+    batch->backlog_buffers = total;
+    return 0;
+}
+
+int batch_set_backlog(packet_batch_t *batch, int limit, batch_backlog_cb_t callback)
+{
+    batch->backlog_limit = limit;
+    batch->backlog_cb = callback;
+    return backlog_grow(batch);
+}
+
+/**
+ * @brief Returns 1 if the send failed only because the send buffer of the socket was full.
+ */
+static int would_block(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+/**
+ * @brief Returns the backlog of the socket, NULL if nothing is waiting for it.
+ */
+static tx_backlog_t *backlog_of(const packet_batch_t *batch, int sock)
+{
+    if (sock < 0 || sock >= batch->backlogs_size || !batch->backlogs[sock] || !batch->backlogs[sock]->count) {
+        return NULL;
+    }
+    return batch->backlogs[sock];
+}
+
+/**
+ * @brief Copies the datagram to the end of the backlog of its socket, drops it if the backlog is full.
+ * When the first datagram is added, tells the event loop to wait for the socket to become writable.
+ */
+static void backlog_add(packet_batch_t *batch, const tx_item_t *item)
+{
+    int sock = item->sock;
+    if (sock >= batch->backlogs_size) {
+        int size = batch->backlogs_size ? batch->backlogs_size : 64;
+        while (size <= sock) {
+            size *= 2;
+        }
+        tx_backlog_t **backlogs = realloc(batch->backlogs, size * sizeof(*backlogs));
+        if (!backlogs) {
+            stats.tx_queue_dropped++;
+            return;
+        }
+        memset(backlogs + batch->backlogs_size, 0, (size - batch->backlogs_size) * sizeof(*backlogs));
+        batch->backlogs = backlogs;
+        batch->backlogs_size = size;
+    }
+    tx_backlog_t *backlog = batch->backlogs[sock];
+    if (!backlog) {
+        backlog = calloc(1, sizeof(*backlog));
+        if (backlog) {
+            backlog->items = calloc((size_t)batch->backlog_limit, sizeof(*backlog->items));
+        }
+        if (!backlog || !backlog->items) {
+            free(backlog);
+            stats.tx_queue_dropped++;
+            return;
+        }
+        batch->backlogs[sock] = backlog;
+    }
+    if (backlog->count >= batch->backlog_limit || (!batch->backlog_free_count && backlog_grow(batch) != 0)) {
+        stats.tx_queue_dropped++;
+        return;
+    }
+    uint8_t *data = batch->backlog_free[--batch->backlog_free_count];
+    memcpy(data, item->buffer, item->length);
+    tx_pending_t *pending = &backlog->items[(backlog->head + backlog->count) % batch->backlog_limit];
+    pending->data = data;
+    pending->length = item->length;
+    pending->addr = item->addr;
+    pending->has_addr = item->has_addr;
+    pending->tos = item->tos;
+    pending->txtime = item->txtime;
+    backlog->count++;
+    stats.tx_queued++;
+    if (backlog->count == 1) {
+        backlog->ctx = item->ctx;
+        if (batch->backlog_cb) {
+            batch->backlog_cb(sock, item->ctx, 1);
+        }
+    }
+}
+
+/**
+ * @brief Removes the first datagram from the backlog, its buffer goes back to the pool.
+ */
+static void backlog_pop(packet_batch_t *batch, tx_backlog_t *backlog)
+{
+    batch->backlog_free[batch->backlog_free_count++] = backlog->items[backlog->head].data;
+    backlog->head = (backlog->head + 1) % batch->backlog_limit;
+    backlog->count--;
+}
+
+#ifdef USE_MMSG
+/**
+ * @brief Appends one item of ancillary data to a message.
+ */
+static void add_control(struct msghdr *hdr, int level, int type, const void *data, size_t size)
+{
+    struct cmsghdr *cmsg = (struct cmsghdr *)((char *)hdr->msg_control + hdr->msg_controllen);
+    cmsg->cmsg_level = level;
+    cmsg->cmsg_type = type;
+    cmsg->cmsg_len = CMSG_LEN(size);
+    memcpy(CMSG_DATA(cmsg), data, size);
+    hdr->msg_controllen += CMSG_SPACE(size);
+}
+
+/**
+ * @brief Sets the TOS byte of a message to send, if it is set (-1 keeps the one of the socket).
+ */
+static void set_tos(packet_batch_t *batch, int n, int tos)
+{
+    if (tos >= 0) {
+        struct msghdr *hdr = &batch->msgs[n].msg_hdr;
+        hdr->msg_control = batch->control + n * CONTROL_SIZE;
+        add_control(hdr, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    }
+}
+#endif
+
+void batch_send_backlog(packet_batch_t *batch, int sock)
+{
+    tx_backlog_t *backlog = backlog_of(batch, sock);
+    if (!backlog) {
+        return;
+    }
+    while (backlog->count > 0) {
+#ifdef USE_MMSG
+        int n = 0;
+        while (n < backlog->count && n < batch->capacity) {
+            tx_pending_t *pending = &backlog->items[(backlog->head + n) % batch->backlog_limit];
+            struct msghdr *hdr = &batch->msgs[n].msg_hdr;
+            memset(hdr, 0, sizeof(*hdr));
+            batch->iovs[n].iov_base = pending->data;
+            batch->iovs[n].iov_len = pending->length;
+            if (pending->has_addr) {
+                hdr->msg_name = &pending->addr;
+                hdr->msg_namelen = sizeof(pending->addr);
+            }
+            hdr->msg_iov = &batch->iovs[n];
+            hdr->msg_iovlen = 1;
+#ifdef USE_TXTIME
+            // Keep its pacing, a departure time in the past is sent right away
+            if (pending->txtime) {
+                hdr->msg_control = batch->control + n * CONTROL_SIZE;
+                add_control(hdr, SOL_SOCKET, SCM_TXTIME, &pending->txtime, sizeof(pending->txtime));
+            }
+#endif
+            set_tos(batch, n, pending->tos);
+            n++;
+        }
+        int r = sendmmsg(sock, batch->msgs, n, MSG_DONTWAIT);
+#else
+        tx_pending_t *pending = &backlog->items[backlog->head];
+        int r = pending->has_addr
+            ? sendto(sock, pending->data, pending->length, MSG_DONTWAIT, (struct sockaddr *)&pending->addr, sizeof(pending->addr))
+            : send(sock, pending->data, pending->length, MSG_DONTWAIT);
+        r = r < 0 ? -1 : 1;
+#endif
+        stats.tx_calls++;
+        if (r < 0) {
+            if (would_block(errno)) {
+                return; // Still full, the next notification comes when there is room
+            }
+            // Drop the refused one and go on
+            serror_level(LL_DEBUG, "send from the backlog");
+            stats.tx_errors++;
+            backlog_pop(batch, backlog);
+            continue;
+        }
+        for (int m = 0; m < r; m++) {
+            backlog_pop(batch, backlog);
+        }
+        stats.tx_packets += r;
+        stats.tx_queue_flushed += r;
+    }
+    if (batch->backlog_cb) {
+        batch->backlog_cb(sock, backlog->ctx, 0);
+    }
+}
+
+void batch_drop_backlog(packet_batch_t *batch, int sock)
+{
+    if (sock < 0 || sock >= batch->backlogs_size || !batch->backlogs[sock]) {
+        return;
+    }
+    tx_backlog_t *backlog = batch->backlogs[sock];
+    stats.tx_queue_dropped += backlog->count;
+    while (backlog->count > 0) {
+        backlog_pop(batch, backlog);
+    }
+    free(backlog->items);
+    free(backlog);
+    batch->backlogs[sock] = NULL;
+}
+
+/**
+ * @brief Logs a failed send at debug level.
+ */
+static void log_send_error(const tx_item_t *item)
+{
+    struct sockaddr_in peer = item->addr;
+    if (!item->has_addr) {
+        socklen_t peer_len = sizeof(peer);
+        memset(&peer, 0, sizeof(peer));
+        getpeername(item->sock, (struct sockaddr *)&peer, &peer_len);
+    }
+    serror_level(LL_DEBUG, "sendto %s:%d", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+}
+
+#if !defined(USE_MMSG) || defined(USE_IO_URING)
+/**
+ * @brief Sends one queued datagram with its own syscall.
+ */
+static void send_item(packet_batch_t *batch, const tx_item_t *item)
+{
+    if (backlog_of(batch, item->sock)) {
+        // Behind the ones already waiting
+        backlog_add(batch, item);
+        return;
+    }
+    int flags = batch->backlog_limit ? MSG_DONTWAIT : 0;
+    ssize_t r;
+    if (item->has_addr) {
+        r = sendto(item->sock, item->buffer, item->length, flags, (struct sockaddr *)&item->addr, sizeof(item->addr));
+    } else {
+        r = send(item->sock, item->buffer, item->length, flags);
+    }
+    stats.tx_calls++;
+    if (r < 0) {
+        if (batch->backlog_limit && would_block(errno)) {
+            backlog_add(batch, item);
+            return;
+        }
+        log_send_error(item);
+        stats.tx_errors++;
+        return;
+    }
+    stats.tx_packets++;
+}
+#endif
+
+#ifdef USE_MMSG
+/**
+ * @brief Returns the number of queued datagrams, starting from order[pos], which can
+ * be sent as one GSO buffer: same destination, all of the same length except the last
+ * one, which may be shorter.
+ */
+static int gso_run_length(const packet_batch_t *batch, const int *order, int pos, int count)
+{
+#ifdef USE_UDP_OFFLOAD
+    const tx_item_t *first = &batch->items[order[pos]];
+    if (!batch->gso || first->sock == batch->raw_sock || first->txtime) {
+        return 1;
+    }
+    int total = first->length;
+    int k = pos + 1;
+    while (k < count && k - pos < GSO_MAX_SEGMENTS) {
+        const tx_item_t *item = &batch->items[order[k]];
+        if (item->has_addr != first->has_addr
+            || (first->has_addr && memcmp(&item->addr, &first->addr, sizeof(item->addr)) != 0)
+            || item->length > first->length
+            || item->txtime
+            || item->tos != first->tos
+            || total + item->length > GSO_MAX_PAYLOAD) {
+            break;
+        }
+        total += item->length;
+        k++;
+        if (item->length < first->length) {
+            break; // only the last segment may be shorter
+        }
+    }
+    return k - pos;
+#else
+    (void)batch; (void)order; (void)pos; (void)count;
+    return 1;
+#endif
+}
+
+/**
+ * @brief Fills message 'n' with 'segs' datagrams, starting from order[pos], one iovec each
+ * from batch->iovs[iov] on. The kernel cuts a GSO buffer by the segment size, not by the iovecs.
+ */
+static void fill_message(packet_batch_t *batch, int n, const int *order, int pos, int segs, int iov)
+{
+    tx_item_t *first = &batch->items[order[pos]];
+    struct msghdr *hdr = &batch->msgs[n].msg_hdr;
+    for (int k = 0; k < segs; k++) {
+        tx_item_t *item = &batch->items[order[pos + k]];
+        batch->iovs[iov + k].iov_base = item->buffer;
+        batch->iovs[iov + k].iov_len = item->length;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    if (first->has_addr) {
+        hdr->msg_name = &first->addr;
+        hdr->msg_namelen = sizeof(first->addr);
+    }
+    hdr->msg_iov = &batch->iovs[iov];
+    hdr->msg_iovlen = segs;
+#ifdef USE_UDP_OFFLOAD
+    if (segs > 1) {
+        uint16_t gso_size = first->length;
+        hdr->msg_control = batch->control + n * CONTROL_SIZE;
+        add_control(hdr, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+    }
+#endif
+#ifdef USE_TXTIME
+    // Paced datagrams are never coalesced
+    if (first->txtime) {
+        hdr->msg_control = batch->control + n * CONTROL_SIZE;
+        add_control(hdr, SOL_SOCKET, SCM_TXTIME, &first->txtime, sizeof(first->txtime));
+    }
+#endif
+    // Coalesced datagrams all have the same one
+    set_tos(batch, n, first->tos);
+}
+
+/**
+ * @brief Sends the queued datagrams order[0..count-1], all for the same socket.
+ */
+static void flush_socket(packet_batch_t *batch, int sock, int *order, int count)
+{
+    if (backlog_of(batch, sock)) {
+        // Behind the ones already waiting
+        for (int i = 0; i < count; i++) {
+            backlog_add(batch, &batch->items[order[i]]);
+        }
+        return;
+    }
+    int flags = batch->backlog_limit ? MSG_DONTWAIT : 0;
+    int pos = 0;
+    while (pos < count) {
+        int n = 0;
+        int p = pos;
+        while (p < count && n < batch->capacity) {
+            int segs = gso_run_length(batch, order, p, count);
+            fill_message(batch, n, order, p, segs, p - pos);
+            batch->index[n++] = p;
+            p += segs;
+        }
+        batch->index[n] = p;
+
+        int r = sendmmsg(sock, batch->msgs, n, flags);
+        stats.tx_calls++;
+        if (r < 0 && batch->backlog_limit && would_block(errno)) {
+            // The send buffer is full, the rest waits for the socket to become writable
+            for (int k = pos; k < count; k++) {
+                backlog_add(batch, &batch->items[order[k]]);
+            }
+            return;
+        }
+        if (r < 0) {
+            // The first message of the rest was refused
+            int segs = batch->index[1] - pos;
+#ifdef USE_UDP_OFFLOAD
+            if (segs > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                log(LL_WARN, "UDP GSO is not supported by the kernel or the network device (%s), sending packets one by one",
+                    strerror(errno));
+                batch->gso = 0;
+                continue; // retry the same packets without coalescing
+            }
+#endif
+            // Drop it and go on
+            log_send_error(&batch->items[order[pos]]);
+            stats.tx_errors += segs;
+            pos += segs;
+            continue;
+        }
+        for (int m = 0; m < r; m++) {
+            int segs = batch->index[m + 1] - batch->index[m];
+            stats.tx_packets += segs;
+            if (segs > 1) {
+                stats.tx_gso_packets += segs;
+            }
+        }
+        pos = batch->index[r];
+    }
+}
+#endif
+
+void batch_flush(packet_batch_t *batch)
+{
+    // At the hand-off to the kernel (or to the pipeline threads)
+    record_latency(batch);
+    if (batch->pipeline) {
+        pipeline_submit(batch->pipeline, batch);
+        return;
+    }
+#ifdef USE_IO_URING
+    if (batch->uring) {
+        for (int i = 0; i < batch->tx_count; i++) {
+            tx_item_t *item = &batch->items[i];
+            if (uring_send(batch->uring, item->sock, item->buffer, item->length, item->has_addr ? &item->addr : NULL,
+                    item->txtime, item->tos) < 0) {
+                // Too many sends in flight: send this one right away, after the ones already queued
+                uring_submit(batch->uring);
+                send_item(batch, item);
+            }
+        }
+        batch->tx_count = 0;
+        batch->arena_used = 0;
+        return;
+    }
+#endif
+#ifdef USE_MMSG
+    int *order = batch->order;
+    for (int first = 0; first < batch->tx_count; first++) {
+        int sock = batch->items[first].sock;
+        if (sock < 0) {
+            continue; // already sent with an earlier group
+        }
+        // Collect all the datagrams for this socket, keeping their order
+        int count = 0;
+        for (int i = first; i < batch->tx_count; i++) {
+            if (batch->items[i].sock == sock) {
+                order[count++] = i;
+            }
+        }
+        flush_socket(batch, sock, order, count);
+        for (int i = 0; i < count; i++) {
+            batch->items[order[i]].sock = -1;
+        }
+    }
+#else
+    for (int i = 0; i < batch->tx_count; i++) {
+        send_item(batch, &batch->items[i]);
+    }
+#endif
+    batch->tx_count = 0;
+    batch->arena_used = 0;
+}
@@ -0,0 +1,262 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+#include "uring.h"
+
+#ifdef USE_MMSG
+#include <sys/socket.h>
+#include <netinet/udp.h>
+// UDP GRO/GSO need recvmmsg()/sendmmsg() with ancillary data
+#ifdef UDP_SEGMENT
+#define USE_UDP_OFFLOAD
+#define GSO_MAX_SEGMENTS        64                  // maximum number of segments the kernel accepts in one buffer
+#define GSO_MAX_PAYLOAD         (BUFFER_SIZE - 28)  // maximum UDP payload in one buffer
+#define OFFLOAD_ARENA_SIZE      (4 * (BUFFER_SIZE + PREBUFFER_SIZE))
+#endif
+#endif
+
+// One received datagram. Every slot keeps PREBUFFER_SIZE bytes of headroom in front
+// of the payload, so masking handlers can prepend headers by moving the pointer back.
+typedef struct {
+    uint8_t *data;                  // BUFFER_SIZE + PREBUFFER_SIZE bytes of storage
+    int length;                     // datagram length, larger than BUFFER_SIZE if it was truncated
+    struct sockaddr_in addr;        // sender address
+    int gso_size;                   // segment size if the kernel coalesced several datagrams (UDP GRO), 0 otherwise
+    uint64_t rx_ns;                 // kernel receive timestamp (latency histograms), 0 if none
+    int tos;                        // TOS byte (DSCP and ECN) of the datagram, -1 if not reported
+} rx_slot_t;
+
+// One datagram waiting to be sent. The buffer points into an rx slot (or into the
+// send arena for a GRO segment), so the batch must be flushed before the next receive.
+typedef struct {
+    int sock;                       // socket to send through
+    uint8_t *buffer;                // data to send
+    int length;                     // length of the data
+    struct sockaddr_in addr;        // destination address, used only if has_addr is set
+    uint8_t has_addr;               // 0 for connected sockets
+    uint8_t *xor_data;              // pipeline mode: keystream XOR past the header left to do, NULL if none
+    int xor_length;
+    void *ctx;                      // owner of the socket, passed to the backlog callback
+    int rx_slot;                    // rx slot the buffer points into, -1 if none
+    uint64_t rx_ns;                 // kernel receive timestamp of the datagram it was made from, 0 if none
+    int latency_histogram;          // latency histogram to count it in, -1 if none
+    uint64_t txtime;                // departure time on CLOCK_MONOTONIC (pacing), 0 to send right away
+    int tos;                        // TOS byte to send with, -1 for the one of the socket
+} tx_item_t;
+
+// One datagram a socket did not take because its send buffer was full, a copy in a buffer of the backlog
+typedef struct {
+    uint8_t *data;
+    int length;
+    struct sockaddr_in addr;
+    uint8_t has_addr;
+    int tos;
+    uint64_t txtime;                // departure time on CLOCK_MONOTONIC (pacing), 0 to send right away
+} tx_pending_t;
+
+// Datagrams waiting for a socket to become writable, in the order they were queued
+typedef struct {
+    tx_pending_t *items;            // ring of 'backlog_limit' items
+    int head;
+    int count;
+    void *ctx;                      // owner of the socket
+} tx_backlog_t;
+
+/**
+ * @brief Called when a socket starts or stops waiting to become writable, so the event loop
+ * can watch it for that and call batch_send_backlog().
+ *
+ * @param sock Socket.
+ * @param ctx Owner of the socket, as passed to batch_queue().
+ * @param waiting 1 if there are datagrams waiting, 0 if the backlog is empty now.
+ */
+typedef void (*batch_backlog_cb_t)(int sock, void *ctx, int waiting);
+
+struct pipeline;
+
+typedef struct {
+    int size;                       // maximum number of datagrams per syscall
+    rx_slot_t *slots;               // receive ring, 'size' slots
+    tx_item_t *items;               // send queue, 'capacity' items
+    int capacity;                   // size of the send queue
+    int tx_count;                   // number of queued items
+    uint8_t gro;                    // 1 if the sockets deliver coalesced datagrams (UDP GRO)
+    uint8_t gso;                    // 1 if equal-sized datagrams are sent as one buffer (UDP GSO)
+    int raw_sock;                   // socket whose datagrams carry their own UDP header, never sent as one buffer, -1 if none
+    int64_t rx_drops;               // drop counter of the socket reported by the last batch_recv(), -1 if none
+    int rx_slot;                    // rx slot of the datagram being handled, -1 if none
+    uint64_t rx_ns;                 // kernel receive timestamp of the datagram being handled, 0 if none
+    int latency_histogram;          // latency histogram of the next queued datagram, -1 to not count it
+    uint64_t txtime;                // departure time of the next queued datagram, 0 to send right away
+    int rx_tos;                     // TOS byte of the datagram being handled, -1 if not reported
+    int tos;                        // TOS byte of the next queued datagram, -1 for the one of the socket
+    uint8_t *arena;                 // UDP offload mode: the GRO segments are processed and queued here, one after another
+    int arena_size;
+    int arena_used;
+#ifdef USE_MMSG
+    struct mmsghdr *msgs;           // scratch headers for recvmmsg()/sendmmsg()
+    struct iovec *iovs;
+    int *index;                     // first queued item of every message in msgs (position in order)
+    int *order;                     // queued items for the socket being flushed
+    char *control;                  // ancillary data of every message in msgs
+#endif
+#ifdef USE_IO_URING
+    uring_t *uring;                 // if set, datagrams are queued to io_uring instead of being sent with syscalls
+#endif
+    struct pipeline *pipeline;      // if set, datagrams are handed over to the processing threads instead of being sent
+    int backlog_limit;              // datagrams kept per socket while its send buffer is full, 0 to block on send instead
+    uint8_t **backlog_free;         // buffers of BUFFER_SIZE bytes for them not in use, allocated 'backlog_limit' at a time
+    int backlog_free_count;
+    int backlog_buffers;            // number of them allocated
+    tx_backlog_t **backlogs;        // indexed by socket, NULL if the socket has never backed up
+    int backlogs_size;
+    batch_backlog_cb_t backlog_cb;
+} packet_batch_t;
+
+/**
+ * @brief Allocates the receive ring and the send queue.
+ *
+ * @param batch Batch to initialize.
+ * @param size Maximum number of datagrams per syscall.
+ * @param udp_offload 1 to receive with UDP GRO and send with UDP GSO.
+ * @return 0 on success, -1 if out of memory.
+ */
+int batch_init(packet_batch_t *batch, int size, uint8_t udp_offload);
+
+/**
+ * @brief Asks the kernel to coalesce datagrams received on the socket (UDP GRO).
+ *
+ * @param sock Socket to set the option on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int batch_enable_gro(int sock);
+
+/**
+ * @brief Asks the kernel to report the drop counter of the socket with the received datagrams (SO_RXQ_OVFL).
+ *
+ * @param sock Socket to set the option on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int batch_enable_drop_counter(int sock);
+
+/**
+ * @brief Asks the kernel to timestamp the datagrams received on the socket (SO_TIMESTAMPNS).
+ *
+ * @param sock Socket to set the option on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int batch_enable_timestamps(int sock);
+
+/**
+ * @brief Asks the kernel to report the TOS byte of the datagrams received on the socket (IP_RECVTOS).
+ *
+ * @param sock Socket to set the option on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int batch_enable_tos(int sock);
+
+/**
+ * @brief Lets the datagrams sent through the socket carry a departure time (SO_TXTIME on CLOCK_MONOTONIC).
+ *
+ * @param sock Socket to set the option on.
+ * @return 0 on success, -1 if the kernel does not support it.
+ */
+int batch_enable_txtime(int sock);
+
+/**
+ * @brief Receives up to batch->size datagrams from the socket without blocking.
+ * The drop counter of the socket, if reported, is left in batch->rx_drops.
+ *
+ * @param batch Batch to receive into, the slots are overwritten.
+ * @param sock Socket to receive from.
+ * @return Number of received datagrams (0 if there was nothing to read), or -1 on error.
+ */
+int batch_recv(packet_batch_t *batch, int sock);
+
+/**
+ * @brief Queues a datagram. If the queue is full, it is flushed first.
+ * If batch->latency_histogram is set, the datagram is counted there when it is flushed,
+ * from batch->rx_ns on; it is reset to -1 then. Likewise, if batch->txtime is set, the kernel
+ * holds the datagram until then, and it is reset to 0; if batch->tos is set, the datagram is
+ * sent with this TOS byte, and it is reset to -1. A datagram which has to wait for room
+ * in the send buffer is sent right away when there is room, with its TOS byte.
+ * Nothing is copied: a GRO segment from batch_segment() is queued right where it is.
+ *
+ * @param batch Batch to queue into.
+ * @param sock Socket to send through.
+ * @param buffer Data to send, must stay valid until the next batch_flush().
+ * @param length Length of the data.
+ * @param addr Destination address, NULL for connected sockets.
+ * @param ctx Owner of the socket, passed to the backlog callback, may be NULL.
+ */
+void batch_queue(packet_batch_t *batch, int sock, uint8_t *buffer, int length, const struct sockaddr_in *addr, void *ctx);
+
+/**
+ * @brief Sends all the queued datagrams, one syscall per destination socket.
+ * Datagrams for the same socket are sent in the order they were queued.
+ * With io_uring, they are queued to the ring and go out with the next uring_wait().
+ * In the pipeline mode, they are handed over to the processing threads.
+ * In the UDP offload mode, runs of equal-sized datagrams for the same destination
+ * are handed to the kernel as one buffer (the last one may be shorter).
+ *
+ * @param batch Batch to flush.
+ */
+void batch_flush(packet_batch_t *batch);
+
+/**
+ * @brief Makes the sends non-blocking: the datagrams a socket does not take because its send
+ * buffer is full are kept, up to 'limit' per socket, and sent when it becomes writable.
+ * Buffers for 'limit' of them are allocated here; more only when several sockets are full at once,
+ * and they are kept for reuse.
+ * Without it, sending blocks until there is room. Not used with io_uring and in the pipeline mode.
+ *
+ * @param batch Batch.
+ * @param limit Maximum number of datagrams kept per socket, the newer ones are dropped.
+ * @param callback Called when a socket starts or stops waiting to become writable.
+ * @return 0 on success, -1 if out of memory.
+ */
+int batch_set_backlog(packet_batch_t *batch, int limit, batch_backlog_cb_t callback);
+
+/**
+ * @brief Sends the datagrams waiting for the socket, must be called when it becomes writable.
+ *
+ * @param batch Batch.
+ * @param sock Socket.
+ */
+void batch_send_backlog(packet_batch_t *batch, int sock);
+
+/**
+ * @brief Drops the datagrams waiting for the socket, must be called before it is closed
+ * or handed over to another thread. The callback is not called.
+ *
+ * @param batch Batch.
+ * @param sock Socket.
+ */
+void batch_drop_backlog(packet_batch_t *batch, int sock);
+
+/**
+ * @brief Checks if the buffer points into the storage of the slot.
+ *
+ * @param slot Slot.
+ * @param buffer Buffer.
+ * @return 1 if it does, 0 otherwise.
+ */
+int batch_in_slot(const rx_slot_t *slot, const uint8_t *buffer);
+
+/**
+ * @brief Copies one segment of a coalesced datagram into the free part of the send arena, so
+ * it can be processed (and grow) in place without touching the other segments, and queued
+ * from there. The queue is flushed first if the arena is full.
+ *
+ * @param batch Batch the slot belongs to.
+ * @param slot Slot with a coalesced datagram (gso_size is not 0).
+ * @param offset Offset of the segment, a multiple of slot->gso_size.
+ * @param length Filled with the length of the segment, only the last one may be shorter than gso_size.
+ * @return Pointer to the copy, PREBUFFER_SIZE bytes of headroom are available before it.
+ */
+uint8_t *batch_segment(packet_batch_t *batch, rx_slot_t *slot, int offset, int *length);
+
+#endif // _BATCH_H_
@@ -6,10 +6,46 @@
 #include "wg-obfuscator.h"
 #include "mini_argp.h"
 #include "masking.h"
+#include "uring.h"
+#include "xdp.h"
+#include "offload.h"
+#include "latency.h"
 
 // Executable name
 static const char *arg0;
 
+// Codes of the options which have no short form, they are outside the printable range
+enum {
+    OPT_BATCH_SIZE = 1,
+    OPT_DRAIN_BUDGET,
+    OPT_SEND_QUEUE,
+    OPT_UDP_OFFLOAD,
+    OPT_IO_URING,
+    OPT_THREADS,
+    OPT_PIN_THREADS,
+    OPT_PIPELINE,
+    OPT_XDP_INTERFACE,
+    OPT_XDP_MODE,
+    OPT_TC_OFFLOAD,
+    OPT_LATENCY_MODE,
+    OPT_REALTIME,
+    OPT_TICKLESS,
+    OPT_CONNECTED_CLIENTS,
+    OPT_RAW_UPSTREAM,
+    OPT_SOURCE_POOL,
+    OPT_SOCKET_POOL,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_LATENCY_HISTOGRAMS,
+    OPT_PACING_RATE,
+    OPT_PRESERVE_TOS,
+    OPT_DSCP_MAP,
+    OPT_ICMP_ERRORS,
+    OPT_JUMBO_CACHE,
+    OPT_PORT_HOPPING,
+    OPT_HOP_ON_DROP,
+};
+
 /* The options we understand. */
 static const mini_argp_opt options[] = {
     { "help", '?', 0 },
@@ -33,6 +69,34 @@ static const mini_argp_opt options[] = {
     { "log-file", 'L', 1 },
     { "log-timestamps", 'T', 1 },
     { "resolve-interval", 'R', 1 },
+    { "batch-size", OPT_BATCH_SIZE, 1 },
+    { "drain-budget", OPT_DRAIN_BUDGET, 1 },
+    { "send-queue", OPT_SEND_QUEUE, 1 },
+    { "udp-offload", OPT_UDP_OFFLOAD, 0 },
+    { "io-uring", OPT_IO_URING, 0 },
+    { "threads", OPT_THREADS, 1 },
+    { "pin-threads", OPT_PIN_THREADS, 0 },
+    { "pipeline", OPT_PIPELINE, 1 },
+    { "xdp-interface", OPT_XDP_INTERFACE, 1 },
+    { "xdp-mode", OPT_XDP_MODE, 1 },
+    { "tc-offload", OPT_TC_OFFLOAD, 1 },
+    { "latency-mode", OPT_LATENCY_MODE, 1 },
+    { "realtime", OPT_REALTIME, 0 },
+    { "tickless", OPT_TICKLESS, 0 },
+    { "connected-clients", OPT_CONNECTED_CLIENTS, 0 },
+    { "raw-upstream", OPT_RAW_UPSTREAM, 1 },
+    { "source-pool", OPT_SOURCE_POOL, 1 },
+    { "socket-pool", OPT_SOCKET_POOL, 1 },
+    { "rcvbuf", OPT_RCVBUF, 1 },
+    { "sndbuf", OPT_SNDBUF, 1 },
+    { "latency-histograms", OPT_LATENCY_HISTOGRAMS, 0 },
+    { "pacing-rate", OPT_PACING_RATE, 1 },
+    { "preserve-tos", OPT_PRESERVE_TOS, 0 },
+    { "dscp-map", OPT_DSCP_MAP, 1 },
+    { "icmp-errors", OPT_ICMP_ERRORS, 0 },
+    { "jumbo-cache", OPT_JUMBO_CACHE, 1 },
+    { "port-hopping", OPT_PORT_HOPPING, 1 },
+    { "hop-on-drop", OPT_HOP_ON_DROP, 1 },
     { 0 }
 };
 
@@ -46,8 +110,10 @@ static void show_usage(void)
         "                             (can be used instead of the rest arguments)\n"
         "  -i, --source-if=<ip>       Source interface to listen on\n"
         "                             (optional, default - 0.0.0.0, e.g. all)\n"
-        "  -p, --source-lport=<port>  Source port to listen\n"
-        "  -t, --target=<ip>:<port>   Target IP and port\n"
+        "  -p, --source-lport=<port>  Source port to listen, or a range of them\n"
+        "                             (<first>-<last>)\n"
+        "  -t, --target=<ip>:<port>   Target IP and port, or a range of ports\n"
+        "                             (<ip>:<first>-<last>)\n"
         "  -k, --key=<key>            Obfuscation key \n"
         "                             (required, must be 1-255 characters long)\n"
         "  -a, --masking=<type>       Masking type (optional, default - AUTO)\n"
@@ -85,7 +151,72 @@ static void show_usage(void)
         "                             every N seconds (default: 0 - disabled).\n"
         "                             SIGHUP always triggers a refresh.\n"
         "                             If non-zero, a failed resolve at startup is retried\n"
-        "                             instead of exiting.\n");
+        "                             instead of exiting.\n"
+        "      --batch-size=<number>  Maximum number of packets received or sent\n"
+        "                             with a single system call (default: 16)\n"
+        "      --drain-budget=<number>\n"
+        "                             Maximum number of packets received from one socket\n"
+        "                             per wakeup (default: 64)\n"
+        "      --send-queue=<number>  Maximum number of packets kept per socket while\n"
+        "                             its send buffer is full (default: 256, 0 - wait)\n"
+        "      --udp-offload          Let the kernel coalesce received packets (UDP GRO)\n"
+        "                             and split sent ones (UDP GSO), Linux only\n"
+        "      --io-uring             Use io_uring instead of epoll for receiving\n"
+        "                             and sending, Linux 6.0+ only\n"
+        "      --threads=<number>     Number of worker threads, each with its own\n"
+        "                             listening socket (default: 1), Linux only\n"
+        "      --pin-threads          Pin the worker threads to CPUs and hand every\n"
+        "                             packet to the thread on the CPU it arrived on\n"
+        "      --pipeline=<number>    Receive, process and send on separate threads,\n"
+        "                             with this many processing threads (default: 0)\n"
+        "      --xdp-interface=<name> Receive the packets of the handshaked clients\n"
+        "                             through AF_XDP on this interface, Linux 5.9+ only\n"
+        "      --xdp-mode=<mode>      XDP attach mode: 'native' (default, falls back\n"
+        "                             to 'skb' if the driver has no XDP support) or 'skb'\n"
+        "      --tc-offload=<list>    Forward the data packets of the handshaked clients\n"
+        "                             in the kernel, on these comma-separated interfaces\n"
+        "      --latency-mode=<usec>  Busy poll the sockets and keep polling for this many\n"
+        "                             microseconds after a packet before sleeping\n"
+        "                             (default: 0 - disabled), Linux only\n"
+        "      --realtime             Lock the memory and run the worker threads with\n"
+        "                             the real-time priority, Linux only\n"
+        "      --tickless             Wake up only when a client timer is due and\n"
+        "                             expire the timers of many clients together\n"
+        "      --connected-clients    Give every handshaked client its own socket\n"
+        "                             connected to it, Linux only\n"
+        "      --raw-upstream=<first>-<last>\n"
+        "                             Send to the target through one raw socket, from\n"
+        "                             a port of this range per client, Linux only\n"
+        "      --source-pool=<list>   Bind the sockets to the target to these\n"
+        "                             comma-separated local addresses, each with an\n"
+        "                             optional port range: 10.0.0.2:20000-59999\n"
+        "      --socket-pool=<n>      Keep this many sockets to the target ready for\n"
+        "                             new clients in every worker thread (default: 0)\n"
+        "      --rcvbuf=<bytes>       Receive buffer size of the sockets\n"
+        "                             (default: 0 - system default)\n"
+        "      --sndbuf=<bytes>       Send buffer size of the sockets\n"
+        "                             (default: 0 - system default)\n"
+        "      --latency-histograms   Measure the time from the kernel receiving every\n"
+        "                             packet to sending it on, Linux only\n"
+        "      --pacing-rate=<kbit/s> Send the packets of every client no faster than\n"
+        "                             this, Linux with the fq qdisc only\n"
+        "                             (default: 0 - no pacing)\n"
+        "      --preserve-tos         Forward the DSCP and ECN bits of every packet,\n"
+        "                             Linux only\n"
+        "      --dscp-map=<rules>     Change the DSCP of the forwarded packets, e.g.\n"
+        "                             'up:46=34,down:*=0', implies --preserve-tos\n"
+        "      --icmp-errors          Remove the clients as soon as ICMP reports the\n"
+        "                             server or the client unreachable, Linux only\n"
+        "      --jumbo-cache=<KiB>    Cache the keystream of packets longer than 2048\n"
+        "                             bytes too, in this much memory per thread\n"
+        "                             (default: 0 - up to 2048 bytes only)\n"
+        "      --port-hopping=<s>     Move every client to another port of the\n"
+        "                             target range this often, and to a new source\n"
+        "                             port with its next handshake (default: 0 - never)\n"
+        "      --hop-on-drop=<%>      Move a client to another port of the target\n"
+        "                             range when the throughput from the server falls\n"
+        "                             this many percent below its average\n"
+        "                             (default: 0 - never)\n");
 }
 
 static int parse_opt(const char *lname, char sname, const char *val, void *ctx);
@@ -109,6 +240,14 @@ static void reset_config(obfuscator_config_t *config)
     config->in_timeout = IN_TIMEOUT_DEFAULT;
     config->max_dummy_length_data = MAX_DUMMY_LENGTH_DATA_DEFAULT;
     config->log_timestamps = -1; // auto
+    config->batch_size = BATCH_SIZE_DEFAULT;
+    config->drain_budget = DRAIN_BUDGET_DEFAULT;
+    config->send_queue = SEND_QUEUE_DEFAULT;
+    config->threads = 1;
+    for (int d = 0; d < 64; d++) {
+        config->dscp_map[DIR_CLIENT_TO_SERVER][d] = d;
+        config->dscp_map[DIR_SERVER_TO_CLIENT][d] = d;
+    }
     verbose = LL_DEFAULT;
 }
 
@@ -157,6 +296,58 @@ static int parse_bool(const char *str)
     return -1;
 }
 
+/**
+ * Parses the DSCP remapping rules into the configuration: comma-separated "<from>=<to>",
+ * each optionally prefixed with "up:" (client to server) or "down:" (server to client)
+ * to apply in one direction only, "*" as <from> for all the values. Later rules win.
+ *
+ * @param config Pointer to the obfuscator_config structure to update.
+ * @param rules Rules.
+ * @return 0 on success, -1 if the rules are invalid.
+ */
+static int parse_dscp_map(obfuscator_config_t *config, const char *rules)
+{
+    char buffer[1024];
+    strncpy(buffer, rules, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    char *saveptr = NULL;
+    for (char *rule = strtok_r(buffer, ", ", &saveptr); rule; rule = strtok_r(NULL, ", ", &saveptr)) {
+        uint8_t up = 1, down = 1;
+        if (!strncmp(rule, "up:", 3)) {
+            down = 0;
+            rule += 3;
+        } else if (!strncmp(rule, "down:", 5)) {
+            up = 0;
+            rule += 5;
+        }
+        char *eq = strchr(rule, '=');
+        if (!eq) {
+            return -1;
+        }
+        *eq = 0;
+        char *to_str = eq + 1;
+        uint8_t all = !strcmp(rule, "*");
+        if ((!all && !is_integer(rule)) || !is_integer(to_str)) {
+            return -1;
+        }
+        int from = all ? 0 : atoi(rule);
+        int to = atoi(to_str);
+        if (from < 0 || from > 63 || to < 0 || to > 63) {
+            return -1;
+        }
+        for (int d = all ? 0 : from; d <= (all ? 63 : from); d++) {
+            if (up) {
+                config->dscp_map[DIR_CLIENT_TO_SERVER][d] = to;
+            }
+            if (down) {
+                config->dscp_map[DIR_SERVER_TO_CLIENT][d] = to;
+            }
+        }
+    }
+    return 0;
+}
+
 /**
  * @brief Reads and processes the configuration file.
  *
@@ -230,17 +421,17 @@ static void read_config_file(const char *filename, obfuscator_config_t *config)
             continue;
         }
 
-        // Parse key-value pairs
-        char *key = strtok(line, "=");
-        key = trim(key);
-        while (strlen(key) && (key[strlen(key) - 1] == ' ' || key[strlen(key) - 1] == '\t' || key[strlen(key) - 1] == '\r' || key[strlen(key) - 1] == '\n')) {
-            key[strlen(key) - 1] = 0;
-        }
-        char *value = strtok(NULL, "=");
+        // Parse key-value pairs, the value is the rest of the line after the first '=' and may contain more of them
+        char *value = strchr(line, '=');
         if (value == NULL) {
             log(LL_ERROR, "Invalid configuration line: %s", line);
             exit(EXIT_FAILURE);
         }
+        *value++ = 0;
+        char *key = trim(line);
+        while (strlen(key) && (key[strlen(key) - 1] == ' ' || key[strlen(key) - 1] == '\t' || key[strlen(key) - 1] == '\r' || key[strlen(key) - 1] == '\n')) {
+            key[strlen(key) - 1] = 0;
+        }
         value = trim(value);
         if (!*value) {
             log(LL_ERROR, "Invalid configuration line: %s", line);
@@ -288,18 +479,32 @@ static int parse_opt(const char *lname, char sname, const char *val, void *ctx)
             config->client_interface[sizeof(config->client_interface) - 1] = 0; // Ensure null-termination
             config->client_interface_set = 1;
             break;
-        case 'p':
-            if (!is_integer(val)) {
-                log(LL_ERROR, "Invalid source port: %s (must be an integer)", val);
+        case 'p': {
+            char range[32];
+            strncpy(range, val, sizeof(range) - 1);
+            range[sizeof(range) - 1] = 0;
+            char *dash = strchr(range, '-');
+            if (dash) {
+                *dash = 0;
+            }
+            if (!is_integer(range) || (dash && !is_integer(dash + 1))) {
+                log(LL_ERROR, "Invalid source port: %s (must be an integer or <first>-<last>)", val);
                 exit(EXIT_FAILURE);
             }
-            config->listen_port = atoi(val);
-            if (config->listen_port <= 0 || config->listen_port > 65535) {
+            config->listen_port = atoi(range);
+            int last = dash ? atoi(dash + 1) : config->listen_port;
+            if (config->listen_port <= 0 || last > 65535 || config->listen_port > last) {
                 log(LL_ERROR, "Invalid listen port: %s (must be between 1 and 65535)", val);
                 exit(EXIT_FAILURE);
             }
+            config->listen_ports = last - config->listen_port + 1;
+            if (config->listen_ports > LISTEN_PORTS_MAX) {
+                log(LL_ERROR, "Invalid listen port range: %s (must be at most %d ports)", val, LISTEN_PORTS_MAX);
+                exit(EXIT_FAILURE);
+            }
             config->listen_port_set = 1;
             break;
+        }
         case 't':
             strncpy(config->forward_host_port, val, sizeof(config->forward_host_port) - 1);
             config->forward_host_port[sizeof(config->forward_host_port) - 1] = 0; // Ensure null-termination
@@ -489,6 +694,293 @@ static int parse_opt(const char *lname, char sname, const char *val, void *ctx)
             }
             config->resolve_interval *= 1000; // Convert to milliseconds
             break;
+        case OPT_BATCH_SIZE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid batch size: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->batch_size = atoi(val);
+            if (config->batch_size <= 0 || config->batch_size > BATCH_SIZE_MAX) {
+                log(LL_ERROR, "Invalid batch size: %s (must be between 1 and %d)", val, BATCH_SIZE_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_DRAIN_BUDGET:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid drain budget: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->drain_budget = atoi(val);
+            if (config->drain_budget <= 0 || config->drain_budget > DRAIN_BUDGET_MAX) {
+                log(LL_ERROR, "Invalid drain budget: %s (must be between 1 and %d)", val, DRAIN_BUDGET_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SEND_QUEUE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid send queue size: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->send_queue = atoi(val);
+            if (config->send_queue < 0 || config->send_queue > SEND_QUEUE_MAX) {
+                log(LL_ERROR, "Invalid send queue size: %s (must be between 0 and %d)", val, SEND_QUEUE_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_UDP_OFFLOAD:
+#ifdef __linux__
+            config->udp_offload = 1;
+#else
+            log(LL_WARN, "UDP offload is not supported on this platform");
+#endif
+            break;
+        case OPT_IO_URING:
+#ifdef USE_IO_URING
+            config->io_uring = 1;
+#else
+            log(LL_WARN, "io_uring is not supported by this build");
+#endif
+            break;
+        case OPT_THREADS:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid number of threads: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->threads = atoi(val);
+            if (config->threads <= 0 || config->threads > THREADS_MAX) {
+                log(LL_ERROR, "Invalid number of threads: %s (must be between 1 and %d)", val, THREADS_MAX);
+                exit(EXIT_FAILURE);
+            }
+#ifndef __linux__
+            if (config->threads > 1) {
+                log(LL_WARN, "Multiple threads are not supported on this platform");
+                config->threads = 1;
+            }
+#endif
+            break;
+        case OPT_PIN_THREADS:
+#ifdef __linux__
+            config->pin_threads = 1;
+#else
+            log(LL_WARN, "Pinning threads to CPUs is not supported on this platform");
+#endif
+            break;
+        case OPT_PIPELINE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid number of pipeline threads: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->pipeline = atoi(val);
+            if (config->pipeline < 0 || config->pipeline > PIPELINE_MAX) {
+                log(LL_ERROR, "Invalid number of pipeline threads: %s (must be between 0 and %d)", val, PIPELINE_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_XDP_INTERFACE:
+#ifdef USE_AF_XDP
+            strncpy(config->xdp_interface, val, sizeof(config->xdp_interface) - 1);
+            config->xdp_interface[sizeof(config->xdp_interface) - 1] = 0; // Ensure null-termination
+#else
+            log(LL_WARN, "AF_XDP is not supported by this build");
+#endif
+            break;
+        case OPT_XDP_MODE:
+            strncpy(val_lower, val, sizeof(val_lower) - 1);
+            val_lower[sizeof(val_lower) - 1] = 0;
+            for (char *p = val_lower; *p; ++p) *p = tolower((unsigned char)*p);
+            if (strcmp(val_lower, "native") == 0) {
+                config->xdp_skb_mode = 0;
+            } else if (strcmp(val_lower, "skb") == 0 || strcmp(val_lower, "generic") == 0) {
+                config->xdp_skb_mode = 1;
+            } else {
+                log(LL_ERROR, "Invalid XDP mode: %s (must be one of 'NATIVE', 'SKB')", val);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TC_OFFLOAD:
+#ifdef USE_TC_OFFLOAD
+            strncpy(config->tc_offload, val, sizeof(config->tc_offload) - 1);
+            config->tc_offload[sizeof(config->tc_offload) - 1] = 0; // Ensure null-termination
+#else
+            log(LL_WARN, "TC offload is not supported by this build");
+#endif
+            break;
+        case OPT_LATENCY_MODE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid latency mode budget: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->latency_mode = atoi(val);
+            if (config->latency_mode < 0 || config->latency_mode > LATENCY_BUDGET_MAX) {
+                log(LL_ERROR, "Invalid latency mode budget: %s (must be between 0 and %d)", val, LATENCY_BUDGET_MAX);
+                exit(EXIT_FAILURE);
+            }
+#ifndef USE_LATENCY_MODE
+            if (config->latency_mode) {
+                log(LL_WARN, "Latency mode is not supported on this platform");
+                config->latency_mode = 0;
+            }
+#endif
+            break;
+        case OPT_REALTIME:
+#ifdef USE_LATENCY_MODE
+            config->realtime = 1;
+#else
+            log(LL_WARN, "Real-time scheduling is not supported on this platform");
+#endif
+            break;
+        case OPT_TICKLESS:
+            config->tickless = 1;
+            break;
+        case OPT_RAW_UPSTREAM: {
+            char range[32];
+            strncpy(range, val, sizeof(range) - 1);
+            range[sizeof(range) - 1] = 0;
+            char *dash = strchr(range, '-');
+            if (dash) {
+                *dash = 0;
+            }
+            if (!dash || !is_integer(range) || !is_integer(dash + 1)) {
+                log(LL_ERROR, "Invalid raw upstream port range: %s (must be <first>-<last>)", val);
+                exit(EXIT_FAILURE);
+            }
+            int first = atoi(range);
+            int last = atoi(dash + 1);
+            if (first < 1 || last > 65535 || first > last) {
+                log(LL_ERROR, "Invalid raw upstream port range: %s (must be between 1 and 65535)", val);
+                exit(EXIT_FAILURE);
+            }
+#ifdef __linux__
+            config->raw_upstream_port = (uint16_t)first;
+            config->raw_upstream_ports = last - first + 1;
+#else
+            log(LL_WARN, "Raw upstream is not supported on this platform");
+#endif
+            break;
+        }
+        case OPT_SOURCE_POOL:
+            strncpy(config->source_pool, val, sizeof(config->source_pool) - 1);
+            config->source_pool[sizeof(config->source_pool) - 1] = 0; // Ensure null-termination
+            break;
+        case OPT_SOCKET_POOL:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid socket pool size: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->socket_pool = atoi(val);
+            if (config->socket_pool < 0 || config->socket_pool > SOCKET_POOL_MAX) {
+                log(LL_ERROR, "Invalid socket pool size: %s (must be between 0 and %d)", val, SOCKET_POOL_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_RCVBUF:
+        case OPT_SNDBUF: {
+            const char *name = sname == OPT_RCVBUF ? "receive" : "send";
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid %s buffer size: %s (must be an integer)", name, val);
+                exit(EXIT_FAILURE);
+            }
+            int size = atoi(val);
+            if (size < 0 || size > SOCKET_BUFFER_MAX) {
+                log(LL_ERROR, "Invalid %s buffer size: %s (must be between 0 and %d)", name, val, SOCKET_BUFFER_MAX);
+                exit(EXIT_FAILURE);
+            }
+            if (sname == OPT_RCVBUF) {
+                config->rcvbuf = size;
+            } else {
+                config->sndbuf = size;
+            }
+            break;
+        }
+        case OPT_LATENCY_HISTOGRAMS:
+#ifdef __linux__
+            config->latency_histograms = 1;
+#else
+            log(LL_WARN, "Latency histograms are not supported on this platform");
+#endif
+            break;
+        case OPT_PACING_RATE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid pacing rate: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->pacing_rate = atoi(val);
+            if (config->pacing_rate < 0 || config->pacing_rate > PACING_RATE_MAX) {
+                log(LL_ERROR, "Invalid pacing rate: %s (must be between 0 and %d)", val, PACING_RATE_MAX);
+                exit(EXIT_FAILURE);
+            }
+#ifndef USE_TXTIME
+            if (config->pacing_rate) {
+                log(LL_WARN, "Pacing is not supported on this platform");
+                config->pacing_rate = 0;
+            }
+#endif
+            break;
+        case OPT_PRESERVE_TOS:
+#ifdef __linux__
+            config->preserve_tos = 1;
+#else
+            log(LL_WARN, "Preserving the TOS byte is not supported on this platform");
+#endif
+            break;
+        case OPT_DSCP_MAP:
+            if (parse_dscp_map(config, val) != 0) {
+                log(LL_ERROR, "Invalid DSCP map: %s (must be [up:|down:]<from>=<to>,..., the values between 0 and 63 or * for any)", val);
+                exit(EXIT_FAILURE);
+            }
+#ifdef __linux__
+            config->preserve_tos = 1;
+#else
+            log(LL_WARN, "Preserving the TOS byte is not supported on this platform");
+#endif
+            break;
+        case OPT_ICMP_ERRORS:
+#ifdef USE_RECVERR
+            config->icmp_errors = 1;
+#else
+            log(LL_WARN, "ICMP errors are not supported on this platform");
+#endif
+            break;
+        case OPT_JUMBO_CACHE:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid jumbo cache size: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->jumbo_cache = atoi(val);
+            if (config->jumbo_cache < 0 || config->jumbo_cache > JUMBO_CACHE_MAX) {
+                log(LL_ERROR, "Invalid jumbo cache size: %s (must be between 0 and %d)", val, JUMBO_CACHE_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_PORT_HOPPING:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid port hopping interval: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->port_hopping = atoi(val);
+            if (config->port_hopping < 0 || config->port_hopping > PORT_HOPPING_MAX) {
+                log(LL_ERROR, "Invalid port hopping interval: %s (must be between 0 and %d)", val, PORT_HOPPING_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_HOP_ON_DROP:
+            if (!is_integer(val)) {
+                log(LL_ERROR, "Invalid hop on drop percentage: %s (must be an integer)", val);
+                exit(EXIT_FAILURE);
+            }
+            config->hop_on_drop = atoi(val);
+            if (config->hop_on_drop < 0 || config->hop_on_drop > 99) {
+                log(LL_ERROR, "Invalid hop on drop percentage: %s (must be between 0 and 99)", val);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_CONNECTED_CLIENTS:
+#ifdef __linux__
+            config->connected_clients = 1;
+#else
+            log(LL_WARN, "Connected client sockets are not supported on this platform");
+#endif
+            break;
         default:
             // should never happen
             return -1;
@@ -0,0 +1,152 @@
+#include "ebpf.h"
+
+#ifdef USE_EBPF
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+void ebpf_init(ebpf_prog_t *prog)
+{
+    prog->count = 0;
+    prog->label_count = 0;
+    prog->overflow = 0;
+}
+
+void ebpf_emit(ebpf_prog_t *prog, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    if (prog->count >= EBPF_INSNS_MAX) {
+        prog->overflow = 1;
+        return;
+    }
+    prog->jump_labels[prog->count] = -1;
+    prog->insns[prog->count++] = (struct bpf_insn){ .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm };
+}
+
+int ebpf_label(ebpf_prog_t *prog)
+{
+    if (prog->label_count >= EBPF_LABELS_MAX) {
+        prog->overflow = 1;
+        return 0;
+    }
+    prog->labels[prog->label_count] = -1;
+    return prog->label_count++;
+}
+
+void ebpf_place(ebpf_prog_t *prog, int label)
+{
+    prog->labels[label] = prog->count;
+}
+
+void ebpf_jump(ebpf_prog_t *prog, uint8_t code, uint8_t dst, uint8_t src, int32_t imm, int label)
+{
+    ebpf_emit(prog, code, dst, src, 0, imm);
+    if (!prog->overflow) {
+        prog->jump_labels[prog->count - 1] = label;
+    }
+}
+
+void ebpf_map_fd(ebpf_prog_t *prog, uint8_t dst, int fd)
+{
+    ebpf_emit(prog, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    ebpf_emit(prog, 0, 0, 0, 0, 0);
+}
+
+int ebpf_load(ebpf_prog_t *prog, uint32_t type)
+{
+    if (prog->overflow) {
+        errno = E2BIG;
+        return -1;
+    }
+    for (int i = 0; i < prog->count; i++) {
+        int label = prog->jump_labels[i];
+        if (label < 0) {
+            continue;
+        }
+        if (prog->labels[label] < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        prog->insns[i].off = (int16_t)(prog->labels[label] - i - 1);
+    }
+
+    static char verifier_log[65536];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.insns = (uint64_t)(uintptr_t)prog->insns;
+    attr.insn_cnt = prog->count;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && errno != EPERM && verbose >= LL_DEBUG) {
+        // Load it again to see why the verifier rejected it
+        int saved_errno = errno;
+        attr.log_buf = (uint64_t)(uintptr_t)verifier_log;
+        attr.log_size = sizeof(verifier_log);
+        attr.log_level = 1;
+        if (sys_bpf(BPF_PROG_LOAD, &attr) < 0) {
+            log(LL_DEBUG, "eBPF verifier log:\n%s", verifier_log);
+        }
+        errno = saved_errno;
+    }
+    return fd;
+}
+
+int ebpf_link_create(int prog_fd, int ifindex, uint32_t attach_type, uint32_t flags)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = attach_type;
+    attr.link_create.flags = flags;
+    return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+int ebpf_map_create(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+int ebpf_map_update(int fd, const void *key, const void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int ebpf_map_lookup(int fd, const void *key, void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+int ebpf_map_delete(int fd, const void *key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+#endif // USE_EBPF
@@ -0,0 +1,132 @@
+#ifndef _EBPF_H_
+#define _EBPF_H_
+
+#include <stdint.h>
+#include "wg-obfuscator.h"
+
+// eBPF programs are written instruction by instruction and loaded with the bpf() syscall,
+// so neither a BPF compiler nor libbpf is needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#define USE_EBPF
+#endif
+#endif
+
+#ifdef USE_EBPF
+
+#define EBPF_INSNS_MAX      1024
+#define EBPF_LABELS_MAX     64
+
+// Program being built, jumps go to labels which are resolved when it is loaded
+typedef struct {
+    struct bpf_insn insns[EBPF_INSNS_MAX];
+    int count;
+    int labels[EBPF_LABELS_MAX];    // instruction index of every label, -1 until it is placed
+    int label_count;
+    int jump_labels[EBPF_INSNS_MAX]; // label of every jump instruction, -1 for the other instructions
+    uint8_t overflow;               // 1 if the program or the labels did not fit
+} ebpf_prog_t;
+
+// Shortcuts for the instructions, 'p' is the program being built
+#define EBPF_MOV(p, dst, src)               ebpf_emit(p, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define EBPF_MOV_IMM(p, dst, imm)           ebpf_emit(p, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define EBPF_ALU(p, op, dst, src)           ebpf_emit(p, BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0)
+#define EBPF_ALU_IMM(p, op, dst, imm)       ebpf_emit(p, BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define EBPF_ALU32_IMM(p, op, dst, imm)     ebpf_emit(p, BPF_ALU | (op) | BPF_K, dst, 0, 0, imm)
+#define EBPF_BE16(p, dst)                   ebpf_emit(p, BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, 16)
+#define EBPF_LDX(p, size, dst, src, off)    ebpf_emit(p, BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define EBPF_STX(p, size, dst, src, off)    ebpf_emit(p, BPF_STX | (size) | BPF_MEM, dst, src, off, 0)
+#define EBPF_ST(p, size, dst, off, imm)     ebpf_emit(p, BPF_ST | (size) | BPF_MEM, dst, 0, off, imm)
+#define EBPF_ATOMIC_ADD(p, size, dst, src, off) ebpf_emit(p, BPF_STX | (size) | BPF_ATOMIC, dst, src, off, BPF_ADD)
+#define EBPF_JMP(p, op, dst, src, label)    ebpf_jump(p, BPF_JMP | (op) | BPF_X, dst, src, 0, label)
+#define EBPF_JMP_IMM(p, op, dst, imm, label) ebpf_jump(p, BPF_JMP | (op) | BPF_K, dst, 0, imm, label)
+#define EBPF_JMP32_IMM(p, op, dst, imm, label) ebpf_jump(p, BPF_JMP32 | (op) | BPF_K, dst, 0, imm, label)
+#define EBPF_GOTO(p, label)                 ebpf_jump(p, BPF_JMP | BPF_JA, 0, 0, 0, label)
+#define EBPF_CALL(p, func)                  ebpf_emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define EBPF_EXIT(p)                        ebpf_emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/**
+ * @brief Starts an empty program.
+ */
+void ebpf_init(ebpf_prog_t *prog);
+
+/**
+ * @brief Appends one instruction.
+ */
+void ebpf_emit(ebpf_prog_t *prog, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm);
+
+/**
+ * @brief Creates a label, it can be jumped to before and after it is placed.
+ *
+ * @return Label number.
+ */
+int ebpf_label(ebpf_prog_t *prog);
+
+/**
+ * @brief Places the label at the next instruction.
+ */
+void ebpf_place(ebpf_prog_t *prog, int label);
+
+/**
+ * @brief Appends a jump instruction to the label.
+ */
+void ebpf_jump(ebpf_prog_t *prog, uint8_t code, uint8_t dst, uint8_t src, int32_t imm, int label);
+
+/**
+ * @brief Appends the two instructions which load the address of the map into the register.
+ */
+void ebpf_map_fd(ebpf_prog_t *prog, uint8_t dst, int fd);
+
+/**
+ * @brief Resolves the labels and loads the program into the kernel. If the verifier
+ * rejects it, its log is written at the DEBUG level.
+ *
+ * @param prog Program.
+ * @param type Program type, BPF_PROG_TYPE_*.
+ * @return Program descriptor, -1 on error (errno is set).
+ */
+int ebpf_load(ebpf_prog_t *prog, uint32_t type);
+
+/**
+ * @brief Attaches the program with a BPF link, it stays attached while the link is open.
+ *
+ * @param prog_fd Program descriptor.
+ * @param ifindex Interface to attach to.
+ * @param attach_type Attach type, BPF_*.
+ * @param flags Attach flags.
+ * @return Link descriptor, -1 on error (errno is set).
+ */
+int ebpf_link_create(int prog_fd, int ifindex, uint32_t attach_type, uint32_t flags);
+
+/**
+ * @brief Creates a map.
+ *
+ * @return Map descriptor, -1 on error (errno is set).
+ */
+int ebpf_map_create(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries);
+
+/**
+ * @brief Adds or replaces a map element.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int ebpf_map_update(int fd, const void *key, const void *value);
+
+/**
+ * @brief Reads a map element.
+ *
+ * @return 0 on success, -1 if there is no such element or on error (errno is set).
+ */
+int ebpf_map_lookup(int fd, const void *key, void *value);
+
+/**
+ * @brief Deletes a map element.
+ *
+ * @return 0 on success, -1 if there is no such element or on error (errno is set).
+ */
+int ebpf_map_delete(int fd, const void *key);
+
+#endif // USE_EBPF
+
+#endif // _EBPF_H_
@@ -0,0 +1,82 @@
+#include "histogram.h"
+
+#define SUB_BUCKETS     (1 << HISTOGRAM_SUB_BITS)
+
+/**
+ * @brief Returns the bucket of a value.
+ */
+static int bucket_of(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    int bits = 63 - __builtin_clzll(value);
+    if (bits >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = bits - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Returns the largest value of a bucket.
+ */
+static uint64_t bucket_top(int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(histogram_t *h, uint64_t value)
+{
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void histogram_add(histogram_t *to, const histogram_t *from)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > to->max) {
+        to->max = max;
+    }
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double percentile)
+{
+    // The total is counted separately, so it may be a little off from the sum of the counts
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += h->counts[i];
+    }
+    if (!total) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            if (i == HISTOGRAM_BUCKETS - 1) {
+                // The last bucket has no upper bound
+                return h->max;
+            }
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
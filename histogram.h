@@ -0,0 +1,43 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+// Log-linear histogram: every power of two is split into 2^HISTOGRAM_SUB_BITS equal buckets,
+// so any value is known within about 6%, from single nanoseconds up to minutes
+#define HISTOGRAM_SUB_BITS      4
+#define HISTOGRAM_MAX_BITS      40      // larger values are counted in the last bucket
+#define HISTOGRAM_BUCKETS       ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;                 // number of values
+    uint64_t max;                   // the largest value
+} histogram_t;
+
+/**
+ * @brief Counts a value.
+ *
+ * @param h Histogram.
+ * @param value Value.
+ */
+void histogram_record(histogram_t *h, uint64_t value);
+
+/**
+ * @brief Adds the counts of another histogram, which may be updated by another thread meanwhile.
+ *
+ * @param to Histogram to add to.
+ * @param from Histogram to add.
+ */
+void histogram_add(histogram_t *to, const histogram_t *from);
+
+/**
+ * @brief Returns the value below which the given share of the values lie.
+ *
+ * @param h Histogram.
+ * @param percentile Share of the values, from 0 to 100.
+ * @return The largest value of the bucket the percentile falls into, 0 if the histogram is empty.
+ */
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+
+#endif // _HISTOGRAM_H_
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "wg-obfuscator.h"
+#include "latency.h"
+#include "stats.h"
+
+#ifdef USE_LATENCY_MODE
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL     69
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/ioctl.h>
+// Linux 6.9+, not in the libc headers yet
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+#define EPIOCSPARAMS            _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+#endif
+
+int latency_enable_busy_poll(int sock, int budget_us)
+{
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &budget_us, sizeof(budget_us)) < 0) {
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &optval, sizeof(optval));
+    return 0;
+}
+
+#ifdef USE_EPOLL
+int latency_enable_epoll_busy_poll(int epfd, int budget_us)
+{
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = (uint32_t)budget_us;
+    params.prefer_busy_poll = 1;
+    return ioctl(epfd, EPIOCSPARAMS, &params);
+}
+#endif
+
+int latency_realtime_thread(void)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = LATENCY_RT_PRIORITY;
+    if ((errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int latency_lock_memory(void)
+{
+    return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+#endif // USE_LATENCY_MODE
+
+void latency_account(uint64_t since_ns, int packets)
+{
+    if (packets <= 0) {
+        return;
+    }
+    uint64_t latency = latency_now_ns() - since_ns;
+    stats.latency_packets += packets;
+    stats.latency_ns_total += latency * packets;
+    if (latency > stats.latency_ns_max) {
+        stats.latency_ns_max = latency;
+    }
+}
+
+void latency_record(int histogram, uint64_t rx_ns, uint64_t now_ns)
+{
+    if (histogram < 0 || histogram >= LATENCY_HISTOGRAMS || now_ns < rx_ns) {
+        // The wall clock has been set back meanwhile
+        return;
+    }
+    histogram_record(&stats.latency_histograms[histogram], now_ns - rx_ns);
+}
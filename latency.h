@@ -0,0 +1,105 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "wg-obfuscator.h"
+
+// Low-latency mode: busy polling of the sockets and spinning of the event loop, Linux only
+#ifdef __linux__
+#define USE_LATENCY_MODE
+#endif
+
+#define LATENCY_BUDGET_MAX          100000  // upper limit for the spin budget, in microseconds
+#define LATENCY_RT_PRIORITY         10      // SCHED_FIFO priority of the worker threads in the real-time mode
+
+// Latency histograms: from the kernel receive timestamp of a datagram to its send call,
+// by direction (DIR_CLIENT_TO_SERVER or DIR_SERVER_TO_CLIENT) and packet type
+enum {
+    LATENCY_HANDSHAKE = 0,          // handshakes and cookie replies
+    LATENCY_DATA,                   // data packets
+    LATENCY_MASKING,                // packets of the clients with masking, any type
+    LATENCY_TYPES
+};
+#define LATENCY_HISTOGRAMS          (2 * LATENCY_TYPES)     // index: direction * LATENCY_TYPES + type
+
+/**
+ * @brief Returns the monotonic time in nanoseconds.
+ */
+static inline uint64_t latency_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the wall clock time in nanoseconds, the clock of the kernel receive timestamps.
+ */
+static inline uint64_t latency_realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef USE_LATENCY_MODE
+
+/**
+ * @brief Lets receive calls on the socket poll the device queue for up to 'budget_us'
+ * microseconds instead of waiting for the interrupt (SO_BUSY_POLL), and asks the kernel
+ * to keep the interrupts of the queue off while the socket is busy polled (SO_PREFER_BUSY_POLL).
+ *
+ * @param sock Socket.
+ * @param budget_us Busy poll time in microseconds.
+ * @return 0 on success, -1 on error (errno is set). SO_BUSY_POLL above the net.core.busy_read
+ *         sysctl needs CAP_NET_ADMIN; SO_PREFER_BUSY_POLL needs Linux 5.11+, its failure is ignored.
+ */
+int latency_enable_busy_poll(int sock, int budget_us);
+
+#ifdef USE_EPOLL
+/**
+ * @brief Lets epoll_wait() poll the device queues of the watched sockets for up to 'budget_us'
+ * microseconds before it sleeps (EPIOCSPARAMS).
+ *
+ * @param epfd epoll descriptor.
+ * @param budget_us Busy poll time in microseconds.
+ * @return 0 on success, -1 on error (errno is set, ENOTTY before Linux 6.9).
+ */
+int latency_enable_epoll_busy_poll(int epfd, int budget_us);
+#endif
+
+/**
+ * @brief Switches the calling thread to the SCHED_FIFO real-time scheduling class.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int latency_realtime_thread(void);
+
+/**
+ * @brief Locks all the current and future memory of the process, so the event loop never waits for a page fault.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int latency_lock_memory(void);
+
+#endif // USE_LATENCY_MODE
+
+/**
+ * @brief Adds the forwarding latency of 'packets' datagrams which became ready at 'since_ns' to the statistics.
+ *
+ * @param since_ns Time the event loop woke up for them, latency_now_ns().
+ * @param packets Number of datagrams.
+ */
+void latency_account(uint64_t since_ns, int packets);
+
+/**
+ * @brief Adds the time a datagram has spent from the kernel receive timestamp until now to a latency histogram.
+ *
+ * @param histogram Histogram, direction * LATENCY_TYPES + type.
+ * @param rx_ns Kernel receive timestamp, latency_realtime_ns() clock.
+ * @param now_ns Current time, latency_realtime_ns().
+ */
+void latency_record(int histogram, uint64_t rx_ns, uint64_t now_ns);
+
+#endif // _LATENCY_H_
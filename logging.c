@@ -250,9 +250,12 @@ void log_reopen(void)
         return;
     }
     if (log_fd >= 0) {
-        close(log_fd);
+        // Replace the file behind the descriptor in one step, other threads may be writing to it
+        dup2(fd, log_fd);
+        close(fd);
+    } else {
+        log_fd = fd;
     }
-    log_fd = fd;
 
     log_printf(LL_INFO, "Log file reopened, %s", version_string());
 }
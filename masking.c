@@ -8,7 +8,7 @@
 static _Thread_local struct {
     int listen_sock;
     struct sockaddr_in *sender_addr;
-    int server_sock;
+    client_entry_t *server_client;
 } g_send_ctx;
 
 static ssize_t send_to_client_cb(uint8_t *buffer, int length) {
@@ -16,7 +16,7 @@ static ssize_t send_to_client_cb(uint8_t *buffer, int length) {
 }
 
 static ssize_t send_to_server_cb(uint8_t *buffer, int length) {
-    return send(g_send_ctx.server_sock, buffer, length, 0);
+    return send_to_server(g_send_ctx.server_client, buffer, length);
 }
 
 masking_handler_t * get_masking_handler_by_name(const char *name) {
@@ -46,7 +46,7 @@ void masking_on_handshake_req_from_client(obfuscator_config_t *config,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     client->masking_handler->on_handshake_req(config, client, DIR_CLIENT_TO_SERVER, client_addr, server_addr, send_to_client_cb, send_to_server_cb);
 }
 
@@ -61,7 +61,7 @@ void masking_on_handshake_req_from_server(obfuscator_config_t *config,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     client->masking_handler->on_handshake_req(config, client, DIR_SERVER_TO_CLIENT, server_addr, client_addr, send_to_server_cb, send_to_client_cb);
 }
 
@@ -74,7 +74,7 @@ int masking_unwrap_from_client(uint8_t **buffer_ptr, int length,
                                 masking_handler_t **masking_handler_out) {
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = client_addr;
-    g_send_ctx.server_sock = client ? client->server_sock : 0;
+    g_send_ctx.server_client = client;
 
     if (!client && !config->masking_handler_set) {
         // Brueteforce detection of masking type if no client entry and no default masking handler
@@ -121,7 +121,7 @@ int masking_unwrap_from_server(uint8_t **buffer_ptr, int length,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     return client->masking_handler->on_data_unwrap(buffer_ptr, length, config, client, DIR_SERVER_TO_CLIENT, server_addr, &client->client_addr, send_to_server_cb, send_to_client_cb);
 }
 
@@ -136,7 +136,7 @@ int masking_data_wrap_to_client(uint8_t **buffer_ptr, int length,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     return client->masking_handler->on_data_wrap(buffer_ptr, length, config, client, DIR_SERVER_TO_CLIENT, server_addr, &client->client_addr, send_to_server_cb, send_to_client_cb);
 }
 
@@ -151,10 +151,17 @@ int masking_data_wrap_to_server(uint8_t **buffer_ptr, int length,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     return client->masking_handler->on_data_wrap(buffer_ptr, length, config, client, DIR_CLIENT_TO_SERVER, &client->client_addr, server_addr, send_to_client_cb, send_to_server_cb);
 }
 
+int masking_wrap_overhead(const client_entry_t *client) {
+    if (!client->masking_handler || !client->masking_handler->on_data_wrap) {
+        return 0;
+    }
+    return client->masking_handler->wrap_overhead;
+}
+
 void masking_on_timer(obfuscator_config_t *config,
                                 client_entry_t *client,
                                 int listen_sock,
@@ -165,6 +172,6 @@ void masking_on_timer(obfuscator_config_t *config,
 
     g_send_ctx.listen_sock = listen_sock;
     g_send_ctx.sender_addr = &client->client_addr;
-    g_send_ctx.server_sock = client->server_sock;
+    g_send_ctx.server_client = client;
     client->masking_handler->on_timer(config, client, &client->client_addr, server_addr, send_to_client_cb, send_to_server_cb);
 }
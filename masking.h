@@ -40,6 +40,7 @@ struct masking_handler {
     masking_data_handler_t on_data_unwrap;
     masking_timer_handler_t on_timer;
     uint32_t timer_interval_s;
+    uint16_t wrap_overhead;         // bytes on_data_wrap adds to every datagram
 };
 typedef struct masking_handler masking_handler_t;
 
@@ -83,6 +84,8 @@ int masking_unwrap_from_server(uint8_t **buffer_ptr, int length,
                                 int listen_sock,
                                 struct sockaddr_in *server_addr);
 
+int masking_wrap_overhead(const client_entry_t *client);
+
 void masking_on_timer(obfuscator_config_t *config,
                                 client_entry_t *client,
                                 int listen_sock,
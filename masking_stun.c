@@ -302,4 +302,5 @@ masking_handler_t stun_masking_handler = {
     .on_data_unwrap = stun_on_data_unwrap,
     .on_timer = stun_on_timer,
     .timer_interval_s = 10, // 10 seconds
+    .wrap_overhead = STUN_WRAP_OVERHEAD,
 };
@@ -4,9 +4,10 @@
 #include "wg-obfuscator.h"
 #include "obfuscation.h"
 
-static uint8_t crc_a[256]; // step(crc, 0): contribution of the current CRC state
-static uint8_t crc_b[256]; // step(0, inbyte): contribution of the input byte
-static uint8_t tables_ready = 0;
+// Every worker thread builds its own tables and cache, so no locking is needed
+static _Thread_local uint8_t crc_a[256]; // step(crc, 0): contribution of the current CRC state
+static _Thread_local uint8_t crc_b[256]; // step(0, inbyte): contribution of the input byte
+static _Thread_local uint8_t tables_ready = 0;
 
 typedef struct {
     uint8_t *data;  // cached keystream bytes, NULL until first allocation
@@ -15,7 +16,17 @@ typedef struct {
     uint8_t  crc;   // CRC state right after the 'valid' bytes
 } keystream_row_t;
 
-static keystream_row_t rows[256];
+static _Thread_local keystream_row_t rows[256];
+
+// Jumbo mode: memory of the cache of every thread past the first KEYSTREAM_ROW_MAX bytes
+// of the rows, 0 for rows of KEYSTREAM_ROW_MAX bytes
+static size_t jumbo_limit = 0;
+static _Thread_local size_t cache_used = 0;
+
+// Pipeline mode: the keystream XOR past the header is left to a processing thread
+static _Thread_local uint8_t defer_enabled = 0;
+static _Thread_local uint8_t *deferred_buffer = NULL;
+static _Thread_local int deferred_length = 0;
 
 // Single step of the original bit-by-bit CRC8 update, kept only to build the tables.
 static uint8_t crc8_step(uint8_t crc, uint8_t inbyte) {
@@ -41,27 +52,52 @@ static void ensure_tables(void) {
     tables_ready = 1;
 }
 
+// Longest row the cache keeps
+static inline int row_max(void) {
+    return jumbo_limit ? KEYSTREAM_ROW_JUMBO : KEYSTREAM_ROW_MAX;
+}
+
+// Part of a row of 'cap' bytes counted against the jumbo mode cache, the first
+// KEYSTREAM_ROW_MAX bytes are cached anyway
+static inline size_t jumbo_bytes(int cap) {
+    return cap > KEYSTREAM_ROW_MAX ? (size_t)(cap - KEYSTREAM_ROW_MAX) : 0;
+}
+
 // Ensure the given row holds at least 'need' valid keystream bytes (capped at
-// KEYSTREAM_ROW_MAX). On allocation failure the row is left as large as it could
-// grow; the caller then computes the missing tail on the fly.
+// row_max()). On allocation failure, or when the jumbo mode cache is full, the row
+// is left as large as it could grow; the caller then computes the missing tail on the fly.
 static void grow_row(keystream_row_t *row, int cls, int need, const char *key, int key_length) {
-    if (need > KEYSTREAM_ROW_MAX) {
-        need = KEYSTREAM_ROW_MAX;
+    if (need > row_max()) {
+        need = row_max();
     }
     if (row->valid >= need) {
         return;
     }
     if (row->cap < need) {
         int newcap = (need + 255) & ~255; // round up to a 256-byte chunk
-        if (newcap > KEYSTREAM_ROW_MAX) {
-            newcap = KEYSTREAM_ROW_MAX;
+        if (newcap > row_max()) {
+            newcap = row_max();
+        }
+        if (jumbo_limit && cache_used - jumbo_bytes(row->cap) + jumbo_bytes(newcap) > jumbo_limit) {
+            // Only what is left of the cache, never less than a normal row
+            size_t room = jumbo_limit - cache_used + jumbo_bytes(row->cap);
+            newcap = (int)((KEYSTREAM_ROW_MAX + room) & ~(size_t)255);
+        }
+        if (newcap > row->cap) {
+            uint8_t *p = realloc(row->data, newcap);
+            if (!p) {
+                return; // keep whatever we already have; tail handled by caller
+            }
+            cache_used += jumbo_bytes(newcap) - jumbo_bytes(row->cap);
+            row->data = p;
+            row->cap = newcap;
         }
-        uint8_t *p = realloc(row->data, newcap);
-        if (!p) {
-            return; // keep whatever we already have; tail handled by caller
+        if (need > row->cap) {
+            need = row->cap;
+        }
+        if (row->valid >= need) {
+            return;
         }
-        row->data = p;
-        row->cap = newcap;
     }
 
     uint8_t crc = row->crc;
@@ -94,37 +130,75 @@ static void xor_block(uint8_t *dst, const uint8_t *ks, int n) {
     }
 }
 
-void xor_data(uint8_t *buffer, int length, char *key, int key_length) {
-    if (length <= 0) {
-        return;
-    }
+// XOR bytes [from, to) of a packet of 'length' bytes with its keystream.
+static void xor_range(uint8_t *buffer, int length, int from, int to, char *key, int key_length) {
     ensure_tables();
 
     int cls = length & 0xFF;
     keystream_row_t *row = &rows[cls];
 
-    int cached = (length <= KEYSTREAM_ROW_MAX) ? length : KEYSTREAM_ROW_MAX;
+    int cached = (length <= row_max()) ? length : row_max();
     if (row->valid < cached) {
         grow_row(row, cls, cached, key, key_length);
     }
 
-    int n = (length < row->valid) ? length : row->valid;
-    if (n > 0) {
-        xor_block(buffer, row->data, n);
+    int n = (to < row->valid) ? to : row->valid;
+    if (n > from) {
+        xor_block(buffer + from, row->data + from, n - from);
     }
 
     // Tail beyond the cache limit (or beyond what we could allocate): compute on
     // the fly, continuing the CRC chain from the last cached state.
-    if (n < length) {
+    if (n < to) {
         uint8_t crc = row->crc;
         int ki = n % key_length;
-        for (int i = n; i < length; i++) {
+        for (int i = n; i < to; i++) {
             uint8_t inbyte = (uint8_t)(key[ki] + cls + key_length);
             crc = crc_a[crc] ^ crc_b[inbyte];
-            buffer[i] ^= crc;
+            if (i >= from) {
+                buffer[i] ^= crc;
+            }
             if (++ki == key_length) {
                 ki = 0;
             }
         }
     }
 }
+
+void xor_data(uint8_t *buffer, int length, char *key, int key_length) {
+    if (length <= 0) {
+        return;
+    }
+    if (defer_enabled && length > WG_HEADER_SIZE) {
+        // Only the header is needed right away, the rest is XORed by xor_data_finish()
+        xor_range(buffer, length, 0, WG_HEADER_SIZE, key, key_length);
+        deferred_buffer = buffer;
+        deferred_length = length;
+        return;
+    }
+    xor_range(buffer, length, 0, length, key, key_length);
+}
+
+void xor_data_jumbo(size_t limit) {
+    jumbo_limit = limit;
+}
+
+void xor_data_defer(uint8_t enabled) {
+    defer_enabled = enabled;
+    deferred_buffer = NULL;
+}
+
+uint8_t *xor_data_take_deferred(int *length) {
+    uint8_t *buffer = deferred_buffer;
+    if (length) {
+        *length = deferred_length;
+    }
+    deferred_buffer = NULL;
+    return buffer;
+}
+
+void xor_data_finish(uint8_t *buffer, int length, char *key, int key_length) {
+    if (length > WG_HEADER_SIZE) {
+        xor_range(buffer, length, WG_HEADER_SIZE, length, key, key_length);
+    }
+}
@@ -2,6 +2,7 @@
 #define _OBFUSCATION_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 // Current obfuscation version
 #define OBFUSCATION_VERSION     1
@@ -9,16 +10,23 @@
 // Maximum length (in bytes) of a single cached keystream row.
 // The keystream depends only on (key, length mod 256), so it is cached in 256
 // lazily-grown rows. Packets longer than this limit are still handled correctly:
-// the part beyond the limit is computed on the fly. Worst-case cache memory is
-// 256 * KEYSTREAM_ROW_MAX bytes. 2048 covers a typical MTU plus masking overhead.
+// the part beyond the limit is computed on the fly, unless the jumbo mode is on. Worst-case cache memory is
+// 256 * KEYSTREAM_ROW_MAX bytes per worker thread. 2048 covers a typical MTU plus masking overhead.
 #define KEYSTREAM_ROW_MAX       2048
 
+// Maximum length of a cached row in the jumbo mode (see xor_data_jumbo()), where the
+// rows are limited by the total memory of the cache instead.
+#define KEYSTREAM_ROW_JUMBO     65536
+
 // WireGuard packet types
 #define WG_TYPE_HANDSHAKE       0x01
 #define WG_TYPE_HANDSHAKE_RESP  0x02
 #define WG_TYPE_COOKIE          0x03
 #define WG_TYPE_DATA            0x04
 
+// Packet type and, once obfuscated, the random byte and the dummy data length
+#define WG_HEADER_SIZE          4
+
 #define WG_TYPE(data) ((uint32_t)(data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24)))
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -51,9 +59,79 @@ static inline uint8_t is_obfuscated(uint8_t *data) {
 void xor_data(uint8_t *buffer, int length, char *key, int key_length);
 
 /**
- * @brief Encodes the given buffer using the specified key and version.
+ * @brief Jumbo mode: lets the cached keystream rows grow up to KEYSTREAM_ROW_JUMBO bytes,
+ * so long packets (jumbo frames) are XORed from the cache too, as long as the rows of
+ * a thread take no more than 'limit' bytes in total. Must be called before the first xor_data().
+ *
+ * @param limit Memory of the cache per thread in bytes, 0 for rows of KEYSTREAM_ROW_MAX bytes.
+ */
+void xor_data_jumbo(size_t limit);
+
+/**
+ * @brief Pipeline mode: makes xor_data() on the calling thread XOR only the header
+ * (the first WG_HEADER_SIZE bytes, which encode() and decode() work with) and remember
+ * the buffer, so the rest can be finished by another thread with xor_data_finish().
+ *
+ * @param enabled 1 to defer the XOR past the header, 0 to XOR whole packets.
+ */
+void xor_data_defer(uint8_t enabled);
+
+/**
+ * @brief Returns the buffer of the last xor_data() call on this thread whose XOR was
+ * deferred, and forgets it.
+ *
+ * @param length Filled with the length the keystream is derived from, may be NULL.
+ * @return Pointer to the data, NULL if nothing is deferred.
+ */
+uint8_t *xor_data_take_deferred(int *length);
+
+/**
+ * @brief XORs the part of the buffer past the header, the rest of a deferred xor_data() call.
+ *
+ * @param buffer Pointer to the data buffer returned by xor_data_take_deferred().
+ * @param length Length returned by xor_data_take_deferred().
+ * @param key Pointer to the key used for XOR operation.
+ * @param key_length Length of the key in bytes.
+ */
+void xor_data_finish(uint8_t *buffer, int length, char *key, int key_length);
+
+/**
+ * @brief Picks a random length of dummy data for a packet.
+ *
+ * @param packet_type               WireGuard packet type.
+ * @param length                    Length of the packet before the dummy data is added.
+ * @param max_dummy_length_data     Maximum length of dummy data for data packets.
+ * @return                          Length of dummy data to add, the total never exceeds MAX_DUMMY_LENGTH_TOTAL.
+ */
+static inline uint16_t dummy_length_for(uint32_t packet_type, int length, int max_dummy_length_data) {
+    uint16_t dummy_length = 0;
+    if (length < MAX_DUMMY_LENGTH_TOTAL) {
+        uint16_t max_dummy_length = MAX_DUMMY_LENGTH_TOTAL - length;
+        switch (packet_type) {
+            case WG_TYPE_HANDSHAKE:
+            case WG_TYPE_HANDSHAKE_RESP:
+                // length to MAX_DUMMY_LENGTH_HANDSHAKE
+                dummy_length = rand() % MIN(max_dummy_length, MAX_DUMMY_LENGTH_HANDSHAKE);
+                break;
+            case WG_TYPE_COOKIE:
+            case WG_TYPE_DATA:
+                // length to MAX_DUMMY_LENGTH_HANDSHAKE
+                if (max_dummy_length_data) {
+                    dummy_length = rand() % MIN(max_dummy_length, max_dummy_length_data);
+                }
+                break;
+            default:
+                //assert(0);
+                break;
+        }
+    }
+    return dummy_length;
+}
+
+/**
+ * @brief Encodes the given buffer using the specified key and version, adding
+ * exactly the given amount of dummy data.
  *
- * This function applies an encoding algorithm to the input buffer using the provided key and version.
  * WARNING: buffer must be at least 4 bytes long and aligned to 4 bytes.
  *
  * @param buffer                    Pointer to the data buffer to encode.
@@ -61,39 +139,17 @@ void xor_data(uint8_t *buffer, int length, char *key, int key_length);
  * @param key                       Pointer to the key used for encoding.
  * @param key_length                Length of the key in bytes.
  * @param version                   Encoding version to use.
- * @param max_dummy_length_data     Maximum length of dummy data for data packets.
- * @return                          0 on success, or a negative value on error.
+ * @param dummy_length              Length of dummy data to add, ignored for packets of MAX_DUMMY_LENGTH_TOTAL bytes or longer.
+ * @return                          Length of the encoded data.
  */
-static inline int encode(uint8_t *buffer, int length, char *key, int key_length, uint8_t version, int max_dummy_length_data) {
+static inline int encode_with_dummy(uint8_t *buffer, int length, char *key, int key_length, uint8_t version, uint16_t dummy_length) {
     if (version >= 1) {
-        uint32_t packet_type = WG_TYPE(buffer);
         // Add some randomness to the packet
         uint8_t rnd = 1 + (rand() % 255);
         buffer[0] ^= rnd; // Xor the first byte to a random value
         buffer[1] = rnd; // Set the second byte to a random value
         // Add dummy data to the packet
         if (length < MAX_DUMMY_LENGTH_TOTAL) {
-            uint16_t dummy_length = 0;
-            uint16_t max_dummy_length = MAX_DUMMY_LENGTH_TOTAL - length;
-            if (length < MAX_DUMMY_LENGTH_TOTAL) {
-                switch (packet_type) {
-                    case WG_TYPE_HANDSHAKE:
-                    case WG_TYPE_HANDSHAKE_RESP:
-                        // length to MAX_DUMMY_LENGTH_HANDSHAKE
-                        dummy_length = rand() % MIN(max_dummy_length, MAX_DUMMY_LENGTH_HANDSHAKE);
-                        break;
-                    case WG_TYPE_COOKIE:
-                    case WG_TYPE_DATA:
-                        // length to MAX_DUMMY_LENGTH_HANDSHAKE
-                        if (max_dummy_length_data) {
-                            dummy_length = rand() % MIN(max_dummy_length, max_dummy_length_data);
-                        }
-                        break;
-                    default:
-                        //assert(0);
-                        break;
-                }
-            }
             buffer[2] = dummy_length & 0xFF; // Set the dummy length in the packet
             buffer[3] = dummy_length >> 8; // Set the dummy length in
             if (dummy_length > 0) {
@@ -111,6 +167,25 @@ static inline int encode(uint8_t *buffer, int length, char *key, int key_length,
     return length;
 }
 
+/**
+ * @brief Encodes the given buffer using the specified key and version.
+ *
+ * This function applies an encoding algorithm to the input buffer using the provided key and version.
+ * WARNING: buffer must be at least 4 bytes long and aligned to 4 bytes.
+ *
+ * @param buffer                    Pointer to the data buffer to encode.
+ * @param length                    Length of the data buffer in bytes.
+ * @param key                       Pointer to the key used for encoding.
+ * @param key_length                Length of the key in bytes.
+ * @param version                   Encoding version to use.
+ * @param max_dummy_length_data     Maximum length of dummy data for data packets.
+ * @return                          0 on success, or a negative value on error.
+ */
+static inline int encode(uint8_t *buffer, int length, char *key, int key_length, uint8_t version, int max_dummy_length_data) {
+    uint16_t dummy_length = version >= 1 ? dummy_length_for(WG_TYPE(buffer), length, max_dummy_length_data) : 0;
+    return encode_with_dummy(buffer, length, key, key_length, version, dummy_length);
+}
+
 /**
  * Decodes the given buffer using the provided key.
  * 
@@ -0,0 +1,762 @@
+#define _GNU_SOURCE
+#include "offload.h"
+
+#ifdef USE_TC_OFFLOAD
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include "config.h"
+#include "obfuscation.h"
+
+#define HEADERS_SIZE            42      // Ethernet, IPv4 without options and UDP
+
+// Stack of the program, offsets from r10
+#define S_KEY                   -8      // offload_key_t of the datagram
+#define S_DADDR                 -12     // its destination address
+#define S_LOCAL_ADDR            -16     // partner flow: our address to send from
+#define S_IFINDEX               -20     // partner flow: interface to send to
+#define S_MACS                  -32     // partner flow: MAC addresses, 12 bytes
+#define S_PARTNER               -40     // offload_key_t of the partner flow
+#define S_ROW                   -44     // keystream row number
+#define S_HEADER                -48     // obfuscated header when encoding
+#define S_DUMMY                 -52     // length of dummy data when encoding
+#define S_LENGTH                -56     // payload length as received
+#define S_NEW_LENGTH            -60     // payload length to send
+#define S_PSEUDO_NEW            -76     // pseudo header fields to send with: addresses and UDP length, 12 bytes
+#define S_PSEUDO_OLD            -88     // and as received
+#define S_PSEUDO_DIFF           -96     // checksum difference between them
+
+#define FLOW(field)             ((int16_t)offsetof(offload_flow_t, field))
+
+/**
+ * @brief Reloads r2 = data and r3 = data_end, jumps to the label if the packet is
+ * shorter than the headers and 'payload' bytes of payload.
+ */
+static void emit_reload(ebpf_prog_t *p, int payload, int fail)
+{
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data));
+    EBPF_LDX(p, BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end));
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_2);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_4, HEADERS_SIZE + payload);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_4, BPF_REG_3, fail);
+}
+
+/**
+ * @brief XORs the payload up to the end of the packet with the keystream row in r9.
+ * Clobbers r0-r5 and r8. Eight bytes at a time, then the tail byte by byte with
+ * a bounded counter, which keeps the number of states for the verifier linear.
+ */
+static void emit_xor_payload(ebpf_prog_t *p)
+{
+    int words = ebpf_label(p);
+    int bytes = ebpf_label(p);
+    int tail = ebpf_label(p);
+    int done = ebpf_label(p);
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data));
+    EBPF_LDX(p, BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end));
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_MOV_IMM(p, BPF_REG_5, 0);
+    ebpf_place(p, words);
+    EBPF_JMP_IMM(p, BPF_JGT, BPF_REG_5, OFFLOAD_PAYLOAD_MAX - 8, bytes);
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_2);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_1, BPF_REG_5);
+    EBPF_MOV(p, BPF_REG_0, BPF_REG_1);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_0, 8);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_0, BPF_REG_3, bytes);
+    EBPF_LDX(p, BPF_DW, BPF_REG_0, BPF_REG_1, 0);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_9);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_4, BPF_REG_5);
+    EBPF_LDX(p, BPF_DW, BPF_REG_4, BPF_REG_4, 0);
+    EBPF_ALU(p, BPF_XOR, BPF_REG_0, BPF_REG_4);
+    EBPF_STX(p, BPF_DW, BPF_REG_1, BPF_REG_0, 0);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_5, 8);
+    EBPF_GOTO(p, words);
+    ebpf_place(p, bytes);
+    EBPF_MOV(p, BPF_REG_8, BPF_REG_5);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_8, 8);
+    ebpf_place(p, tail);
+    EBPF_JMP(p, BPF_JGE, BPF_REG_5, BPF_REG_8, done);
+    EBPF_JMP_IMM(p, BPF_JGT, BPF_REG_5, OFFLOAD_PAYLOAD_MAX - 1, done);
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_2);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_1, BPF_REG_5);
+    EBPF_MOV(p, BPF_REG_0, BPF_REG_1);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_0, 1);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_0, BPF_REG_3, done);
+    EBPF_LDX(p, BPF_B, BPF_REG_0, BPF_REG_1, 0);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_9);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_4, BPF_REG_5);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_4, 0);
+    EBPF_ALU(p, BPF_XOR, BPF_REG_0, BPF_REG_4);
+    EBPF_STX(p, BPF_B, BPF_REG_1, BPF_REG_0, 0);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_5, 1);
+    EBPF_GOTO(p, tail);
+    ebpf_place(p, done);
+}
+
+/**
+ * @brief Loads the keystream row of the payload length in r8 into r9, jumps to the label if there is none.
+ */
+static void emit_keystream_row(ebpf_prog_t *p, int keystream_fd, int fail)
+{
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_AND, BPF_REG_4, 0xFF);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_ROW);
+    ebpf_map_fd(p, BPF_REG_1, keystream_fd);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, S_ROW);
+    EBPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    EBPF_JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, fail);
+    EBPF_MOV(p, BPF_REG_9, BPF_REG_0);
+}
+
+/**
+ * @brief Loads the program which forwards the data packets of the known flows, see
+ * decode() and encode_with_dummy() in obfuscation.h for what it does to the payload.
+ * Whatever it is not sure about goes on to the kernel stack and to the obfuscator.
+ *
+ * Registers: r6 = skb, r7 = flow, r8 = payload length, r9 = keystream row.
+ */
+static int load_program(offload_t *offload)
+{
+    static ebpf_prog_t prog;
+    ebpf_prog_t *p = &prog;
+    ebpf_init(p);
+    int pass = ebpf_label(p);
+    int drop = ebpf_label(p);
+    int any_daddr = ebpf_label(p);
+    int decode = ebpf_label(p);
+    int encode = ebpf_label(p);
+    int no_dummy = ebpf_label(p);
+    int clamped = ebpf_label(p);
+    int fill_done = ebpf_label(p);
+    int rewrite = ebpf_label(p);
+
+    EBPF_MOV(p, BPF_REG_6, BPF_REG_1);
+    // Ethernet, IPv4 without options and UDP headers must be there
+    emit_reload(p, 0, pass);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 12);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, htons(ETH_P_IP), pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_2, 14);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, 0x45, pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_2, 23);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, IPPROTO_UDP, pass);
+    // Fragments and GSO packets are left to the kernel
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 20);
+    EBPF_ALU32_IMM(p, BPF_AND, BPF_REG_4, htons(0x3FFF));
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, 0, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_6, offsetof(struct __sk_buff, gso_size));
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, 0, pass);
+    // Key of the flow and the destination address
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 26);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_KEY);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 34);
+    EBPF_STX(p, BPF_H, BPF_REG_10, BPF_REG_4, S_KEY + 4);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 36);
+    EBPF_STX(p, BPF_H, BPF_REG_10, BPF_REG_4, S_KEY + 6);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 30);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_DADDR);
+    // Payload length, the whole datagram must be there
+    EBPF_LDX(p, BPF_H, BPF_REG_8, BPF_REG_2, 38);
+    EBPF_BE16(p, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_8, -8);
+    EBPF_JMP_IMM(p, BPF_JSLT, BPF_REG_8, 4, pass);
+    EBPF_JMP_IMM(p, BPF_JSGT, BPF_REG_8, OFFLOAD_PAYLOAD_MAX, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_6, offsetof(struct __sk_buff, len));
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_5, HEADERS_SIZE);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_5, BPF_REG_4, pass);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_8, S_LENGTH);
+
+    // The flow
+    ebpf_map_fd(p, BPF_REG_1, offload->flows_fd);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, S_KEY);
+    EBPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    EBPF_JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, pass);
+    EBPF_MOV(p, BPF_REG_7, BPF_REG_0);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_7, FLOW(expect_daddr));
+    EBPF_JMP32_IMM(p, BPF_JEQ, BPF_REG_4, 0, any_daddr);
+    EBPF_LDX(p, BPF_W, BPF_REG_5, BPF_REG_10, S_DADDR);
+    EBPF_JMP(p, BPF_JNE, BPF_REG_4, BPF_REG_5, pass);
+    ebpf_place(p, any_daddr);
+
+    // Remember where it came from, so the partner flow can answer the same way
+    emit_reload(p, 0, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_6, offsetof(struct __sk_buff, ingress_ifindex));
+    EBPF_STX(p, BPF_W, BPF_REG_7, BPF_REG_4, FLOW(ifindex));
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_DADDR);
+    EBPF_STX(p, BPF_W, BPF_REG_7, BPF_REG_4, FLOW(local_addr));
+    for (int i = 0; i < 6; i += 2) {
+        // Source MAC first: it is the destination when answering
+        EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 6 + i);
+        EBPF_STX(p, BPF_H, BPF_REG_7, BPF_REG_4, FLOW(macs) + i);
+        EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, i);
+        EBPF_STX(p, BPF_H, BPF_REG_7, BPF_REG_4, FLOW(macs) + 6 + i);
+    }
+    EBPF_ST(p, BPF_B, BPF_REG_7, FLOW(seen), 1);
+
+    // The partner flow must have been seen, otherwise it is not known where to send
+    EBPF_LDX(p, BPF_DW, BPF_REG_4, BPF_REG_7, FLOW(partner));
+    EBPF_STX(p, BPF_DW, BPF_REG_10, BPF_REG_4, S_PARTNER);
+    ebpf_map_fd(p, BPF_REG_1, offload->flows_fd);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, S_PARTNER);
+    EBPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    EBPF_JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_0, FLOW(seen));
+    EBPF_JMP32_IMM(p, BPF_JEQ, BPF_REG_4, 0, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_0, FLOW(ifindex));
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_IFINDEX);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_0, FLOW(local_addr));
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_LOCAL_ADDR);
+    for (int i = 0; i < 12; i += 4) {
+        EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_0, FLOW(macs) + i);
+        EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_MACS + i);
+    }
+
+    // The payload must be in the linear part to be rewritten
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_CALL(p, BPF_FUNC_skb_pull_data);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_7, FLOW(op));
+    EBPF_JMP32_IMM(p, BPF_JEQ, BPF_REG_4, OFFLOAD_OP_DECODE, decode);
+    EBPF_JMP32_IMM(p, BPF_JEQ, BPF_REG_4, OFFLOAD_OP_ENCODE, encode);
+
+    // Clean client: only data packets, as is
+    emit_reload(p, 4, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, HEADERS_SIZE);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, WG_TYPE_DATA, pass);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_8, S_NEW_LENGTH);
+    EBPF_GOTO(p, rewrite);
+
+    // Decoding: only obfuscated data packets of version 1 or later
+    ebpf_place(p, decode);
+    emit_keystream_row(p, offload->keystream_fd, pass);
+    emit_reload(p, 4, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, HEADERS_SIZE);
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_4);
+    EBPF_ALU32_IMM(p, BPF_ADD, BPF_REG_5, -1);
+    EBPF_JMP32_IMM(p, BPF_JLT, BPF_REG_5, 4, pass);     // not obfuscated
+    EBPF_LDX(p, BPF_W, BPF_REG_5, BPF_REG_9, 0);
+    EBPF_ALU(p, BPF_XOR, BPF_REG_4, BPF_REG_5);
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_4);
+    EBPF_ALU32_IMM(p, BPF_ADD, BPF_REG_5, -1);
+    EBPF_JMP32_IMM(p, BPF_JLT, BPF_REG_5, 4, pass);     // version 0
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_4);
+    EBPF_ALU_IMM(p, BPF_RSH, BPF_REG_5, 8);
+    EBPF_ALU(p, BPF_XOR, BPF_REG_5, BPF_REG_4);
+    EBPF_ALU_IMM(p, BPF_AND, BPF_REG_5, 0xFF);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_5, WG_TYPE_DATA, pass);
+    EBPF_ALU_IMM(p, BPF_RSH, BPF_REG_4, 16);            // dummy data length
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_8);
+    EBPF_ALU(p, BPF_SUB, BPF_REG_5, BPF_REG_4);
+    EBPF_JMP_IMM(p, BPF_JSLT, BPF_REG_5, 4, pass);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_5, S_NEW_LENGTH);
+    emit_xor_payload(p);
+    emit_reload(p, 4, drop);
+    EBPF_ST(p, BPF_W, BPF_REG_2, HEADERS_SIZE, WG_TYPE_DATA);
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_10, S_NEW_LENGTH);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_MOV_IMM(p, BPF_REG_3, 0);
+    EBPF_CALL(p, BPF_FUNC_skb_change_tail);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, drop);
+    EBPF_GOTO(p, rewrite);
+
+    // Encoding: only data packets
+    ebpf_place(p, encode);
+    emit_reload(p, 4, pass);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, HEADERS_SIZE);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, WG_TYPE_DATA, pass);
+    // Dummy data length as dummy_length_for() picks it
+    EBPF_MOV_IMM(p, BPF_REG_5, 0);
+    EBPF_JMP_IMM(p, BPF_JSGE, BPF_REG_8, MAX_DUMMY_LENGTH_TOTAL, no_dummy);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_7, FLOW(max_dummy));
+    EBPF_MOV_IMM(p, BPF_REG_1, MAX_DUMMY_LENGTH_TOTAL);
+    EBPF_ALU(p, BPF_SUB, BPF_REG_1, BPF_REG_8);
+    EBPF_JMP(p, BPF_JLE, BPF_REG_4, BPF_REG_1, clamped);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_1);
+    ebpf_place(p, clamped);
+    EBPF_JMP_IMM(p, BPF_JEQ, BPF_REG_4, 0, no_dummy);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_DUMMY);
+    EBPF_CALL(p, BPF_FUNC_get_prandom_u32);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_DUMMY);
+    EBPF_ALU(p, BPF_MOD, BPF_REG_0, BPF_REG_4);
+    EBPF_MOV(p, BPF_REG_5, BPF_REG_0);
+    ebpf_place(p, no_dummy);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_5, S_DUMMY);
+    // Header: the type XORed with a random byte, the byte itself and the dummy data length
+    EBPF_CALL(p, BPF_FUNC_get_prandom_u32);
+    EBPF_ALU_IMM(p, BPF_MOD, BPF_REG_0, 255);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_0, 1);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_0);
+    EBPF_ALU_IMM(p, BPF_XOR, BPF_REG_4, WG_TYPE_DATA);
+    EBPF_ALU_IMM(p, BPF_LSH, BPF_REG_0, 8);
+    EBPF_ALU(p, BPF_OR, BPF_REG_4, BPF_REG_0);
+    EBPF_LDX(p, BPF_W, BPF_REG_5, BPF_REG_10, S_DUMMY);
+    EBPF_ALU_IMM(p, BPF_LSH, BPF_REG_5, 16);
+    EBPF_ALU(p, BPF_OR, BPF_REG_4, BPF_REG_5);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_HEADER);
+    EBPF_LDX(p, BPF_W, BPF_REG_5, BPF_REG_10, S_DUMMY);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_8, BPF_REG_5);
+    EBPF_JMP_IMM(p, BPF_JSGT, BPF_REG_8, OFFLOAD_PAYLOAD_MAX, pass);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_8, S_NEW_LENGTH);
+    emit_keystream_row(p, offload->keystream_fd, pass);
+    // Grow the packet, nothing is changed before this point
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_MOV_IMM(p, BPF_REG_3, 0);
+    EBPF_CALL(p, BPF_FUNC_skb_change_tail);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, pass);
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_CALL(p, BPF_FUNC_skb_pull_data);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, drop);
+    // Fill the dummy data with 0xFF
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, data));
+    EBPF_LDX(p, BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct __sk_buff, data_end));
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_LENGTH);
+    EBPF_JMP_IMM(p, BPF_JGT, BPF_REG_4, OFFLOAD_PAYLOAD_MAX, drop);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, HEADERS_SIZE);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_2, BPF_REG_4);
+    EBPF_LDX(p, BPF_W, BPF_REG_1, BPF_REG_10, S_DUMMY);
+    EBPF_ALU_IMM(p, BPF_OR, BPF_REG_1, 0);              // not tied to the stack slot, so the loop does not narrow it
+    EBPF_MOV_IMM(p, BPF_REG_5, 0);
+    int fill_loop = ebpf_label(p);
+    ebpf_place(p, fill_loop);
+    EBPF_JMP(p, BPF_JGE, BPF_REG_5, BPF_REG_1, fill_done);
+    EBPF_JMP_IMM(p, BPF_JGE, BPF_REG_5, MAX_DUMMY_LENGTH_TOTAL, fill_done);
+    EBPF_MOV(p, BPF_REG_0, BPF_REG_2);
+    EBPF_ALU(p, BPF_ADD, BPF_REG_0, BPF_REG_5);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_0);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_4, 1);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_4, BPF_REG_3, fill_done);
+    EBPF_ST(p, BPF_B, BPF_REG_0, 0, 0xFF);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_5, 1);
+    EBPF_GOTO(p, fill_loop);
+    ebpf_place(p, fill_done);
+    emit_reload(p, 4, drop);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_HEADER);
+    EBPF_STX(p, BPF_W, BPF_REG_2, BPF_REG_4, HEADERS_SIZE);
+    emit_xor_payload(p);
+
+    // Addresses and ports of the partner flow, lengths and the IP checksum
+    ebpf_place(p, rewrite);
+    EBPF_LDX(p, BPF_W, BPF_REG_8, BPF_REG_10, S_NEW_LENGTH);
+    EBPF_JMP_IMM(p, BPF_JGT, BPF_REG_8, OFFLOAD_PAYLOAD_MAX, drop);
+    emit_reload(p, 0, drop);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 26);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_OLD);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 30);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_OLD + 4);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 38);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_OLD + 8);
+    for (int i = 0; i < 12; i += 4) {
+        EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_MACS + i);
+        EBPF_STX(p, BPF_W, BPF_REG_2, BPF_REG_4, i);
+    }
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_4, HEADERS_SIZE - 14);
+    EBPF_BE16(p, BPF_REG_4);
+    EBPF_STX(p, BPF_H, BPF_REG_2, BPF_REG_4, 16);
+    EBPF_ST(p, BPF_B, BPF_REG_2, 22, 64);
+    EBPF_ST(p, BPF_H, BPF_REG_2, 24, 0);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_10, S_LOCAL_ADDR);
+    EBPF_STX(p, BPF_W, BPF_REG_2, BPF_REG_4, 26);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_NEW);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_7, FLOW(new_daddr));
+    EBPF_STX(p, BPF_W, BPF_REG_2, BPF_REG_4, 30);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_NEW + 4);
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 14);
+    for (int i = 18; i < 34; i += 4) {
+        EBPF_LDX(p, BPF_W, BPF_REG_5, BPF_REG_2, i);
+        EBPF_ALU(p, BPF_ADD, BPF_REG_4, BPF_REG_5);
+    }
+    for (int i = 0; i < 4; i++) {
+        EBPF_MOV(p, BPF_REG_5, BPF_REG_4);
+        EBPF_ALU_IMM(p, BPF_RSH, BPF_REG_5, 16);
+        EBPF_ALU_IMM(p, BPF_AND, BPF_REG_4, 0xFFFF);
+        EBPF_ALU(p, BPF_ADD, BPF_REG_4, BPF_REG_5);
+    }
+    EBPF_ALU_IMM(p, BPF_XOR, BPF_REG_4, 0xFFFF);
+    EBPF_STX(p, BPF_H, BPF_REG_2, BPF_REG_4, 24);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_7, FLOW(new_sport));
+    EBPF_STX(p, BPF_H, BPF_REG_2, BPF_REG_4, 34);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_7, FLOW(new_dport));
+    EBPF_STX(p, BPF_H, BPF_REG_2, BPF_REG_4, 36);
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_8);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_4, 8);
+    EBPF_BE16(p, BPF_REG_4);
+    EBPF_STX(p, BPF_H, BPF_REG_2, BPF_REG_4, 38);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, S_PSEUDO_NEW + 8);
+    // UDP checksum. A packet from a local socket (CHECKSUM_PARTIAL) gets its checksum from the
+    // device, only the pseudo header part is updated. Any other packet is sent without a checksum,
+    // computing it over the payload is not worth it.
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_1, S_PSEUDO_OLD);
+    EBPF_MOV_IMM(p, BPF_REG_2, 12);
+    EBPF_MOV(p, BPF_REG_3, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_3, S_PSEUDO_NEW);
+    EBPF_MOV_IMM(p, BPF_REG_4, 12);
+    EBPF_MOV_IMM(p, BPF_REG_5, 0);
+    EBPF_CALL(p, BPF_FUNC_csum_diff);
+    EBPF_STX(p, BPF_DW, BPF_REG_10, BPF_REG_0, S_PSEUDO_DIFF);
+    emit_reload(p, 0, drop);
+    // Adding the checksum itself zeroes it, unless the checksum is partial
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 40);
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_MOV_IMM(p, BPF_REG_2, 40);
+    EBPF_MOV_IMM(p, BPF_REG_3, 0);
+    EBPF_MOV_IMM(p, BPF_REG_5, 0);
+    EBPF_CALL(p, BPF_FUNC_l4_csum_replace);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, drop);
+    // Then only the partial one is updated, a zero one is left as is
+    EBPF_MOV(p, BPF_REG_1, BPF_REG_6);
+    EBPF_MOV_IMM(p, BPF_REG_2, 40);
+    EBPF_MOV_IMM(p, BPF_REG_3, 0);
+    EBPF_LDX(p, BPF_DW, BPF_REG_4, BPF_REG_10, S_PSEUDO_DIFF);
+    EBPF_MOV_IMM(p, BPF_REG_5, BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0);
+    EBPF_CALL(p, BPF_FUNC_l4_csum_replace);
+    EBPF_JMP_IMM(p, BPF_JNE, BPF_REG_0, 0, drop);
+    // Activity for check_clients(), then send
+    EBPF_CALL(p, BPF_FUNC_ktime_get_ns);
+    EBPF_STX(p, BPF_DW, BPF_REG_7, BPF_REG_0, FLOW(last_seen_ns));
+    EBPF_MOV_IMM(p, BPF_REG_1, 1);
+    EBPF_ATOMIC_ADD(p, BPF_DW, BPF_REG_7, BPF_REG_1, FLOW(packets));
+    EBPF_LDX(p, BPF_W, BPF_REG_1, BPF_REG_10, S_IFINDEX);
+    EBPF_MOV_IMM(p, BPF_REG_2, 0);
+    EBPF_CALL(p, BPF_FUNC_redirect);
+    EBPF_EXIT(p);
+
+    ebpf_place(p, pass);
+    EBPF_MOV_IMM(p, BPF_REG_0, TC_ACT_OK);
+    EBPF_EXIT(p);
+    ebpf_place(p, drop);
+    EBPF_MOV_IMM(p, BPF_REG_0, TC_ACT_SHOT);
+    EBPF_EXIT(p);
+
+    offload->prog_fd = ebpf_load(p, BPF_PROG_TYPE_SCHED_CLS);
+    return offload->prog_fd;
+}
+
+/**
+ * @brief Fills the keystream map: row N is what xor_data() XORs a payload of N bytes
+ * modulo 256 with, the keystream only depends on the length modulo 256 and the position.
+ */
+static int fill_keystream(offload_t *offload, char *key, int key_length)
+{
+    static uint8_t buffer[OFFLOAD_PAYLOAD_MAX + 256];
+    for (uint32_t row = 0; row < 256; row++) {
+        int length = OFFLOAD_PAYLOAD_MAX + (int)row;
+        memset(buffer, 0, length);
+        xor_data(buffer, length, key, key_length);
+        if (ebpf_map_update(offload->keystream_fd, &row, buffer) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Netlink request for the traffic control
+typedef struct {
+    struct nlmsghdr n;
+    struct tcmsg t;
+    char attrs[256];
+} tc_request_t;
+
+static void tc_request_init(tc_request_t *req, int type, int flags, int ifindex, uint32_t parent, uint32_t handle, uint32_t info)
+{
+    memset(req, 0, sizeof(*req));
+    req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+    req->n.nlmsg_type = type;
+    req->n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    req->t.tcm_family = AF_UNSPEC;
+    req->t.tcm_ifindex = ifindex;
+    req->t.tcm_parent = parent;
+    req->t.tcm_handle = handle;
+    req->t.tcm_info = info;
+}
+
+static struct rtattr *tc_request_attr(tc_request_t *req, int type, const void *data, int length)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(req->n.nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(length);
+    if (length) {
+        memcpy(RTA_DATA(rta), data, length);
+    }
+    req->n.nlmsg_len = NLMSG_ALIGN(req->n.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+/**
+ * @brief Sends the request and waits for the acknowledgement.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+static int tc_request_send(tc_request_t *req)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    if (sendto(fd, req, req->n.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t reply[1024] __attribute__((aligned(4)));
+    ssize_t length = recv(fd, reply, sizeof(reply), 0);
+    int saved_errno = errno;
+    close(fd);
+    if (length < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    const struct nlmsghdr *n = (const struct nlmsghdr *)reply;
+    if (length < (ssize_t)NLMSG_LENGTH(sizeof(struct nlmsgerr)) || n->nlmsg_type != NLMSG_ERROR) {
+        errno = EPROTO;
+        return -1;
+    }
+    const struct nlmsgerr *err = NLMSG_DATA(n);
+    if (err->error) {
+        errno = -err->error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Attaches the program to the ingress of the interface, as "tc filter add dev <ifname>
+ * ingress prio <listen port> handle 1 bpf direct-action" would. The clsact qdisc is created if needed.
+ */
+static int attach_program(offload_t *offload, int ifindex)
+{
+    tc_request_t req;
+    tc_request_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0), 0);
+    tc_request_attr(&req, TCA_KIND, "clsact", sizeof("clsact"));
+    if (tc_request_send(&req) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    // A filter left by a previous run is replaced
+    tc_request_init(&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_REPLACE, ifindex,
+        TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS), 1, TC_H_MAKE((uint32_t)ntohs(offload->listen_port) << 16, htons(ETH_P_IP)));
+    tc_request_attr(&req, TCA_KIND, "bpf", sizeof("bpf"));
+    struct rtattr *options = tc_request_attr(&req, TCA_OPTIONS, NULL, 0);
+    uint32_t fd = offload->prog_fd;
+    uint32_t flags = TCA_BPF_FLAG_ACT_DIRECT;
+    tc_request_attr(&req, TCA_BPF_FD, &fd, sizeof(fd));
+    tc_request_attr(&req, TCA_BPF_NAME, "wg-obfuscator", sizeof("wg-obfuscator"));
+    tc_request_attr(&req, TCA_BPF_FLAGS, &flags, sizeof(flags));
+    options->rta_len = (uint16_t)((char *)&req + req.n.nlmsg_len - (char *)options);
+    return tc_request_send(&req);
+}
+
+static void detach_program(offload_t *offload, int ifindex)
+{
+    tc_request_t req;
+    tc_request_init(&req, RTM_DELTFILTER, 0, ifindex,
+        TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS), 1, TC_H_MAKE((uint32_t)ntohs(offload->listen_port) << 16, htons(ETH_P_IP)));
+    tc_request_attr(&req, TCA_KIND, "bpf", sizeof("bpf"));
+    if (tc_request_send(&req) < 0) {
+        log(LL_WARN, "Failed to detach TC offload program from interface %d: %s", ifindex, strerror(errno));
+    }
+}
+
+int offload_init(offload_t *offload, const char *interfaces, const struct sockaddr_in *listen_addr,
+    char *key, int key_length, int max_clients)
+{
+    memset(offload, 0, sizeof(*offload));
+    offload->prog_fd = offload->flows_fd = offload->keystream_fd = -1;
+    offload->listen_addr = listen_addr->sin_addr.s_addr;
+    offload->listen_port = listen_addr->sin_port;
+
+    offload->flows_fd = ebpf_map_create(BPF_MAP_TYPE_HASH, sizeof(offload_key_t), sizeof(offload_flow_t), max_clients * 2);
+    offload->keystream_fd = ebpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), OFFLOAD_PAYLOAD_MAX, 256);
+    if (offload->flows_fd < 0 || offload->keystream_fd < 0) {
+        serror("Failed to create TC offload maps");
+        offload_free(offload);
+        return -1;
+    }
+    if (fill_keystream(offload, key, key_length) < 0) {
+        serror("Failed to fill TC offload keystream map");
+        offload_free(offload);
+        return -1;
+    }
+    if (load_program(offload) < 0) {
+        serror("Failed to load TC offload program");
+        offload_free(offload);
+        return -1;
+    }
+
+    char list[256];
+    strncpy(list, interfaces, sizeof(list) - 1);
+    list[sizeof(list) - 1] = 0;
+    char *saveptr = NULL;
+    for (char *ifname = strtok_r(list, ",", &saveptr); ifname; ifname = strtok_r(NULL, ",", &saveptr)) {
+        ifname = trim(ifname);
+        if (!*ifname) {
+            continue;
+        }
+        if (offload->ifindex_count >= OFFLOAD_INTERFACES_MAX) {
+            log(LL_ERROR, "Too many TC offload interfaces, the maximum is %d", OFFLOAD_INTERFACES_MAX);
+            offload_free(offload);
+            return -1;
+        }
+        int ifindex = if_nametoindex(ifname);
+        if (!ifindex) {
+            serror("Unknown TC offload interface '%s'", ifname);
+            offload_free(offload);
+            return -1;
+        }
+        if (attach_program(offload, ifindex) < 0) {
+            serror("Failed to attach TC offload program to '%s'", ifname);
+            offload_free(offload);
+            return -1;
+        }
+        offload->ifindexes[offload->ifindex_count++] = ifindex;
+    }
+    if (!offload->ifindex_count) {
+        log(LL_ERROR, "No TC offload interfaces specified");
+        offload_free(offload);
+        return -1;
+    }
+    return 0;
+}
+
+void offload_free(offload_t *offload)
+{
+    for (int i = 0; i < offload->ifindex_count; i++) {
+        detach_program(offload, offload->ifindexes[i]);
+    }
+    if (offload->prog_fd >= 0) {
+        close(offload->prog_fd);
+    }
+    if (offload->flows_fd >= 0) {
+        close(offload->flows_fd);
+    }
+    if (offload->keystream_fd >= 0) {
+        close(offload->keystream_fd);
+    }
+    memset(offload, 0, sizeof(*offload));
+    offload->prog_fd = offload->flows_fd = offload->keystream_fd = -1;
+}
+
+static void client_keys(offload_t *offload, const client_entry_t *client_entry, const struct sockaddr_in *forward_addr,
+    offload_key_t *to_server, offload_key_t *to_client)
+{
+    *to_server = (offload_key_t){
+        .addr = client_entry->client_addr.sin_addr.s_addr,
+        .port = client_entry->client_addr.sin_port,
+        .local_port = offload->listen_port,
+    };
+    *to_client = (offload_key_t){
+        .addr = forward_addr->sin_addr.s_addr,
+        .port = forward_addr->sin_port,
+        .local_port = client_entry->our_addr.sin_port,
+    };
+}
+
+int offload_add_client(offload_t *offload, const obfuscator_config_t *config, client_entry_t *client_entry,
+    const struct sockaddr_in *forward_addr)
+{
+    // Masking and the old version are left to the obfuscator
+    if (client_entry->masking_handler || (client_entry->version < 1 && !client_entry->client_clean)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    offload_key_t to_server, to_client;
+    client_keys(offload, client_entry, forward_addr, &to_server, &to_client);
+
+    // What the program has learned is kept after a new handshake
+    offload_flow_t a, b;
+    if (ebpf_map_lookup(offload->flows_fd, &to_server, &a) < 0) {
+        memset(&a, 0, sizeof(a));
+    }
+    if (ebpf_map_lookup(offload->flows_fd, &to_client, &b) < 0) {
+        memset(&b, 0, sizeof(b));
+    }
+    a.new_daddr = forward_addr->sin_addr.s_addr;
+    a.new_sport = client_entry->our_addr.sin_port;
+    a.new_dport = forward_addr->sin_port;
+    a.expect_daddr = offload->listen_addr;
+    a.op = client_entry->client_obfuscated ? OFFLOAD_OP_DECODE
+        : client_entry->client_clean ? OFFLOAD_OP_NONE : OFFLOAD_OP_ENCODE;
+    a.max_dummy = config->max_dummy_length_data;
+    a.partner = to_client;
+    b.new_daddr = client_entry->client_addr.sin_addr.s_addr;
+    b.new_sport = offload->listen_port;
+    b.new_dport = client_entry->client_addr.sin_port;
+    b.expect_daddr = 0;
+    b.op = client_entry->server_obfuscated ? OFFLOAD_OP_DECODE
+        : client_entry->client_clean ? OFFLOAD_OP_NONE : OFFLOAD_OP_ENCODE;
+    b.max_dummy = config->max_dummy_length_data;
+    b.partner = to_server;
+    if (ebpf_map_update(offload->flows_fd, &to_server, &a) < 0
+        || ebpf_map_update(offload->flows_fd, &to_client, &b) < 0) {
+        int saved_errno = errno;
+        ebpf_map_delete(offload->flows_fd, &to_server);
+        errno = saved_errno;
+        return -1;
+    }
+    client_entry->offloaded = 1;
+    return 0;
+}
+
+void offload_remove_client(offload_t *offload, client_entry_t *client_entry, const struct sockaddr_in *forward_addr)
+{
+    if (!client_entry->offloaded) {
+        return;
+    }
+    offload_key_t to_server, to_client;
+    client_keys(offload, client_entry, forward_addr, &to_server, &to_client);
+    ebpf_map_delete(offload->flows_fd, &to_server);
+    ebpf_map_delete(offload->flows_fd, &to_client);
+    client_entry->offloaded = 0;
+    client_entry->offload_packets = 0;
+}
+
+uint64_t offload_poll_client(offload_t *offload, client_entry_t *client_entry, const struct sockaddr_in *forward_addr)
+{
+    offload_key_t to_server, to_client;
+    client_keys(offload, client_entry, forward_addr, &to_server, &to_client);
+    offload_flow_t a, b;
+    if (ebpf_map_lookup(offload->flows_fd, &to_server, &a) < 0
+        || ebpf_map_lookup(offload->flows_fd, &to_client, &b) < 0) {
+        return 0;
+    }
+    // Same clock as get_time_ms()
+    long a_time = (long)(a.last_seen_ns / 1000000);
+    long b_time = (long)(b.last_seen_ns / 1000000);
+    if (a.packets && a_time > client_entry->last_activity_time) {
+        client_entry->last_activity_time = a_time;
+    }
+    if (b.packets && b_time > client_entry->last_activity_time) {
+        client_entry->last_activity_time = b_time;
+    }
+    if (b.packets && b_time > client_entry->last_incoming_time) {
+        client_entry->last_incoming_time = b_time;
+    }
+    uint64_t packets = a.packets + b.packets;
+    uint64_t delta = packets - client_entry->offload_packets;
+    client_entry->offload_packets = packets;
+    return delta;
+}
+
+#endif // USE_TC_OFFLOAD
@@ -0,0 +1,115 @@
+#ifndef _OFFLOAD_H_
+#define _OFFLOAD_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+#include "ebpf.h"
+
+// In-kernel forwarding of the data packets of the handshaked clients, a TC program
+// attached to the interfaces does the obfuscation. Can be left out of the build with "make TC_OFFLOAD=0".
+#if defined(USE_EBPF) && !defined(NO_TC_OFFLOAD)
+#if __has_include(<linux/pkt_cls.h>)
+#define USE_TC_OFFLOAD
+#endif
+#endif
+
+#ifdef USE_TC_OFFLOAD
+
+#define OFFLOAD_INTERFACES_MAX      8
+#define OFFLOAD_PAYLOAD_MAX         2048    // longer datagrams are left to the obfuscator
+
+// What the program does with the payload of a flow
+#define OFFLOAD_OP_NONE             0       // forward as is (clean clients)
+#define OFFLOAD_OP_DECODE           1
+#define OFFLOAD_OP_ENCODE           2
+
+// Key of a flow: the datagrams from 'addr:port' to our 'local_port', all in network byte order
+typedef struct {
+    uint32_t addr;
+    uint16_t port;
+    uint16_t local_port;
+} offload_key_t;
+
+// Value of a flow, shared with the program. Every client has two flows, one in each direction,
+// and each of them is sent with what the program has learned from the other one.
+typedef struct {
+    uint32_t new_daddr;             // destination after the rewrite
+    uint16_t new_sport;
+    uint16_t new_dport;
+    uint32_t expect_daddr;          // required destination address, 0 for any
+    uint8_t op;                     // OFFLOAD_OP_*
+    uint8_t seen;                   // set by the program once a datagram of the flow has arrived
+    uint16_t max_dummy;             // maximum length of dummy data when encoding
+    offload_key_t partner;          // flow in the opposite direction
+    // Learned by the program from the last datagram of the flow
+    uint32_t ifindex;               // interface it arrived on
+    uint32_t local_addr;            // our address it was sent to
+    uint8_t macs[12];               // its source and destination MAC addresses
+    uint32_t reserved;
+    uint64_t last_seen_ns;          // CLOCK_MONOTONIC time of the last datagram forwarded by the program
+    uint64_t packets;               // datagrams forwarded by the program
+} offload_flow_t;
+
+typedef struct {
+    int prog_fd;
+    int flows_fd;
+    int keystream_fd;               // keystream rows by the payload length modulo 256, see obfuscation.c
+    int ifindexes[OFFLOAD_INTERFACES_MAX];
+    int ifindex_count;
+    uint32_t listen_addr;           // in network byte order, INADDR_ANY for any
+    uint16_t listen_port;           // in network byte order, also the priority of the filter
+} offload_t;
+
+/**
+ * @brief Loads the program and attaches it to the ingress of every interface.
+ *
+ * @param offload Context to initialize.
+ * @param interfaces Comma-separated list of interfaces: the one the clients come from
+ *                   and the one the packets of the target arrive on ("lo" if it is local).
+ * @param listen_addr Address and port the obfuscator listens on.
+ * @param key Obfuscation key.
+ * @param key_length Length of the key.
+ * @param max_clients Maximum number of clients.
+ * @return 0 on success, -1 on error (the reason is logged).
+ */
+int offload_init(offload_t *offload, const char *interfaces, const struct sockaddr_in *listen_addr,
+    char *key, int key_length, int max_clients);
+
+/**
+ * @brief Detaches the program and releases all the resources.
+ */
+void offload_free(offload_t *offload);
+
+/**
+ * @brief Hands the data packets of a handshaked client over to the program, or updates its flows
+ * after a new handshake. The first datagram in each direction still goes through the obfuscator,
+ * the program learns the addresses to send with from it.
+ *
+ * @param offload Context.
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry.
+ * @param forward_addr Address of the target.
+ * @return 0 on success, -1 if the client can not be offloaded or on error (errno is set).
+ */
+int offload_add_client(offload_t *offload, const obfuscator_config_t *config, client_entry_t *client_entry,
+    const struct sockaddr_in *forward_addr);
+
+/**
+ * @brief Takes the packets of the client back from the program.
+ */
+void offload_remove_client(offload_t *offload, client_entry_t *client_entry, const struct sockaddr_in *forward_addr);
+
+/**
+ * @brief Updates the activity times of an offloaded client from what the program has forwarded.
+ *
+ * @param offload Context.
+ * @param client_entry Client entry.
+ * @param forward_addr Address of the target.
+ * @return Number of datagrams the program has forwarded since the last call.
+ */
+uint64_t offload_poll_client(offload_t *offload, client_entry_t *client_entry, const struct sockaddr_in *forward_addr);
+
+#endif // USE_TC_OFFLOAD
+
+#endif // _OFFLOAD_H_
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include "wg-obfuscator.h"
+#include "pipeline.h"
+#include "obfuscation.h"
+#include "stats.h"
+
+// Rounds of polling an empty ring before going to sleep
+#define SPIN_ROUNDS     256
+
+static int ring_init(spsc_ring_t *ring, uint32_t capacity)
+{
+    ring->head = ring->tail = 0;
+    ring->mask = capacity - 1;
+    ring->entries = calloc(capacity, sizeof(*ring->entries));
+    return ring->entries ? 0 : -1;
+}
+
+static int ring_empty(spsc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+/**
+ * @brief Adds an entry, the ring never overflows: it can hold every packet of the pool.
+ */
+static void ring_push(spsc_ring_t *ring, void *entry)
+{
+    ring->entries[ring->tail & ring->mask] = entry;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *ring_pop(spsc_ring_t *ring)
+{
+    if (ring_empty(ring)) {
+        return NULL;
+    }
+    void *entry = ring->entries[ring->head & ring->mask];
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return entry;
+}
+
+static void doorbell_init(doorbell_t *bell)
+{
+    pthread_mutex_init(&bell->lock, NULL);
+    pthread_cond_init(&bell->cond, NULL);
+    bell->sleeping = 0;
+}
+
+/**
+ * @brief Waits until the ring is not empty, polling it for a while before going to sleep.
+ */
+static void doorbell_wait(doorbell_t *bell, spsc_ring_t *ring)
+{
+    for (int i = 0; i < SPIN_ROUNDS; i++) {
+        if (!ring_empty(ring)) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&bell->lock);
+    __atomic_store_n(&bell->sleeping, 1, __ATOMIC_RELAXED);
+    // Pairs with the fence in doorbell_ring(): either we see the new entry, or the producer sees us sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (ring_empty(ring)) {
+        pthread_cond_wait(&bell->cond, &bell->lock);
+    }
+    __atomic_store_n(&bell->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bell->lock);
+}
+
+/**
+ * @brief Wakes up the consumer after an entry was pushed, if it is sleeping.
+ */
+static void doorbell_ring(doorbell_t *bell)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bell->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&bell->lock);
+        pthread_cond_signal(&bell->cond);
+        pthread_mutex_unlock(&bell->lock);
+    }
+}
+
+int pipeline_init(pipeline_t *pipeline, int stages, int batch_size, char *key, int key_length)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->stage_count = stages;
+    pipeline->batch_size = batch_size;
+    pipeline->key = key;
+    pipeline->key_length = key_length;
+    // Enough packets for every thread to work on a full batch while the next ones are received
+    pipeline->packet_count = 4 * batch_size * (stages + 1);
+    uint32_t capacity = 1;
+    while (capacity < (uint32_t)pipeline->packet_count) {
+        capacity <<= 1;
+    }
+
+    pipeline->packets = calloc((size_t)pipeline->packet_count, sizeof(*pipeline->packets));
+    pipeline->stages = calloc((size_t)stages, sizeof(*pipeline->stages));
+    if (!pipeline->packets || !pipeline->stages || ring_init(&pipeline->free, capacity) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < stages; i++) {
+        pipeline_stage_t *stage = &pipeline->stages[i];
+        if (ring_init(&stage->in, capacity) != 0 || ring_init(&stage->out, capacity) != 0) {
+            return -1;
+        }
+        doorbell_init(&stage->bell);
+        stage->pipeline = pipeline;
+    }
+    for (int i = 0; i < pipeline->packet_count; i++) {
+        pipeline->packets[i].buffer = malloc(BUFFER_SIZE + PREBUFFER_SIZE);
+        if (!pipeline->packets[i].buffer) {
+            return -1;
+        }
+        ring_push(&pipeline->free, &pipeline->packets[i]);
+    }
+    doorbell_init(&pipeline->free_bell);
+    doorbell_init(&pipeline->tx_bell);
+    return 0;
+}
+
+/**
+ * @brief Processing thread: finishes the keystream XOR, the receiving thread has done the rest.
+ */
+static void *stage_run(void *arg)
+{
+    pipeline_stage_t *stage = arg;
+    pipeline_t *pipeline = stage->pipeline;
+    while (1) {
+        pipeline_packet_t *packet = ring_pop(&stage->in);
+        if (!packet) {
+            doorbell_wait(&stage->bell, &stage->in);
+            continue;
+        }
+        if (packet->xor_data) {
+            xor_data_finish(packet->xor_data, packet->xor_length, pipeline->key, pipeline->key_length);
+        }
+        ring_push(&stage->out, packet);
+        doorbell_ring(&pipeline->tx_bell);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends the batch and gives the buffers of the sent packets back to the receiving thread.
+ */
+static void tx_flush(pipeline_t *pipeline, packet_batch_t *batch, pipeline_packet_t **sent, int *sent_count)
+{
+    batch_flush(batch);
+    for (int i = 0; i < *sent_count; i++) {
+        ring_push(&pipeline->free, sent[i]);
+    }
+    *sent_count = 0;
+    doorbell_ring(&pipeline->free_bell);
+}
+
+/**
+ * @brief Sending thread: takes the packets from the processing threads in the same
+ * round-robin order they were handed out, so they leave in the order they arrived.
+ */
+static void *tx_run(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    packet_batch_t batch;
+    pipeline_packet_t **sent = calloc((size_t)pipeline->batch_size, sizeof(*sent));
+    int sent_count = 0;
+
+    stats_register();
+    if (!sent || batch_init(&batch, pipeline->batch_size, 0) != 0) {
+        log(LL_ERROR, "Failed to allocate memory for the sending thread");
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        pipeline_stage_t *stage = &pipeline->stages[pipeline->next_out];
+        pipeline_packet_t *packet = ring_pop(&stage->out);
+        if (!packet) {
+            if (sent_count > 0) {
+                // Nothing more right now, send what we have
+                tx_flush(pipeline, &batch, sent, &sent_count);
+                continue;
+            }
+            doorbell_wait(&pipeline->tx_bell, &stage->out);
+            continue;
+        }
+        pipeline->next_out = (pipeline->next_out + 1) % pipeline->stage_count;
+        if (packet->close) {
+            // The datagrams handed over before it are all in the batch now
+            tx_flush(pipeline, &batch, sent, &sent_count);
+            close(packet->sock);
+            ring_push(&pipeline->free, packet);
+            doorbell_ring(&pipeline->free_bell);
+            continue;
+        }
+        batch.txtime = packet->txtime;
+        batch.tos = packet->tos;
+        batch_queue(&batch, packet->sock, packet->data, packet->length, packet->has_addr ? &packet->addr : NULL, NULL);
+        sent[sent_count++] = packet;
+        if (sent_count == pipeline->batch_size) {
+            tx_flush(pipeline, &batch, sent, &sent_count);
+        }
+    }
+    return NULL;
+}
+
+int pipeline_start(pipeline_t *pipeline)
+{
+    // Signals are handled by the main thread only
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&pipeline->tx_thread, NULL, tx_run, pipeline);
+    for (int i = 0; i < pipeline->stage_count && !err; i++) {
+        err = pthread_create(&pipeline->stages[i].thread, NULL, stage_run, &pipeline->stages[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+/**
+ * @brief Takes a free packet from the pool, waits for the sending thread if all of them are in flight.
+ */
+static pipeline_packet_t *take_packet(pipeline_t *pipeline)
+{
+    pipeline_packet_t *packet;
+    while (!(packet = ring_pop(&pipeline->free))) {
+        doorbell_wait(&pipeline->free_bell, &pipeline->free);
+    }
+    return packet;
+}
+
+/**
+ * @brief Passes the packet to the next processing thread in turn.
+ */
+static void hand_over(pipeline_t *pipeline, pipeline_packet_t *packet)
+{
+    pipeline_stage_t *stage = &pipeline->stages[pipeline->next_in];
+    pipeline->next_in = (pipeline->next_in + 1) % pipeline->stage_count;
+    ring_push(&stage->in, packet);
+    doorbell_ring(&stage->bell);
+}
+
+void pipeline_submit(pipeline_t *pipeline, packet_batch_t *batch)
+{
+    for (int i = 0; i < batch->tx_count; i++) {
+        tx_item_t *item = &batch->items[i];
+        pipeline_packet_t *packet = take_packet(pipeline);
+        // Still there unless an earlier item has taken the slot over
+        rx_slot_t *slot = item->rx_slot >= 0 ? &batch->slots[item->rx_slot] : NULL;
+        if (slot && batch_in_slot(slot, item->buffer)) {
+            // Take the whole buffer over, the slot receives into the free one next time
+            uint8_t *buffer = slot->data;
+            slot->data = packet->buffer;
+            packet->buffer = buffer;
+            packet->data = item->buffer;
+            packet->xor_data = item->xor_data;
+            packet->xor_length = item->xor_length;
+        } else {
+            // Not received into the batch, finish it here and copy
+            if (item->xor_data) {
+                xor_data_finish(item->xor_data, item->xor_length, pipeline->key, pipeline->key_length);
+            }
+            packet->data = packet->buffer + PREBUFFER_SIZE;
+            memcpy(packet->data, item->buffer, item->length);
+            packet->xor_data = NULL;
+        }
+        packet->length = item->length;
+        packet->sock = item->sock;
+        packet->has_addr = item->has_addr;
+        packet->addr = item->addr;
+        packet->txtime = item->txtime;
+        packet->tos = item->tos;
+        packet->close = 0;
+        hand_over(pipeline, packet);
+    }
+    batch->tx_count = 0;
+}
+
+void pipeline_close(pipeline_t *pipeline, int sock)
+{
+    // Goes the same way as the datagrams, so the sending thread gets it after all of them
+    pipeline_packet_t *packet = take_packet(pipeline);
+    packet->xor_data = NULL;
+    packet->sock = sock;
+    packet->close = 1;
+    hand_over(pipeline, packet);
+}
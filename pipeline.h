@@ -0,0 +1,110 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+#include "batch.h"
+
+#define CACHE_LINE_SIZE         64
+
+// Single-producer/single-consumer ring of pointers. The indexes written by the
+// producer and by the consumer live on separate cache lines, so the two threads
+// do not keep stealing the line from each other.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint32_t head;    // next entry to take, written by the consumer
+    _Alignas(CACHE_LINE_SIZE) uint32_t tail;    // next entry to fill, written by the producer
+    _Alignas(CACHE_LINE_SIZE) uint32_t mask;    // capacity - 1, the capacity is a power of two
+    void **entries;
+} spsc_ring_t;
+
+// Wakes up a thread sleeping on an empty ring. The producer takes the lock only
+// if the consumer has actually gone to sleep.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleeping;
+} doorbell_t;
+
+// One datagram on its way through the pipeline, it owns its buffer until it is sent
+typedef struct {
+    uint8_t *buffer;                // BUFFER_SIZE + PREBUFFER_SIZE bytes from the pool
+    uint8_t *data;                  // datagram to send, inside the buffer
+    int length;
+    uint8_t *xor_data;              // keystream XOR past the header left to do, NULL if none
+    int xor_length;
+    int sock;                       // socket to send through
+    struct sockaddr_in addr;        // destination address, used only if has_addr is set
+    uint8_t has_addr;
+    uint64_t txtime;                // departure time (pacing), 0 to send right away
+    int tos;                        // TOS byte to send with, -1 for the one of the socket
+    uint8_t close;                  // not a datagram: the socket is closed once everything before it is sent
+} pipeline_packet_t;
+
+// Processing thread: finishes the XOR of the packets handed to it, in order
+typedef struct {
+    spsc_ring_t in;                 // from the receiving thread
+    spsc_ring_t out;                // to the sending thread
+    doorbell_t bell;                // rung by the receiving thread
+    pthread_t thread;
+    struct pipeline *pipeline;
+} pipeline_stage_t;
+
+typedef struct pipeline {
+    pipeline_stage_t *stages;
+    int stage_count;
+    int next_in;                    // receiving thread: stage for the next packet
+    int next_out;                   // sending thread: stage the next packet comes from
+    spsc_ring_t free;               // sent packets, back to the receiving thread
+    doorbell_t free_bell;           // rung by the sending thread
+    doorbell_t tx_bell;             // rung by the processing threads
+    pthread_t tx_thread;
+    pipeline_packet_t *packets;     // the pool, every packet has its own buffer
+    int packet_count;
+    int batch_size;
+    char *key;
+    int key_length;
+} pipeline_t;
+
+/**
+ * @brief Allocates the rings and the buffer pool.
+ *
+ * @param pipeline Pipeline to initialize.
+ * @param stages Number of processing threads.
+ * @param batch_size Maximum number of datagrams per syscall, the pool size is derived from it.
+ * @param key Obfuscation key.
+ * @param key_length Length of the key.
+ * @return 0 on success, -1 if out of memory.
+ */
+int pipeline_init(pipeline_t *pipeline, int stages, int batch_size, char *key, int key_length);
+
+/**
+ * @brief Starts the processing threads and the sending thread.
+ *
+ * @param pipeline Pipeline to start.
+ * @return 0 on success, an error number otherwise.
+ */
+int pipeline_start(pipeline_t *pipeline);
+
+/**
+ * @brief Hands all the queued datagrams of the batch over to the processing threads,
+ * called by batch_flush() on the receiving thread. The rx slots the datagrams are in
+ * get fresh buffers from the pool, so nothing is copied.
+ *
+ * @param pipeline Pipeline to submit to.
+ * @param batch Batch with the queued datagrams, every rx slot holds at most one of them.
+ */
+void pipeline_submit(pipeline_t *pipeline, packet_batch_t *batch);
+
+/**
+ * @brief Closes a socket once every datagram handed over for it so far has been sent, called on the
+ * receiving thread instead of close(). It does not wait: the sending thread closes the socket when it
+ * gets there, so no datagram goes out through a new socket with the same number.
+ *
+ * @param pipeline Pipeline the datagrams were submitted to.
+ * @param sock Socket to close, no longer watched.
+ */
+void pipeline_close(pipeline_t *pipeline, int sock);
+
+#endif // _PIPELINE_H_
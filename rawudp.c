@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include "wg-obfuscator.h"
+#include "rawudp.h"
+
+#ifdef USE_RAW_UPSTREAM
+#include <linux/filter.h>
+
+int rawudp_init(rawudp_t *raw, uint16_t first, int count, int index, int workers, uint32_t fwmark)
+{
+    memset(raw, 0, sizeof(*raw));
+    raw->sock = -1;
+    raw->first = first;
+    raw->count = count;
+    raw->index = index;
+    raw->workers = workers;
+    raw->slots = index < count ? (count - index + workers - 1) / workers : 0;
+    raw->owners = calloc(raw->slots ? raw->slots : 1, sizeof(*raw->owners));
+    raw->free_slots = malloc((raw->slots ? raw->slots : 1) * sizeof(*raw->free_slots));
+    if (!raw->owners || !raw->free_slots) {
+        rawudp_close(raw);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < raw->slots; i++) {
+        raw->free_slots[i] = i;
+    }
+    raw->free_count = raw->slots;
+
+    raw->sock = socket(AF_INET, SOCK_RAW, IPPROTO_UDP);
+    if (raw->sock < 0) {
+        int saved_errno = errno;
+        rawudp_close(raw);
+        errno = saved_errno;
+        return -1;
+    }
+    // Every UDP datagram of the host would come here until the filter is set, take none
+    struct sock_filter drop = { BPF_RET | BPF_K, 0, 0, 0 };
+    struct sock_fprog prog = { .len = 1, .filter = &drop };
+    if (setsockopt(raw->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        int saved_errno = errno;
+        rawudp_close(raw);
+        errno = saved_errno;
+        return -1;
+    }
+    // Same as the server sockets of the clients
+    int optval = 1;
+    if (setsockopt(raw->sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        int saved_errno = errno;
+        rawudp_close(raw);
+        errno = saved_errno;
+        return -1;
+    }
+    if (fwmark && setsockopt(raw->sock, SOL_SOCKET, SO_MARK, &fwmark, sizeof(fwmark)) < 0) {
+        log(LL_WARN, "Failed to set 'firewall mark' for raw upstream socket: %s", strerror(errno));
+    }
+    return 0;
+}
+
+int rawudp_set_target(rawudp_t *raw, const struct sockaddr_in *target)
+{
+    raw->target = *target;
+    raw->target.sin_port = 0;
+    raw->target_port = target->sin_port;
+
+    // The program sees the packet from the IP header on
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, 12 },                                     // A = source address
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 9, ntohl(target->sin_addr.s_addr) },
+        { BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0 },                                     // X = length of the IP header
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, 0 },                                      // A = source port
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 6, ntohs(target->sin_port) },
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, 2 },                                      // A = destination port
+        { BPF_ALU | BPF_SUB | BPF_K, 0, 0, raw->first },                            // below the range it wraps around
+        { BPF_JMP | BPF_JGE | BPF_K, 3, 0, (uint32_t)raw->count },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)raw->workers },
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)raw->index },
+        { BPF_RET | BPF_K, 0, 0, 0xffffffff },                                      // the whole packet
+        { BPF_RET | BPF_K, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code
+    };
+    return setsockopt(raw->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+uint16_t rawudp_alloc_port(rawudp_t *raw, void *owner)
+{
+    if (!raw->free_count) {
+        return 0;
+    }
+    int slot = raw->free_slots[raw->free_head];
+    raw->free_head = (raw->free_head + 1) % raw->slots;
+    raw->free_count--;
+    raw->owners[slot] = owner;
+    return (uint16_t)(raw->first + slot * raw->workers + raw->index);
+}
+
+void rawudp_free_port(rawudp_t *raw, uint16_t port)
+{
+    int slot = (port - raw->first) / raw->workers;
+    if (port < raw->first || slot >= raw->slots || !raw->owners[slot]) {
+        return;
+    }
+    raw->owners[slot] = NULL;
+    raw->free_slots[(raw->free_head + raw->free_count) % raw->slots] = slot;
+    raw->free_count++;
+}
+
+void *rawudp_owner(const rawudp_t *raw, uint16_t port)
+{
+    int offset = port - raw->first;
+    if (offset >= 0 && offset < raw->count && offset % raw->workers == raw->index) {
+        return raw->owners[offset / raw->workers];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fills the UDP header of a datagram to the target.
+ */
+static void fill_header(const rawudp_t *raw, struct udphdr *udp, int length, uint16_t port)
+{
+    udp->source = htons(port);
+    udp->dest = raw->target_port;
+    udp->len = htons((uint16_t)(length + RAWUDP_HEADER_SIZE));
+    udp->check = 0;
+}
+
+uint8_t *rawudp_wrap(const rawudp_t *raw, uint8_t *buffer, int *length, uint16_t port)
+{
+    uint8_t *header = buffer - RAWUDP_HEADER_SIZE;
+    struct udphdr udp;
+    fill_header(raw, &udp, *length, port);
+    memcpy(header, &udp, sizeof(udp));
+    *length += RAWUDP_HEADER_SIZE;
+    return header;
+}
+
+ssize_t rawudp_send(const rawudp_t *raw, const uint8_t *buffer, int length, uint16_t port)
+{
+    struct udphdr udp;
+    fill_header(raw, &udp, length, port);
+    struct iovec iov[2] = {
+        { .iov_base = &udp, .iov_len = sizeof(udp) },
+        { .iov_base = (void *)buffer, .iov_len = length }
+    };
+    struct msghdr msg = {
+        .msg_name = (void *)&raw->target,
+        .msg_namelen = sizeof(raw->target),
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+    ssize_t r = sendmsg(raw->sock, &msg, 0);
+    return r < 0 ? r : r - RAWUDP_HEADER_SIZE;
+}
+
+uint8_t *rawudp_unwrap(const rawudp_t *raw, uint8_t *packet, int *length, void **owner)
+{
+    *owner = NULL;
+    if (*length < (int)sizeof(struct iphdr)) {
+        return NULL;
+    }
+    struct iphdr ip;
+    memcpy(&ip, packet, sizeof(ip));
+    int ip_length = ip.ihl * 4;
+    if (ip.version != 4 || ip.protocol != IPPROTO_UDP || ip.saddr != raw->target.sin_addr.s_addr
+        || ip_length < (int)sizeof(ip) || *length < ip_length + RAWUDP_HEADER_SIZE) {
+        return NULL;
+    }
+    struct udphdr udp;
+    memcpy(&udp, packet + ip_length, sizeof(udp));
+    int udp_length = ntohs(udp.len);
+    if (udp.source != raw->target_port || udp_length < RAWUDP_HEADER_SIZE || udp_length > *length - ip_length) {
+        return NULL;
+    }
+    *owner = rawudp_owner(raw, ntohs(udp.dest));
+    *length = udp_length - RAWUDP_HEADER_SIZE;
+    return packet + ip_length + RAWUDP_HEADER_SIZE;
+}
+
+void rawudp_close(rawudp_t *raw)
+{
+    if (raw->sock >= 0) {
+        close(raw->sock);
+    }
+    raw->sock = -1;
+    free(raw->owners);
+    raw->owners = NULL;
+    free(raw->free_slots);
+    raw->free_slots = NULL;
+    raw->slots = 0;
+    raw->free_count = 0;
+}
+
+#else
+
+int rawudp_init(rawudp_t *raw, uint16_t first, int count, int index, int workers, uint32_t fwmark)
+{
+    (void)first; (void)count; (void)index; (void)workers; (void)fwmark;
+    memset(raw, 0, sizeof(*raw));
+    raw->sock = -1;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int rawudp_set_target(rawudp_t *raw, const struct sockaddr_in *target)
+{
+    (void)raw; (void)target;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+uint16_t rawudp_alloc_port(rawudp_t *raw, void *owner)
+{
+    (void)raw; (void)owner;
+    return 0;
+}
+
+void rawudp_free_port(rawudp_t *raw, uint16_t port)
+{
+    (void)raw; (void)port;
+}
+
+void *rawudp_owner(const rawudp_t *raw, uint16_t port)
+{
+    (void)raw; (void)port;
+    return NULL;
+}
+
+uint8_t *rawudp_wrap(const rawudp_t *raw, uint8_t *buffer, int *length, uint16_t port)
+{
+    (void)raw; (void)length; (void)port;
+    return buffer;
+}
+
+ssize_t rawudp_send(const rawudp_t *raw, const uint8_t *buffer, int length, uint16_t port)
+{
+    (void)raw; (void)buffer; (void)length; (void)port;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+uint8_t *rawudp_unwrap(const rawudp_t *raw, uint8_t *packet, int *length, void **owner)
+{
+    (void)raw; (void)packet; (void)length;
+    *owner = NULL;
+    return NULL;
+}
+
+void rawudp_close(rawudp_t *raw)
+{
+    (void)raw;
+}
+
+#endif // USE_RAW_UPSTREAM
@@ -0,0 +1,123 @@
+#ifndef _RAWUDP_H_
+#define _RAWUDP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+
+// Raw upstream: the datagrams of all the dynamic clients go to the target through one raw socket,
+// every client is told apart by its source port only. Linux only, needs CAP_NET_RAW.
+#ifdef __linux__
+#define USE_RAW_UPSTREAM
+#endif
+
+#define RAWUDP_HEADER_SIZE      8       // UDP header, written in front of every datagram sent
+
+// Raw socket of one worker thread and the ports of its clients. The ports of the range are
+// shared by the worker threads round-robin: port first + k belongs to worker k % workers.
+typedef struct {
+    int sock;                       // raw socket, -1 if not open
+    uint16_t first;                 // first port of the range
+    int count;                      // number of ports in the range
+    int index;                      // worker thread owning this socket
+    int workers;                    // number of worker threads
+    int slots;                      // number of ports of this worker thread
+    void **owners;                  // owner of every port of this worker, by slot, NULL if the port is free
+    int *free_slots;                // ring of the free slots, the oldest freed one is reused first
+    int free_head;
+    int free_count;
+    struct sockaddr_in target;      // target address, the port is 0 for sendto() on the raw socket
+    uint16_t target_port;           // target port in network byte order
+} rawudp_t;
+
+/**
+ * @brief Opens the raw socket of a worker thread and allocates its share of the ports.
+ * Nothing is received until rawudp_set_target() is called.
+ *
+ * @param raw Raw upstream to initialize.
+ * @param first First port of the range.
+ * @param count Number of ports in the range.
+ * @param index Worker thread.
+ * @param workers Number of worker threads.
+ * @param fwmark Firewall mark for the sent datagrams, 0 for none.
+ * @return 0 on success, -1 on error (errno is set, EPERM without CAP_NET_RAW, EOPNOTSUPP if not supported).
+ */
+int rawudp_init(rawudp_t *raw, uint16_t first, int count, int index, int workers, uint32_t fwmark);
+
+/**
+ * @brief Sets the target address and attaches the filter which lets only the datagrams
+ * from the target to the ports of this worker thread through. Called again when the target changes.
+ *
+ * @param raw Raw upstream.
+ * @param target Target address.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int rawudp_set_target(rawudp_t *raw, const struct sockaddr_in *target);
+
+/**
+ * @brief Takes the least recently freed port of this worker thread.
+ *
+ * @param raw Raw upstream.
+ * @param owner Owner of the port, returned by rawudp_unwrap() for the datagrams to it.
+ * @return Port in host byte order, 0 if all the ports are taken.
+ */
+uint16_t rawudp_alloc_port(rawudp_t *raw, void *owner);
+
+/**
+ * @brief Returns the port to the free ones.
+ *
+ * @param raw Raw upstream.
+ * @param port Port in host byte order, taken by rawudp_alloc_port().
+ */
+void rawudp_free_port(rawudp_t *raw, uint16_t port);
+
+/**
+ * @brief Returns the owner of a port of this worker thread.
+ *
+ * @param raw Raw upstream.
+ * @param port Port in host byte order.
+ * @return Owner, NULL if the port is free or belongs to another worker thread.
+ */
+void *rawudp_owner(const rawudp_t *raw, uint16_t port);
+
+/**
+ * @brief Writes the UDP header in front of the datagram, into the headroom of the buffer.
+ * The checksum is left zero, which IPv4 allows; WireGuard authenticates every packet itself.
+ *
+ * @param raw Raw upstream.
+ * @param buffer Datagram, there must be RAWUDP_HEADER_SIZE bytes of headroom before it.
+ * @param length Length of the datagram, updated to the length with the header.
+ * @param port Source port in host byte order.
+ * @return Start of the header, the data to send through raw->sock to raw->target.
+ */
+uint8_t *rawudp_wrap(const rawudp_t *raw, uint8_t *buffer, int *length, uint16_t port);
+
+/**
+ * @brief Sends one datagram right away, without the headroom needed by rawudp_wrap().
+ *
+ * @param raw Raw upstream.
+ * @param buffer Datagram.
+ * @param length Length of the datagram.
+ * @param port Source port in host byte order.
+ * @return Number of bytes sent without the header, -1 on error (errno is set).
+ */
+ssize_t rawudp_send(const rawudp_t *raw, const uint8_t *buffer, int length, uint16_t port);
+
+/**
+ * @brief Finds the payload of a received IPv4 packet and the owner of its destination port.
+ *
+ * @param raw Raw upstream.
+ * @param packet Packet from the IP header on.
+ * @param length Length of the packet, updated to the length of the payload.
+ * @param owner Set to the owner of the destination port, NULL if the port is free.
+ * @return Start of the payload, NULL if the packet is not a valid datagram from the target.
+ */
+uint8_t *rawudp_unwrap(const rawudp_t *raw, uint8_t *packet, int *length, void **owner);
+
+/**
+ * @brief Closes the socket and frees the port tables.
+ */
+void rawudp_close(rawudp_t *raw);
+
+#endif // _RAWUDP_H_
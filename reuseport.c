@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "wg-obfuscator.h"
+#include "reuseport.h"
+
+#ifdef __linux__
+#include <linux/filter.h>
+
+/**
+ * @brief Attaches the classic BPF program to the SO_REUSEPORT group of the socket.
+ * The program returns the index of the socket in the group.
+ */
+static int attach(int sock, struct sock_filter *code, int length)
+{
+    struct sock_fprog prog = {
+        .len = (unsigned short)length,
+        .filter = code
+    };
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int reuseport_attach_hash(int sock, int workers)
+{
+    // The program sees the UDP payload, the headers are reached relative to the network header
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },   // A = source address
+        { BPF_ST, 0, 0, 0 },                                    // M[0] = A
+        { BPF_LDX | BPF_B | BPF_MSH, 0, 0, SKF_NET_OFF },       // X = length of the IP header
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, SKF_NET_OFF },        // A = source port
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },                        // X = A
+        { BPF_LD | BPF_MEM, 0, 0, 0 },                          // A = M[0]
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },                 // A ^= X
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers }, // A %= workers
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    return attach(sock, code, sizeof(code) / sizeof(code[0]));
+}
+
+int reuseport_attach_cpu(int sock, const int *cpus, int workers)
+{
+    int length = 0;
+    struct sock_filter *code = calloc((size_t)workers * 2 + 3, sizeof(*code));
+    if (!code) {
+        errno = ENOMEM;
+        return -1;
+    }
+    code[length++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+    for (int i = 0; i < workers; i++) {
+        code[length++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpus[i] };
+        code[length++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (uint32_t)i };
+    }
+    // A CPU without a worker thread, spread its datagrams anyway
+    code[length++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers };
+    code[length++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+    int r = attach(sock, code, length);
+    int saved_errno = errno;
+    free(code);
+    errno = saved_errno;
+    return r;
+}
+
+#else
+
+int reuseport_attach_hash(int sock, int workers)
+{
+    (void)sock; (void)workers;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int reuseport_attach_cpu(int sock, const int *cpus, int workers)
+{
+    (void)sock; (void)cpus; (void)workers;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+#endif
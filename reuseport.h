@@ -0,0 +1,43 @@
+#ifndef _REUSEPORT_H_
+#define _REUSEPORT_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+
+/**
+ * @brief Returns the worker thread which receives the datagrams of the client.
+ * Must match the program attached by reuseport_attach_hash().
+ *
+ * @param addr Client address.
+ * @param workers Number of worker threads.
+ * @return Index of the worker thread.
+ */
+static inline int reuseport_worker_for(const struct sockaddr_in *addr, int workers)
+{
+    return (int)((ntohl(addr->sin_addr.s_addr) ^ ntohs(addr->sin_port)) % (uint32_t)workers);
+}
+
+/**
+ * @brief Attaches a program to the SO_REUSEPORT group of the socket, which picks
+ * the listening socket by the client address, see reuseport_worker_for().
+ * The sockets of the group are numbered in the order they were bound.
+ *
+ * @param sock Any socket of the group.
+ * @param workers Number of sockets in the group.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int reuseport_attach_hash(int sock, int workers);
+
+/**
+ * @brief Attaches a program to the SO_REUSEPORT group of the socket, which picks
+ * the listening socket of the worker thread pinned to the CPU the datagram arrived on.
+ *
+ * @param sock Any socket of the group.
+ * @param cpus CPU of every worker thread.
+ * @param workers Number of sockets in the group.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int reuseport_attach_cpu(int sock, const int *cpus, int workers);
+
+#endif // _REUSEPORT_H_
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "wg-obfuscator.h"
+#include "srcpool.h"
+
+int srcpool_parse(srcpool_t *pool, const char *list)
+{
+    memset(pool, 0, sizeof(*pool));
+    char buffer[1024];
+    strncpy(buffer, list, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    char *saveptr = NULL;
+    for (char *item = strtok_r(buffer, ", ", &saveptr); item; item = strtok_r(NULL, ", ", &saveptr)) {
+        if (pool->count >= SRCPOOL_MAX) {
+            log(LL_ERROR, "Too many source addresses, the maximum is %d", SRCPOOL_MAX);
+            return -1;
+        }
+        srcpool_entry_t *entry = &pool->entries[pool->count];
+        char *range = strchr(item, ':');
+        if (range) {
+            *range++ = 0;
+        }
+        if (inet_pton(AF_INET, item, &entry->addr) != 1) {
+            log(LL_ERROR, "Invalid source address: %s", item);
+            return -1;
+        }
+        if (range) {
+            char *dash = strchr(range, '-');
+            char *end;
+            long first = strtol(range, &end, 10);
+            long last = dash ? strtol(dash + 1, &end, 10) : first;
+            if (*end || (dash && end == dash + 1) || end == range || first < 1 || last > 65535 || last < first) {
+                log(LL_ERROR, "Invalid port range for the source address %s: %s", item, range);
+                return -1;
+            }
+            entry->first = (uint16_t)first;
+            entry->count = (int)(last - first + 1);
+        }
+        pool->count++;
+    }
+    if (!pool->count) {
+        log(LL_ERROR, "Source address pool is empty");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Binds the socket to a free port of the address, starting from the port after the last one taken.
+ */
+static int bind_entry(srcpool_entry_t *entry, int sock)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = entry->addr
+    };
+    if (!entry->count) {
+        addr.sin_port = 0;
+        return bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    for (int i = 0; i < entry->count; i++) {
+        int offset = (int)((unsigned)__atomic_fetch_add(&entry->cursor, 1, __ATOMIC_RELAXED) % (unsigned)entry->count);
+        addr.sin_port = htons((uint16_t)(entry->first + offset));
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return 0;
+        }
+        if (errno != EADDRINUSE) {
+            return -1;
+        }
+    }
+    errno = EADDRINUSE;
+    return -1;
+}
+
+int srcpool_bind(srcpool_t *pool, int sock)
+{
+    if (!pool->count) {
+        errno = EINVAL;
+        return -1;
+    }
+    int start = (int)((unsigned)__atomic_fetch_add(&pool->cursor, 1, __ATOMIC_RELAXED) % (unsigned)pool->count);
+    uint8_t tried[SRCPOOL_MAX] = {0};
+    int error = 0;
+    for (int attempt = 0; attempt < pool->count; attempt++) {
+        // The least used address not tried yet, the equally used ones in turn
+        int best = -1;
+        int best_in_use = 0;
+        for (int k = 0; k < pool->count; k++) {
+            int i = (start + k) % pool->count;
+            int in_use = __atomic_load_n(&pool->entries[i].in_use, __ATOMIC_RELAXED);
+            if (!tried[i] && (best < 0 || in_use < best_in_use)) {
+                best = i;
+                best_in_use = in_use;
+            }
+        }
+        tried[best] = 1;
+        if (bind_entry(&pool->entries[best], sock) == 0) {
+            __atomic_add_fetch(&pool->entries[best].in_use, 1, __ATOMIC_RELAXED);
+            return best;
+        }
+        if (errno != EADDRINUSE) {
+            // Probably the address is not local (anymore), try the others
+            int saved_errno = errno;
+            char addr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &pool->entries[best].addr, addr, sizeof(addr));
+            log(LL_DEBUG, "Can't bind to the source address %s: %s", addr, strerror(saved_errno));
+            if (!error) {
+                error = saved_errno;
+            }
+        } else {
+            error = EADDRINUSE;
+        }
+    }
+    errno = error;
+    return -1;
+}
+
+void srcpool_release(srcpool_t *pool, int index)
+{
+    if (index < 0 || index >= pool->count) {
+        return;
+    }
+    __atomic_sub_fetch(&pool->entries[index].in_use, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,55 @@
+#ifndef _SRCPOOL_H_
+#define _SRCPOOL_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+
+#define SRCPOOL_MAX             64      // maximum number of addresses in the pool
+
+// One local address of the pool, with its own port range or the ephemeral ports of the kernel
+typedef struct {
+    struct in_addr addr;
+    uint16_t first;                 // first port of the range
+    int count;                      // number of ports in the range, 0 to let the kernel pick one
+    int cursor;                     // next port of the range to try, shared by the worker threads
+    int in_use;                     // sockets bound to this address now
+} srcpool_entry_t;
+
+// Local addresses and ports the server sockets of the dynamic clients are bound to,
+// so the clients are not limited by the ephemeral ports of a single address
+typedef struct {
+    srcpool_entry_t entries[SRCPOOL_MAX];
+    int count;                      // number of addresses, 0 if the pool is not used
+    int cursor;                     // round-robin among the equally used addresses
+} srcpool_t;
+
+/**
+ * @brief Parses the comma-separated list of addresses, each with an optional port range:
+ * "10.0.0.2,10.0.0.3:20000-59999".
+ *
+ * @param pool Pool to fill.
+ * @param list List of addresses.
+ * @return 0 on success, -1 if the list is invalid (the error is logged).
+ */
+int srcpool_parse(srcpool_t *pool, const char *list);
+
+/**
+ * @brief Binds the socket to the least used address of the pool, the next one if all
+ * its ports are taken. Safe to call from several worker threads.
+ *
+ * @param pool Pool.
+ * @param sock Socket, not bound yet.
+ * @return Index of the address, -1 on error (errno is set, EADDRINUSE if the whole pool is taken).
+ */
+int srcpool_bind(srcpool_t *pool, int sock);
+
+/**
+ * @brief Returns the address taken by srcpool_bind(), called when its socket is closed.
+ *
+ * @param pool Pool.
+ * @param index Index of the address.
+ */
+void srcpool_release(srcpool_t *pool, int index);
+
+#endif // _SRCPOOL_H_
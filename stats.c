@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "wg-obfuscator.h"
+#include "stats.h"
+
+_Thread_local obfuscator_stats_t stats;
+
+// Counters of all the worker threads, summed up when written to the log
+static obfuscator_stats_t *thread_stats[THREADS_MAX];
+static int thread_stats_count = 0;
+static pthread_mutex_t thread_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+// When the first worker thread has started counting, in milliseconds
+static long started_ms = 0;
+
+/**
+ * @brief Returns the monotonic time in milliseconds.
+ */
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Adds the counters of the calling thread to the ones written to the log.
+ * Must be called once by every worker thread before it starts counting.
+ */
+void stats_register(void)
+{
+    pthread_mutex_lock(&thread_stats_lock);
+    if (thread_stats_count == 0) {
+        started_ms = now_ms();
+    }
+    if (thread_stats_count < THREADS_MAX) {
+        thread_stats[thread_stats_count++] = &stats;
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+}
+
+/**
+ * @brief Sums up the counters of all the worker threads. The other threads keep
+ * counting meanwhile, so the result is a close approximation.
+ */
+static void stats_sum(obfuscator_stats_t *total)
+{
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&thread_stats_lock);
+    for (int i = 0; i < thread_stats_count; i++) {
+        const obfuscator_stats_t *s = thread_stats[i];
+        total->rx_packets += __atomic_load_n(&s->rx_packets, __ATOMIC_RELAXED);
+        total->rx_calls += __atomic_load_n(&s->rx_calls, __ATOMIC_RELAXED);
+        total->rx_gro_packets += __atomic_load_n(&s->rx_gro_packets, __ATOMIC_RELAXED);
+        total->tx_packets += __atomic_load_n(&s->tx_packets, __ATOMIC_RELAXED);
+        total->tx_calls += __atomic_load_n(&s->tx_calls, __ATOMIC_RELAXED);
+        total->tx_gso_packets += __atomic_load_n(&s->tx_gso_packets, __ATOMIC_RELAXED);
+        total->tx_errors += __atomic_load_n(&s->tx_errors, __ATOMIC_RELAXED);
+        total->xdp_rx_packets += __atomic_load_n(&s->xdp_rx_packets, __ATOMIC_RELAXED);
+        total->xdp_tx_packets += __atomic_load_n(&s->xdp_tx_packets, __ATOMIC_RELAXED);
+        total->offload_packets += __atomic_load_n(&s->offload_packets, __ATOMIC_RELAXED);
+        total->latency_packets += __atomic_load_n(&s->latency_packets, __ATOMIC_RELAXED);
+        total->latency_ns_total += __atomic_load_n(&s->latency_ns_total, __ATOMIC_RELAXED);
+        total->drain_listen_exhausted += __atomic_load_n(&s->drain_listen_exhausted, __ATOMIC_RELAXED);
+        total->drain_server_exhausted += __atomic_load_n(&s->drain_server_exhausted, __ATOMIC_RELAXED);
+        total->tx_queued += __atomic_load_n(&s->tx_queued, __ATOMIC_RELAXED);
+        total->tx_queue_flushed += __atomic_load_n(&s->tx_queue_flushed, __ATOMIC_RELAXED);
+        total->tx_queue_dropped += __atomic_load_n(&s->tx_queue_dropped, __ATOMIC_RELAXED);
+        total->wakeups += __atomic_load_n(&s->wakeups, __ATOMIC_RELAXED);
+        total->wakeups_avoided += __atomic_load_n(&s->wakeups_avoided, __ATOMIC_RELAXED);
+        total->source_pool_bound += __atomic_load_n(&s->source_pool_bound, __ATOMIC_RELAXED);
+        total->source_pool_released += __atomic_load_n(&s->source_pool_released, __ATOMIC_RELAXED);
+        total->source_pool_exhausted += __atomic_load_n(&s->source_pool_exhausted, __ATOMIC_RELAXED);
+        total->socket_pool_hits += __atomic_load_n(&s->socket_pool_hits, __ATOMIC_RELAXED);
+        total->socket_pool_misses += __atomic_load_n(&s->socket_pool_misses, __ATOMIC_RELAXED);
+        total->rx_drops_listen += __atomic_load_n(&s->rx_drops_listen, __ATOMIC_RELAXED);
+        total->rx_drops_clients += __atomic_load_n(&s->rx_drops_clients, __ATOMIC_RELAXED);
+        total->rx_drops_raw += __atomic_load_n(&s->rx_drops_raw, __ATOMIC_RELAXED);
+        total->pacing_delayed += __atomic_load_n(&s->pacing_delayed, __ATOMIC_RELAXED);
+        total->pacing_dropped += __atomic_load_n(&s->pacing_dropped, __ATOMIC_RELAXED);
+        total->icmp_port_unreachable += __atomic_load_n(&s->icmp_port_unreachable, __ATOMIC_RELAXED);
+        total->icmp_host_unreachable += __atomic_load_n(&s->icmp_host_unreachable, __ATOMIC_RELAXED);
+        total->icmp_frag_needed += __atomic_load_n(&s->icmp_frag_needed, __ATOMIC_RELAXED);
+        total->icmp_removed += __atomic_load_n(&s->icmp_removed, __ATOMIC_RELAXED);
+        total->mtu_padding_clamped += __atomic_load_n(&s->mtu_padding_clamped, __ATOMIC_RELAXED);
+        total->mtu_padding_dropped += __atomic_load_n(&s->mtu_padding_dropped, __ATOMIC_RELAXED);
+        total->port_hops += __atomic_load_n(&s->port_hops, __ATOMIC_RELAXED);
+        total->port_hops_drop += __atomic_load_n(&s->port_hops_drop, __ATOMIC_RELAXED);
+        total->source_hops += __atomic_load_n(&s->source_hops, __ATOMIC_RELAXED);
+        for (int h = 0; h < LATENCY_HISTOGRAMS; h++) {
+            histogram_add(&total->latency_histograms[h], &s->latency_histograms[h]);
+        }
+        uint64_t latency_max = __atomic_load_n(&s->latency_ns_max, __ATOMIC_RELAXED);
+        if (latency_max > total->latency_ns_max) {
+            total->latency_ns_max = latency_max;
+        }
+    }
+    pthread_mutex_unlock(&thread_stats_lock);
+}
+
+/**
+ * @brief Returns the average number of datagrams per syscall, multiplied by 100.
+ */
+static uint64_t per_call_x100(uint64_t packets, uint64_t calls)
+{
+    return calls ? packets * 100 / calls : 0;
+}
+
+/**
+ * @brief Writes the percentiles of a latency histogram to the log, if it is not empty.
+ *
+ * @param h Histogram.
+ * @param name Direction and packet type.
+ */
+static void log_latency_histogram(const histogram_t *h, const char *name)
+{
+    if (!h->total) {
+        return;
+    }
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    uint64_t ns[5];
+    for (int i = 0; i < 4; i++) {
+        ns[i] = histogram_percentile(h, percentiles[i]);
+    }
+    ns[4] = h->max;
+    log(LL_INFO, "  latency %s: %" PRIu64 " packets, p50 %" PRIu64 ".%03" PRIu64 " us, p90 %" PRIu64 ".%03" PRIu64
+        " us, p99 %" PRIu64 ".%03" PRIu64 " us, p99.9 %" PRIu64 ".%03" PRIu64 " us, max %" PRIu64 ".%03" PRIu64 " us",
+        name, h->total, ns[0] / 1000, ns[0] % 1000, ns[1] / 1000, ns[1] % 1000, ns[2] / 1000, ns[2] % 1000,
+        ns[3] / 1000, ns[3] % 1000, ns[4] / 1000, ns[4] % 1000);
+}
+
+/**
+ * @brief Writes all the counters to the log.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param clients Current number of client entries.
+ */
+void stats_log(const obfuscator_config_t *config, int clients)
+{
+    obfuscator_stats_t stats;
+    stats_sum(&stats);
+    uint64_t rx_avg = per_call_x100(stats.rx_packets, stats.rx_calls);
+    uint64_t tx_avg = per_call_x100(stats.tx_packets, stats.tx_calls);
+
+    log(LL_INFO, "Statistics: clients=%d, batch size=%d, threads=%d", clients, config->batch_size, config->threads);
+    log(LL_INFO, "  received: %" PRIu64 " packets in %" PRIu64 " calls (%" PRIu64 ".%02" PRIu64 " per call)",
+        stats.rx_packets, stats.rx_calls, rx_avg / 100, rx_avg % 100);
+    log(LL_INFO, "  sent: %" PRIu64 " packets in %" PRIu64 " calls (%" PRIu64 ".%02" PRIu64 " per call), %" PRIu64 " errors",
+        stats.tx_packets, stats.tx_calls, tx_avg / 100, tx_avg % 100, stats.tx_errors);
+#ifdef USE_RXQ_OVFL
+    if (config->raw_upstream_ports) {
+        log(LL_INFO, "  dropped by the kernel: %" PRIu64 " packets on the listening sockets, %" PRIu64 " on the sockets of the clients, %" PRIu64 " on the raw upstream sockets",
+            stats.rx_drops_listen, stats.rx_drops_clients, stats.rx_drops_raw);
+    } else {
+        log(LL_INFO, "  dropped by the kernel: %" PRIu64 " packets on the listening sockets, %" PRIu64 " on the sockets of the clients",
+            stats.rx_drops_listen, stats.rx_drops_clients);
+    }
+#endif
+    if (!config->io_uring) {
+        log(LL_INFO, "  drain budget of %d packets used up: %" PRIu64 " times on the listening socket, %" PRIu64 " times on the server sockets",
+            config->drain_budget, stats.drain_listen_exhausted, stats.drain_server_exhausted);
+    }
+    if (config->send_queue && !config->io_uring && !config->pipeline) {
+        log(LL_INFO, "  send queues of %d packets: %" PRIu64 " packets queued, %" PRIu64 " sent later, %" PRIu64 " dropped",
+            config->send_queue, stats.tx_queued, stats.tx_queue_flushed, stats.tx_queue_dropped);
+    }
+    if (config->udp_offload) {
+        log(LL_INFO, "  UDP offload: %" PRIu64 " packets received coalesced (GRO), %" PRIu64 " packets sent segmented (GSO)",
+            stats.rx_gro_packets, stats.tx_gso_packets);
+    }
+    if (config->xdp_interface[0]) {
+        log(LL_INFO, "  AF_XDP: %" PRIu64 " packets received, %" PRIu64 " packets sent",
+            stats.xdp_rx_packets, stats.xdp_tx_packets);
+    }
+    if (config->tc_offload[0]) {
+        log(LL_INFO, "  TC offload: %" PRIu64 " packets forwarded in the kernel", stats.offload_packets);
+    }
+    if (config->latency_mode) {
+        uint64_t avg_ns = stats.latency_packets ? stats.latency_ns_total / stats.latency_packets : 0;
+        log(LL_INFO, "  latency: %" PRIu64 " packets, %" PRIu64 ".%03" PRIu64 " us average, %" PRIu64 ".%03" PRIu64 " us maximum",
+            stats.latency_packets, avg_ns / 1000, avg_ns % 1000, stats.latency_ns_max / 1000, stats.latency_ns_max % 1000);
+    }
+    if (config->latency_histograms) {
+        static const char *names[LATENCY_HISTOGRAMS] = {
+            "client->server handshake", "client->server data", "client->server masking",
+            "server->client handshake", "server->client data", "server->client masking"
+        };
+        for (int h = 0; h < LATENCY_HISTOGRAMS; h++) {
+            log_latency_histogram(&stats.latency_histograms[h], names[h]);
+        }
+    }
+    if (config->tickless) {
+        long uptime_ms = now_ms() - started_ms;
+        uint64_t avoided_x100 = uptime_ms > 0 ? stats.wakeups_avoided * 100000 / (uint64_t)uptime_ms : 0;
+        log(LL_INFO, "  tickless: %" PRIu64 " wakeups, %" PRIu64 " avoided (%" PRIu64 ".%02" PRIu64 " per second)",
+            stats.wakeups, stats.wakeups_avoided, avoided_x100 / 100, avoided_x100 % 100);
+    }
+    if (config->source_pool[0] && !config->raw_upstream_ports) {
+        log(LL_INFO, "  source pool: %" PRIu64 " sockets bound now, %" PRIu64 " in total, %" PRIu64 " clients refused with all the ports taken",
+            stats.source_pool_bound - stats.source_pool_released, stats.source_pool_bound, stats.source_pool_exhausted);
+    }
+    if (config->socket_pool && !config->raw_upstream_ports) {
+        log(LL_INFO, "  socket pool of %d sockets: %" PRIu64 " new clients took a ready socket (hits), %" PRIu64 " found none (misses)",
+            config->socket_pool, stats.socket_pool_hits, stats.socket_pool_misses);
+    }
+    if (config->pacing_rate) {
+        log(LL_INFO, "  pacing at %d kbit/s: %" PRIu64 " packets delayed, %" PRIu64 " dropped more than %d ms behind",
+            config->pacing_rate, stats.pacing_delayed, stats.pacing_dropped, PACING_HORIZON);
+    }
+    if (config->icmp_errors) {
+        log(LL_INFO, "  ICMP errors: %" PRIu64 " port unreachable, %" PRIu64 " host unreachable, %" PRIu64
+            " fragmentation needed, %" PRIu64 " clients removed",
+            stats.icmp_port_unreachable, stats.icmp_host_unreachable, stats.icmp_frag_needed, stats.icmp_removed);
+    }
+    if (config->port_hopping || config->hop_on_drop) {
+        log(LL_INFO, "  port hopping: %" PRIu64 " hops to another target port (%" PRIu64 " on a throughput drop), %" PRIu64 " to another source port",
+            stats.port_hops, stats.port_hops_drop, stats.source_hops);
+    }
+    log(LL_INFO, "  path MTU: %" PRIu64 " packets padded less to fit, %" PRIu64 " dropped as too large because of the padding",
+        stats.mtu_padding_clamped, stats.mtu_padding_dropped);
+}
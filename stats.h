@@ -0,0 +1,59 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include "wg-obfuscator.h"
+#include "latency.h"
+#include "histogram.h"
+
+// Runtime counters, written to the log on SIGUSR1
+typedef struct {
+    uint64_t rx_packets;                        // datagrams received
+    uint64_t rx_calls;                          // receive syscalls which returned at least one datagram
+    uint64_t rx_gro_packets;                    // datagrams which arrived coalesced by the kernel (UDP GRO)
+    uint64_t tx_packets;                        // datagrams handed to the kernel
+    uint64_t tx_calls;                          // send syscalls
+    uint64_t tx_gso_packets;                    // datagrams sent as a part of a larger buffer (UDP GSO)
+    uint64_t tx_errors;                         // datagrams the kernel refused to send
+    uint64_t xdp_rx_packets;                    // datagrams received through AF_XDP
+    uint64_t xdp_tx_packets;                    // datagrams sent through AF_XDP
+    uint64_t offload_packets;                   // datagrams forwarded by the TC offload program
+    uint64_t latency_packets;                   // datagrams with the forwarding latency measured (latency mode)
+    uint64_t latency_ns_total;                  // sum of their latencies, from the wakeup to the send call
+    uint64_t latency_ns_max;                    // the longest of them
+    uint64_t drain_listen_exhausted;            // wakeups which left datagrams in the listening socket, its drain budget was used up
+    uint64_t drain_server_exhausted;            // the same for the server sockets
+    uint64_t tx_queued;                         // datagrams kept because the send buffer of the socket was full
+    uint64_t tx_queue_flushed;                  // of them, sent when the socket became writable
+    uint64_t tx_queue_dropped;                  // datagrams dropped because the backlog of the socket was full
+    uint64_t wakeups;                           // wakeups of the event loop (tickless mode)
+    uint64_t wakeups_avoided;                   // wakeups a periodic loop would have made on top of them
+    uint64_t source_pool_bound;                 // server sockets bound to an address of the source pool
+    uint64_t source_pool_released;              // of them, closed since
+    uint64_t source_pool_exhausted;             // clients refused because all the ports of the source pool were taken
+    uint64_t socket_pool_hits;                  // new clients which got a ready server socket from the socket pool
+    uint64_t socket_pool_misses;                // new clients which found the socket pool empty
+    uint64_t rx_drops_listen;                   // datagrams the kernel dropped on the listening sockets, their receive buffers were full
+    uint64_t rx_drops_clients;                  // the same on the sockets of the clients (to the server and connected to the clients)
+    uint64_t rx_drops_raw;                      // the same on the raw upstream sockets
+    uint64_t pacing_delayed;                    // datagrams given a later departure time by the pacing
+    uint64_t pacing_dropped;                    // datagrams dropped because their client was too far over the pacing rate
+    uint64_t icmp_port_unreachable;             // ICMP "port unreachable" errors about the sent datagrams
+    uint64_t icmp_host_unreachable;             // ICMP "host unreachable" and the other "destination unreachable" errors
+    uint64_t icmp_frag_needed;                  // ICMP "fragmentation needed" errors
+    uint64_t icmp_removed;                      // clients removed because their path was reported unreachable
+    uint64_t mtu_padding_clamped;               // datagrams given less dummy data so they fit the path MTU
+    uint64_t mtu_padding_dropped;               // datagrams reported too large for the path which would have fit without what we added
+    uint64_t port_hops;                         // hops of the clients to another port of the target range
+    uint64_t port_hops_drop;                    // of them, because the throughput from the server had dropped
+    uint64_t source_hops;                       // server connections moved to a new source port
+    histogram_t latency_histograms[LATENCY_HISTOGRAMS];     // from the kernel receive timestamp to the send call (latency histograms)
+} obfuscator_stats_t;
+
+// Counters of the current worker thread
+extern _Thread_local obfuscator_stats_t stats;
+
+void stats_register(void);
+void stats_log(const obfuscator_config_t *config, int clients);
+
+#endif // _STATS_H_
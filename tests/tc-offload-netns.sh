@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Checks the TC offload program on real packets: three network namespaces joined with
+# veth pairs, a client, an obfuscator with --tc-offload in the middle, a second
+# obfuscator and a server behind it:
+#
+#   wgo-c: client 10.201.1.2:25000
+#     | veth
+#   wgo-o: obfuscator -p 21000 -t 10.201.2.2:22000 --tc-offload=o0,o1 (encodes)
+#     | veth
+#   wgo-s: obfuscator -p 22000 -t 127.0.0.1:23000 (decodes), echo server 127.0.0.1:23000
+#
+# The client makes a handshake and sends data packets, the server echoes them back.
+# The second obfuscator only accepts what the program has encoded and addressed right,
+# and the client only gets its packets back if the program has also decoded the echoes.
+# The statistics of the first obfuscator must show the packets forwarded in the kernel.
+#
+# Needs root (CAP_NET_ADMIN and CAP_BPF), iproute2 and python3.
+# Usage: tests/tc-offload-netns.sh [path to wg-obfuscator] [number of packets]
+
+BIN=$(realpath "${1:-./wg-obfuscator}")
+COUNT=${2:-1000}
+LOG_O=/tmp/wgo-tc-offload-o.log
+LOG_S=/tmp/wgo-tc-offload-s.log
+
+if [ "$(id -u)" != "0" ]; then
+    echo "Needs root"
+    exit 2
+fi
+if [ ! -x "$BIN" ]; then
+    echo "$BIN not found, build it first"
+    exit 2
+fi
+
+cleanup() {
+    for ns in wgo-c wgo-o wgo-s; do
+        ip netns pids $ns 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del $ns 2>/dev/null
+    done
+}
+trap cleanup EXIT
+cleanup
+set -e
+
+for ns in wgo-c wgo-o wgo-s; do
+    ip netns add $ns
+    ip -n $ns link set lo up
+done
+ip link add c0 netns wgo-c type veth peer name o0 netns wgo-o
+ip link add o1 netns wgo-o type veth peer name s0 netns wgo-s
+ip -n wgo-c addr add 10.201.1.2/24 dev c0
+ip -n wgo-o addr add 10.201.1.1/24 dev o0
+ip -n wgo-o addr add 10.201.2.1/24 dev o1
+ip -n wgo-s addr add 10.201.2.2/24 dev s0
+ip -n wgo-c link set c0 up
+ip -n wgo-o link set o0 up
+ip -n wgo-o link set o1 up
+ip -n wgo-s link set s0 up
+
+ip netns exec wgo-s "$BIN" -p 22000 -t 127.0.0.1:23000 -k test -v DEBUG > "$LOG_S" 2>&1 &
+ip netns exec wgo-o "$BIN" -p 21000 -t 10.201.2.2:22000 -k test --tc-offload=o0,o1 -v DEBUG > "$LOG_O" 2>&1 &
+O_PID=$!
+sleep 1
+if ! grep -q "in the kernel on" "$LOG_O"; then
+    echo "The TC program was not attached:"
+    cat "$LOG_O"
+    exit 1
+fi
+
+# Echo server: answers the handshake with a handshake response, returns everything else as is
+ip netns exec wgo-s python3 -c '
+import os, socket, struct
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("127.0.0.1", 23000))
+while True:
+    data, peer = s.recvfrom(4096)
+    if data[:4] == struct.pack("<I", 1):
+        s.sendto(struct.pack("<I", 2) + os.urandom(88), peer)
+    else:
+        s.sendto(data, peer)
+' &
+sleep 0.5
+
+ip netns exec wgo-c python3 -c '
+import os, socket, struct, sys, time
+count = int(sys.argv[1])
+c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+c.bind(("10.201.1.2", 25000))
+c.settimeout(1)
+obfuscator = ("10.201.1.1", 21000)
+c.sendto(struct.pack("<I", 1) + os.urandom(144), obfuscator)
+if c.recv(4096)[:4] != struct.pack("<I", 2):
+    sys.exit("No handshake response")
+good = 0
+for i in range(count):
+    packet = struct.pack("<I", 4) + os.urandom(28 + i % 1300)
+    c.sendto(packet, obfuscator)
+    try:
+        good += c.recv(4096) == packet
+    except socket.timeout:
+        pass
+print("%d of %d packets came back intact" % (good, count))
+sys.exit(0 if good == count else 1)
+' "$COUNT"
+
+# The forwarded packets are picked up from the program about once a second
+sleep 2
+kill -USR1 $O_PID
+sleep 0.5
+FORWARDED=$(sed -n "s/.*TC offload: \([0-9]*\) packets forwarded in the kernel.*/\1/p" "$LOG_O" | tail -n 1)
+echo "${FORWARDED:-0} packets forwarded in the kernel"
+# All but the handshakes and the first packet in each direction
+if [ "${FORWARDED:-0}" -lt $((COUNT * 2 - 2)) ]; then
+    echo "Too few, see $LOG_O"
+    exit 1
+fi
+echo "OK"
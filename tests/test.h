@@ -0,0 +1,66 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks for the unit tests: a failed one is reported and counted, the test goes on
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    long long _actual = (long long)(actual), _expected = (long long)(expected); \
+    if (_actual != _expected) { \
+        fprintf(stderr, "%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+        test_failures++; \
+    } \
+} while (0)
+
+// For the checks in a loop, the message tells which case has failed
+#define CHECK_MSG(cond, fmt, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+// Seed of rand() for the tests with random cases, they are the same on every run
+#define TEST_SEED 1
+
+#ifdef TEST_LOGGING
+#include "../wg-obfuscator.h"
+
+// What logging.c needs from the rest of the program, for the tests that link it.
+// TEST_LOGGING is the logging level, below LL_ERROR to keep the expected errors quiet.
+int verbose = TEST_LOGGING;
+char section_name[256] = DEFAULT_INSTANCE_NAME;
+
+const char *version_string(void)
+{
+    return "test";
+}
+#endif
+
+/**
+ * @brief Reports the result of the test, to be returned from main().
+ */
+static inline int test_result(const char *name)
+{
+    if (test_failures) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: OK\n", name);
+    return 0;
+}
+
+#endif // _TEST_H_
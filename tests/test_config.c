@@ -0,0 +1,128 @@
+#define TEST_LOGGING (LL_ERROR - 1)
+#include "test.h"
+#include "../config.c"
+
+// What config.c needs from the rest of the program
+void register_child_instance(pid_t pid)
+{
+    (void)pid;
+}
+
+masking_handler_t * get_masking_handler_by_name(const char *name)
+{
+    (void)name;
+    return NULL;
+}
+
+/**
+ * @brief Checks the whole map of a direction: 'from' goes to 'to', every other class
+ * to 'others', or stays as it is if 'others' is -1.
+ */
+static void check_map(const obfuscator_config_t *config, int direction, int from, int to, int others)
+{
+    for (int d = 0; d < 64; d++) {
+        int expected = d == from ? to : (others < 0 ? d : others);
+        CHECK_MSG(config->dscp_map[direction][d] == expected, "direction %d: DSCP %d goes to %d, expected %d",
+            direction, d, config->dscp_map[direction][d], expected);
+    }
+}
+
+static void test_identity(void)
+{
+    static obfuscator_config_t config;
+    reset_config(&config);
+    check_map(&config, DIR_CLIENT_TO_SERVER, -1, -1, -1);
+    check_map(&config, DIR_SERVER_TO_CLIENT, -1, -1, -1);
+}
+
+static void test_both_directions(void)
+{
+    static obfuscator_config_t config;
+    reset_config(&config);
+    CHECK_EQ(parse_dscp_map(&config, "46=34"), 0);
+    check_map(&config, DIR_CLIENT_TO_SERVER, 46, 34, -1);
+    check_map(&config, DIR_SERVER_TO_CLIENT, 46, 34, -1);
+}
+
+static void test_directions(void)
+{
+    static obfuscator_config_t config;
+    reset_config(&config);
+    // As in the example configuration file, with a space after the comma
+    CHECK_EQ(parse_dscp_map(&config, "up:46=34, down:*=0"), 0);
+    check_map(&config, DIR_CLIENT_TO_SERVER, 46, 34, -1);
+    check_map(&config, DIR_SERVER_TO_CLIENT, -1, -1, 0);
+}
+
+static void test_later_rules_win(void)
+{
+    static obfuscator_config_t config;
+    reset_config(&config);
+    CHECK_EQ(parse_dscp_map(&config, "*=0,46=46"), 0);
+    check_map(&config, DIR_CLIENT_TO_SERVER, 46, 46, 0);
+    check_map(&config, DIR_SERVER_TO_CLIENT, 46, 46, 0);
+    // On top of the rules parsed before
+    CHECK_EQ(parse_dscp_map(&config, "down:46=0,0=63"), 0);
+    CHECK_EQ(config.dscp_map[DIR_CLIENT_TO_SERVER][0], 63);
+    CHECK_EQ(config.dscp_map[DIR_CLIENT_TO_SERVER][46], 46);
+    CHECK_EQ(config.dscp_map[DIR_CLIENT_TO_SERVER][10], 0);
+    check_map(&config, DIR_SERVER_TO_CLIENT, 0, 63, 0);
+}
+
+static void test_invalid(void)
+{
+    static const char *invalid[] = {
+        "46", "46=", "=34", "46=64", "64=1", "-1=3", "46=-1", "x=1", "46=3x", "up:", "up:*=", "sideways:46=34", "46=34,47",
+    };
+    for (int i = 0; i < TEST_COUNT(invalid); i++) {
+        static obfuscator_config_t config;
+        reset_config(&config);
+        CHECK_MSG(parse_dscp_map(&config, invalid[i]) == -1, "'%s' is accepted", invalid[i]);
+    }
+}
+
+static void test_option(void)
+{
+    static obfuscator_config_t config;
+    // The parser writes into the arguments
+    char arg0[] = "wg-obfuscator", arg1[] = "--dscp-map=up:*=8";
+    char *argv[] = { arg0, arg1, NULL };
+    CHECK_EQ(parse_config(2, argv, &config), 0);
+    check_map(&config, DIR_CLIENT_TO_SERVER, -1, -1, 8);
+    check_map(&config, DIR_SERVER_TO_CLIENT, -1, -1, -1);
+#ifdef __linux__
+    // Implied
+    CHECK_EQ(config.preserve_tos, 1);
+#endif
+}
+
+static void test_config_file(void)
+{
+    static obfuscator_config_t config;
+    // The line of the example configuration file, the value has '=' in it too
+    char path[] = "/tmp/test_config_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "[main]\nsource-lport = 13255\n\tdscp-map = up:46=34, down:*=0   # comment\n");
+    fclose(file);
+    char arg0[] = "wg-obfuscator", arg1[] = "-c";
+    char *argv[] = { arg0, arg1, path, NULL };
+    CHECK_EQ(parse_config(3, argv, &config), 0);
+    unlink(path);
+    CHECK_EQ(config.listen_port, 13255);
+    check_map(&config, DIR_CLIENT_TO_SERVER, 46, 34, -1);
+    check_map(&config, DIR_SERVER_TO_CLIENT, -1, -1, 0);
+}
+
+int main(void)
+{
+    test_identity();
+    test_both_directions();
+    test_directions();
+    test_later_rules_win();
+    test_invalid();
+    test_option();
+    test_config_file();
+    return test_result("dscp-map");
+}
@@ -0,0 +1,100 @@
+#include "test.h"
+#include "../histogram.c"
+
+/**
+ * @brief Checks that the value falls into a bucket that holds it, at most 1/SUB_BUCKETS wide.
+ */
+static void check_value(uint64_t value)
+{
+    int bucket = bucket_of(value);
+    CHECK(bucket >= 0 && bucket < HISTOGRAM_BUCKETS);
+    if (bucket == HISTOGRAM_BUCKETS - 1) {
+        CHECK(value >= ((uint64_t)1 << HISTOGRAM_MAX_BITS) - ((uint64_t)1 << (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS)));
+        return;
+    }
+    uint64_t top = bucket_top(bucket);
+    uint64_t bottom = bucket ? bucket_top(bucket - 1) + 1 : 0;
+    CHECK_MSG(value >= bottom && value <= top, "value %llu is in the bucket %d of %llu..%llu",
+        (unsigned long long)value, bucket, (unsigned long long)bottom, (unsigned long long)top);
+    CHECK((top - bottom) * SUB_BUCKETS <= value);
+}
+
+static void test_buckets(void)
+{
+    // Every value up to a few powers of two, then the edges of each one
+    for (uint64_t value = 0; value < 4096; value++) {
+        check_value(value);
+    }
+    for (int bits = 12; bits < HISTOGRAM_MAX_BITS; bits++) {
+        uint64_t power = (uint64_t)1 << bits;
+        check_value(power - 1);
+        check_value(power);
+        check_value(power + 1);
+        check_value(power + power / 3);
+    }
+    // The buckets follow each other with no gaps
+    for (int bucket = 1; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+        CHECK_EQ(bucket_of(bucket_top(bucket)), bucket);
+        CHECK_EQ(bucket_of(bucket_top(bucket - 1) + 1), bucket);
+    }
+    // Larger values are all in the last bucket
+    CHECK_EQ(bucket_of((uint64_t)1 << HISTOGRAM_MAX_BITS), HISTOGRAM_BUCKETS - 1);
+    CHECK_EQ(bucket_of(UINT64_MAX), HISTOGRAM_BUCKETS - 1);
+}
+
+static void test_percentiles(void)
+{
+    static histogram_t h;
+    memset(&h, 0, sizeof(h));
+    CHECK_EQ(histogram_percentile(&h, 50), 0);
+
+    // A single value is every percentile, never rounded above the maximum
+    histogram_record(&h, 1000);
+    CHECK_EQ(histogram_percentile(&h, 0), 1000);
+    CHECK_EQ(histogram_percentile(&h, 50), 1000);
+    CHECK_EQ(histogram_percentile(&h, 100), 1000);
+
+    memset(&h, 0, sizeof(h));
+    for (uint64_t value = 1; value <= 100000; value++) {
+        histogram_record(&h, value);
+    }
+    CHECK_EQ(h.total, 100000);
+    CHECK_EQ(h.max, 100000);
+    static const double percentiles[] = { 1, 10, 50, 90, 99, 99.9 };
+    for (int i = 0; i < TEST_COUNT(percentiles); i++) {
+        uint64_t exact = (uint64_t)(percentiles[i] * 1000);
+        uint64_t value = histogram_percentile(&h, percentiles[i]);
+        CHECK(value >= exact);
+        CHECK(value <= exact + exact / SUB_BUCKETS);
+    }
+    CHECK_EQ(histogram_percentile(&h, 100), 100000);
+}
+
+static void test_add(void)
+{
+    static histogram_t a, b, sum;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&sum, 0, sizeof(sum));
+    srand(TEST_SEED);
+    for (int i = 0; i < 10000; i++) {
+        uint64_t value = (uint64_t)rand() * (uint64_t)(1 + rand() % 1000);
+        histogram_record(i % 3 ? &a : &b, value);
+    }
+    histogram_add(&sum, &a);
+    histogram_add(&sum, &b);
+    CHECK_EQ(sum.total, 10000);
+    CHECK_EQ(sum.max, a.max > b.max ? a.max : b.max);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        CHECK_EQ(sum.counts[i], a.counts[i] + b.counts[i]);
+    }
+    CHECK_EQ(histogram_percentile(&sum, 100), sum.max);
+}
+
+int main(void)
+{
+    test_buckets();
+    test_percentiles();
+    test_add();
+    return test_result("histogram");
+}
@@ -0,0 +1,144 @@
+#include "test.h"
+#include "../obfuscation.c"
+
+static char key[] = "test key";
+
+/**
+ * @brief XORs the packet with its keystream computed bit by bit, without the cache.
+ */
+static void reference_xor(uint8_t *buffer, int length)
+{
+    int key_length = (int)strlen(key);
+    uint8_t crc = 0;
+    for (int i = 0; i < length; i++) {
+        crc = crc8_step(crc, (uint8_t)(key[i % key_length] + (length & 0xFF) + key_length));
+        buffer[i] ^= crc;
+    }
+}
+
+/**
+ * @brief Empties the cache, and sets the jumbo mode limit, 0 to turn it off.
+ */
+static void reset_cache(size_t limit)
+{
+    for (int i = 0; i < 256; i++) {
+        free(rows[i].data);
+    }
+    memset(rows, 0, sizeof(rows));
+    cache_used = 0;
+    xor_data_jumbo(limit);
+}
+
+/**
+ * @brief XORs a packet of 'length' bytes and checks it against the reference.
+ */
+static void check_xor(int length)
+{
+    static uint8_t packet[KEYSTREAM_ROW_JUMBO + 4096], expected[KEYSTREAM_ROW_JUMBO + 4096];
+    for (int i = 0; i < length; i++) {
+        packet[i] = expected[i] = (uint8_t)(i * 7 + length);
+    }
+    xor_data(packet, length, key, (int)strlen(key));
+    reference_xor(expected, length);
+    CHECK_MSG(memcmp(packet, expected, length) == 0, "packet of %d bytes is XORed wrong", length);
+}
+
+/**
+ * @brief Checks that the counted memory is what the rows take past KEYSTREAM_ROW_MAX bytes.
+ */
+static void check_accounting(void)
+{
+    size_t total = 0;
+    for (int i = 0; i < 256; i++) {
+        CHECK(rows[i].cap <= row_max());
+        CHECK(rows[i].valid <= rows[i].cap);
+        total += jumbo_bytes(rows[i].cap);
+    }
+    CHECK_EQ(cache_used, total);
+    if (jumbo_limit) {
+        CHECK(cache_used <= jumbo_limit);
+    }
+}
+
+static void test_normal_rows(void)
+{
+    reset_cache(0);
+    static const int lengths[] = { 1, 32, 148, 1420, 2047, 2048, 2049, 3000, 9000, 65535 };
+    for (int i = 0; i < TEST_COUNT(lengths); i++) {
+        check_xor(lengths[i]);
+    }
+    // Longer packets reuse the first KEYSTREAM_ROW_MAX bytes, the rest is computed on the fly
+    CHECK_EQ(rows[9000 & 0xFF].cap, KEYSTREAM_ROW_MAX);
+    CHECK_EQ(rows[2049 & 0xFF].valid, KEYSTREAM_ROW_MAX);
+    CHECK_EQ(cache_used, 0);
+    check_accounting();
+}
+
+static void test_jumbo_limit(void)
+{
+    // Room for one 9000-byte row, a part of another one and nothing more
+    size_t limit = 10 * 1024;
+    reset_cache(limit);
+    // Not counted: a normal row
+    check_xor(1500);
+    CHECK_EQ(cache_used, 0);
+    // 9216 bytes, 7168 of them past a normal row
+    check_xor(9000);
+    CHECK_EQ(rows[9000 & 0xFF].cap, 9216);
+    CHECK_EQ(cache_used, 7168);
+    // What is left, 3072 bytes, on top of a normal row
+    check_xor(9001);
+    CHECK_EQ(rows[9001 & 0xFF].cap, KEYSTREAM_ROW_MAX + 3072);
+    CHECK_EQ(cache_used, limit);
+    // Full, but never less than a normal row
+    check_xor(9002);
+    CHECK_EQ(rows[9002 & 0xFF].cap, KEYSTREAM_ROW_MAX);
+    CHECK_EQ(rows[9002 & 0xFF].valid, KEYSTREAM_ROW_MAX);
+    CHECK_EQ(cache_used, limit);
+    check_accounting();
+    // The rows cut short still give the right keystream
+    check_xor(9001);
+    check_xor(9002);
+    check_xor(9000 + 256);
+}
+
+static void test_jumbo_regrow(void)
+{
+    size_t limit = 8 * 1024;
+    reset_cache(limit);
+    check_xor(4000);
+    CHECK_EQ(rows[4000 & 0xFF].cap, 4096);
+    CHECK_EQ(cache_used, 2048);
+    // The same row grows, what it already has is not counted twice
+    check_xor(4000 + 256 * 40);
+    CHECK_EQ(rows[4000 & 0xFF].cap, KEYSTREAM_ROW_MAX + (int)limit);
+    CHECK_EQ(cache_used, limit);
+    check_accounting();
+    // And the longest row, over the limit
+    check_xor(KEYSTREAM_ROW_JUMBO - 1);
+    check_accounting();
+    check_xor(KEYSTREAM_ROW_JUMBO + 100);
+    check_accounting();
+}
+
+static void test_jumbo_many_rows(void)
+{
+    size_t limit = 64 * 1024;
+    reset_cache(limit);
+    srand(TEST_SEED);
+    for (int i = 0; i < 2000; i++) {
+        check_xor(1 + rand() % (KEYSTREAM_ROW_JUMBO + 1024));
+        check_accounting();
+    }
+    CHECK_EQ(cache_used, limit);
+}
+
+int main(void)
+{
+    test_normal_rows();
+    test_jumbo_limit();
+    test_jumbo_regrow();
+    test_jumbo_many_rows();
+    reset_cache(0);
+    return test_result("keystream cache");
+}
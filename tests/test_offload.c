@@ -0,0 +1,180 @@
+#define TEST_LOGGING LL_DEBUG   // the verifier log is printed if the program is rejected
+#include "test.h"
+#include "../ebpf.c"
+#include "../offload.c"
+
+#ifdef USE_TC_OFFLOAD
+
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+// What offload.c needs from config.c, the interface list is not parsed here
+char *trim(char *s)
+{
+    return s;
+}
+
+#define CLIENT_ADDR     0x0A000001      // 10.0.0.1
+#define SERVER_ADDR     0x0A000002      // 10.0.0.2
+#define LOCAL_ADDR      0x0A000003      // 10.0.0.3
+#define CLIENT_PORT     40000
+#define LISTEN_PORT     13255
+#define FORWARD_PORT    50000
+#define SERVER_PORT     51820
+
+static char key[] = "test-key";
+
+/**
+ * @brief Builds an Ethernet, IPv4 and UDP packet with the given payload, returns its length.
+ */
+static int build_packet(uint8_t *packet, uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+    const uint8_t *payload, int length)
+{
+    memset(packet, 0, HEADERS_SIZE);
+    memcpy(packet, "\x02\0\0\0\0\x01\x02\0\0\0\0\x02", 12);
+    packet[12] = ETH_P_IP >> 8;
+    packet[13] = ETH_P_IP & 0xFF;
+    struct iphdr *ip = (struct iphdr *)(packet + 14);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(HEADERS_SIZE - 14 + length);
+    ip->saddr = htonl(saddr);
+    ip->daddr = htonl(daddr);
+    struct udphdr *udp = (struct udphdr *)(packet + 34);
+    udp->source = htons(sport);
+    udp->dest = htons(dport);
+    udp->len = htons(8 + length);
+    memcpy(packet + HEADERS_SIZE, payload, length);
+    return HEADERS_SIZE + length;
+}
+
+/**
+ * @brief Runs the program on the packet, it is replaced with the result.
+ *
+ * @return The verdict of the program, or -1 if it could not be run.
+ */
+static int run_program(int prog_fd, uint8_t *packet, int *length)
+{
+    static uint8_t out[HEADERS_SIZE + OFFLOAD_PAYLOAD_MAX + 256];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.test.prog_fd = prog_fd;
+    attr.test.data_in = (uint64_t)(uintptr_t)packet;
+    attr.test.data_size_in = *length;
+    attr.test.data_out = (uint64_t)(uintptr_t)out;
+    attr.test.data_size_out = sizeof(out);
+    if (sys_bpf(BPF_PROG_TEST_RUN, &attr) < 0) {
+        return -1;
+    }
+    *length = attr.test.data_size_out;
+    memcpy(packet, out, *length);
+    return attr.test.retval;
+}
+
+static void test_program(offload_t *offload)
+{
+    // The client is decoded on its way to the server and the server is encoded on its way back,
+    // the same flows offload_add_client() sets up
+    offload_key_t to_server = { htonl(CLIENT_ADDR), htons(CLIENT_PORT), htons(LISTEN_PORT) };
+    offload_key_t to_client = { htonl(SERVER_ADDR), htons(SERVER_PORT), htons(FORWARD_PORT) };
+    offload_flow_t a = {
+        .new_daddr = htonl(SERVER_ADDR), .new_sport = htons(FORWARD_PORT), .new_dport = htons(SERVER_PORT),
+        .op = OFFLOAD_OP_DECODE, .partner = to_client
+    };
+    offload_flow_t b = {
+        .new_daddr = htonl(CLIENT_ADDR), .new_sport = htons(LISTEN_PORT), .new_dport = htons(CLIENT_PORT),
+        .op = OFFLOAD_OP_ENCODE, .max_dummy = 100, .partner = to_server,
+        // As if the server has already answered through the obfuscator
+        .seen = 1, .ifindex = 1, .local_addr = htonl(LOCAL_ADDR)
+    };
+    CHECK_EQ(ebpf_map_update(offload->flows_fd, &to_server, &a), 0);
+    CHECK_EQ(ebpf_map_update(offload->flows_fd, &to_client, &b), 0);
+
+    static uint8_t packet[HEADERS_SIZE + OFFLOAD_PAYLOAD_MAX + 256];
+    static uint32_t data[OFFLOAD_PAYLOAD_MAX / 4], payload[OFFLOAD_PAYLOAD_MAX / 4];
+    uint8_t version;
+    srand(TEST_SEED);
+    for (int length = 32; length <= 1500; length += 293) {
+        for (int i = 0; i < length; i++) {
+            ((uint8_t *)data)[i] = (uint8_t)rand();
+        }
+        data[0] = WG_TYPE_DATA;
+
+        // Client to server: decoded
+        memcpy(payload, data, length);
+        int payload_length = encode((uint8_t *)payload, length, key, sizeof(key) - 1, OBFUSCATION_VERSION, 100);
+        int packet_length = build_packet(packet, CLIENT_ADDR, CLIENT_PORT, LOCAL_ADDR, LISTEN_PORT,
+            (uint8_t *)payload, payload_length);
+        CHECK_MSG(run_program(offload->prog_fd, packet, &packet_length) == TC_ACT_REDIRECT,
+            "%d bytes to the server are not forwarded", length);
+        CHECK_EQ(packet_length, HEADERS_SIZE + length);
+        struct iphdr *ip = (struct iphdr *)(packet + 14);
+        struct udphdr *udp = (struct udphdr *)(packet + 34);
+        CHECK_EQ(ntohl(ip->saddr), LOCAL_ADDR);
+        CHECK_EQ(ntohl(ip->daddr), SERVER_ADDR);
+        CHECK_EQ(ntohs(udp->source), FORWARD_PORT);
+        CHECK_EQ(ntohs(udp->dest), SERVER_PORT);
+        CHECK_EQ(ntohs(udp->len), 8 + length);
+        CHECK_MSG(memcmp(packet + HEADERS_SIZE, data, length) == 0, "%d bytes to the server are decoded wrong", length);
+
+        // Server to client: encoded, decode() must restore it
+        packet_length = build_packet(packet, SERVER_ADDR, SERVER_PORT, LOCAL_ADDR, FORWARD_PORT, (uint8_t *)data, length);
+        CHECK_MSG(run_program(offload->prog_fd, packet, &packet_length) == TC_ACT_REDIRECT,
+            "%d bytes to the client are not forwarded", length);
+        CHECK_EQ(ntohl(ip->daddr), CLIENT_ADDR);
+        CHECK_EQ(ntohs(udp->source), LISTEN_PORT);
+        CHECK_EQ(ntohs(udp->dest), CLIENT_PORT);
+        payload_length = packet_length - HEADERS_SIZE;
+        CHECK_EQ(ntohs(udp->len), 8 + payload_length);
+        memcpy(payload, packet + HEADERS_SIZE, payload_length);
+        CHECK_EQ(decode((uint8_t *)payload, payload_length, key, sizeof(key) - 1, &version), length);
+        CHECK_MSG(memcmp(payload, data, length) == 0, "%d bytes to the client are encoded wrong", length);
+    }
+
+    // Handshakes and unknown flows are left to the obfuscator
+    memset(data, 0, sizeof(data));
+    data[0] = WG_TYPE_HANDSHAKE;
+    memcpy(payload, data, 148);
+    int payload_length = encode((uint8_t *)payload, 148, key, sizeof(key) - 1, OBFUSCATION_VERSION, 0);
+    int packet_length = build_packet(packet, CLIENT_ADDR, CLIENT_PORT, LOCAL_ADDR, LISTEN_PORT,
+        (uint8_t *)payload, payload_length);
+    CHECK_EQ(run_program(offload->prog_fd, packet, &packet_length), TC_ACT_OK);
+    data[0] = WG_TYPE_DATA;
+    packet_length = build_packet(packet, CLIENT_ADDR, CLIENT_PORT + 1, LOCAL_ADDR, LISTEN_PORT, (uint8_t *)data, 64);
+    CHECK_EQ(run_program(offload->prog_fd, packet, &packet_length), TC_ACT_OK);
+}
+
+int main(void)
+{
+    offload_t offload = { .prog_fd = -1 };
+    offload.flows_fd = ebpf_map_create(BPF_MAP_TYPE_HASH, sizeof(offload_key_t), sizeof(offload_flow_t), 16);
+    offload.keystream_fd = ebpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), OFFLOAD_PAYLOAD_MAX, 256);
+    if (offload.flows_fd < 0 || offload.keystream_fd < 0) {
+        if (errno == EPERM) {
+            printf("tc offload: skipped, needs CAP_BPF and CAP_NET_ADMIN\n");
+            return 0;
+        }
+        CHECK_MSG(0, "can't create the maps: %s", strerror(errno));
+        return test_result("tc offload");
+    }
+    CHECK_EQ(fill_keystream(&offload, key, sizeof(key) - 1), 0);
+    CHECK_MSG(load_program(&offload) >= 0, "the verifier rejects the program: %s", strerror(errno));
+    if (offload.prog_fd >= 0) {
+        test_program(&offload);
+    }
+    offload_free(&offload);
+    return test_result("tc offload");
+}
+
+#else
+
+int main(void)
+{
+    printf("tc offload: skipped, the TC offload is not built in\n");
+    return 0;
+}
+
+#endif // USE_TC_OFFLOAD
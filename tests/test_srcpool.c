@@ -0,0 +1,143 @@
+#include <unistd.h>
+#define TEST_LOGGING (LL_ERROR - 1)
+#include "test.h"
+#include "../srcpool.c"
+
+static void test_parse(void)
+{
+    srcpool_t pool;
+    CHECK_EQ(srcpool_parse(&pool, "127.0.0.2, 127.0.0.3:20000-20003,127.0.0.4:30000"), 0);
+    CHECK_EQ(pool.count, 3);
+    CHECK_EQ(ntohl(pool.entries[0].addr.s_addr), 0x7F000002);
+    CHECK_EQ(pool.entries[0].count, 0);
+    CHECK_EQ(ntohl(pool.entries[1].addr.s_addr), 0x7F000003);
+    CHECK_EQ(pool.entries[1].first, 20000);
+    CHECK_EQ(pool.entries[1].count, 4);
+    CHECK_EQ(pool.entries[2].first, 30000);
+    CHECK_EQ(pool.entries[2].count, 1);
+    CHECK_EQ(srcpool_parse(&pool, "10.0.0.1:1-65535"), 0);
+    CHECK_EQ(pool.entries[0].count, 65535);
+
+    static const char *invalid[] = {
+        "", " , ", "10.0.0", "10.0.0.256", "host", "10.0.0.1:", "10.0.0.1:0", "10.0.0.1:65536",
+        "10.0.0.1:5-3", "10.0.0.1:1-", "10.0.0.1:-5", "10.0.0.1:abc", "10.0.0.1:1000x", "10.0.0.1:1-2-3"
+    };
+    for (int i = 0; i < TEST_COUNT(invalid); i++) {
+        CHECK_MSG(srcpool_parse(&pool, invalid[i]) == -1, "invalid list \"%s\" is accepted", invalid[i]);
+    }
+
+    // No more than SRCPOOL_MAX addresses
+    char list[1024] = "";
+    for (int i = 0; i < SRCPOOL_MAX; i++) {
+        sprintf(list + strlen(list), "%s10.0.%d.%d", i ? "," : "", i / 256, i % 256 + 1);
+    }
+    CHECK_EQ(srcpool_parse(&pool, list), 0);
+    CHECK_EQ(pool.count, SRCPOOL_MAX);
+    strcat(list, ",10.1.0.1");
+    CHECK_EQ(srcpool_parse(&pool, list), -1);
+}
+
+static int udp_socket(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(sock >= 0);
+    return sock;
+}
+
+/**
+ * @brief Returns the port the socket is bound to, and checks its address.
+ */
+static int bound_port(int sock, uint32_t addr)
+{
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    CHECK_EQ(getsockname(sock, (struct sockaddr *)&local, &length), 0);
+    CHECK_EQ(ntohl(local.sin_addr.s_addr), addr);
+    return ntohs(local.sin_port);
+}
+
+static void test_bind(void)
+{
+    // Two ports on each address, every address of 127.0.0.0/8 is local
+    srcpool_t pool;
+    CHECK_EQ(srcpool_parse(&pool, "127.0.0.2:47100-47101,127.0.0.3:47100-47101"), 0);
+    int socks[5];
+    int counts[2] = { 0 };
+    for (int i = 0; i < 4; i++) {
+        socks[i] = udp_socket();
+        int index = srcpool_bind(&pool, socks[i]);
+        CHECK(index == 0 || index == 1);
+        if (index < 0) {
+            continue;
+        }
+        counts[index]++;
+        int port = bound_port(socks[i], 0x7F000002 + index);
+        CHECK(port == 47100 || port == 47101);
+        // Evenly spread among the addresses
+        CHECK(counts[index] - counts[!index] <= 1);
+    }
+    CHECK_EQ(pool.entries[0].in_use, 2);
+    CHECK_EQ(pool.entries[1].in_use, 2);
+
+    // The whole pool is taken
+    socks[4] = udp_socket();
+    CHECK_EQ(srcpool_bind(&pool, socks[4]), -1);
+    CHECK_EQ(errno, EADDRINUSE);
+
+    // A port is freed, and taken again
+    struct sockaddr_in local;
+    socklen_t length = sizeof(local);
+    getsockname(socks[1], (struct sockaddr *)&local, &length);
+    int index = (int)(ntohl(local.sin_addr.s_addr) - 0x7F000002);
+    close(socks[1]);
+    srcpool_release(&pool, index);
+    CHECK_EQ(pool.entries[index].in_use, 1);
+    close(socks[4]);
+    socks[4] = udp_socket();
+    CHECK_EQ(srcpool_bind(&pool, socks[4]), index);
+    CHECK_EQ(bound_port(socks[4], 0x7F000002 + index), ntohs(local.sin_port));
+    socks[1] = socks[4];
+    for (int i = 0; i < 4; i++) {
+        close(socks[i]);
+    }
+
+    // Out of range indexes are ignored
+    srcpool_release(&pool, -1);
+    srcpool_release(&pool, pool.count);
+}
+
+static void test_bind_not_local(void)
+{
+    // An address that is not local is skipped, the kernel picks the port of the other one
+    srcpool_t pool;
+    CHECK_EQ(srcpool_parse(&pool, "192.0.2.1,127.0.0.2"), 0);
+    for (int i = 0; i < 3; i++) {
+        int sock = udp_socket();
+        CHECK_EQ(srcpool_bind(&pool, sock), 1);
+        CHECK(bound_port(sock, 0x7F000002) != 0);
+        close(sock);
+        srcpool_release(&pool, 1);
+    }
+    CHECK_EQ(pool.entries[0].in_use, 0);
+    CHECK_EQ(pool.entries[1].in_use, 0);
+
+    // Only the error of the address that is not local
+    CHECK_EQ(srcpool_parse(&pool, "192.0.2.1"), 0);
+    int sock = udp_socket();
+    CHECK_EQ(srcpool_bind(&pool, sock), -1);
+    CHECK_EQ(errno, EADDRNOTAVAIL);
+    close(sock);
+
+    // Nothing to bind to
+    memset(&pool, 0, sizeof(pool));
+    CHECK_EQ(srcpool_bind(&pool, -1), -1);
+    CHECK_EQ(errno, EINVAL);
+}
+
+int main(void)
+{
+    test_parse();
+    test_bind();
+    test_bind_not_local();
+    return test_result("source address pool");
+}
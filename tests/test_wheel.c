@@ -0,0 +1,203 @@
+#include <stddef.h>
+#include "test.h"
+#include "../wheel.h"
+
+typedef struct {
+    wheel_timer_t timer;
+    long due;                       // time it was added for, in milliseconds
+    int fired;
+} test_timer_t;
+
+// State of the wheel_advance() call in progress
+static long advance_from;
+static long advance_to;
+static long last_due;
+
+static test_timer_t *timer_of(wheel_timer_t *timer)
+{
+    return (test_timer_t *)((char *)timer - offsetof(test_timer_t, timer));
+}
+
+/**
+ * @brief Checks that the timer has expired neither early nor late, and in order.
+ */
+static void on_expire(wheel_timer_t *timer, void *arg)
+{
+    (void)arg;
+    test_timer_t *t = timer_of(timer);
+    // Rounded up to a whole tick, never before its time
+    long tick_due = (t->due + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS * WHEEL_TICK_MS;
+    CHECK(tick_due <= advance_to);
+    CHECK(tick_due > advance_from);
+    CHECK(tick_due >= last_due);
+    CHECK(!wheel_pending(timer));
+    last_due = tick_due;
+    t->fired++;
+}
+
+static int advance(wheel_t *wheel, long now)
+{
+    advance_to = now;
+    last_due = 0;
+    int count = wheel_advance(wheel, now, on_expire, NULL);
+    advance_from = now;
+    return count;
+}
+
+static void add(wheel_t *wheel, test_timer_t *t, long due)
+{
+    t->due = due;
+    t->fired = 0;
+    wheel_add(wheel, &t->timer, due);
+}
+
+static void test_single(void)
+{
+    wheel_t wheel;
+    test_timer_t t = { 0 };
+    wheel_init(&wheel, 1000);
+    advance_from = 1000;
+    add(&wheel, &t, 1250);
+    CHECK(wheel_pending(&t.timer));
+    CHECK_EQ(wheel_timeout(&wheel, 1000), 300);
+    CHECK_EQ(advance(&wheel, 1299), 0);
+    CHECK_EQ(advance(&wheel, 1300), 1);
+    CHECK_EQ(t.fired, 1);
+    CHECK_EQ(wheel.pending, 0);
+    CHECK_EQ(wheel_timeout(&wheel, 1300), -1);
+}
+
+static void on_expire_count(wheel_timer_t *timer, void *arg)
+{
+    (void)arg;
+    timer_of(timer)->fired++;
+}
+
+static void test_past(void)
+{
+    wheel_t wheel;
+    test_timer_t t = { 0 };
+    wheel_init(&wheel, 5000);
+    add(&wheel, &t, 0);
+    CHECK_EQ(wheel_timeout(&wheel, 5000), 0);
+    CHECK_EQ(wheel_advance(&wheel, 5000, on_expire_count, NULL), 1);
+    CHECK_EQ(t.fired, 1);
+}
+
+static void test_delete_and_move(void)
+{
+    wheel_t wheel;
+    test_timer_t a = { 0 }, b = { 0 };
+    wheel_init(&wheel, 0);
+    advance_from = 0;
+    add(&wheel, &a, 500);
+    add(&wheel, &b, 700);
+    wheel_del(&wheel, &a.timer);
+    CHECK(!wheel_pending(&a.timer));
+    wheel_del(&wheel, &a.timer);
+    CHECK_EQ(wheel.pending, 1);
+    // Moved to a level 1 slot
+    add(&wheel, &b, 100000);
+    CHECK_EQ(wheel.pending, 1);
+    CHECK_EQ(advance(&wheel, 99999), 0);
+    CHECK_EQ(advance(&wheel, 100000), 1);
+    CHECK_EQ(a.fired, 0);
+    CHECK_EQ(b.fired, 1);
+}
+
+/**
+ * @brief One timer on every level, and one past the top level, each must come down
+ * the levels and expire exactly at its tick.
+ */
+static void test_cascade(void)
+{
+    static const long delays[] = {
+        WHEEL_TICK_MS * 63L,
+        WHEEL_TICK_MS * 64L,
+        WHEEL_TICK_MS * (64L * 64 + 17),
+        WHEEL_TICK_MS * (64L * 64 * 64 * 3 + 64 * 5 + 1),
+        WHEEL_TICK_MS * (64L * 64 * 64 * 64 + 64 * 64 * 7 + 3),
+        WHEEL_TICK_MS * (64L * 64 * 64 * 64 * 3 + 11) + 1,
+    };
+    for (int i = 0; i < TEST_COUNT(delays); i++) {
+        for (long start = 0; start < 3 * WHEEL_TICK_MS * 64; start += WHEEL_TICK_MS * 37 + 13) {
+            wheel_t wheel;
+            test_timer_t t = { 0 };
+            wheel_init(&wheel, start);
+            advance_from = start;
+            add(&wheel, &t, start + delays[i]);
+            long due = (start + delays[i] + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS * WHEEL_TICK_MS;
+            // Wake up whenever the wheel asks to, it must never skip the timer
+            long now = start;
+            while (!t.fired && now < due + WHEEL_TICK_MS) {
+                long timeout = wheel_timeout(&wheel, now);
+                CHECK(timeout >= 0);
+                now += timeout > 0 ? timeout : 1;
+                advance(&wheel, now);
+            }
+            CHECK_EQ(t.fired, 1);
+            CHECK_EQ(now, due);
+        }
+    }
+}
+
+static void on_expire_readd(wheel_timer_t *timer, void *arg)
+{
+    wheel_t *wheel = arg;
+    test_timer_t *t = timer_of(timer);
+    t->fired++;
+    if (t->fired < 5) {
+        t->due += 1000;
+        wheel_add(wheel, timer, t->due);
+    }
+}
+
+static void test_readd_from_callback(void)
+{
+    wheel_t wheel;
+    test_timer_t t = { 0 };
+    wheel_init(&wheel, 0);
+    add(&wheel, &t, 1000);
+    CHECK_EQ(wheel_advance(&wheel, 10000, on_expire_readd, &wheel), 5);
+    CHECK_EQ(t.fired, 5);
+    CHECK_EQ(wheel.pending, 0);
+}
+
+/**
+ * @brief Many timers with random times, the time advanced in random steps.
+ */
+static void test_random(void)
+{
+    enum { COUNT = 2000 };
+    static test_timer_t timers[COUNT];
+    wheel_t wheel;
+    srand(TEST_SEED);
+    wheel_init(&wheel, 12345);
+    advance_from = 12345;
+    for (int i = 0; i < COUNT; i++) {
+        add(&wheel, &timers[i], 12345 + rand() % (WHEEL_TICK_MS * 64 * 64 * 64));
+    }
+    CHECK_EQ(wheel.pending, COUNT);
+    long now = 12345;
+    int expired = 0;
+    while (now < 12345 + WHEEL_TICK_MS * 64 * 64 * 64 + WHEEL_TICK_MS) {
+        now += rand() % (WHEEL_TICK_MS * 300);
+        expired += advance(&wheel, now);
+    }
+    CHECK_EQ(expired, COUNT);
+    CHECK_EQ(wheel.pending, 0);
+    for (int i = 0; i < COUNT; i++) {
+        CHECK_EQ(timers[i].fired, 1);
+    }
+}
+
+int main(void)
+{
+    test_single();
+    test_past();
+    test_delete_and_move();
+    test_cascade();
+    test_readd_from_callback();
+    test_random();
+    return test_result("wheel");
+}
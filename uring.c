@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "stats.h"
+
+#define URING_BUFFER_GROUP      0
+#define URING_BUFFERS_MIN       32
+#define URING_BUFFERS_MAX       32768
+
+// Upper two bits of user_data tell what a completion belongs to
+#define TAG_WATCH               0ULL    // generation << 32 | descriptor
+#define TAG_SEND                1ULL    // index of the send
+#define TAG_IGNORE              2ULL    // cancellations, nothing to do
+#define TAG_SHIFT               62
+#define GENERATION_MASK         0x3FFFFFFFU
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint32_t round_up_pow2(uint32_t v)
+{
+    uint32_t r = 1;
+    while (r < v) {
+        r <<= 1;
+    }
+    return r;
+}
+
+/**
+ * @brief Returns 1 if the kernel knows the opcode. Multishot recvmsg has no opcode
+ * or feature flag of its own, it came in the same release (6.0) as IORING_OP_SEND_ZC.
+ */
+static int opcode_supported(int fd, int opcode)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+    int supported = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && opcode <= probe->last_op
+        && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/**
+ * @brief Hands the queued submissions to the kernel and optionally waits for completions.
+ */
+static int enter(uring_t *ring, unsigned wait_nr, int timeout_ms)
+{
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0
+    };
+    int r;
+    if (wait_nr) {
+        r = sys_io_uring_enter(ring->fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        r = sys_io_uring_enter(ring->fd, to_submit, 0, 0, NULL, 0);
+    }
+    if (to_submit && ring->sends_queued && (r >= 0 || errno == ETIME)) {
+        stats.tx_calls++;
+        ring->sends_queued = 0;
+    }
+    return r;
+}
+
+/**
+ * @brief Returns a free submission queue entry, flushing the queue to the kernel if it is full.
+ */
+static struct io_uring_sqe *get_sqe(uring_t *ring)
+{
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        enter(ring, 0, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    uint32_t index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+/**
+ * @brief Gives the buffer back to the kernel.
+ */
+static void recycle_buffer(uring_t *ring, int id)
+{
+    // Fill the fields one by one: 'resv' of the first entry is the ring tail
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buffer_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * ring->buffer_size);
+    buf->len = ring->buffer_size;
+    buf->bid = id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void unref_buffer(uring_t *ring, int id)
+{
+    if (--ring->buffer_refs[id] == 0) {
+        recycle_buffer(ring, id);
+    }
+}
+
+static uint64_t watch_user_data(const uring_watch_t *watch, int fd)
+{
+    return (TAG_WATCH << TAG_SHIFT) | ((uint64_t)(watch->generation & GENERATION_MASK) << 32) | (uint32_t)fd;
+}
+
+/**
+ * @brief Submits the multishot request for the watched descriptor.
+ */
+static int arm(uring_t *ring, int fd)
+{
+    uring_watch_t *watch = &ring->watches[fd];
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        watch->rearm = 1;
+        ring->rearm_pending = 1;
+        return -1;
+    }
+    sqe->fd = fd;
+    sqe->user_data = watch_user_data(watch, fd);
+    if (watch->type == URING_EV_RECV) {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&ring->recv_msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_TRUNC; // report the real length of the truncated datagrams
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER == __BIG_ENDIAN
+        sqe->poll32_events = ((uint32_t)POLLIN << 16) | ((uint32_t)POLLIN >> 16); // the halves are swapped on big endian
+#else
+        sqe->poll32_events = POLLIN;
+#endif
+    }
+    watch->rearm = 0;
+    return 0;
+}
+
+/**
+ * @brief Submits again the multishot requests which have finished, e.g. after
+ * the kernel ran out of free buffers.
+ */
+static void rearm_all(uring_t *ring)
+{
+    if (!ring->rearm_pending) {
+        return;
+    }
+    ring->rearm_pending = 0;
+    for (int fd = 0; fd < ring->watch_count; fd++) {
+        if (ring->watches[fd].type && ring->watches[fd].rearm) {
+            arm(ring, fd);
+        }
+    }
+}
+
+static int watch(uring_t *ring, int fd, void *ctx, uint8_t type)
+{
+    if (fd >= ring->watch_count) {
+        int count = fd + 64;
+        uring_watch_t *watches = realloc(ring->watches, count * sizeof(*watches));
+        if (!watches) {
+            return -1;
+        }
+        memset(watches + ring->watch_count, 0, (count - ring->watch_count) * sizeof(*watches));
+        ring->watches = watches;
+        ring->watch_count = count;
+    }
+    uring_watch_t *w = &ring->watches[fd];
+    w->generation++;
+    w->ctx = ctx;
+    w->type = type;
+    arm(ring, fd);
+    return 0;
+}
+
+int uring_watch_socket(uring_t *ring, int fd, void *ctx)
+{
+    return watch(ring, fd, ctx, URING_EV_RECV);
+}
+
+int uring_watch_readable(uring_t *ring, int fd, void *ctx)
+{
+    return watch(ring, fd, ctx, URING_EV_READABLE);
+}
+
+void uring_unwatch(uring_t *ring, int fd)
+{
+    if (fd < 0 || fd >= ring->watch_count || !ring->watches[fd].type) {
+        return;
+    }
+    uring_watch_t *w = &ring->watches[fd];
+    // The request keeps its own reference to the socket, closing the descriptor does not stop it
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = watch_user_data(w, fd);
+        sqe->user_data = TAG_IGNORE << TAG_SHIFT;
+    }
+    w->type = 0;
+    w->rearm = 0;
+    w->ctx = NULL;
+    w->generation++;
+}
+
+/**
+ * @brief Handles a completed send.
+ */
+static void complete_send(uring_t *ring, int index, int res)
+{
+    uring_send_t *send = &ring->sends[index];
+    if (res < 0) {
+        errno = -res;
+        if (send->msg.msg_name) {
+            serror_level(LL_DEBUG, "sendto %s:%d", inet_ntoa(send->addr.sin_addr), ntohs(send->addr.sin_port));
+        } else {
+            serror_level(LL_DEBUG, "send");
+        }
+        stats.tx_errors++;
+    } else {
+        stats.tx_packets++;
+    }
+    unref_buffer(ring, send->buffer);
+    send->next = ring->free_send;
+    ring->free_send = index;
+}
+
+/**
+ * @brief Turns a completion into an event, returns 0 if there is nothing for the main loop.
+ */
+static int handle_completion(uring_t *ring, uint64_t user_data, int res, uint32_t flags, uring_event_t *event)
+{
+    uint64_t tag = user_data >> TAG_SHIFT;
+    if (tag == TAG_SEND) {
+        complete_send(ring, (int)(uint32_t)user_data, res);
+        return 0;
+    }
+    if (tag != TAG_WATCH) {
+        return 0;
+    }
+
+    int fd = (int)(uint32_t)user_data;
+    uint32_t generation = (user_data >> 32) & GENERATION_MASK;
+    int id = (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    uring_watch_t *w = fd < ring->watch_count ? &ring->watches[fd] : NULL;
+    if (!w || !w->type || (w->generation & GENERATION_MASK) != generation) {
+        // The descriptor has been closed in the meantime
+        if (id >= 0) {
+            recycle_buffer(ring, id);
+        }
+        return 0;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        // The request is over: out of buffers, an error, or the kernel just decided so
+        w->rearm = 1;
+        ring->rearm_pending = 1;
+    }
+
+    if (w->type == URING_EV_READABLE) {
+        if (res < 0) {
+            return 0;
+        }
+        memset(event, 0, sizeof(*event));
+        event->type = URING_EV_READABLE;
+        event->fd = fd;
+        event->ctx = w->ctx;
+        return 1;
+    }
+
+    if (res < 0) {
+        if (res == -ENOBUFS) {
+            return 0;
+        }
+        errno = -res;
+        serror_level(LL_DEBUG, "io_uring recvmsg");
+        memset(event, 0, sizeof(*event));
+        event->type = URING_EV_ERROR;
+        event->fd = fd;
+        event->ctx = w->ctx;
+        return 1;
+    }
+    if (id < 0) {
+        return 0;
+    }
+
+    // Layout: header, address, control data, payload. The size of the control data is chosen
+    // so that the payload always starts at PREBUFFER_SIZE, the space before it is the headroom.
+    uint8_t *buffer = ring->buffers + (size_t)id * ring->buffer_size;
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buffer, sizeof(out));
+    memset(event, 0, sizeof(*event));
+    memcpy(&event->addr, buffer + sizeof(out),
+        out.namelen < sizeof(event->addr) ? out.namelen : sizeof(event->addr));
+    event->type = URING_EV_RECV;
+    event->fd = fd;
+    event->ctx = w->ctx;
+    event->data = buffer + PREBUFFER_SIZE;
+    event->length = out.payloadlen;
+    event->drops = -1;
+    event->rx_ns = 0;
+    event->tos = -1;
+    struct msghdr control = {
+        .msg_control = buffer + sizeof(out) + ring->recv_msg.msg_namelen,
+        .msg_controllen = out.controllen
+    };
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&control); cmsg; cmsg = CMSG_NXTHDR(&control, cmsg)) {
+#ifdef USE_RXQ_OVFL
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            event->drops = drops;
+        }
+#endif
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            event->rx_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        }
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+            event->tos = *CMSG_DATA(cmsg);
+        }
+    }
+
+    ring->buffer_refs[id] = 1;
+    ring->held[ring->held_count++] = id;
+    stats.rx_packets++;
+    if (!ring->rx_counted) {
+        stats.rx_calls++;
+        ring->rx_counted = 1;
+    }
+    return 1;
+}
+
+int uring_next(uring_t *ring, uring_event_t *event)
+{
+    while (1) {
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return 0;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (handle_completion(ring, user_data, res, flags, event)) {
+            return 1;
+        }
+    }
+}
+
+int uring_wait(uring_t *ring, int timeout_ms)
+{
+    rearm_all(ring);
+    int r = enter(ring, 1, timeout_ms);
+    if (r < 0 && errno != ETIME && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+void uring_submit(uring_t *ring)
+{
+    if (ring->sq_local_tail != *ring->sq_tail) {
+        enter(ring, 0, 0);
+    }
+}
+
+int uring_send(uring_t *ring, int sock, uint8_t *buffer, int length, const struct sockaddr_in *addr, uint64_t txtime, int tos)
+{
+    if (buffer < ring->buffers || buffer >= ring->buffers + (size_t)ring->buffer_count * ring->buffer_size
+        || ring->free_send < 0) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    int index = ring->free_send;
+    uring_send_t *send = &ring->sends[index];
+    ring->free_send = send->next;
+
+    send->buffer = (int)((buffer - ring->buffers) / ring->buffer_size);
+    ring->buffer_refs[send->buffer]++;
+    send->iov.iov_base = buffer;
+    send->iov.iov_len = length;
+    memset(&send->msg, 0, sizeof(send->msg));
+    if (addr) {
+        send->addr = *addr;
+        send->msg.msg_name = &send->addr;
+        send->msg.msg_namelen = sizeof(send->addr);
+    }
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+    send->msg.msg_control = send->control;
+#ifdef USE_TXTIME
+    if (txtime) {
+        struct cmsghdr *cmsg = (struct cmsghdr *)(send->control + send->msg.msg_controllen);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+        memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+        send->msg.msg_controllen += CMSG_SPACE(sizeof(txtime));
+    }
+#else
+    (void)txtime;
+#endif
+    if (tos >= 0) {
+        struct cmsghdr *cmsg = (struct cmsghdr *)(send->control + send->msg.msg_controllen);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TOS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(tos));
+        memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+        send->msg.msg_controllen += CMSG_SPACE(sizeof(tos));
+    }
+    if (!send->msg.msg_controllen) {
+        send->msg.msg_control = NULL;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->user_data = (TAG_SEND << TAG_SHIFT) | (uint32_t)index;
+    ring->sends_queued++;
+    return 0;
+}
+
+void uring_release(uring_t *ring)
+{
+    for (int i = 0; i < ring->held_count; i++) {
+        unref_buffer(ring, ring->held[i]);
+    }
+    ring->held_count = 0;
+    ring->rx_counted = 0;
+}
+
+int uring_init(uring_t *ring, int size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->free_send = -1;
+
+    uint32_t buffers = round_up_pow2(size * 4);
+    if (buffers < URING_BUFFERS_MIN) buffers = URING_BUFFERS_MIN;
+    if (buffers > URING_BUFFERS_MAX) buffers = URING_BUFFERS_MAX;
+    // Room for a send per buffer plus re-armed requests, more is submitted right away if needed
+    uint32_t entries = buffers * 2;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = entries * 4;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Older kernel, try without the optional flags
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !opcode_supported(ring->fd, IORING_OP_SEND_ZC)) {
+        uring_free(ring);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_free(ring);
+            return -1;
+        }
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Provided buffers
+    ring->buffer_count = buffers;
+    ring->buffer_size = BUFFER_SIZE + PREBUFFER_SIZE;
+    ring->buf_ring_size = buffers * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    ring->buffers = malloc((size_t)buffers * ring->buffer_size);
+    ring->buffer_refs = calloc(buffers, sizeof(*ring->buffer_refs));
+    ring->held = calloc(buffers, sizeof(*ring->held));
+    ring->send_count = buffers;
+    ring->sends = calloc(ring->send_count, sizeof(*ring->sends));
+    if (!ring->buffers || !ring->buffer_refs || !ring->held || !ring->sends) {
+        uring_free(ring);
+        errno = ENOMEM;
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buffers;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_free(ring);
+        return -1;
+    }
+    for (uint32_t i = 0; i < buffers; i++) {
+        recycle_buffer(ring, i);
+    }
+    for (int i = ring->send_count - 1; i >= 0; i--) {
+        ring->sends[i].next = ring->free_send;
+        ring->free_send = i;
+    }
+
+    // The address goes right after the header, then the control data up to PREBUFFER_SIZE
+    ring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    ring->recv_msg.msg_controllen = PREBUFFER_SIZE - sizeof(struct io_uring_recvmsg_out) - sizeof(struct sockaddr_in);
+    return 0;
+}
+
+void uring_free(uring_t *ring)
+{
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buffers);
+    free(ring->buffer_refs);
+    free(ring->held);
+    free(ring->sends);
+    free(ring->watches);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+#endif // USE_IO_URING
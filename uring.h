@@ -0,0 +1,189 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+
+// io_uring event loop, needs multishot recvmsg and provided buffer rings (kernel headers 6.0+).
+// Can be left out of the build with "make IO_URING=0".
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define USE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef USE_IO_URING
+
+#include <sys/socket.h>
+
+#define URING_EV_RECV           1       // a datagram arrived on a watched socket
+#define URING_EV_READABLE       2       // a watched descriptor became readable
+#define URING_EV_ERROR          3       // receiving from a watched socket failed, e.g. its error queue has ICMP errors
+
+// One completion handed to the main loop
+typedef struct {
+    int type;                       // URING_EV_RECV, URING_EV_READABLE or URING_EV_ERROR
+    int fd;                         // watched descriptor
+    void *ctx;                      // context passed when the descriptor was added
+    uint8_t *data;                  // URING_EV_RECV: the datagram, PREBUFFER_SIZE bytes of headroom are available before it
+    int length;                     // URING_EV_RECV: datagram length, larger than BUFFER_SIZE if it was truncated
+    struct sockaddr_in addr;        // URING_EV_RECV: sender address
+    int64_t drops;                  // URING_EV_RECV: drop counter of the socket (SO_RXQ_OVFL), -1 if not reported
+    uint64_t rx_ns;                 // URING_EV_RECV: kernel receive timestamp (SO_TIMESTAMPNS), 0 if none
+    int tos;                        // URING_EV_RECV: TOS byte (IP_RECVTOS), -1 if not reported
+} uring_event_t;
+
+// A watched descriptor, indexed by the descriptor number
+typedef struct {
+    void *ctx;
+    uint32_t generation;            // tells completions of a closed descriptor from the ones of a new one with the same number
+    uint8_t type;                   // URING_EV_RECV or URING_EV_READABLE, 0 if not watched
+    uint8_t rearm;                  // the multishot request has finished and must be submitted again
+} uring_watch_t;
+
+// A send in flight, the kernel reads the header and the data until it completes
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in addr;
+    char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))]; // departure time (SO_TXTIME) and TOS byte, if any
+    int buffer;                     // provided buffer the data is in
+    int next;                       // next free send
+} uring_send_t;
+
+typedef struct {
+    int fd;                         // io_uring instance
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail;         // entries up to here are filled, but not yet handed to the kernel
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    // Completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    // Provided buffers: the kernel picks a free one for every received datagram
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *buffers;
+    int buffer_count;
+    int buffer_size;                // BUFFER_SIZE + PREBUFFER_SIZE
+    uint16_t buf_tail;
+    uint16_t *buffer_refs;          // a buffer goes back to the kernel when nothing refers to it
+    int *held;                      // buffers of the events handed out since the last uring_release()
+    int held_count;
+    struct msghdr recv_msg;         // template for the multishot recvmsg requests
+    // Sends
+    uring_send_t *sends;
+    int send_count;
+    int free_send;                  // first free send, -1 if all of them are in flight
+    int sends_queued;               // sends filled since the last submission
+    // Watched descriptors
+    uring_watch_t *watches;
+    int watch_count;
+    uint8_t rearm_pending;
+    uint8_t rx_counted;
+} uring_t;
+
+/**
+ * @brief Sets up an io_uring instance with a ring of provided receive buffers.
+ *
+ * @param ring Ring to initialize.
+ * @param size Batch size, the number of buffers is derived from it.
+ * @return 0 on success, -1 with errno set if io_uring or one of the required features is not available.
+ */
+int uring_init(uring_t *ring, int size);
+
+/**
+ * @brief Releases all the resources of the ring.
+ */
+void uring_free(uring_t *ring);
+
+/**
+ * @brief Keeps a multishot recvmsg request armed on the socket, every datagram
+ * becomes a URING_EV_RECV event.
+ *
+ * @param ring Ring to use.
+ * @param fd Socket to receive from.
+ * @param ctx Context returned with the events.
+ * @return 0 on success, -1 if out of memory.
+ */
+int uring_watch_socket(uring_t *ring, int fd, void *ctx);
+
+/**
+ * @brief Keeps a multishot poll request armed on the descriptor, it becomes
+ * a URING_EV_READABLE event every time there is something to read.
+ *
+ * @param ring Ring to use.
+ * @param fd Descriptor to watch.
+ * @param ctx Context returned with the events.
+ * @return 0 on success, -1 if out of memory.
+ */
+int uring_watch_readable(uring_t *ring, int fd, void *ctx);
+
+/**
+ * @brief Stops watching the descriptor, must be called before it is closed.
+ * Completions still in flight for it are dropped.
+ */
+void uring_unwatch(uring_t *ring, int fd);
+
+/**
+ * @brief Submits everything queued so far and waits for completions.
+ *
+ * @param ring Ring to use.
+ * @param timeout_ms Maximum time to wait in milliseconds, -1 to wait without a limit.
+ * @return 0 on success or timeout, -1 on error (errno is set, EINTR if interrupted by a signal).
+ */
+int uring_wait(uring_t *ring, int timeout_ms);
+
+/**
+ * @brief Takes the next completion to handle.
+ *
+ * @param ring Ring to use.
+ * @param event Filled with the event.
+ * @return 1 if there is an event, 0 if the completion queue is empty.
+ */
+int uring_next(uring_t *ring, uring_event_t *event);
+
+/**
+ * @brief Queues a datagram to be sent with the next uring_wait(), without a syscall.
+ *
+ * @param ring Ring to use.
+ * @param sock Socket to send through.
+ * @param buffer Data to send, must be inside a received buffer handed out since the last uring_release().
+ * @param length Length of the data.
+ * @param addr Destination address, NULL for connected sockets.
+ * @param txtime Departure time on CLOCK_MONOTONIC (the socket has SO_TXTIME set), 0 to send right away.
+ * @param tos TOS byte to send with, -1 for the one of the socket.
+ * @return 0 if queued, -1 if the data is not in a received buffer or there are too many sends in flight,
+ *         the caller must send it by itself then.
+ */
+int uring_send(uring_t *ring, int sock, uint8_t *buffer, int length, const struct sockaddr_in *addr, uint64_t txtime, int tos);
+
+/**
+ * @brief Flushes the send queue to the kernel right away.
+ */
+void uring_submit(uring_t *ring);
+
+/**
+ * @brief Gives back the buffers of all the events handed out so far, except
+ * the ones still referred to by queued sends.
+ */
+void uring_release(uring_t *ring);
+
+#endif // USE_IO_URING
+
+#endif // _URING_H_
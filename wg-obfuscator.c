@@ -1,4 +1,5 @@
-﻿#include <stdio.h>
+﻿#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -10,25 +11,104 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sched.h>
+#include <stddef.h>
+#include <limits.h>
+#include <inttypes.h>
 #include "wg-obfuscator.h"
 #include "config.h"
 #include "obfuscation.h"
 #include "uthash.h"
 #include "masking.h"
+#include "batch.h"
+#include "stats.h"
+#include "uring.h"
+#include "reuseport.h"
+#include "pipeline.h"
+#include "xdp.h"
+#include "offload.h"
+#include "latency.h"
+#include "wheel.h"
+#include "rawudp.h"
+#include "srcpool.h"
+#ifdef USE_RECVERR
+#include <netinet/ip_icmp.h>
+#include <linux/errqueue.h>
+#endif
 
 // Verbosity level
 int verbose = LL_DEFAULT;
 // Section name (for multiple instances)
 char section_name[256] = DEFAULT_INSTANCE_NAME;
-// Listening socket for receiving data from the clients
-static int listen_sock = 0;
-// Hash table for client connections
-static client_entry_t *conn_table = NULL;
+// Listening socket for receiving data from the clients (every worker thread has its own)
+static _Thread_local int listen_sock = 0;
+// Listening sockets of this worker thread, one per port of the range, the first one is listen_sock
+static _Thread_local int *listen_socks = NULL;
+static int listen_ports = 1;
+// Hash table for client connections (every worker thread has its own share of the clients)
+static _Thread_local client_entry_t *conn_table = NULL;
+// Number of client entries in all the worker threads
+static int clients_total = 0;
 // PIDs of the other instances, filled by the parent process only
 static pid_t *child_pids = NULL;
 static int child_pids_count = 0;
 // Set by the SIGHUP handler, the log file is reopened from the main loop
 static volatile sig_atomic_t log_reopen_pending = 0;
+// Set by the SIGUSR1 handler, the statistics are written to the log from the main loop
+static volatile sig_atomic_t stats_dump_pending = 0;
+// Address for forwarding socket, for sending data to the server (every worker thread keeps a copy)
+static _Thread_local struct sockaddr_in forward_addr;
+// Expiry timers of the client entries of this worker thread
+static _Thread_local wheel_t timers;
+// Send queue of this worker thread, if it keeps the datagrams the sockets did not take
+static _Thread_local packet_batch_t *send_batch = NULL;
+// Raw socket to the target shared by the dynamic clients of this worker, NULL if they have their own sockets
+static _Thread_local rawudp_t *raw_upstream = NULL;
+// Last drop counters reported by the listening sockets and the raw upstream socket of this worker
+static _Thread_local uint32_t listen_drops_seen[LISTEN_PORTS_MAX];
+static _Thread_local uint32_t raw_drops_seen = 0;
+// Spare entries with the server socket already open, connected and watched, taken by the new clients
+static _Thread_local client_entry_t **spare_entries = NULL;
+static _Thread_local int spare_count = 0;
+// Target host and port as written in the configuration, for the log
+static char target_host[256] = {0};
+static int target_port = -1;
+// Number of ports of the target range, from target_port on
+static int target_ports = 1;
+// 1 if the clients hop over the ports of the target range
+static uint8_t port_hopping = 0;
+// Length of the obfuscation key
+static int key_length = 0;
+
+// Worker thread: owns a listening socket, an event loop and a share of the clients.
+// The kernel hands every client's datagrams to the same worker, so they need no locking.
+typedef struct {
+    int index;                      // position of the listening socket in the SO_REUSEPORT group
+    pthread_t thread;
+    obfuscator_config_t *config;
+    int listen_sock;
+    int listen_socks[LISTEN_PORTS_MAX]; // one per port of the range, the first one is listen_sock
+    client_entry_t *conn_table;     // static bindings, created before the thread starts
+    struct sockaddr_in forward_addr;
+    int resolve_result_rd;          // re-resolve results for this worker
+    int resolve_result_wr;
+    int cpu;                        // CPU to pin the thread to, -1 to not pin it
+    rawudp_t raw;                   // raw upstream socket and the ports of this worker, if enabled
+} worker_t;
+
+static worker_t *workers = NULL;
+static int workers_count = 1;
+// Local addresses the server sockets of the dynamic clients are bound to, shared by the workers
+static srcpool_t source_pool;
+// Worker running on the current thread
+static _Thread_local worker_t *worker = NULL;
+
+// Socket being drained during one wakeup of the event loop
+typedef struct {
+    client_entry_t *client_entry;   // owner of the socket, NULL for the listening and raw upstream sockets
+    int sock;                       // socket to drain
+    int received;                   // datagrams received from it so far
+} drain_slot_t;
 
 // Hostname re-resolve: the blocking getaddrinfo() runs in a helper thread
 #define RESOLVE_TAG_TARGET (-1)
@@ -36,20 +116,51 @@ typedef struct {
     int32_t tag;     // RESOLVE_TAG_TARGET or index into resolve_bindings
     int32_t err;     // getaddrinfo() error, 0 on success
     uint32_t addr;   // IPv4 address in network byte order
+    int32_t adopt;   // 1 if the static binding 'tag' is handed over from another worker thread
 } resolve_result_t;
 
 static int resolve_wake_rd = -1;
 static int resolve_wake_wr = -1;
-static int resolve_result_rd = -1;
-static int resolve_result_wr = -1;
+static _Thread_local int resolve_result_rd = -1;
+// Tickless mode: written by the signal handlers, wakes up the first worker thread, it may sleep for long
+static int signal_wake_rd = -1;
+static int signal_wake_wr = -1;
 static char resolve_target_host[256];
 static int resolve_target_is_name = 0;
 static long resolve_interval_ms = 0;
 static client_entry_t **resolve_bindings = NULL;
+static int *resolve_bindings_worker = NULL; // worker thread owning every static binding
 static int resolve_bindings_count = 0;
 
 #ifdef USE_EPOLL
-    static int epfd = 0;
+    static _Thread_local int epfd = 0;
+    // Set in the entry pointer of the epoll events for the socket connected to the client
+    #define CLIENT_SOCK_TAG ((uintptr_t)1)
+    // And for the server socket a source port hop has left behind
+    #define RETIRED_SOCK_TAG ((uintptr_t)2)
+#else
+    // Descriptors for poll(), updated only when a socket is watched or unwatched. Every client
+    // entry knows its position, and every position its client entry (NULL for the other sockets).
+    static _Thread_local struct pollfd *pollfds = NULL;
+    static _Thread_local client_entry_t **poll_entries = NULL;
+    static _Thread_local int pollfds_count = 0;
+    static _Thread_local int pollfds_capacity = 0;
+#endif
+#ifdef USE_IO_URING
+    static _Thread_local uring_t uring;
+    static _Thread_local uint8_t uring_enabled = 0;
+#endif
+// Receiving, processing and sending threads, if the pipeline mode is enabled
+static pipeline_t pipeline;
+#ifdef USE_AF_XDP
+    // AF_XDP fast path for the handshaked clients, only with a single worker thread
+    static xdp_t xdp;
+    static uint8_t xdp_enabled = 0;
+#endif
+#ifdef USE_TC_OFFLOAD
+    // In-kernel forwarding of the data packets, shared by all the worker threads
+    static offload_t offload;
+    static uint8_t offload_enabled = 0;
 #endif
 
 /**
@@ -78,6 +189,21 @@ static void signal_handler(int signal) {
     if (epfd) {
         close(epfd);
     }
+#endif
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        uring_free(&uring);
+    }
+#endif
+#ifdef USE_AF_XDP
+    if (xdp_enabled) {
+        xdp_free(&xdp);
+    }
+#endif
+#ifdef USE_TC_OFFLOAD
+    if (offload_enabled) {
+        offload_free(&offload);
+    }
 #endif
     log(LL_INFO, "Stopped.");
     exit(signal != -1 ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -154,16 +280,15 @@ static int resolve_hostname_startup(const char *host, struct in_addr *out, long
 }
 
 /**
- * @brief Sends one resolve result to the main thread. The write is at most
+ * @brief Writes one resolve result to a worker thread. The write is at most
  * PIPE_BUF bytes, so it is atomic and cannot interleave with another result.
  */
-static void resolve_send_result(int32_t tag, int32_t err, uint32_t addr)
+static void resolve_write_result(int fd, const resolve_result_t *r)
 {
-    resolve_result_t r = { .tag = tag, .err = err, .addr = addr };
-    const char *p = (const char *)&r;
-    size_t left = sizeof(r);
+    const char *p = (const char *)r;
+    size_t left = sizeof(*r);
     while (left) {
-        ssize_t n = write(resolve_result_wr, p, left);
+        ssize_t n = write(fd, p, left);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -175,6 +300,23 @@ static void resolve_send_result(int32_t tag, int32_t err, uint32_t addr)
     }
 }
 
+/**
+ * @brief Sends one resolve result to the worker threads: the target address
+ * to all of them, a static binding address to the one owning the binding.
+ */
+static void resolve_send_result(int32_t tag, int32_t err, uint32_t addr)
+{
+    resolve_result_t r = { .tag = tag, .err = err, .addr = addr };
+    if (tag == RESOLVE_TAG_TARGET) {
+        for (int i = 0; i < workers_count; i++) {
+            resolve_write_result(workers[i].resolve_result_wr, &r);
+        }
+    } else {
+        int owner = __atomic_load_n(&resolve_bindings_worker[tag], __ATOMIC_ACQUIRE);
+        resolve_write_result(workers[owner].resolve_result_wr, &r);
+    }
+}
+
 static void resolve_one(int32_t tag, const char *host)
 {
     struct in_addr addr;
@@ -231,376 +373,2523 @@ static void resolve_wake(void)
 }
 
 /**
- * @brief Applies one re-resolve result on the main thread.
+ * @brief Wakes up the first worker thread from a signal handler, in the tickless mode.
+ * Otherwise it wakes up every POLL_TIMEOUT anyway and sees the flags set by the handler.
  */
-static void apply_resolve_result(const resolve_result_t *r, struct sockaddr_in *forward_addr)
+static void signal_wake(void)
 {
-    if (r->err != 0) {
-        const char *name = "?";
-        if (r->tag == RESOLVE_TAG_TARGET) {
-            name = resolve_target_host;
-        } else if (r->tag >= 0 && r->tag < resolve_bindings_count && resolve_bindings[r->tag]) {
-            name = resolve_bindings[r->tag]->bind_host;
-        }
-        log(LL_WARN, "Can't re-resolve hostname '%s': %s", name, gai_strerror(r->err));
+    char c = 1;
+    if (signal_wake_wr < 0) {
         return;
     }
+    if (write(signal_wake_wr, &c, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        // Nothing useful can be done from a signal handler
+    }
+}
 
-    if (r->tag == RESOLVE_TAG_TARGET) {
-        if (forward_addr->sin_addr.s_addr == r->addr) {
-            return;
+/**
+ * @brief Reads all the pending wakeups written by signal_wake().
+ */
+static void drain_signal_wake(void)
+{
+    char buffer[64];
+    while (1) {
+        ssize_t n = read(signal_wake_rd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        char old_ip[INET_ADDRSTRLEN], new_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &forward_addr->sin_addr, old_ip, sizeof(old_ip));
-        forward_addr->sin_addr.s_addr = r->addr;
-        inet_ntop(AF_INET, &forward_addr->sin_addr, new_ip, sizeof(new_ip));
-        log(LL_INFO, "Target address changed: %s -> %s", old_ip, new_ip);
-
-        client_entry_t *e, *tmp;
-        HASH_ITER(hh, conn_table, e, tmp) {
-            if (connect(e->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr)) < 0) {
-                serror_level(LL_WARN, "Failed to update target address for client %s:%d",
-                    inet_ntoa(e->client_addr.sin_addr), ntohs(e->client_addr.sin_port));
-            }
+        if (n <= 0) {
+            break;
         }
-        return;
     }
+}
 
-    if (r->tag < 0 || r->tag >= resolve_bindings_count) {
-        return;
-    }
-    client_entry_t *entry = resolve_bindings[r->tag];
-    if (!entry || !entry->is_static) {
-        return;
-    }
-    if (entry->client_addr.sin_addr.s_addr == r->addr) {
-        return;
+#ifndef USE_EPOLL
+/**
+ * @brief Adds the descriptor to the poll() set, growing it if needed.
+ *
+ * @param fd Descriptor to wait for data on.
+ * @param client_entry Client entry the descriptor belongs to, NULL for the other sockets.
+ * @return 0 on success, -1 if out of memory (errno is set).
+ */
+static int poll_add(int fd, client_entry_t *client_entry)
+{
+    if (pollfds_count == pollfds_capacity) {
+        int capacity = pollfds_capacity ? pollfds_capacity * 2 : 64;
+        struct pollfd *fds = realloc(pollfds, capacity * sizeof(*fds));
+        if (fds) {
+            pollfds = fds;
+        }
+        client_entry_t **entries = realloc(poll_entries, capacity * sizeof(*entries));
+        if (entries) {
+            poll_entries = entries;
+        }
+        if (!fds || !entries) {
+            errno = ENOMEM;
+            return -1;
+        }
+        pollfds_capacity = capacity;
     }
+    pollfds[pollfds_count].fd = fd;
+    pollfds[pollfds_count].events = POLLIN;
+    pollfds[pollfds_count].revents = 0;
+    poll_entries[pollfds_count] = client_entry;
+    pollfds_count++;
+    return 0;
+}
 
-    struct sockaddr_in new_addr = entry->client_addr;
-    new_addr.sin_addr.s_addr = r->addr;
-
-    client_entry_t *collision = NULL;
-    HASH_FIND(hh, conn_table, &new_addr, sizeof(new_addr), collision);
-    if (collision && collision != entry) {
-        log(LL_WARN, "Static binding '%s' re-resolved to %s:%d, but that address is already in use",
-            entry->bind_host, inet_ntoa(new_addr.sin_addr), ntohs(new_addr.sin_port));
+/**
+ * @brief Removes a descriptor from the poll() set, the last descriptor takes its place.
+ *
+ * @param index Position of the descriptor.
+ */
+static void poll_del(int index)
+{
+    pollfds_count--;
+    if (index == pollfds_count) {
         return;
     }
-
-    char old_ip[INET_ADDRSTRLEN], new_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &entry->client_addr.sin_addr, old_ip, sizeof(old_ip));
-    inet_ntop(AF_INET, &new_addr.sin_addr, new_ip, sizeof(new_ip));
-
-    HASH_DEL(conn_table, entry);
-    entry->client_addr.sin_addr.s_addr = r->addr;
-    HASH_ADD(hh, conn_table, client_addr, sizeof(entry->client_addr), entry);
-    log(LL_INFO, "Static binding '%s' address changed: %s -> %s", entry->bind_host, old_ip, new_ip);
+    pollfds[index] = pollfds[pollfds_count];
+    poll_entries[index] = poll_entries[pollfds_count];
+    client_entry_t *moved = poll_entries[index];
+    if (moved && pollfds[index].fd == moved->client_sock) {
+        moved->client_poll_index = index;
+    } else if (moved && pollfds[index].fd == moved->retired_sock) {
+        moved->retired_poll_index = index;
+    } else if (moved) {
+        moved->poll_index = index;
+    }
 }
+#endif
 
 /**
- * @brief Reads every queued re-resolve result. Each write is atomic, so one
- * read of sizeof(resolve_result_t) is one message.
+ * @brief Starts waiting for data on the server socket of the client.
+ *
+ * @param client_entry Client entry to watch.
+ * @return 0 on success, -1 on error.
  */
-static void drain_resolve_results(struct sockaddr_in *forward_addr)
+static int watch_client(client_entry_t *client_entry)
 {
-    resolve_result_t r;
-    while (1) {
-        ssize_t n = read(resolve_result_rd, &r, sizeof(r));
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                break;
-            }
-            serror_level(LL_WARN, "Failed to read hostname re-resolve result");
-            break;
-        }
-        if (n == 0) {
-            break;
-        }
-        if (n != (ssize_t)sizeof(r)) {
-            log(LL_WARN, "Short read from hostname resolver (%zd bytes)", n);
-            break;
-        }
-        apply_resolve_result(&r, forward_addr);
+    if (client_entry->raw_upstream) {
+        // The raw socket is watched for all the clients
+        return 0;
+    }
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        return uring_watch_socket(&uring, client_entry->server_sock, client_entry);
     }
+#endif
+#ifdef USE_EPOLL
+    struct epoll_event e = {
+        .events = EPOLLIN,
+        .data.ptr = client_entry
+    };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, client_entry->server_sock, &e);
+#else
+    if (poll_add(client_entry->server_sock, client_entry) < 0) {
+        return -1;
+    }
+    client_entry->poll_index = pollfds_count - 1;
+    return 0;
+#endif
 }
 
 /**
- * @brief Starts the resolver thread if there is at least one hostname to refresh.
+ * @brief Stops waiting for data on the server socket of the client, must be called before it is closed.
+ *
+ * @param client_entry Client entry to stop watching.
  */
-static void resolve_start_thread(void)
+static void unwatch_client(client_entry_t *client_entry)
 {
-    int wake[2], result[2];
-    pthread_t thread;
-
-    if (!resolve_target_is_name && resolve_bindings_count == 0) {
+    if (client_entry->raw_upstream) {
         return;
     }
-
-    if (pipe(wake) < 0 || pipe(result) < 0) {
-        log(LL_WARN, "Can't create pipes for hostname re-resolve, periodic refresh disabled");
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        uring_unwatch(&uring, client_entry->server_sock);
         return;
     }
-    resolve_wake_rd = wake[0];
-    resolve_wake_wr = wake[1];
-    resolve_result_rd = result[0];
-    resolve_result_wr = result[1];
+#endif
+#ifdef USE_EPOLL
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client_entry->server_sock, NULL);
+#else
+    poll_del(client_entry->poll_index);
+#endif
+}
 
-    fcntl(resolve_wake_rd, F_SETFL, O_NONBLOCK);
-    fcntl(resolve_wake_wr, F_SETFL, O_NONBLOCK);
-    fcntl(resolve_result_rd, F_SETFL, O_NONBLOCK);
+/**
+ * @brief Starts waiting for data on the new server socket of the client after a source port hop.
+ * The old one stays watched as the retired socket, the replies still on their way to it are forwarded
+ * until it is closed.
+ *
+ * @param client_entry Client entry, with the old socket in retired_sock.
+ * @return 0 on success, -1 on error.
+ */
+static int watch_hop(client_entry_t *client_entry)
+{
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        // Watched by the descriptor, the old one is still told apart
+        return watch_client(client_entry);
+    }
+#endif
+#ifdef USE_EPOLL
+    struct epoll_event e = {
+        .events = EPOLLIN,
+        .data.ptr = (void *)((uintptr_t)client_entry | RETIRED_SOCK_TAG)
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, client_entry->retired_sock, &e) != 0) {
+        return -1;
+    }
+#else
+    client_entry->retired_poll_index = client_entry->poll_index;
+#endif
+    return watch_client(client_entry);
+}
 
-    if (pthread_create(&thread, NULL, resolve_thread_fn, NULL) != 0) {
-        log(LL_WARN, "Can't start hostname resolver thread, periodic refresh disabled");
-        close(resolve_wake_rd);
-        close(resolve_wake_wr);
-        close(resolve_result_rd);
-        close(resolve_result_wr);
-        resolve_wake_rd = resolve_wake_wr = resolve_result_rd = resolve_result_wr = -1;
+/**
+ * @brief Stops waiting for data on the server socket a source port hop has left behind,
+ * must be called before it is closed.
+ *
+ * @param client_entry Client entry.
+ */
+static void unwatch_retired(client_entry_t *client_entry)
+{
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        uring_unwatch(&uring, client_entry->retired_sock);
         return;
     }
-    pthread_detach(thread);
+#endif
+#ifdef USE_EPOLL
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client_entry->retired_sock, NULL);
+#else
+    poll_del(client_entry->retired_poll_index);
+#endif
+}
 
-    if (resolve_interval_ms > 0) {
-        log(LL_INFO, "Re-resolving hostnames every %ld seconds (and on SIGHUP)", resolve_interval_ms / 1000);
-    } else {
-        log(LL_INFO, "Re-resolving hostnames on SIGHUP");
+/**
+ * @brief Starts waiting for data on the socket connected to the client.
+ *
+ * @param client_entry Client entry to watch.
+ * @return 0 on success, -1 on error.
+ */
+static int watch_client_sock(client_entry_t *client_entry)
+{
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        return uring_watch_socket(&uring, client_entry->client_sock, client_entry);
+    }
+#endif
+#ifdef USE_EPOLL
+    struct epoll_event e = {
+        .events = EPOLLIN,
+        .data.ptr = (void *)((uintptr_t)client_entry | CLIENT_SOCK_TAG)
+    };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, client_entry->client_sock, &e);
+#else
+    if (poll_add(client_entry->client_sock, client_entry) < 0) {
+        return -1;
     }
+    client_entry->client_poll_index = pollfds_count - 1;
+    return 0;
+#endif
 }
 
 /**
- * @brief Remembers the PID of a forked instance.
+ * @brief Stops waiting for data on the socket connected to the client, must be called before it is closed.
  *
- * Called by the configuration parser for every additional section, so that the
- * parent process can forward signals to all the instances.
- *
- * @param pid PID of the forked instance.
+ * @param client_entry Client entry to stop watching.
  */
-void register_child_instance(pid_t pid)
+static void unwatch_client_sock(client_entry_t *client_entry)
 {
-    pid_t *new_pids = realloc(child_pids, (child_pids_count + 1) * sizeof(pid_t));
-    if (!new_pids) {
-        log(LL_WARN, "Out of memory, instance with PID %ld will not receive forwarded signals", (long)pid);
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        uring_unwatch(&uring, client_entry->client_sock);
         return;
     }
-    child_pids = new_pids;
-    child_pids[child_pids_count++] = pid;
+#endif
+#ifdef USE_EPOLL
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client_entry->client_sock, NULL);
+#else
+    poll_del(client_entry->client_poll_index);
+#endif
 }
 
-#ifdef SIGHUP
 /**
- * @brief Handles SIGHUP: schedules reopening of the log file.
+ * @brief Starts or stops waiting for the socket to become writable, called by the send queue
+ * when datagrams start or stop waiting for it.
  *
- * The actual reopening is done by the main loop, the handler only sets a flag
- * and forwards the signal to the instances of the other configuration sections.
- *
- * @param sig Signal number received by the process.
+ * @param sock Listening socket, server socket or connected socket of a client.
+ * @param ctx Client entry, NULL for the listening socket.
+ * @param waiting 1 to wait, 0 to stop.
  */
-static void sighup_handler(int sig)
+static void watch_writable(int sock, void *ctx, int waiting)
 {
-    (void)sig;
-    log_reopen_pending = 1;
-    resolve_wake();
-    // The list is filled before the handler is installed, so it can't change here
-    for (int i = 0; i < child_pids_count; i++) {
-        kill(child_pids[i], SIGHUP);
+    client_entry_t *client_entry = ctx;
+#ifdef USE_EPOLL
+    struct epoll_event e = {
+        .events = EPOLLIN | (waiting ? EPOLLOUT : 0)
+    };
+    if (client_entry && sock == client_entry->client_sock) {
+        e.data.ptr = (void *)((uintptr_t)client_entry | CLIENT_SOCK_TAG);
+    } else if (client_entry && sock == client_entry->retired_sock) {
+        e.data.ptr = (void *)((uintptr_t)client_entry | RETIRED_SOCK_TAG);
+    } else if (client_entry) {
+        e.data.ptr = client_entry;
+    } else {
+        e.data.fd = sock;
+    }
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &e) != 0) {
+        serror_level(LL_WARN, "epoll_ctl for writability");
+    }
+#else
+    int index = !client_entry ? -1
+              : sock == client_entry->client_sock ? client_entry->client_poll_index
+              : sock == client_entry->retired_sock ? client_entry->retired_poll_index
+              : client_entry->poll_index;
+    for (int i = 0; index < 0 && i < pollfds_count; i++) {
+        if (pollfds[i].fd == sock) {
+            index = i;
+        }
+    }
+    if (index >= 0) {
+        pollfds[index].events = POLLIN | (waiting ? POLLOUT : 0);
     }
-}
 #endif
+}
 
 /**
- * @brief Creates a new client_entry_t structure and initializes it with the provided client and forward addresses.
+ * @brief Sets the buffer sizes of a socket, past the system limits if privileged,
+ * and asks the kernel to report the datagrams it drops on the socket, to timestamp
+ * the received ones if the latency histograms are on, to take departure times
+ * with the sent ones if the pacing is on, to report their TOS byte if it is preserved,
+ * and to queue the ICMP errors about the sent datagrams if they are read.
  *
  * @param config Pointer to the obfuscator configuration structure.
- * @param client_addr Pointer to a struct sockaddr_in representing the client's address.
- * @param forward_addr Pointer to a struct sockaddr_in representing the address to which traffic should be forwarded.
- * @return Pointer to the newly created client_entry_t structure, or NULL on failure.
+ * @param sock Socket.
+ * @return 0 on success, -1 if a buffer size can't be set (errno is set).
  */
-static client_entry_t * new_client_entry(obfuscator_config_t *config, struct sockaddr_in *client_addr, struct sockaddr_in *forward_addr) {
-    if (HASH_COUNT(conn_table) >= config->max_clients) {
-        log(LL_ERROR, "Maximum number of clients reached (%d), cannot add new client", config->max_clients);
-        return NULL;
+static int setup_socket_buffers(const obfuscator_config_t *config, int sock)
+{
+#ifdef __linux__
+    // The forced variants ignore net.core.rmem_max and wmem_max, but need CAP_NET_ADMIN
+    if (config->rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &config->rcvbuf, sizeof(config->rcvbuf)) < 0
+        && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf, sizeof(config->rcvbuf)) < 0) {
+        return -1;
     }
-    client_entry_t * client_entry = malloc(sizeof(client_entry_t));
-    if (!client_entry) {
-        log(LL_ERROR, "Failed to allocate memory for client entry");
-        return NULL;
+    if (config->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &config->sndbuf, sizeof(config->sndbuf)) < 0
+        && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &config->sndbuf, sizeof(config->sndbuf)) < 0) {
+        return -1;
     }
-    memset(client_entry, 0, sizeof(client_entry_t));
-    // Set default version (latest)
-    client_entry->version = OBFUSCATION_VERSION;
-    // Set the client address
-    memcpy(&client_entry->client_addr, client_addr, sizeof(client_entry->client_addr));
+#else
+    if (config->rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf, sizeof(config->rcvbuf)) < 0) {
+        return -1;
+    }
+    if (config->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &config->sndbuf, sizeof(config->sndbuf)) < 0) {
+        return -1;
+    }
+#endif
+    // Not available everywhere, the drops are just not counted then
+    batch_enable_drop_counter(sock);
+    if (config->latency_histograms) {
+        batch_enable_timestamps(sock);
+    }
+    if (config->pacing_rate) {
+        // Supported, checked at the start
+        batch_enable_txtime(sock);
+    }
+    if (config->preserve_tos) {
+        batch_enable_tos(sock);
+    }
+#ifdef USE_RECVERR
+    if (config->icmp_errors) {
+        int optval = 1;
+        setsockopt(sock, IPPROTO_IP, IP_RECVERR, &optval, sizeof(optval));
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Finds a socket among the listening sockets of the worker thread.
+ *
+ * @param sock Socket.
+ * @return Index of the port it listens on, -1 if it is not a listening socket.
+ */
+static int listen_sock_index(int sock)
+{
+    if (sock == listen_sock) {
+        return 0;
+    }
+    for (int i = 1; i < listen_ports; i++) {
+        if (listen_socks[i] == sock) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the listening socket the client sends to, its datagrams go back through it.
+ *
+ * @param client_entry Client entry.
+ * @return Socket descriptor.
+ */
+static int client_listen_sock(const client_entry_t *client_entry)
+{
+    return client_entry->listen_sock ? client_entry->listen_sock : listen_sock;
+}
+
+/**
+ * @brief Returns the address of the target the server socket of the client is connected to,
+ * with the port of the target range it is on.
+ *
+ * @param client_entry Client entry.
+ * @param forward_addr Address of the target, with the first port of the range.
+ * @return Address.
+ */
+static struct sockaddr_in client_target_addr(const client_entry_t *client_entry, const struct sockaddr_in *forward_addr)
+{
+    struct sockaddr_in addr = *forward_addr;
+    if (client_entry->target_port) {
+        addr.sin_port = client_entry->target_port;
+    }
+    return addr;
+}
+
+/**
+ * @brief Counts the datagrams the kernel has dropped on a socket since its previous report,
+ * because its receive buffer was full.
+ *
+ * @param client_entry Owner of the socket, NULL for the listening and raw upstream sockets.
+ * @param sock Socket the datagrams were received from.
+ * @param counter Drop counter reported with them, -1 if none.
+ */
+static void account_kernel_drops(client_entry_t *client_entry, int sock, int64_t counter)
+{
+    if (counter < 0) {
+        return;
+    }
+    uint32_t *seen;
+    int port_index = client_entry ? -1 : listen_sock_index(sock);
+    if (!client_entry) {
+        seen = port_index >= 0 ? &listen_drops_seen[port_index] : &raw_drops_seen;
+    } else {
+        if (sock == client_entry->retired_sock) {
+            // Its counter goes away with it
+            return;
+        }
+        seen = sock == client_entry->client_sock ? &client_entry->client_drops_seen : &client_entry->server_drops_seen;
+    }
+    // The counter is 32-bit and wraps around
+    uint32_t drops = (uint32_t)counter - *seen;
+    if (!drops) {
+        return;
+    }
+    *seen = (uint32_t)counter;
+    if (!client_entry) {
+        if (port_index >= 0) {
+            stats.rx_drops_listen += drops;
+        } else {
+            stats.rx_drops_raw += drops;
+        }
+        return;
+    }
+    stats.rx_drops_clients += drops;
+    client_entry->kernel_drops += drops;
+    log(LL_DEBUG, "Kernel dropped %u packets on the %s socket of client %s:%d (%" PRIu64 " in total)",
+        drops, sock == client_entry->client_sock ? "client" : "server",
+        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), client_entry->kernel_drops);
+}
+
+#ifdef USE_RECVERR
+/**
+ * @brief Reads the ICMP errors the kernel has queued for a socket about the datagrams sent
+ * through it (IP_RECVERR). A client whose server or whose own address is reported unreachable
+ * is removed by its timer right after the sockets are drained, not while the event loop may
+ * still refer to it. The MTU reported by "fragmentation needed" is kept with the client.
+ *
+ * @param client_entry Owner of the socket, NULL for the listening and raw upstream sockets.
+ * @param sock Socket.
+ */
+static void read_socket_errors(client_entry_t *client_entry, int sock)
+{
+    for (int i = 0; i < ICMP_ERRORS_MAX; i++) {
+        struct sockaddr_in dest = {0};
+        // Start of the datagram the error is about, from the UDP header on for the raw upstream socket
+        uint8_t data[RAWUDP_HEADER_SIZE];
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct iovec iov = {
+            .iov_base = data,
+            .iov_len = sizeof(data)
+        };
+        struct msghdr msg = {
+            .msg_name = &dest,
+            .msg_namelen = sizeof(dest),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+        ssize_t length = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (length < 0) {
+            // The queue is empty
+            return;
+        }
+        struct sock_extended_err ee;
+        uint8_t found = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) {
+                memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+                found = 1;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+
+        // Whose datagram it was, and which way it went
+        client_entry_t *owner = client_entry;
+        int direction = DIR_CLIENT_TO_SERVER;
+        if (!client_entry && listen_sock_index(sock) >= 0) {
+            HASH_FIND(hh, conn_table, &dest, sizeof(dest), owner);
+            direction = DIR_SERVER_TO_CLIENT;
+        } else if (!client_entry) {
+            // The raw socket gets the errors about any UDP datagram of the host, the port tells ours
+            uint16_t port;
+            memcpy(&port, data, sizeof(port));
+            if (raw_upstream && length >= (ssize_t)sizeof(port) && dest.sin_addr.s_addr == raw_upstream->target.sin_addr.s_addr) {
+                owner = rawudp_owner(raw_upstream, ntohs(port));
+            }
+        } else if (sock == client_entry->client_sock) {
+            direction = DIR_SERVER_TO_CLIENT;
+        }
+        if (!owner || owner->spare) {
+            continue;
+        }
+        const char *peer = direction == DIR_CLIENT_TO_SERVER ? "server of client" : "client";
+
+        if ((ee.ee_origin == SO_EE_ORIGIN_ICMP && ee.ee_type == ICMP_DEST_UNREACH && ee.ee_code == ICMP_FRAG_NEEDED)
+            || (ee.ee_origin == SO_EE_ORIGIN_LOCAL && ee.ee_errno == EMSGSIZE)) {
+            owner->icmp_errors++;
+            stats.icmp_frag_needed++;
+            if (owner->sent_length[direction] > ee.ee_info
+                && owner->sent_length[direction] - owner->sent_padding[direction] <= ee.ee_info) {
+                // The last datagram we encoded for this path only got too large with the padding
+                stats.mtu_padding_dropped++;
+            }
+            if (ee.ee_info && ee.ee_info <= UINT16_MAX && owner->path_mtu[direction] != ee.ee_info) {
+                owner->path_mtu[direction] = (uint16_t)ee.ee_info;
+                log(LL_INFO, "Path MTU towards the %s %s:%d is %u", peer,
+                    inet_ntoa(owner->client_addr.sin_addr), ntohs(owner->client_addr.sin_port), ee.ee_info);
+            }
+            continue;
+        }
+        if (ee.ee_origin != SO_EE_ORIGIN_ICMP || ee.ee_type != ICMP_DEST_UNREACH) {
+            // E.g. TTL exceeded, the path may still work
+            continue;
+        }
+        owner->icmp_errors++;
+        if (ee.ee_code == ICMP_PORT_UNREACH) {
+            stats.icmp_port_unreachable++;
+        } else {
+            stats.icmp_host_unreachable++;
+        }
+        if (owner->is_static || owner->path_dead) {
+            continue;
+        }
+        log(LL_DEBUG, "ICMP reports the %s %s:%d unreachable (%s)", peer,
+            inet_ntoa(owner->client_addr.sin_addr), ntohs(owner->client_addr.sin_port), strerror(ee.ee_errno));
+        owner->path_dead = 1;
+        wheel_add(&timers, &owner->timer, 0);
+    }
+}
+#endif
+
+/**
+ * @brief Picks the latency histogram the next queued datagram is counted in.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param client_entry Client the datagram belongs to.
+ * @param direction DIR_CLIENT_TO_SERVER or DIR_SERVER_TO_CLIENT.
+ * @param buffer Plain WireGuard packet.
+ */
+static void classify_latency(const obfuscator_config_t *config, packet_batch_t *batch,
+    const client_entry_t *client_entry, int direction, const uint8_t *buffer)
+{
+    if (!config->latency_histograms) {
+        return;
+    }
+    int type = WG_TYPE(buffer) == WG_TYPE_DATA ? LATENCY_DATA : LATENCY_HANDSHAKE;
+    if (client_entry->masking_handler && !client_entry->client_clean) {
+        type = LATENCY_MASKING;
+    }
+    batch->latency_histogram = direction * LATENCY_TYPES + type;
+}
+
+/**
+ * @brief Gives the next queued datagram the TOS byte of the datagram being handled,
+ * with the DSCP remapped for the direction and the ECN bits as they are.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param direction DIR_CLIENT_TO_SERVER or DIR_SERVER_TO_CLIENT.
+ */
+static void mark_tos(const obfuscator_config_t *config, packet_batch_t *batch, int direction)
+{
+    if (!config->preserve_tos || batch->rx_tos < 0) {
+        return;
+    }
+    batch->tos = (config->dscp_map[direction][batch->rx_tos >> 2] << 2) | (batch->rx_tos & 0x03);
+}
+
+/**
+ * @brief Checks if the DSCP map changes any class.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @return 1 if some class is mapped to another one, 0 otherwise.
+ */
+static int dscp_remapped(const obfuscator_config_t *config)
+{
+    for (int d = 0; d < 64; d++) {
+        if (config->dscp_map[DIR_CLIENT_TO_SERVER][d] != d || config->dscp_map[DIR_SERVER_TO_CLIENT][d] != d) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Gives the next queued datagram of the client its departure time, so the packets of the
+ * client leave no faster than the pacing rate. The fq qdisc holds them until then.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param client_entry Client the datagram belongs to.
+ * @param direction DIR_CLIENT_TO_SERVER or DIR_SERVER_TO_CLIENT.
+ * @param length Length of the datagram.
+ * @return 0 if the datagram can be queued, -1 if the client is too far over the rate and it must be dropped.
+ */
+static int pace_datagram(const obfuscator_config_t *config, packet_batch_t *batch,
+    client_entry_t *client_entry, int direction, int length)
+{
+    if (!config->pacing_rate) {
+        return 0;
+    }
+    uint64_t now_ns = latency_now_ns();
+    uint64_t *next_ns = &client_entry->pace_next_ns[direction];
+    uint64_t departure_ns = *next_ns > now_ns ? *next_ns : now_ns;
+    if (departure_ns - now_ns > PACING_HORIZON * 1000000ULL) {
+        stats.pacing_dropped++;
+        return -1;
+    }
+    // With the IP and UDP headers; kbit/s to nanoseconds per byte
+    *next_ns = departure_ns + (uint64_t)(length + IP_UDP_HEADERS_SIZE) * 8000000ULL / (uint64_t)config->pacing_rate;
+    if (departure_ns > now_ns) {
+        batch->txtime = departure_ns;
+        stats.pacing_delayed++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes a socket of a client. The datagrams waiting for room in its send buffer are dropped,
+ * and in the pipeline and io_uring modes the ones still on their way to it are sent first: a socket
+ * opened later may get the same number. In the pipeline mode the sending thread closes it then.
+ *
+ * @param sock Socket.
+ */
+static void close_client_socket(int sock)
+{
+    if (send_batch) {
+        batch_drop_backlog(send_batch, sock);
+    }
+    if (pipeline.stage_count) {
+        pipeline_close(&pipeline, sock);
+        return;
+    }
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        // The queued sends find their socket by the number only when they are submitted
+        uring_submit(&uring);
+    }
+#endif
+    close(sock);
+}
+
+/**
+ * @brief Closes the socket connected to the client, if it has one. Its datagrams
+ * come through the listening socket again.
+ *
+ * @param client_entry Client entry.
+ */
+static void disconnect_client(client_entry_t *client_entry)
+{
+    if (client_entry->client_sock < 0) {
+        return;
+    }
+    unwatch_client_sock(client_entry);
+    close_client_socket(client_entry->client_sock);
+    client_entry->client_sock = -1;
+}
+
+/**
+ * @brief Closes the server socket a source port hop has left behind. Not done by the hop itself,
+ * the event loop may still be draining the old socket then.
+ *
+ * @param client_entry Client entry.
+ */
+static void retire_server_sock(client_entry_t *client_entry)
+{
+    if (client_entry->retired_sock < 0) {
+        return;
+    }
+    unwatch_retired(client_entry);
+    close_client_socket(client_entry->retired_sock);
+    if (client_entry->retired_source_index >= 0) {
+        srcpool_release(&source_pool, client_entry->retired_source_index);
+        stats.source_pool_released++;
+    }
+    client_entry->retired_sock = -1;
+    client_entry->retired_source_index = -1;
+}
+
+/**
+ * @brief Closes the connection of the client and frees its entry.
+ *
+ * @param client_entry Client entry to remove.
+ */
+static void remove_client(client_entry_t *client_entry)
+{
+#ifdef USE_AF_XDP
+    if (xdp_enabled) {
+        xdp_remove_client(&xdp, &client_entry->client_addr);
+    }
+#endif
+#ifdef USE_TC_OFFLOAD
+    if (offload_enabled) {
+        offload_remove_client(&offload, client_entry, &forward_addr);
+    }
+#endif
+    retire_server_sock(client_entry);
+    unwatch_client(client_entry);
+    disconnect_client(client_entry);
+    wheel_del(&timers, &client_entry->timer);
+    if (client_entry->kernel_drops) {
+        log(LL_INFO, "Kernel dropped %" PRIu64 " packets of client %s:%d on its sockets", client_entry->kernel_drops,
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+    }
+    if (client_entry->raw_upstream) {
+        rawudp_free_port(raw_upstream, ntohs(client_entry->our_addr.sin_port));
+    } else {
+        close_client_socket(client_entry->server_sock);
+        if (client_entry->source_index >= 0) {
+            srcpool_release(&source_pool, client_entry->source_index);
+            stats.source_pool_released++;
+        }
+    }
+    HASH_DEL(conn_table, client_entry);
+    free(client_entry);
+    __atomic_sub_fetch(&clients_total, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Takes over a static binding from another worker thread, after its address
+ * has changed and the datagrams from the client arrive to this thread now.
+ *
+ * @param entry Static binding entry, already removed from the other worker's table.
+ */
+static void adopt_static_binding(client_entry_t *entry)
+{
+    client_entry_t *collision = NULL;
+    HASH_FIND(hh, conn_table, &entry->client_addr, sizeof(entry->client_addr), collision);
+    if (collision && collision->is_static) {
+        log(LL_WARN, "Static bindings '%s' and '%s' resolve to the same address %s:%d",
+            entry->bind_host, collision->bind_host, inet_ntoa(entry->client_addr.sin_addr), ntohs(entry->client_addr.sin_port));
+    } else if (collision) {
+        // The binding is configured explicitly, so it wins over a dynamic client
+        log(LL_INFO, "Removing client %s:%d, the address now belongs to static binding '%s'",
+            inet_ntoa(collision->client_addr.sin_addr), ntohs(collision->client_addr.sin_port), entry->bind_host);
+        remove_client(collision);
+    }
+    // The listening sockets of the other thread are not ours
+    entry->listen_sock = 0;
+    HASH_ADD(hh, conn_table, client_addr, sizeof(entry->client_addr), entry);
+    if (watch_client(entry) != 0) {
+        serror("Failed to watch client socket");
+    }
+    wheel_add(&timers, &entry->timer, 0);
+}
+
+/**
+ * @brief Applies one re-resolve result on the main thread.
+ */
+static void apply_resolve_result(const resolve_result_t *r, struct sockaddr_in *forward_addr)
+{
+    if (r->err != 0) {
+        const char *name = "?";
+        if (r->tag == RESOLVE_TAG_TARGET) {
+            name = resolve_target_host;
+        } else if (r->tag >= 0 && r->tag < resolve_bindings_count && resolve_bindings[r->tag]) {
+            name = resolve_bindings[r->tag]->bind_host;
+        }
+        // Every worker thread gets the target result, one message in the log is enough
+        if (r->tag != RESOLVE_TAG_TARGET || worker->index == 0) {
+            log(LL_WARN, "Can't re-resolve hostname '%s': %s", name, gai_strerror(r->err));
+        }
+        return;
+    }
+
+    if (r->tag == RESOLVE_TAG_TARGET) {
+        if (forward_addr->sin_addr.s_addr == r->addr) {
+            return;
+        }
+        char old_ip[INET_ADDRSTRLEN], new_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &forward_addr->sin_addr, old_ip, sizeof(old_ip));
+#ifdef USE_TC_OFFLOAD
+        struct sockaddr_in old_forward_addr = *forward_addr;
+#endif
+        forward_addr->sin_addr.s_addr = r->addr;
+        inet_ntop(AF_INET, &forward_addr->sin_addr, new_ip, sizeof(new_ip));
+        if (worker->index == 0) {
+            log(LL_INFO, "Target address changed: %s -> %s", old_ip, new_ip);
+        }
+
+        client_entry_t *e, *tmp;
+        HASH_ITER(hh, conn_table, e, tmp) {
+#ifdef USE_TC_OFFLOAD
+            if (offload_enabled) {
+                // Offloaded again after the next handshake with the new address
+                offload_remove_client(&offload, e, &old_forward_addr);
+            }
+#endif
+            struct sockaddr_in target_addr = client_target_addr(e, forward_addr);
+            if (!e->raw_upstream && connect(e->server_sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) {
+                serror_level(LL_WARN, "Failed to update target address for client %s:%d",
+                    inet_ntoa(e->client_addr.sin_addr), ntohs(e->client_addr.sin_port));
+            }
+        }
+        for (int i = 0; i < spare_count; i++) {
+            if (connect(spare_entries[i]->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr)) < 0) {
+                serror_level(LL_WARN, "Failed to update target address of a spare socket");
+            }
+        }
+        if (raw_upstream && rawudp_set_target(raw_upstream, forward_addr) < 0) {
+            serror_level(LL_WARN, "Failed to update target address of the raw upstream socket");
+        }
+        return;
+    }
+
+    if (r->tag < 0 || r->tag >= resolve_bindings_count) {
+        return;
+    }
+    client_entry_t *entry = resolve_bindings[r->tag];
+    if (!entry || !entry->is_static) {
+        return;
+    }
+    if (r->adopt) {
+        adopt_static_binding(entry);
+        return;
+    }
+    if (entry->client_addr.sin_addr.s_addr == r->addr) {
+        return;
+    }
+
+    struct sockaddr_in new_addr = entry->client_addr;
+    new_addr.sin_addr.s_addr = r->addr;
+
+    int owner = reuseport_worker_for(&new_addr, workers_count);
+    if (owner != worker->index) {
+        // The datagrams from the new address arrive to another worker thread, hand the binding over
+        char old_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &entry->client_addr.sin_addr, old_ip, sizeof(old_ip));
+#ifdef USE_TC_OFFLOAD
+        if (offload_enabled) {
+            offload_remove_client(&offload, entry, forward_addr);
+        }
+#endif
+        unwatch_client(entry);
+        disconnect_client(entry);
+        wheel_del(&timers, &entry->timer);
+        if (send_batch) {
+            batch_drop_backlog(send_batch, entry->server_sock);
+        }
+        HASH_DEL(conn_table, entry);
+        entry->client_addr = new_addr;
+        __atomic_store_n(&resolve_bindings_worker[r->tag], owner, __ATOMIC_RELEASE);
+        resolve_result_t adopt = { .tag = r->tag, .adopt = 1 };
+        resolve_write_result(workers[owner].resolve_result_wr, &adopt);
+        log(LL_INFO, "Static binding '%s' address changed: %s -> %s", entry->bind_host, old_ip, inet_ntoa(new_addr.sin_addr));
+        return;
+    }
+
+    client_entry_t *collision = NULL;
+    HASH_FIND(hh, conn_table, &new_addr, sizeof(new_addr), collision);
+    if (collision && collision != entry) {
+        log(LL_WARN, "Static binding '%s' re-resolved to %s:%d, but that address is already in use",
+            entry->bind_host, inet_ntoa(new_addr.sin_addr), ntohs(new_addr.sin_port));
+        return;
+    }
+
+    char old_ip[INET_ADDRSTRLEN], new_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &entry->client_addr.sin_addr, old_ip, sizeof(old_ip));
+    inet_ntop(AF_INET, &new_addr.sin_addr, new_ip, sizeof(new_ip));
+
+#ifdef USE_AF_XDP
+    if (xdp_enabled) {
+        // Redirected again after the next handshake from the new address
+        xdp_remove_client(&xdp, &entry->client_addr);
+        entry->xdp_ready = 0;
+    }
+#endif
+#ifdef USE_TC_OFFLOAD
+    if (offload_enabled) {
+        offload_remove_client(&offload, entry, forward_addr);
+    }
+#endif
+    // Connected again after the next handshake from the new address
+    disconnect_client(entry);
+    HASH_DEL(conn_table, entry);
+    entry->client_addr.sin_addr.s_addr = r->addr;
+    HASH_ADD(hh, conn_table, client_addr, sizeof(entry->client_addr), entry);
+    log(LL_INFO, "Static binding '%s' address changed: %s -> %s", entry->bind_host, old_ip, new_ip);
+}
+
+/**
+ * @brief Reads every queued re-resolve result. Each write is atomic, so one
+ * read of sizeof(resolve_result_t) is one message.
+ */
+static void drain_resolve_results(struct sockaddr_in *forward_addr)
+{
+    resolve_result_t r;
+    while (1) {
+        ssize_t n = read(resolve_result_rd, &r, sizeof(r));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            serror_level(LL_WARN, "Failed to read hostname re-resolve result");
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n != (ssize_t)sizeof(r)) {
+            log(LL_WARN, "Short read from hostname resolver (%zd bytes)", n);
+            break;
+        }
+        apply_resolve_result(&r, forward_addr);
+    }
+}
+
+/**
+ * @brief Starts a thread with all the signals blocked, so they are always handled by the main thread.
+ *
+ * @param thread Filled with the thread handle.
+ * @param fn Thread function.
+ * @param arg Argument for the thread function.
+ * @return 0 on success, an error number otherwise.
+ */
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+/**
+ * @brief Closes the re-resolve pipes of all the worker threads.
+ */
+static void resolve_close_pipes(void)
+{
+    for (int i = 0; i < workers_count; i++) {
+        if (workers[i].resolve_result_rd >= 0) {
+            close(workers[i].resolve_result_rd);
+            close(workers[i].resolve_result_wr);
+        }
+        workers[i].resolve_result_rd = workers[i].resolve_result_wr = -1;
+    }
+}
+
+/**
+ * @brief Starts the resolver thread if there is at least one hostname to refresh.
+ * Must be called before the worker threads are started.
+ */
+static void resolve_start_thread(void)
+{
+    int wake[2];
+    pthread_t thread;
+
+    if (!resolve_target_is_name && resolve_bindings_count == 0) {
+        return;
+    }
+
+    if (pipe(wake) < 0) {
+        log(LL_WARN, "Can't create pipes for hostname re-resolve, periodic refresh disabled");
+        return;
+    }
+    for (int i = 0; i < workers_count; i++) {
+        int result[2];
+        if (pipe(result) < 0) {
+            log(LL_WARN, "Can't create pipes for hostname re-resolve, periodic refresh disabled");
+            close(wake[0]);
+            close(wake[1]);
+            resolve_close_pipes();
+            return;
+        }
+        workers[i].resolve_result_rd = result[0];
+        workers[i].resolve_result_wr = result[1];
+        fcntl(workers[i].resolve_result_rd, F_SETFL, O_NONBLOCK);
+    }
+    resolve_wake_rd = wake[0];
+    resolve_wake_wr = wake[1];
+
+    fcntl(resolve_wake_rd, F_SETFL, O_NONBLOCK);
+    fcntl(resolve_wake_wr, F_SETFL, O_NONBLOCK);
+
+    if (start_thread(&thread, resolve_thread_fn, NULL) != 0) {
+        log(LL_WARN, "Can't start hostname resolver thread, periodic refresh disabled");
+        close(resolve_wake_rd);
+        close(resolve_wake_wr);
+        resolve_close_pipes();
+        resolve_wake_rd = resolve_wake_wr = -1;
+        return;
+    }
+    pthread_detach(thread);
+
+    if (resolve_interval_ms > 0) {
+        log(LL_INFO, "Re-resolving hostnames every %ld seconds (and on SIGHUP)", resolve_interval_ms / 1000);
+    } else {
+        log(LL_INFO, "Re-resolving hostnames on SIGHUP");
+    }
+}
+
+/**
+ * @brief Remembers the PID of a forked instance.
+ *
+ * Called by the configuration parser for every additional section, so that the
+ * parent process can forward signals to all the instances.
+ *
+ * @param pid PID of the forked instance.
+ */
+void register_child_instance(pid_t pid)
+{
+    pid_t *new_pids = realloc(child_pids, (child_pids_count + 1) * sizeof(pid_t));
+    if (!new_pids) {
+        log(LL_WARN, "Out of memory, instance with PID %ld will not receive forwarded signals", (long)pid);
+        return;
+    }
+    child_pids = new_pids;
+    child_pids[child_pids_count++] = pid;
+}
+
+#ifdef SIGHUP
+/**
+ * @brief Handles SIGHUP: schedules reopening of the log file.
+ *
+ * The actual reopening is done by the main loop, the handler only sets a flag
+ * and forwards the signal to the instances of the other configuration sections.
+ *
+ * @param sig Signal number received by the process.
+ */
+static void sighup_handler(int sig)
+{
+    (void)sig;
+    log_reopen_pending = 1;
+    resolve_wake();
+    signal_wake();
+    // The list is filled before the handler is installed, so it can't change here
+    for (int i = 0; i < child_pids_count; i++) {
+        kill(child_pids[i], SIGHUP);
+    }
+}
+#endif
+
+#ifdef SIGUSR1
+/**
+ * @brief Handles SIGUSR1: schedules writing of the statistics to the log.
+ *
+ * @param sig Signal number received by the process.
+ */
+static void sigusr1_handler(int sig)
+{
+    (void)sig;
+    stats_dump_pending = 1;
+    signal_wake();
+    for (int i = 0; i < child_pids_count; i++) {
+        kill(child_pids[i], SIGUSR1);
+    }
+}
+#endif
+
+/**
+ * @brief Creates the socket of a dynamic client for the connection to the server.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry.
+ * @param forward_addr Address to forward to.
+ * @return 0 on success, -1 on error.
+ */
+static int open_server_socket(obfuscator_config_t *config, client_entry_t *client_entry, struct sockaddr_in *forward_addr)
+{
+    client_entry->server_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    // TODO: add client address to log
+    if (client_entry->server_sock < 0) {
+        serror("Failed to create server socket for client");
+        return -1;
+    }
+#ifdef __linux__
+    // Set "Don't Fragment" flag
+    int optval = 1;
+    if (setsockopt(client_entry->server_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        serror("Failed to set 'don't fragment' flag for client");
+        close(client_entry->server_sock);
+        return -1;
+    }
+    if (config->fwmark) {
+        if (setsockopt(client_entry->server_sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0) {
+            log(LL_WARN, "Failed to set 'firewall mark' for client: %s", strerror(errno));
+        }
+    }
+    if (config->udp_offload && batch_enable_gro(client_entry->server_sock) < 0) {
+        log(LL_WARN, "Failed to enable UDP GRO for client: %s", strerror(errno));
+    }
+    if (config->latency_mode && latency_enable_busy_poll(client_entry->server_sock, config->latency_mode) < 0) {
+        log(LL_DEBUG, "Failed to enable busy polling for client: %s", strerror(errno));
+    }
+#endif
+    if (setup_socket_buffers(config, client_entry->server_sock) < 0) {
+        log(LL_WARN, "Failed to set socket buffer sizes for client: %s", strerror(errno));
+    }
+    if (source_pool.count) {
+        // Otherwise connect() takes an ephemeral port of the default source address
+        client_entry->source_index = srcpool_bind(&source_pool, client_entry->server_sock);
+        if (client_entry->source_index < 0) {
+            // Running out of the ports is reported by the caller
+            int saved_errno = errno;
+            if (errno != EADDRINUSE) {
+                serror("Failed to bind server socket to the source pool");
+            }
+            close(client_entry->server_sock);
+            errno = saved_errno;
+            return -1;
+        }
+        stats.source_pool_bound++;
+    }
+    // Set the server address to the specified one
+    connect(client_entry->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr));
+    // Get the assigned port number
+    socklen_t our_addr_len = sizeof(client_entry->our_addr);
+    if (getsockname(client_entry->server_sock, (struct sockaddr *)&client_entry->our_addr, &our_addr_len) == -1) {
+        serror("Failed to get socket port number");
+        close(client_entry->server_sock);
+        if (client_entry->source_index >= 0) {
+            srcpool_release(&source_pool, client_entry->source_index);
+            stats.source_pool_released++;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Connects the server socket of the client to another port of the target range.
+ * The source port stays the same, so the server side keeps the client as it is.
+ *
+ * @param client_entry Client entry with its own server socket.
+ * @param port Port of the target range.
+ * @return 0 on success, -1 on error.
+ */
+static int set_target_port(client_entry_t *client_entry, uint16_t port)
+{
+    struct sockaddr_in target_addr = forward_addr;
+    target_addr.sin_port = htons(port);
+    if (connect(client_entry->server_sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) {
+        return -1;
+    }
+    client_entry->target_port = target_addr.sin_port;
+    return 0;
+}
+
+/**
+ * @brief Moves the client to another port of the target range, picked at random, and its
+ * server connection to a new source port with the next handshake from the client.
+ *
+ * @param client_entry Client entry with its own server socket.
+ * @param now Current time in milliseconds.
+ */
+static void hop_client(client_entry_t *client_entry, long now)
+{
+    uint16_t current = ntohs(client_target_addr(client_entry, &forward_addr).sin_port);
+    uint16_t port = target_port + (current - target_port + 1 + rand() % (target_ports - 1)) % target_ports;
+    if (set_target_port(client_entry, port) < 0) {
+        serror_level(LL_WARN, "Failed to move client %s:%d to target port %d",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), port);
+    } else {
+        log(LL_DEBUG, "Client %s:%d hops from target port %d to %d",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), current, port);
+        stats.port_hops++;
+    }
+    // The local port of a static binding is configured
+    client_entry->hop_source = !client_entry->is_static;
+    client_entry->hop_time = now;
+    client_entry->hop_window_start = now;
+    client_entry->hop_rx_bytes = 0;
+    client_entry->hop_tx_packets = 0;
+    // The throughput may differ on the new path
+    client_entry->hop_rx_avg = 0;
+}
+
+/**
+ * @brief Hops the client to another port of the target range when the hopping interval has passed,
+ * or when the throughput from the server has dropped while the client kept sending. The throughput
+ * is measured over HOP_WINDOW and compared to its moving average.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry with its own server socket.
+ * @param now Current time in milliseconds.
+ */
+static void check_port_hop(obfuscator_config_t *config, client_entry_t *client_entry, long now)
+{
+    if (!client_entry->hop_time) {
+        client_entry->hop_time = now;
+        client_entry->hop_window_start = now;
+        return;
+    }
+    if (config->port_hopping && now - client_entry->hop_time >= config->port_hopping * 1000L) {
+        hop_client(client_entry, now);
+        return;
+    }
+    long elapsed = now - client_entry->hop_window_start;
+    if (!config->hop_on_drop || elapsed < HOP_WINDOW) {
+        return;
+    }
+    uint64_t rate = client_entry->hop_rx_bytes * 1000 / (uint64_t)elapsed;
+    uint64_t avg = client_entry->hop_rx_avg;
+    uint8_t active = client_entry->hop_tx_packets > 0;
+    client_entry->hop_window_start = now;
+    client_entry->hop_rx_bytes = 0;
+    client_entry->hop_tx_packets = 0;
+    if (!active) {
+        // Nothing was asked for, so nothing was missing
+        return;
+    }
+    if (avg >= HOP_DROP_MIN_RATE && rate * 100 < avg * (uint64_t)(100 - config->hop_on_drop)) {
+        log(LL_DEBUG, "Throughput from the server of client %s:%d has dropped to %" PRIu64 " bytes/s from %" PRIu64 " on average",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), rate, avg);
+        stats.port_hops_drop++;
+        hop_client(client_entry, now);
+        return;
+    }
+    // Moving average over about 8 windows
+    client_entry->hop_rx_avg = avg ? avg - avg / 8 + rate / 8 : rate;
+}
+
+/**
+ * @brief Moves the server connection of the client to a new source port. The server side sees
+ * it as a new client, so it is done with a handshake from the client, which sets it up there.
+ * Both sockets are watched until the timer of the client closes the old one, HOP_RETIRE_DELAY later.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Dynamic client entry with its own server socket.
+ * @param now Current time in milliseconds.
+ */
+static void hop_source_port(obfuscator_config_t *config, client_entry_t *client_entry, long now)
+{
+    if (client_entry->retired_sock >= 0) {
+        // The last hop is not over yet, the next handshake hops
+        return;
+    }
+    client_entry->hop_source = 0;
+    int sock = client_entry->server_sock;
+    int source_index = client_entry->source_index;
+    struct sockaddr_in our_addr = client_entry->our_addr;
+    struct sockaddr_in target_addr = client_target_addr(client_entry, &forward_addr);
+    client_entry->source_index = -1;
+    if (open_server_socket(config, client_entry, &target_addr) != 0) {
+        log(LL_WARN, "Failed to move client %s:%d to a new source port",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        client_entry->server_sock = sock;
+        client_entry->source_index = source_index;
+        client_entry->our_addr = our_addr;
+        return;
+    }
+    log(LL_DEBUG, "Client %s:%d hops from source port %d to %d",
+        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+        ntohs(our_addr.sin_port), ntohs(client_entry->our_addr.sin_port));
+    client_entry->retired_sock = sock;
+    client_entry->retired_source_index = source_index;
+    client_entry->retire_time = now + HOP_RETIRE_DELAY;
+    client_entry->server_drops_seen = 0;
+    if (watch_hop(client_entry) != 0) {
+        serror("Failed to watch client socket");
+    }
+    stats.source_hops++;
+    wheel_add(&timers, &client_entry->timer, 0);
+}
+
+/**
+ * @brief Allocates a client entry with the connection to the server ready and watched,
+ * the client address is not set yet.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param forward_addr Address to forward to.
+ * @return Pointer to the new entry, NULL on error (errno is EADDRINUSE if the source pool is taken).
+ */
+static client_entry_t * open_client_entry(obfuscator_config_t *config, struct sockaddr_in *forward_addr)
+{
+    client_entry_t * client_entry = malloc(sizeof(client_entry_t));
+    if (!client_entry) {
+        log(LL_ERROR, "Failed to allocate memory for client entry");
+        return NULL;
+    }
+    memset(client_entry, 0, sizeof(client_entry_t));
+    client_entry->client_sock = -1;
+    client_entry->source_index = -1;
+    client_entry->retired_sock = -1;
+    client_entry->retired_source_index = -1;
+    client_entry->retired_poll_index = -1;
+    if (raw_upstream) {
+        // Only a source port, the datagrams go through the raw socket of the worker
+        uint16_t port = rawudp_alloc_port(raw_upstream, client_entry);
+        if (!port) {
+            log(LL_ERROR, "All the raw upstream ports are taken, cannot add new client");
+            free(client_entry);
+            return NULL;
+        }
+        client_entry->raw_upstream = 1;
+        client_entry->server_sock = -1;
+        client_entry->our_addr.sin_family = AF_INET;
+        client_entry->our_addr.sin_port = htons(port);
+    } else if (open_server_socket(config, client_entry, forward_addr) != 0) {
+        int saved_errno = errno;
+        free(client_entry);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (watch_client(client_entry) != 0) {
+        serror("Failed to watch client socket");
+        close(client_entry->server_sock);
+        if (client_entry->source_index >= 0) {
+            srcpool_release(&source_pool, client_entry->source_index);
+            stats.source_pool_released++;
+        }
+        free(client_entry);
+        return NULL;
+    }
+    return client_entry;
+}
+
+/**
+ * @brief Takes a spare entry from the socket pool of the worker thread.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @return Entry with the server socket ready, NULL if the pool is empty or not used.
+ */
+static client_entry_t * take_spare_entry(obfuscator_config_t *config)
+{
+    if (!config->socket_pool) {
+        return NULL;
+    }
+    if (!spare_count) {
+        stats.socket_pool_misses++;
+        return NULL;
+    }
+    stats.socket_pool_hits++;
+    client_entry_t *client_entry = spare_entries[--spare_count];
+    client_entry->spare = 0;
+    return client_entry;
+}
+
+/**
+ * @brief Opens spare server sockets for the socket pool of the worker thread, a few per call,
+ * so a burst of new clients is not held up by the refill. After a failure it waits for a while.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param now Current time in milliseconds.
+ * @return 1 if the pool is still not full and the next call should come right away, 0 otherwise.
+ */
+static int refill_spare_entries(obfuscator_config_t *config, long now)
+{
+    static _Thread_local long retry_at = 0;
+    if (spare_count >= config->socket_pool || now < retry_at) {
+        return 0;
+    }
+    for (int i = 0; i < SOCKET_POOL_REFILL && spare_count < config->socket_pool; i++) {
+        client_entry_t *client_entry = open_client_entry(config, &forward_addr);
+        if (!client_entry) {
+            log(LL_DEBUG, "Failed to open a spare server socket: %s", strerror(errno));
+            retry_at = now + SOCKET_POOL_RETRY;
+            return 0;
+        }
+        client_entry->spare = 1;
+        spare_entries[spare_count++] = client_entry;
+    }
+    return spare_count < config->socket_pool;
+}
+
+/**
+ * @brief Creates a new client_entry_t structure and initializes it with the provided client and forward addresses.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_addr Pointer to a struct sockaddr_in representing the client's address.
+ * @param forward_addr Pointer to a struct sockaddr_in representing the address to which traffic should be forwarded.
+ * @return Pointer to the newly created client_entry_t structure, or NULL on failure.
+ */
+static client_entry_t * new_client_entry(obfuscator_config_t *config, struct sockaddr_in *client_addr, struct sockaddr_in *forward_addr) {
+    // The limit is shared by all the worker threads, they may overshoot it by a client or two at the same moment
+    if (__atomic_load_n(&clients_total, __ATOMIC_RELAXED) >= config->max_clients) {
+        log(LL_ERROR, "Maximum number of clients reached (%d), cannot add new client", config->max_clients);
+        return NULL;
+    }
+    // The socket pool saves the socket setup on the way of the handshake
+    client_entry_t * client_entry = take_spare_entry(config);
+    if (!client_entry) {
+        client_entry = open_client_entry(config, forward_addr);
+        if (!client_entry) {
+            if (errno == EADDRINUSE && source_pool.count) {
+                stats.source_pool_exhausted++;
+                log(LL_ERROR, "All the ports of the source pool are taken, cannot add new client");
+            }
+            return NULL;
+        }
+    }
+    // Set default version (latest)
+    client_entry->version = OBFUSCATION_VERSION;
+    // Set the client address
+    memcpy(&client_entry->client_addr, client_addr, sizeof(client_entry->client_addr));
+    if (target_ports > 1 && !client_entry->raw_upstream && set_target_port(client_entry, target_port + rand() % target_ports) < 0) {
+        // Spread over the ports of the target range, or left on the first one
+        serror_level(LL_WARN, "Failed to connect client %s:%d to its target port",
+            inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+    }
+
+    HASH_ADD(hh, conn_table, client_addr, sizeof(*client_addr), client_entry);
+    __atomic_add_fetch(&clients_total, 1, __ATOMIC_RELAXED);
+    // The timeouts are checked on the next pass, then the timer follows them
+    wheel_add(&timers, &client_entry->timer, 0);
+
+    log(LL_DEBUG, "Added binding: %s:%d:%d", 
+        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+        ntohs(client_entry->our_addr.sin_port));
+
+    return client_entry;
+}
+
+/**
+ * @brief Creates a new static client entry.
+ *
+ * This function allocates and initializes a new client_entry_t structure
+ * using the provided client and forward addresses, as well as the specified local port.
+ *
+ * The entry is not watched yet, the worker thread owning it does that when it starts.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param table Client table of the worker thread which receives the datagrams of this client.
+ * @param client_addr Pointer to a sockaddr_in structure representing the client's address.
+ * @param forward_addr Pointer to a sockaddr_in structure representing the address to forward to.
+ * @param local_port The local port number to connect to the server.
+ * @param bind_host Original hostname from the configuration, stored if it is not an IPv4 literal.
+ * @return Pointer to the newly created client_entry_t structure, or NULL on failure.
+ */
+static client_entry_t * new_client_entry_static(obfuscator_config_t *config, client_entry_t **table, struct sockaddr_in *client_addr, struct sockaddr_in *forward_addr, uint16_t local_port, const char *bind_host) {
+    if (clients_total >= config->max_clients) {
+        log(LL_ERROR, "Maximum number of clients reached (%d), cannot add new client", config->max_clients);
+        return NULL;
+    }
+
+    // Check if such client already exists
+    client_entry_t *existing_entry;
+    HASH_FIND(hh, *table, client_addr, sizeof(*client_addr), existing_entry);
+    if (existing_entry) {
+        log(LL_ERROR, "Binding with client %s:%d already exists", 
+            inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+        return NULL;
+    }
+
+    client_entry_t * client_entry = malloc(sizeof(client_entry_t));
+    if (!client_entry) {
+        log(LL_ERROR, "Failed to allocate memory for client entry");
+        return NULL;
+    }
+    memset(client_entry, 0, sizeof(client_entry_t));
+    client_entry->client_sock = -1;
+    client_entry->source_index = -1;
+    client_entry->retired_sock = -1;
+    client_entry->retired_source_index = -1;
+    // Set default version (latest)
+    client_entry->version = OBFUSCATION_VERSION;
+    // default masking type
+    client_entry->masking_handler = config->masking_handler;
+    // Set the client address
+    memcpy(&client_entry->client_addr, client_addr, sizeof(client_entry->client_addr));
     // Create a socket for the server connection
     client_entry->server_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    // TODO: add client address to log
     if (client_entry->server_sock < 0) {
         serror("Failed to create server socket for client");
         free(client_entry);
         return NULL;
     }
-#ifdef __linux__
-    // Set "Don't Fragment" flag
-    int optval = 1;
-    if (setsockopt(client_entry->server_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
-        serror("Failed to set 'don't fragment' flag for client");
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    // Bind the socket to the specified local port
+    client_entry->our_addr.sin_family = AF_INET;
+    // TODO: ability to bind to a specific address
+    client_entry->our_addr.sin_addr.s_addr = INADDR_ANY;
+    client_entry->our_addr.sin_port = htons(local_port);
+    // Set the local port number
+    if (bind(client_entry->server_sock, (struct sockaddr *)&client_entry->our_addr, sizeof(client_entry->our_addr)) < 0) {
+        serror("Failed to bind server socket to %s:%d", 
+            inet_ntoa(client_entry->our_addr.sin_addr), local_port);
+        close(client_entry->server_sock);
+        free(client_entry);
+        return NULL;
+    }
+#ifdef __linux__
+    // Set "Don't Fragment" flag
+    int optval = 1;
+    if (setsockopt(client_entry->server_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        serror("Failed to set 'don't fragment' flag for client %s:%d", 
+            inet_ntoa(client_entry->client_addr.sin_addr), local_port);
+        close(client_entry->server_sock);
+        free(client_entry);
+        return NULL;
+    }
+    if (config->fwmark) {
+        if (setsockopt(client_entry->server_sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0) {
+            log(LL_WARN, "Failed to set 'firewall mark' for client %s:%d: %s",
+                inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), strerror(errno));
+        }
+    }
+    if (config->udp_offload && batch_enable_gro(client_entry->server_sock) < 0) {
+        log(LL_WARN, "Failed to enable UDP GRO for client %s:%d: %s",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), strerror(errno));
+    }
+    if (config->latency_mode && latency_enable_busy_poll(client_entry->server_sock, config->latency_mode) < 0) {
+        log(LL_DEBUG, "Failed to enable busy polling for client %s:%d: %s",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), strerror(errno));
+    }
+
+#endif
+    if (setup_socket_buffers(config, client_entry->server_sock) < 0) {
+        log(LL_WARN, "Failed to set socket buffer sizes for client %s:%d: %s",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), strerror(errno));
+    }
+    // Set the server address to the specified one
+    connect(client_entry->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr));
+
+    client_entry->is_static = 1;
+    if (bind_host && !is_ipv4_literal(bind_host)) {
+        strncpy(client_entry->bind_host, bind_host, sizeof(client_entry->bind_host) - 1);
+    }
+
+    HASH_ADD(hh, *table, client_addr, sizeof(*client_addr), client_entry);
+    clients_total++;
+
+    return client_entry;
+}
+
+/**
+ * @brief Starts redirecting the datagrams of a handshaked client to the AF_XDP sockets,
+ * if the fast path is enabled. Called on every handshake, the map update is idempotent.
+ *
+ * @param client_entry Client entry.
+ */
+static void xdp_redirect_client(client_entry_t *client_entry)
+{
+#ifdef USE_AF_XDP
+    if (xdp_enabled && xdp_add_client(&xdp, &client_entry->client_addr) < 0) {
+        serror_level(LL_DEBUG, "Failed to redirect client %s:%d to AF_XDP",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+    }
+#else
+    (void)client_entry;
+#endif
+}
+
+/**
+ * @brief Hands the data packets of a handshaked client over to the TC offload program,
+ * if it is enabled. Called on every handshake, after the obfuscation of both sides is known.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry.
+ */
+static void offload_client(obfuscator_config_t *config, client_entry_t *client_entry)
+{
+#ifdef USE_TC_OFFLOAD
+    if (offload_enabled && offload_add_client(&offload, config, client_entry, &forward_addr) < 0) {
+        serror_level(LL_DEBUG, "Client %s:%d is not offloaded",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+    } else if (offload_enabled) {
+        // From now on the timer polls the program for the activity
+        wheel_add(&timers, &client_entry->timer, 0);
+    }
+#else
+    (void)config;
+    (void)client_entry;
+#endif
+}
+
+/**
+ * @brief Gives a handshaked client its own socket, bound to the address and port of the listening
+ * socket and connected to the client, if enabled. The kernel hands the datagrams of the client
+ * to it instead of the listening socket, and looks the route to the client up only once.
+ * Called on every handshake, the socket is created only once.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry.
+ */
+static void connect_client(obfuscator_config_t *config, client_entry_t *client_entry)
+{
+#ifdef __linux__
+    if (!config->connected_clients || client_entry->client_sock >= 0) {
+        return;
+    }
+    struct sockaddr_in local_addr;
+    socklen_t local_addr_len = sizeof(local_addr);
+    if (getsockname(client_listen_sock(client_entry), (struct sockaddr *)&local_addr, &local_addr_len) < 0) {
+        serror_level(LL_WARN, "Failed to get listening socket address");
+        return;
+    }
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        serror_level(LL_WARN, "Failed to create socket for client %s:%d",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        return;
+    }
+    int optval = 1;
+    // Same options as the listening socket, the datagrams of the client go out through this one now
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0
+        || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0
+        || (config->fwmark && setsockopt(sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0)
+        || bind(sock, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0
+        || connect(sock, (struct sockaddr *)&client_entry->client_addr, sizeof(client_entry->client_addr)) < 0) {
+        serror_level(LL_WARN, "Failed to connect socket to client %s:%d",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        close(sock);
+        return;
+    }
+    if (config->udp_offload && batch_enable_gro(sock) < 0) {
+        log(LL_WARN, "Failed to enable UDP GRO for client: %s", strerror(errno));
+    }
+    if (config->latency_mode && latency_enable_busy_poll(sock, config->latency_mode) < 0) {
+        log(LL_DEBUG, "Failed to enable busy polling for client: %s", strerror(errno));
+    }
+    if (setup_socket_buffers(config, sock) < 0) {
+        log(LL_WARN, "Failed to set socket buffer sizes for client: %s", strerror(errno));
+    }
+    client_entry->client_sock = sock;
+    client_entry->client_drops_seen = 0;
+    if (watch_client_sock(client_entry) != 0) {
+        serror_level(LL_WARN, "Failed to watch socket of client %s:%d",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        close(sock);
+        client_entry->client_sock = -1;
+        return;
+    }
+    log(LL_DEBUG, "Connected socket to client %s:%d",
+        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+#else
+    (void)config;
+    (void)client_entry;
+#endif
+}
+
+/**
+ * @brief Sends a datagram to the server right away, used by the masking handlers.
+ *
+ * @param client_entry Client entry, may be NULL if there is none yet.
+ * @param buffer Data to send.
+ * @param length Length of the data.
+ * @return Number of bytes sent, -1 on error (errno is set).
+ */
+ssize_t send_to_server(client_entry_t *client_entry, uint8_t *buffer, int length)
+{
+    if (!client_entry) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (client_entry->raw_upstream) {
+        return rawudp_send(raw_upstream, buffer, length, ntohs(client_entry->our_addr.sin_port));
+    }
+    return send(client_entry->server_sock, buffer, length, 0);
+}
+
+/**
+ * @brief Reads the path MTU the kernel knows for the connected sockets of a client (IP_MTU),
+ * at most every PATH_MTU_INTERVAL milliseconds. The paths through the listening socket and
+ * the raw upstream socket learn it only from the ICMP errors (--icmp-errors).
+ *
+ * @param client_entry Client entry.
+ * @param now Current time in milliseconds.
+ */
+static void update_path_mtu(client_entry_t *client_entry, long now)
+{
+#ifdef IP_MTU
+    if (now - client_entry->path_mtu_time < PATH_MTU_INTERVAL) {
+        return;
+    }
+    client_entry->path_mtu_time = now;
+    int socks[2];
+    socks[DIR_CLIENT_TO_SERVER] = client_entry->raw_upstream ? -1 : client_entry->server_sock;
+    socks[DIR_SERVER_TO_CLIENT] = client_entry->client_sock;
+    for (int direction = 0; direction < 2; direction++) {
+        int mtu;
+        socklen_t mtu_len = sizeof(mtu);
+        if (socks[direction] < 0 || getsockopt(socks[direction], IPPROTO_IP, IP_MTU, &mtu, &mtu_len) < 0 || mtu <= 0) {
+            continue;
+        }
+        if (mtu > UINT16_MAX) {
+            mtu = UINT16_MAX;
+        }
+        if (client_entry->path_mtu[direction] && client_entry->path_mtu[direction] != mtu) {
+            log(LL_INFO, "Path MTU towards the %s %s:%d is %d", direction == DIR_CLIENT_TO_SERVER ? "server of client" : "client",
+                inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), mtu);
+        }
+        client_entry->path_mtu[direction] = mtu;
+    }
+#else
+    (void)client_entry;
+    (void)now;
+#endif
+}
+
+/**
+ * @brief Encodes a datagram for the given client. The dummy data is cut down so that
+ * the datagram, with the masking overhead, still fits the path MTU if it is known.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry the datagram belongs to.
+ * @param direction Direction the datagram goes in.
+ * @param buffer Pointer to the data, there must be room for the dummy data after it.
+ * @param length Length of the data.
+ * @param dummy_length Length of dummy data for data packets, -1 to pick a random one.
+ * @param now Current time in milliseconds.
+ * @return Length of the encoded data.
+ */
+static int encode_packet(obfuscator_config_t *config, client_entry_t *client_entry, direction_t direction,
+                         uint8_t *buffer, int length, int dummy_length, long now)
+{
+    if (client_entry->version < 1 || length >= MAX_DUMMY_LENGTH_TOTAL) {
+        // No dummy data in these
+        dummy_length = 0;
+    } else if (dummy_length < 0 || WG_TYPE(buffer) != WG_TYPE_DATA) {
+        dummy_length = dummy_length_for(WG_TYPE(buffer), length, config->max_dummy_length_data);
+    }
+
+    update_path_mtu(client_entry, now);
+    int overhead = masking_wrap_overhead(client_entry);
+    int mtu = client_entry->path_mtu[direction];
+    if (mtu && dummy_length > 0) {
+        int room = mtu - IP_UDP_HEADERS_SIZE - overhead - length;
+        if (dummy_length > room) {
+            dummy_length = room > 0 ? room : 0;
+            stats.mtu_padding_clamped++;
+        }
+    }
+    int sent_length = IP_UDP_HEADERS_SIZE + overhead + length + dummy_length;
+    client_entry->sent_length[direction] = sent_length > UINT16_MAX ? UINT16_MAX : sent_length;
+    client_entry->sent_padding[direction] = overhead + dummy_length;
+
+    return encode_with_dummy(buffer, length, config->xor_key, key_length, client_entry->version, dummy_length);
+}
+
+/**
+ * @brief Handles one datagram received from a client on the listening socket.
+ *
+ * Decodes or encodes the datagram, updates the state of the client entry and queues
+ * the result to be sent to the server.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Batch to queue the result into.
+ * @param sock Listening socket or socket connected to the client the datagram was received on.
+ * @param buffer Pointer to the received data, PREBUFFER_SIZE bytes of headroom are available before it.
+ * @param length Length of the received data.
+ * @param sender_addr Address of the client.
+ * @param now Current time in milliseconds.
+ * @param dummy_length Length of dummy data for data packets, -1 to pick a random one for every packet.
+ */
+static void handle_client_packet(obfuscator_config_t *config, packet_batch_t *batch, int sock,
+    uint8_t *buffer, int length, struct sockaddr_in *sender_addr, long now, int dummy_length)
+{
+    // Pipeline mode: forget the XOR left over from a packet which was dropped
+    xor_data_take_deferred(NULL);
+    // And the latency histogram of one
+    batch->latency_histogram = -1;
+    if (length > BUFFER_SIZE) {
+        log(LL_DEBUG, "Received packet from %s:%d is too large (%d bytes), while buffer size is %d bytes, ignoring",
+            inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port), length, BUFFER_SIZE);
+        return;
+    }
+
+    // Find the client entry if any
+    client_entry_t *client_entry;
+    HASH_FIND(hh, conn_table, sender_addr, sizeof(*sender_addr), client_entry);
+
+    // The datagrams of the client go back through the listening socket it sends to
+    if (listen_sock_index(sock) < 0) {
+        // Connected to the client
+        sock = client_listen_sock(client_entry);
+    }
+
+    uint8_t obfuscated = length >= 4 && is_obfuscated(buffer);
+    // Is it masked packet maybe?
+    masking_handler_t *masking_handler = config->masking_handler;
+    if (obfuscated) {
+        length = masking_unwrap_from_client(&buffer, length, config, client_entry, sock, sender_addr, &forward_addr, &masking_handler);
+        if (length <= 0) {
+            // Nothing to do
+            return;
+        }
+    }
+    // Check the length
+    if (length < 4) {
+        log(LL_DEBUG, "Received too short packet from %s:%d (%d bytes), ignoring", inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port), length);
+        return;
+    }
+
+    uint8_t version = client_entry ? client_entry->version : OBFUSCATION_VERSION;
+
+    if (verbose >= LL_TRACE) {
+        log(LL_TRACE, "Received %d bytes from %s:%d to %s:%d (known=%s, obfuscated=%s)",
+            length,
+            inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port),
+            target_host, target_port,
+            client_entry ? "yes" : "no", obfuscated ? "yes" : "no");
+        log_hexdump(LL_TRACE, obfuscated ? "X->: " : "O->: ", buffer, length);
+    }
+
+    if (obfuscated) {
+        // decode
+        int original_length = length;
+        length = decode(buffer, length, config->xor_key, key_length, &version);
+        if (length < 4 || length > original_length) {
+            log(LL_DEBUG, "Failed to decode packet from %s:%d (original_length=%d, decoded_length=%d)",
+                inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port), original_length, length);
+            return;
+        }
+    }
+
+    // Is it handshake?
+    if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE) {
+        log(LL_DEBUG, "Received WireGuard handshake from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
+            inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port),
+            target_host, target_port,
+            length, 
+            obfuscated ? "yes" : "no");
+
+        if (!client_entry) {
+            client_entry = new_client_entry(config, sender_addr, &forward_addr);
+            if (!client_entry) {
+                return;
+            }
+            client_entry->last_activity_time = now;
+            client_entry->last_incoming_time = 0;
+            client_entry->masking_handler = masking_handler;
+            client_entry->listen_sock = sock;
+        } else if (client_entry->hop_source) {
+            // A new source port is a new client for the server side, the handshake sets it up there
+            hop_source_port(config, client_entry, now);
+        }
+        if (config->allow_clean) {
+            // Remember whether this client speaks plain WireGuard,
+            // its traffic will be forwarded as is in both directions
+            if (!obfuscated && !client_entry->client_clean) {
+                log(LL_INFO, "Client %s:%d is not obfuscated, forwarding its traffic as is",
+                    inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port));
+            }
+            client_entry->client_clean = !obfuscated;
+            if (client_entry->client_clean) {
+                // No masking for clean clients
+                client_entry->masking_handler = NULL;
+            }
+        }
+        if (!obfuscated && !client_entry->client_clean) {
+            masking_on_handshake_req_from_client(config, client_entry, sock, sender_addr, &forward_addr);
+        }
+        client_entry->handshake_direction = DIR_CLIENT_TO_SERVER;
+        client_entry->last_handshake_request_time = now;
+    }
+    // Is it handshake response?
+    else if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE_RESP) {
+        if (!client_entry) {
+            log(LL_DEBUG, "Received WireGuard handshake response from %s:%d, but no connection entry found for this client",
+                inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port));
+            return;
+        }
+
+        log(LL_DEBUG, "Received WireGuard handshake response from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+            target_host, target_port,
+            length, obfuscated ? "yes" : "no");
+
+        // Check handshake timeout
+        if (now - client_entry->last_handshake_request_time > HANDSHAKE_TIMEOUT) {
+            log(LL_DEBUG, "Ignoring WireGuard handshake response, handshake timeout");
+            return;
+        }
+
+        if (client_entry->handshake_direction != DIR_SERVER_TO_CLIENT) {
+            log(LL_DEBUG, "Received handshake response from %s:%d to %s:%d, but the handshake direction is not set to server-to-client",
+                inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port),
+                target_host, target_port);
+            return;
+        }
+
+        log(!client_entry->handshaked ? LL_INFO : LL_DEBUG, "Handshake established with %s:%d to %s:%d (reverse)",
+            inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port),
+            target_host, target_port);
+        client_entry->handshaked = 1;
+        xdp_redirect_client(client_entry);
+        connect_client(config, client_entry);
+        client_entry->client_obfuscated = obfuscated;
+        client_entry->server_obfuscated = !obfuscated;
+        client_entry->last_handshake_time = now;
+        offload_client(config, client_entry);
+    }
+    // If it's not a handshake or handshake response, connection is not established yet
+    else if (!client_entry || !client_entry->handshaked) {
+        log(LL_DEBUG, "Ignoring data (packet type #%u) from %s:%d to %s:%d until the handshake is completed",
+            WG_TYPE(buffer),
+            inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port),
+            target_host, target_port);
+        return;
+    }
+
+    // Only a datagram which has passed the checks may move the client to another port of the range
+    if (sock != client_listen_sock(client_entry)) {
+        client_entry->listen_sock = sock;
+        if (client_entry->client_sock >= 0) {
+            client_entry->listen_moved = 1;
+            wheel_add(&timers, &client_entry->timer, 0);
+        }
+    }
+
+    // Version downgrade check
+    if (version < client_entry->version) {
+        log(LL_WARN, "Client %s:%d uses old obfuscation version, downgrading from %d to %d", inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port), 
+            client_entry->version, version);
+        client_entry->version = version;
+    }
+
+    classify_latency(config, batch, client_entry, DIR_CLIENT_TO_SERVER, buffer);
+    if (!obfuscated && !client_entry->client_clean) {
+        // If the packet is not obfuscated, we need to encode it
+        length = encode_packet(config, client_entry, DIR_CLIENT_TO_SERVER, buffer, length, dummy_length, now);
+        if (length < 4) {
+            log(LL_ERROR, "Failed to encode packet from %s:%d (too short, length=%d)",
+                inet_ntoa(sender_addr->sin_addr), ntohs(sender_addr->sin_port), length);
+            return;
+        }
+        length = masking_data_wrap_to_server(&buffer, length, config, client_entry, sock, &forward_addr);
+    }
+
+    log_hexdump(LL_TRACE, (!obfuscated && !client_entry->client_clean) ? "X->: " : "O->: ", buffer, length);
+
+    if (pace_datagram(config, batch, client_entry, DIR_CLIENT_TO_SERVER, length) < 0) {
+        return;
+    }
+    mark_tos(config, batch, DIR_CLIENT_TO_SERVER);
+    if (client_entry->raw_upstream) {
+        buffer = rawudp_wrap(raw_upstream, buffer, &length, ntohs(client_entry->our_addr.sin_port));
+        batch_queue(batch, raw_upstream->sock, buffer, length, &raw_upstream->target, NULL);
+    } else {
+        batch_queue(batch, client_entry->server_sock, buffer, length, NULL, client_entry);
+    }
+    client_entry->last_activity_time = now;
+    client_entry->hop_tx_packets++;
+}
+
+/**
+ * @brief Handles one datagram received from the server on a client's socket.
+ *
+ * Decodes or encodes the datagram, updates the state of the client entry and queues
+ * the result to be sent back to the client.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Batch to queue the result into.
+ * @param client_entry Client entry the socket belongs to.
+ * @param buffer Pointer to the received data, PREBUFFER_SIZE bytes of headroom are available before it.
+ * @param length Length of the received data.
+ * @param now Current time in milliseconds.
+ * @param dummy_length Length of dummy data for data packets, -1 to pick a random one for every packet.
+ */
+static void handle_server_packet(obfuscator_config_t *config, packet_batch_t *batch,
+    client_entry_t *client_entry, uint8_t *buffer, int length, long now, int dummy_length)
+{
+    // Pipeline mode: forget the XOR left over from a packet which was dropped
+    xor_data_take_deferred(NULL);
+    // And the latency histogram of one
+    batch->latency_histogram = -1;
+    if (client_entry->spare) {
+        // No client owns the socket yet, nothing is expected on it
+        return;
+    }
+    if (length > BUFFER_SIZE) {
+        log(LL_DEBUG, "Received packet from %s:%d is too large (%d bytes), while buffer size is %d bytes, ignoring",
+            target_host, target_port, length, BUFFER_SIZE);
+        return;
     }
-    if (config->fwmark) {
-        if (setsockopt(client_entry->server_sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0) {
-            log(LL_WARN, "Failed to set 'firewall mark' for client: %s", strerror(errno));
+    uint8_t obfuscated = length >= 4 && is_obfuscated(buffer);
+    if (obfuscated) {
+        // Is it masked packet maybe?
+        length = masking_unwrap_from_server(&buffer, length, config, client_entry, client_listen_sock(client_entry), &forward_addr);
+        if (length <= 0) {
+            // Nothing to do
+            return;
         }
     }
-#endif
-    // Set the server address to the specified one
-    connect(client_entry->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr));
-    // Get the assigned port number
-    socklen_t our_addr_len = sizeof(client_entry->our_addr);
-    if (getsockname(client_entry->server_sock, (struct sockaddr *)&client_entry->our_addr, &our_addr_len) == -1) {
-        serror("Failed to get socket port number");
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    // Check the length
+    if (length < 4) {
+        log(LL_DEBUG, "Received too short packet from %s:%d (%d bytes), ignoring", target_host, target_port, length);
+        return;
     }
 
-#ifdef USE_EPOLL    
-    struct epoll_event e = {
-        .events = EPOLLIN,
-        .data.ptr = client_entry
-    };
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_entry->server_sock, &e) != 0) {
-        serror("epoll_ctl for client socket");
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    uint8_t version = client_entry->version;
+
+    if (verbose >= LL_TRACE) {
+        log(LL_TRACE, "Received %d bytes from %s:%d to %s:%d (obfuscated=%s)",
+            length,
+            target_host, target_port, 
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+            obfuscated ? "yes" : "no");
+        log_hexdump(LL_TRACE, obfuscated ? "<-X: " : "<-O: ", buffer, length);
     }
-#endif
 
-    HASH_ADD(hh, conn_table, client_addr, sizeof(*client_addr), client_entry);
+    if (obfuscated) {
+        // decode
+        int original_length = length;
+        length = decode(buffer, length, config->xor_key, key_length, &version);
+        if (length < 4 || length > original_length) {
+            log(LL_DEBUG, "Failed to decode packet from %s:%d (original_length=%d, decoded_length=%d)", target_host, target_port, original_length, length);
+            return;
+        }
+    }
 
-    log(LL_DEBUG, "Added binding: %s:%d:%d", 
-        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-        ntohs(client_entry->our_addr.sin_port));
+    // Is it handshake?
+    if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE) {
+        log(LL_DEBUG, "Received WireGuard handshake from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
+            target_host, target_port,
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+            length, 
+            obfuscated ? "yes" : "no");
+        if (!obfuscated && !client_entry->client_clean) {
+            // Send STUN binding request before the obfuscated handshake
+            masking_on_handshake_req_from_server(config, client_entry, client_listen_sock(client_entry), &client_entry->client_addr, &forward_addr);
+        }
+        client_entry->handshake_direction = DIR_SERVER_TO_CLIENT;
+        client_entry->last_handshake_request_time = now;
+    }
+    // Is it handshake response?
+    else if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE_RESP) {
+        log(LL_DEBUG, "Received WireGuard handshake response from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
+            target_host, target_port,
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+            length, obfuscated ? "yes" : "no");
+
+        // Check handshake timeout
+        if (now - client_entry->last_handshake_request_time > HANDSHAKE_TIMEOUT) {
+            log(LL_DEBUG, "Ignoring WireGuard handshake response, handshake timeout");
+            return;
+        }
 
-    return client_entry;
+        if (client_entry->handshake_direction != DIR_CLIENT_TO_SERVER) {
+            log(LL_DEBUG, "Received handshake response from %s:%d to %s:%d, but the handshake direction is not set to client-to-server",
+                target_host, target_port,
+                inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+            return;
+        }
+
+        log(!client_entry->handshaked ? LL_INFO : LL_DEBUG, "Handshake established with %s:%d to %s:%d (direct)",
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
+            target_host, target_port);
+        if (!client_entry->handshaked && client_entry->masking_handler && !config->masking_handler_set) {
+            log(LL_INFO, "Autodetected masking handler for client %s:%d: %s", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), client_entry->masking_handler->name);
+        }
+        client_entry->handshaked = 1;
+        xdp_redirect_client(client_entry);
+        connect_client(config, client_entry);
+        client_entry->client_obfuscated = !obfuscated && !client_entry->client_clean;
+        client_entry->server_obfuscated = obfuscated;
+        client_entry->last_handshake_time = now;
+        offload_client(config, client_entry);
+    }
+    // If it's not a handshake or handshake response, connection is not established yet
+    else if (!client_entry->handshaked) {
+        log(LL_DEBUG, "Ignoring response (packet type #%u) from %s:%d to %s:%d until the handshake is completed",
+            WG_TYPE(buffer),
+            target_host, target_port,
+            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        return;
+    }
+
+    // Version downgrade check
+    if (version < client_entry->version) {
+        log(LL_WARN, "Server %s:%d uses old obfuscation version, downgrading from %d to %d", 
+            target_host, target_port, client_entry->version, version);
+        client_entry->version = version;
+    }
+
+    classify_latency(config, batch, client_entry, DIR_SERVER_TO_CLIENT, buffer);
+    if (!obfuscated && !client_entry->client_clean) {
+        // If the packet is not obfuscated, we need to encode it
+        length = encode_packet(config, client_entry, DIR_SERVER_TO_CLIENT, buffer, length, dummy_length, now);
+        if (length < 4) {
+            log(LL_ERROR, "Failed to encode packet from %s:%d", target_host, target_port);
+            return;
+        }
+        length = masking_data_wrap_to_client(&buffer, length, config, client_entry, client_listen_sock(client_entry), &forward_addr);
+    }
+    
+    log_hexdump(LL_TRACE, (!obfuscated && !client_entry->client_clean) ? "<-X: " : "<-O: ", buffer, length);
+
+    client_entry->last_activity_time = now;
+    client_entry->last_incoming_time = now;
+    client_entry->hop_rx_bytes += length;
+    if (pace_datagram(config, batch, client_entry, DIR_SERVER_TO_CLIENT, length) < 0) {
+        return;
+    }
+    mark_tos(config, batch, DIR_SERVER_TO_CLIENT);
+#ifdef USE_AF_XDP
+    // The client's datagrams come through AF_XDP, so the response goes back the same way with the next xdp_flush(),
+    // unless it has to wait for its departure time: only the fq qdisc behind a socket can hold it
+    if (client_entry->xdp_ready && !batch->txtime
+        && xdp_send(&xdp, client_entry->xdp_queue, client_entry->xdp_headers, batch->tos < 0 ? 0 : batch->tos, buffer, length) == 0) {
+        batch->tos = -1;
+        return;
+    }
+#endif
+    // Send the response back to the original client
+    if (client_entry->client_sock >= 0) {
+        batch_queue(batch, client_entry->client_sock, buffer, length, NULL, client_entry);
+    } else {
+        batch_queue(batch, client_listen_sock(client_entry), buffer, length, &client_entry->client_addr, NULL);
+    }
 }
 
 /**
- * @brief Creates a new static client entry.
+ * @brief Receives a batch of datagrams from the clients on the listening socket,
+ * or from one client on its connected socket, and handles it.
  *
- * This function allocates and initializes a new client_entry_t structure
- * using the provided client and forward addresses, as well as the specified local port.
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Receive ring and send queue.
+ * @param client_entry Owner of the socket connected to a client, NULL for the listening socket.
+ * @param sock Listening socket or socket connected to a client.
+ * @param now Current time in milliseconds.
+ * @return Number of datagrams received, 0 if there were none, -1 on error.
+ */
+static int receive_client_batch(obfuscator_config_t *config, packet_batch_t *batch, client_entry_t *client_entry, int sock, long now)
+{
+    int n = batch_recv(batch, sock);
+    if (n < 0) {
+        serror_level(LL_DEBUG, "recvfrom client");
+        return -1;
+    }
+    // Before the datagrams are handled, they may remove the client
+    account_kernel_drops(client_entry, sock, batch->rx_drops);
+    for (int i = 0; i < n; i++) {
+        rx_slot_t *slot = &batch->slots[i];
+        batch->rx_slot = i;
+        batch->rx_ns = slot->rx_ns;
+        batch->rx_tos = slot->tos;
+        if (!slot->gso_size) {
+            handle_client_packet(config, batch, sock, slot->data + PREBUFFER_SIZE, slot->length, &slot->addr, now, -1);
+            continue;
+        }
+        // Coalesced by the kernel: pad all the segments equally, so they can be sent coalesced too
+        int dummy_length = dummy_length_for(WG_TYPE_DATA, slot->gso_size, config->max_dummy_length_data);
+        for (int offset = 0; offset < slot->length; offset += slot->gso_size) {
+            int length;
+            uint8_t *segment = batch_segment(batch, slot, offset, &length);
+            handle_client_packet(config, batch, sock, segment, length, &slot->addr, now, dummy_length);
+        }
+    }
+    batch_flush(batch);
+    return n;
+}
+
+/**
+ * @brief Receives a batch of datagrams from the server on a socket of the client and handles it.
  *
  * @param config Pointer to the obfuscator configuration structure.
- * @param client_addr Pointer to a sockaddr_in structure representing the client's address.
- * @param forward_addr Pointer to a sockaddr_in structure representing the address to forward to.
- * @param local_port The local port number to connect to the server.
- * @param bind_host Original hostname from the configuration, stored if it is not an IPv4 literal.
- * @return Pointer to the newly created client_entry_t structure, or NULL on failure.
+ * @param batch Receive ring and send queue.
+ * @param client_entry Client entry.
+ * @param sock Server socket of the client, or the one a source port hop has left behind.
+ * @param now Current time in milliseconds.
+ * @return Number of datagrams received, 0 if there were none, -1 on error.
  */
-static client_entry_t * new_client_entry_static(obfuscator_config_t *config, struct sockaddr_in *client_addr, struct sockaddr_in *forward_addr, uint16_t local_port, const char *bind_host) {
-    if (HASH_COUNT(conn_table) >= config->max_clients) {
-        log(LL_ERROR, "Maximum number of clients reached (%d), cannot add new client", config->max_clients);
-        return NULL;
+static int receive_server_batch(obfuscator_config_t *config, packet_batch_t *batch, client_entry_t *client_entry, int sock, long now)
+{
+    int n = batch_recv(batch, sock);
+    if (n < 0) {
+        serror_level(LL_DEBUG, "recv from server");
+        return -1;
+    }
+    account_kernel_drops(client_entry, sock, batch->rx_drops);
+    for (int i = 0; i < n; i++) {
+        rx_slot_t *slot = &batch->slots[i];
+        batch->rx_slot = i;
+        batch->rx_ns = slot->rx_ns;
+        batch->rx_tos = slot->tos;
+        if (!slot->gso_size) {
+            handle_server_packet(config, batch, client_entry, slot->data + PREBUFFER_SIZE, slot->length, now, -1);
+            continue;
+        }
+        // Coalesced by the kernel: pad all the segments equally, so they can be sent coalesced too
+        int dummy_length = dummy_length_for(WG_TYPE_DATA, slot->gso_size, config->max_dummy_length_data);
+        for (int offset = 0; offset < slot->length; offset += slot->gso_size) {
+            int length;
+            uint8_t *segment = batch_segment(batch, slot, offset, &length);
+            handle_server_packet(config, batch, client_entry, segment, length, now, dummy_length);
+        }
     }
+    batch_flush(batch);
+    return n;
+}
 
-    // Check if such client already exists
-    client_entry_t *existing_entry;
-    HASH_FIND(hh, conn_table, client_addr, sizeof(*client_addr), existing_entry);
-    if (existing_entry) {
-        log(LL_ERROR, "Binding with client %s:%d already exists", 
-            inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
-        return NULL;
+/**
+ * @brief Returns the monotonic time in milliseconds.
+ */
+static long monotonic_ms(void)
+{
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    return now_ts.tv_sec * 1000 + now_ts.tv_nsec / 1000000;
+}
+
+// Passed to client_timer() through wheel_advance()
+typedef struct {
+    obfuscator_config_t *config;
+    packet_batch_t *batch;
+    long now;
+} timer_context_t;
+
+/**
+ * @brief In the tickless mode, moves the deadline forward to a multiple of 'grid', so the timers
+ * of many clients expire together, in one wakeup, instead of one by one.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param deadline Time in milliseconds.
+ * @param grid Allowed delay in milliseconds.
+ * @return Time in milliseconds.
+ */
+static long coalesce_deadline(obfuscator_config_t *config, long deadline, long grid)
+{
+    if (!config->tickless || deadline <= 0) {
+        return deadline;
     }
+    return (deadline + grid - 1) / grid * grid;
+}
 
-    client_entry_t * client_entry = malloc(sizeof(client_entry_t));
-    if (!client_entry) {
-        log(LL_ERROR, "Failed to allocate memory for client entry");
-        return NULL;
+/**
+ * @brief Returns when the client entry needs attention next: one of its timeouts,
+ * its masking timer, its next port hop or a poll of the TC offload program.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param client_entry Client entry.
+ * @param now Current time in milliseconds.
+ * @return Time in milliseconds, LONG_MAX if never.
+ */
+static long client_deadline(obfuscator_config_t *config, client_entry_t *client_entry, long now)
+{
+    long deadline = LONG_MAX;
+    if (!client_entry->is_static) { // Static entries are never removed
+        deadline = client_entry->last_activity_time + config->idle_timeout;
+        if (config->in_timeout > 0 && client_entry->last_incoming_time + config->in_timeout < deadline) {
+            deadline = client_entry->last_incoming_time + config->in_timeout;
+        }
+        if (!client_entry->handshaked && client_entry->last_activity_time + HANDSHAKE_TIMEOUT < deadline) {
+            deadline = client_entry->last_activity_time + HANDSHAKE_TIMEOUT;
+        }
+        deadline = coalesce_deadline(config, deadline, TICKLESS_SLACK);
     }
-    memset(client_entry, 0, sizeof(client_entry_t));
-    // Set default version (latest)
-    client_entry->version = OBFUSCATION_VERSION;
-    // default masking type
-    client_entry->masking_handler = config->masking_handler;
-    // Set the client address
-    memcpy(&client_entry->client_addr, client_addr, sizeof(client_entry->client_addr));
-    // Create a socket for the server connection
-    client_entry->server_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_entry->server_sock < 0) {
-        serror("Failed to create server socket for client");
-        free(client_entry);
-        return NULL;
+    if (client_entry->masking_handler && client_entry->masking_handler->timer_interval_s > 0) {
+        // Every client on the same beat, the interval is a keepalive, a late one does no harm
+        long interval = client_entry->masking_handler->timer_interval_s * 1000;
+        long masking = coalesce_deadline(config, client_entry->last_masking_timer_time + interval, interval);
+        if (masking < deadline) {
+            deadline = masking;
+        }
     }
-    // Bind the socket to the specified local port
-    client_entry->our_addr.sin_family = AF_INET;
-    // TODO: ability to bind to a specific address
-    client_entry->our_addr.sin_addr.s_addr = INADDR_ANY;
-    client_entry->our_addr.sin_port = htons(local_port);
-    // Set the local port number
-    if (bind(client_entry->server_sock, (struct sockaddr *)&client_entry->our_addr, sizeof(client_entry->our_addr)) < 0) {
-        serror("Failed to bind server socket to %s:%d", 
-            inet_ntoa(client_entry->our_addr.sin_addr), local_port);
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    if (port_hopping) {
+        long hop = LONG_MAX;
+        if (config->port_hopping) {
+            hop = client_entry->hop_time + config->port_hopping * 1000L;
+        }
+        if (config->hop_on_drop && client_entry->hop_window_start + HOP_WINDOW < hop) {
+            hop = client_entry->hop_window_start + HOP_WINDOW;
+        }
+        hop = coalesce_deadline(config, hop, TICKLESS_SLACK);
+        if (hop < deadline) {
+            deadline = hop;
+        }
     }
-#ifdef __linux__
-    // Set "Don't Fragment" flag
-    int optval = 1;
-    if (setsockopt(client_entry->server_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
-        serror("Failed to set 'don't fragment' flag for client %s:%d", 
-            inet_ntoa(client_entry->client_addr.sin_addr), local_port);
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    if (client_entry->retired_sock >= 0 && client_entry->retire_time < deadline) {
+        deadline = client_entry->retire_time;
     }
-    if (config->fwmark) {
-        if (setsockopt(client_entry->server_sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0) {
-            log(LL_WARN, "Failed to set 'firewall mark' for client %s:%d: %s",
-                inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), strerror(errno));
+#ifdef USE_TC_OFFLOAD
+    if (client_entry->offloaded) {
+        long poll = coalesce_deadline(config, now + ITERATE_INTERVAL, TICKLESS_SLACK);
+        if (poll < deadline) {
+            deadline = poll;
         }
     }
+#else
+    (void)now;
+#endif
+    return deadline;
+}
 
+/**
+ * @brief Expiry timer of a client entry: removes the entry if it is idle for too long and runs its masking timer.
+ *
+ * The timer is not moved on every packet, the packets only update the activity times. When it expires,
+ * the timeouts are checked against them and the timer is armed again for the nearest one.
+ */
+static void client_timer(wheel_timer_t *timer, void *arg)
+{
+    timer_context_t *context = arg;
+    obfuscator_config_t *config = context->config;
+    long now = context->now;
+    client_entry_t *client_entry = (client_entry_t *)((char *)timer - offsetof(client_entry_t, timer));
+
+#ifdef USE_TC_OFFLOAD
+    // The program does not wake us up, pick up what it has forwarded
+    if (client_entry->offloaded) {
+        stats.offload_packets += offload_poll_client(&offload, client_entry, &forward_addr);
+    }
 #endif
-    // Set the server address to the specified one
-    connect(client_entry->server_sock, (struct sockaddr *)forward_addr, sizeof(*forward_addr));
+    // Left to the timer by the packets, the sockets may have been in the middle of a drain then.
+    // What has come to the old port since the last wakeup is forwarded first.
+    if (client_entry->retired_sock >= 0 && now >= client_entry->retire_time) {
+        while (receive_server_batch(config, context->batch, client_entry, client_entry->retired_sock, now) == context->batch->size) {
+        }
+        retire_server_sock(client_entry);
+    }
+    if (client_entry->listen_moved) {
+        // The connected socket is bound to the old port, a new one is bound to the new port
+        client_entry->listen_moved = 0;
+        disconnect_client(client_entry);
+        connect_client(config, client_entry);
+    }
+    // Check if the entry is idle for too long
+    uint8_t idle = now - client_entry->last_activity_time >= config->idle_timeout;
+    uint8_t incoming_timeout = config->in_timeout > 0 && now - client_entry->last_incoming_time >= config->in_timeout;
+    uint8_t handshake_timeout = !client_entry->handshaked && now - client_entry->last_activity_time >= HANDSHAKE_TIMEOUT;
+    uint8_t unreachable = client_entry->path_dead;
+    if ((idle || incoming_timeout || handshake_timeout || unreachable) && !client_entry->is_static) { // Do not remove static entries
+        // Remove old entry
+        if (unreachable) {
+            log(LL_INFO, "Removing client %s:%d, ICMP reports its path unreachable", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+            stats.icmp_removed++;
+        } else if (idle) {
+            log(LL_INFO, "Removing idle client %s:%d", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        } else if (incoming_timeout) {
+            log(LL_INFO, "Removing client %s:%d due to incoming timeout", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        } else if (handshake_timeout) {
+            log(LL_DEBUG, "Removing client %s:%d due to handshake timeout", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
+        }
+        remove_client(client_entry);
+        return;
+    }
 
-#ifdef USE_EPOLL    
-    struct epoll_event e = {
-        .events = EPOLLIN,
-        .data.ptr = client_entry
+    if (port_hopping) {
+        check_port_hop(config, client_entry, now);
+    }
+
+    // Check if we need to call masking timer
+    if (client_entry->masking_handler && client_entry->masking_handler->timer_interval_s > 0
+        && now - client_entry->last_masking_timer_time >= client_entry->masking_handler->timer_interval_s * 1000) {
+        client_entry->last_masking_timer_time = now;
+        masking_on_timer(config, client_entry, client_listen_sock(client_entry), &forward_addr);
+    }
+
+    long deadline = client_deadline(config, client_entry, now);
+    if (deadline != LONG_MAX) {
+        wheel_add(&timers, timer, deadline);
+    }
+}
+
+/**
+ * @brief Expires the timers of the client entries which are due, called on every wakeup.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Receive ring and send queue.
+ * @param now Current time in milliseconds.
+ * @return Number of expired timers.
+ */
+static int check_clients(obfuscator_config_t *config, packet_batch_t *batch, long now)
+{
+    timer_context_t context = {
+        .config = config,
+        .batch = batch,
+        .now = now
     };
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_entry->server_sock, &e) != 0) {
-        serror("epoll_ctl for client socket");
-        close(client_entry->server_sock);
-        free(client_entry);
-        return NULL;
+    return wheel_advance(&timers, now, client_timer, &context);
+}
+
+/**
+ * @brief Counts a wakeup of the event loop in the tickless mode, and the ones it has avoided:
+ * the POLL_TIMEOUT ticks slept through, and one for every client timer beyond the first one
+ * expired together.
+ *
+ * @param slept Time spent waiting in milliseconds.
+ * @param expired Number of the client timers expired on this wakeup.
+ */
+static void tickless_account(long slept, int expired)
+{
+    stats.wakeups++;
+    stats.wakeups_avoided += slept / POLL_TIMEOUT;
+    if (expired > 1) {
+        stats.wakeups_avoided += expired - 1;
     }
-#endif
+}
 
-    client_entry->is_static = 1;
-    if (bind_host && !is_ipv4_literal(bind_host)) {
-        strncpy(client_entry->bind_host, bind_host, sizeof(client_entry->bind_host) - 1);
+/**
+ * @brief Handles a packet from the target received on the raw upstream socket.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param packet Packet from the IP header on.
+ * @param length Length of the packet.
+ * @param now Current time in milliseconds.
+ */
+static void handle_raw_packet(obfuscator_config_t *config, packet_batch_t *batch, uint8_t *packet, int length, long now)
+{
+    if (length > BUFFER_SIZE) {
+        // Truncated
+        return;
+    }
+    void *owner;
+    uint8_t *payload = rawudp_unwrap(raw_upstream, packet, &length, &owner);
+    if (!payload || !owner) {
+        // Not for a client of this worker, or the client is gone already
+        return;
     }
+    handle_server_packet(config, batch, owner, payload, length, now, -1);
+}
 
-    HASH_ADD(hh, conn_table, client_addr, sizeof(*client_addr), client_entry);
+/**
+ * @brief Receives a batch of datagrams from the target on the raw upstream socket and handles it.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Receive ring and send queue.
+ * @param now Current time in milliseconds.
+ * @return Number of datagrams received, 0 if there were none, -1 on error.
+ */
+static int receive_raw_batch(obfuscator_config_t *config, packet_batch_t *batch, long now)
+{
+    int n = batch_recv(batch, raw_upstream->sock);
+    if (n < 0) {
+        serror_level(LL_DEBUG, "recv from raw upstream socket");
+        return -1;
+    }
+    account_kernel_drops(NULL, raw_upstream->sock, batch->rx_drops);
+    for (int i = 0; i < n; i++) {
+        rx_slot_t *slot = &batch->slots[i];
+        batch->rx_slot = i;
+        batch->rx_ns = slot->rx_ns;
+        batch->rx_tos = slot->tos;
+        handle_raw_packet(config, batch, slot->data + PREBUFFER_SIZE, slot->length, now);
+    }
+    batch_flush(batch);
+    return n;
+}
 
-    return client_entry;
+#ifdef USE_IO_URING
+/**
+ * @brief Handles all the completed io_uring requests, then sends the replies.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param now Current time in milliseconds.
+ * @return Number of datagrams handled.
+ */
+static int handle_uring_events(obfuscator_config_t *config, packet_batch_t *batch, long now)
+{
+    uring_event_t event;
+    int packets = 0;
+    uint8_t resolve_ready = 0;
+    while (uring_next(&uring, &event)) {
+        if (event.type == URING_EV_READABLE && event.fd == signal_wake_rd) {
+            drain_signal_wake();
+            continue;
+        } else if (event.type == URING_EV_READABLE) {
+            resolve_ready = 1;
+            continue;
+        }
+        if (event.type == URING_EV_ERROR) {
+#ifdef USE_RECVERR
+            if (config->icmp_errors) {
+                read_socket_errors(event.ctx, event.fd);
+            }
+#endif
+            continue;
+        }
+        account_kernel_drops(event.ctx, event.fd, event.drops);
+        batch->rx_ns = event.rx_ns;
+        batch->rx_tos = event.tos;
+        if ((!event.ctx && listen_sock_index(event.fd) >= 0)
+                   || (event.ctx && ((client_entry_t *)event.ctx)->client_sock == event.fd)) {
+            handle_client_packet(config, batch, event.fd, event.data, event.length, &event.addr, now, -1);
+        } else if (!event.ctx) {
+            handle_raw_packet(config, batch, event.data, event.length, now);
+        } else {
+            handle_server_packet(config, batch, event.ctx, event.data, event.length, now, -1);
+        }
+        packets++;
+    }
+    batch_flush(batch);
+    uring_release(&uring);
+    // Only now, the results may rebind or remove the clients the queued datagrams were sent to
+    if (resolve_ready) {
+        drain_resolve_results(&forward_addr);
+    }
+    return packets;
 }
+#endif
 
-#ifndef USE_EPOLL
-static client_entry_t *find_by_server_sock(int fd) {
-    client_entry_t *e, *tmp;
-    HASH_ITER(hh, conn_table, e, tmp) {
-        if (e->server_sock == fd) return e;
+#ifdef USE_AF_XDP
+/**
+ * @brief Handles the datagrams the XDP program has redirected to one of the AF_XDP sockets.
+ * They are decoded in place, in the UMEM frames, and forwarded to the server.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param batch Send queue.
+ * @param index AF_XDP socket index.
+ * @param now Current time in milliseconds.
+ * @return Number of datagrams handled.
+ */
+static int handle_xdp_packets(obfuscator_config_t *config, packet_batch_t *batch, int index, long now)
+{
+    xdp_frame_t frames[batch->size];
+    int n = xdp_recv(&xdp, index, frames, batch->size);
+    // No kernel timestamps here
+    batch->rx_ns = 0;
+    for (int i = 0; i < n; i++) {
+        client_entry_t *client_entry;
+        HASH_FIND(hh, conn_table, &frames[i].addr, sizeof(frames[i].addr), client_entry);
+        if (client_entry) {
+            // The responses are sent back through the same socket, with these headers swapped
+            memcpy(client_entry->xdp_headers, frames[i].headers, XDP_HEADERS_SIZE);
+            client_entry->xdp_queue = index;
+            client_entry->xdp_ready = 1;
+        }
+        // The TOS byte of the IPv4 header, after the Ethernet one
+        batch->rx_tos = frames[i].headers[15];
+        handle_client_packet(config, batch, listen_sock, frames[i].data, frames[i].length, &frames[i].addr, now, -1);
     }
-    return NULL;
+    // The queued datagrams point into the frames, so they must be sent before the frames are given back
+    batch_flush(batch);
+    xdp_release(&xdp, index);
+    return n;
 }
 #endif
 
@@ -630,17 +2919,544 @@ void print_version(void) {
     fprintf(stderr, "Starting %s\n", version_string());
 }
 
+/**
+ * @brief Creates a listening socket for the clients.
+ *
+ * @param config Pointer to the obfuscator configuration structure.
+ * @param listen_addr Address to bind to.
+ * @param reuseport Non-zero to join the SO_REUSEPORT group of the worker threads.
+ * @return Socket descriptor, exits on failure.
+ */
+static int create_listen_socket(obfuscator_config_t *config, struct sockaddr_in *listen_addr, int reuseport)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        serror("Can't create source socket to listen");
+        FAILURE();
+    }
+
+#ifdef __linux__
+    /* Set "Don't Fragment" flag */
+    int optval = 1;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        serror("Failed to set 'don't fragment' flag for listening socket");
+        close(sock);
+        FAILURE();
+    }
+    if (config->fwmark) {
+        if (setsockopt(sock, SOL_SOCKET, SO_MARK, &config->fwmark, sizeof(config->fwmark)) < 0) {
+            log(LL_WARN, "Failed to set 'firewall mark' for listening socket: %s", strerror(errno));
+        }
+    }
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        serror("Failed to set 'reuse port' flag for listening socket");
+        close(sock);
+        FAILURE();
+    }
+#else
+    (void)reuseport;
+#endif
+    if (setup_socket_buffers(config, sock) < 0) {
+        serror_level(LL_WARN, "Failed to set socket buffer sizes for listening socket");
+    } else if (config->rcvbuf) {
+        // Without the privileges, the kernel silently caps the size. It reports the size
+        // doubled on Linux, the other half is for its bookkeeping.
+        int size = 0;
+        socklen_t size_len = sizeof(size);
+        static uint8_t warned = 0;
+#ifdef __linux__
+        int scale = 2;
+#else
+        int scale = 1;
+#endif
+        if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &size_len) == 0 && size < (int64_t)config->rcvbuf * scale && !warned) {
+            log(LL_WARN, "Receive buffer size is limited to %d bytes, raise net.core.rmem_max or run with CAP_NET_ADMIN", size / scale);
+            warned = 1;
+        }
+    }
+
+    /* Bind the listening socket to the specified address and port */
+    if (bind(sock, (struct sockaddr *)listen_addr, sizeof(*listen_addr)) < 0) {
+        serror("Failed to bind source socket to %s:%d",
+            inet_ntoa(listen_addr->sin_addr), ntohs(listen_addr->sin_port));
+        close(sock);
+        FAILURE();
+    }
+    return sock;
+}
+
+/**
+ * @brief Runs the event loop of a worker thread.
+ *
+ * @param arg Worker to run, worker_t pointer.
+ * @return Never returns.
+ */
+static void *worker_run(void *arg)
+{
+    worker = arg;
+    obfuscator_config_t config = *worker->config;
+    packet_batch_t batch; // Receive ring and send queue
+    long now;
+    uint64_t wake_ns = 0;       // latency mode: when the last wait returned
+    uint64_t spin_until_ns = 0; // latency mode: keep polling without sleeping until this time
+
+    listen_sock = worker->listen_sock;
+    listen_socks = worker->listen_socks;
+    conn_table = worker->conn_table;
+    forward_addr = worker->forward_addr;
+    resolve_result_rd = worker->resolve_result_rd;
+    raw_upstream = config.raw_upstream_ports ? &worker->raw : NULL;
+    wheel_init(&timers, monotonic_ms());
+    stats_register();
+
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(worker->cpu, &cpu_set);
+        if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set)) != 0) {
+            serror_level(LL_WARN, "Failed to pin worker thread to CPU %d", worker->cpu);
+        }
+    }
+#endif
+#ifdef USE_LATENCY_MODE
+    if (config.realtime && latency_realtime_thread() < 0) {
+        serror_level(LL_WARN, "Failed to switch worker thread to real-time scheduling");
+    }
+#endif
+
+#ifdef USE_EPOLL
+    struct epoll_event events[MAX_EVENTS];
+    drain_slot_t ready[MAX_EVENTS];
+#else
+    // Grows with the poll() set, but not while it is being drained, new clients may come meanwhile
+    drain_slot_t *ready = NULL;
+    int ready_capacity = 0;
+#endif
+
+#ifdef USE_IO_URING
+    if (config.io_uring) {
+        if (uring_init(&uring, config.batch_size) != 0) {
+            log(LL_WARN, "io_uring is not available (%s), falling back to epoll", strerror(errno));
+        } else {
+            uring_enabled = 1;
+            if (worker->index == 0) {
+                log(LL_INFO, "Using io_uring for receiving and sending");
+            }
+        }
+    }
+#endif
+
+    if (batch_init(&batch, config.batch_size, config.udp_offload) != 0) {
+        log(LL_ERROR, "Failed to allocate memory for %d packet buffers", config.batch_size);
+        FAILURE();
+    }
+    if (worker->index == 0) {
+        log(LL_DEBUG, "Receiving and sending up to %d packets per call", config.batch_size);
+    }
+    if (config.pipeline > 0) {
+        if (pipeline_init(&pipeline, config.pipeline, config.batch_size, worker->config->xor_key, key_length) != 0) {
+            log(LL_ERROR, "Failed to allocate memory for the pipeline");
+            FAILURE();
+        }
+        if ((errno = pipeline_start(&pipeline)) != 0) {
+            serror("Failed to start the pipeline threads");
+            FAILURE();
+        }
+        batch.pipeline = &pipeline;
+        // The hexdumps in the trace log need the whole packet decoded right away
+        xor_data_defer(verbose < LL_TRACE);
+        log(LL_INFO, "Pipeline mode: receiving on one thread, processing on %d, sending on one more", config.pipeline);
+    }
+    // The sends do not block then, a socket with a full send buffer keeps the datagrams for later
+    uint8_t queue_sends = config.send_queue > 0 && !batch.pipeline;
+#ifdef USE_IO_URING
+    if (uring_enabled) {
+        // The kernel waits for the room itself
+        queue_sends = 0;
+        batch.uring = &uring;
+        for (int i = 0; i < listen_ports; i++) {
+            if (uring_watch_socket(&uring, listen_socks[i], NULL) != 0) {
+                log(LL_ERROR, "Failed to allocate memory for io_uring");
+                FAILURE();
+            }
+        }
+        if ((raw_upstream && uring_watch_socket(&uring, raw_upstream->sock, NULL) != 0)
+            || (resolve_result_rd >= 0 && uring_watch_readable(&uring, resolve_result_rd, NULL) != 0)
+            || (worker->index == 0 && signal_wake_rd >= 0 && uring_watch_readable(&uring, signal_wake_rd, NULL) != 0)) {
+            log(LL_ERROR, "Failed to allocate memory for io_uring");
+            FAILURE();
+        }
+    }
+#endif
+
+    if (queue_sends) {
+        if (batch_set_backlog(&batch, config.send_queue, watch_writable) != 0) {
+            log(LL_ERROR, "Failed to allocate memory for the send queue");
+            FAILURE();
+        }
+        send_batch = &batch;
+    }
+    if (raw_upstream) {
+        batch.raw_sock = raw_upstream->sock;
+    }
+
+    /* Use epoll for events if enabled, it is also the fallback for io_uring */
+#ifdef USE_EPOLL
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        serror("epoll_create1");
+        FAILURE();
+    }
+#ifdef USE_LATENCY_MODE
+    // Without it the sockets are still busy polled by the receive calls
+    if (config.latency_mode && latency_enable_epoll_busy_poll(epfd, config.latency_mode) < 0 && worker->index == 0) {
+        log(LL_DEBUG, "epoll busy polling is not available: %s", strerror(errno));
+    }
+#endif
+    for (int i = 0; i < listen_ports; i++) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = listen_socks[i]
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_socks[i], &ev) != 0) {
+            serror("epoll_ctl for listen_sock");
+            FAILURE();
+        }
+    }
+    if (raw_upstream) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = raw_upstream->sock
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, raw_upstream->sock, &ev) != 0) {
+            serror("epoll_ctl for raw upstream socket");
+            FAILURE();
+        }
+    }
+    if (resolve_result_rd >= 0) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = resolve_result_rd
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolve_result_rd, &ev) != 0) {
+            serror("epoll_ctl for hostname resolver");
+            FAILURE();
+        }
+    }
+    if (worker->index == 0 && signal_wake_rd >= 0) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = signal_wake_rd
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, signal_wake_rd, &ev) != 0) {
+            serror("epoll_ctl for signal wakeups");
+            FAILURE();
+        }
+    }
+#ifdef USE_AF_XDP
+    for (int i = 0; xdp_enabled && i < xdp.socket_count; i++) {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = xdp.sockets[i].fd
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, xdp.sockets[i].fd, &ev) != 0) {
+            serror("epoll_ctl for AF_XDP socket");
+            FAILURE();
+        }
+    }
+#endif
+#else
+    for (int i = 0; i < listen_ports; i++) {
+        if (poll_add(listen_socks[i], NULL) != 0) {
+            log(LL_ERROR, "Failed to allocate memory for the poll() descriptors");
+            FAILURE();
+        }
+    }
+    if ((raw_upstream && poll_add(raw_upstream->sock, NULL) != 0)
+        || (resolve_result_rd >= 0 && poll_add(resolve_result_rd, NULL) != 0)
+        || (worker->index == 0 && signal_wake_rd >= 0 && poll_add(signal_wake_rd, NULL) != 0)) {
+        log(LL_ERROR, "Failed to allocate memory for the poll() descriptors");
+        FAILURE();
+    }
+#endif
+
+    /* Open the spare server sockets for the first clients */
+    int spare_refill_pending = 0;
+    if (config.socket_pool) {
+        spare_entries = malloc(config.socket_pool * sizeof(*spare_entries));
+        if (!spare_entries) {
+            log(LL_ERROR, "Failed to allocate memory for the socket pool");
+            FAILURE();
+        }
+        while (refill_spare_entries(&config, monotonic_ms()));
+    }
+
+    /* Wait for data from the server on the static bindings of this worker */
+    {
+        client_entry_t *e, *tmp;
+        HASH_ITER(hh, conn_table, e, tmp) {
+            if (watch_client(e) != 0) {
+                serror("Failed to watch client socket");
+                FAILURE();
+            }
+            wheel_add(&timers, &e->timer, 0);
+        }
+    }
+
+    /* Main loop */
+    while (1) {
+        // Reopen the log file after it has been rotated, requested by SIGHUP
+        if (log_reopen_pending && worker->index == 0) {
+            log_reopen_pending = 0;
+            log_reopen();
+        }
+        // Write the statistics to the log, requested by SIGUSR1
+        if (stats_dump_pending && worker->index == 0) {
+            stats_dump_pending = 0;
+            stats_log(&config, __atomic_load_n(&clients_total, __ATOMIC_RELAXED));
+        }
+
+        // In the latency mode the loop does not sleep for a while after a packet, the next one
+        // is likely to come soon and waking up for it would cost more than the packet itself
+        // In the tickless mode the loop sleeps for as long as there is nothing to do
+        int timeout = config.tickless ? -1 : POLL_TIMEOUT;
+        long sleep_start = monotonic_ms();
+        if (config.latency_mode && latency_now_ns() < spin_until_ns) {
+            timeout = 0;
+        } else {
+            // Sleep no longer than until the next client timer
+            long timer_timeout = wheel_timeout(&timers, sleep_start);
+            if (timer_timeout >= 0 && (timeout < 0 || timer_timeout < timeout)) {
+                timeout = timer_timeout < INT_MAX ? (int)timer_timeout : INT_MAX;
+            }
+        }
+        if (spare_refill_pending) {
+            // The socket pool is refilled between the wakeups, a few sockets at a time
+            timeout = 0;
+        }
+
+#ifdef USE_IO_URING
+        // Submit the queued sends and wait for completions in one syscall
+        if (uring_enabled) {
+            if (uring_wait(&uring, timeout) < 0) {
+                if (errno == EINTR) {
+                    // Interrupted by a signal, e.g. SIGHUP
+                    continue;
+                }
+                serror("io_uring_enter");
+                FAILURE();
+            }
+            now = monotonic_ms();
+            if (config.latency_mode) {
+                wake_ns = latency_now_ns();
+            }
+            int packets = handle_uring_events(&config, &batch, now);
+            if (config.latency_mode && packets > 0) {
+                latency_account(wake_ns, packets);
+                spin_until_ns = wake_ns + config.latency_mode * 1000ULL;
+            }
+            int expired = check_clients(&config, &batch, now);
+            if (config.tickless) {
+                tickless_account(now - sleep_start, expired);
+            }
+            spare_refill_pending = config.socket_pool && refill_spare_entries(&config, now);
+            continue;
+        }
+#endif
+
+        // Using epoll or poll to wait for events
+#ifdef USE_EPOLL
+        int events_n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (events_n < 0) {
+            if (errno == EINTR) {
+                // Interrupted by a signal, e.g. SIGHUP
+                continue;
+            }
+            serror("epoll_wait");
+            FAILURE();
+        }
+#else
+        int ret = poll(pollfds, pollfds_count, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                // Interrupted by a signal, e.g. SIGHUP
+                continue;
+            }
+            serror("poll");
+            FAILURE();
+        }
+#endif
+
+        // Get the current time
+        now = monotonic_ms();
+        if (config.latency_mode) {
+            wake_ns = latency_now_ns();
+#ifdef USE_EPOLL
+            if (events_n > 0) {
+#else
+            if (ret > 0) {
+#endif
+                spin_until_ns = wake_ns + config.latency_mode * 1000ULL;
+            }
+        }
+#ifdef USE_AF_XDP
+        int xdp_packets = 0;
+#endif
+
+        // Collect the ready sockets first, they are drained below
+        int ready_count = 0;
+        uint8_t resolve_ready = 0;
+#ifdef USE_EPOLL
+        for (int e = 0; e < events_n; e++) {
+            struct epoll_event *event = &events[e];
+            if (resolve_result_rd >= 0 && event->data.fd == resolve_result_rd) {
+                resolve_ready = 1;
+                continue;
+            }
+            if (signal_wake_rd >= 0 && event->data.fd == signal_wake_rd) {
+                drain_signal_wake();
+                continue;
+            }
+#ifdef USE_AF_XDP
+            int xsk = xdp_enabled ? xdp_socket_index(&xdp, event->data.fd) : -1;
+            if (xsk >= 0) {
+                xdp_packets += handle_xdp_packets(&config, &batch, xsk, now);
+                continue;
+            }
+#endif
+            client_entry_t *client_entry = NULL;
+            int sock = event->data.fd;
+            if (listen_sock_index(sock) < 0 && !(raw_upstream && sock == raw_upstream->sock)) {
+                uintptr_t ptr = (uintptr_t)event->data.ptr;
+                client_entry = (client_entry_t *)(ptr & ~(CLIENT_SOCK_TAG | RETIRED_SOCK_TAG));
+                sock = (ptr & CLIENT_SOCK_TAG) ? client_entry->client_sock
+                     : (ptr & RETIRED_SOCK_TAG) ? client_entry->retired_sock
+                     : client_entry->server_sock;
+            }
+#ifdef USE_RECVERR
+            if (config.icmp_errors && (event->events & EPOLLERR)) {
+                // ICMP errors about the sent datagrams, the received ones may follow
+                read_socket_errors(client_entry, sock);
+                if (!(event->events & (EPOLLIN | EPOLLOUT))) {
+                    continue;
+                }
+            }
+#endif
+            if (event->events & EPOLLOUT) {
+                // Room in the send buffer, the datagrams kept for the socket go first
+                batch_send_backlog(&batch, sock);
+                if (event->events == EPOLLOUT) {
+                    continue;
+                }
+            }
+            ready[ready_count].client_entry = client_entry;
+            ready[ready_count].sock = sock;
+            ready[ready_count++].received = 0;
+        }
+#else
+        if (ready_capacity < pollfds_count) {
+            drain_slot_t *r = realloc(ready, pollfds_capacity * sizeof(*r));
+            if (!r) {
+                log(LL_ERROR, "Failed to allocate memory for the poll() descriptors");
+                FAILURE();
+            }
+            ready = r;
+            ready_capacity = pollfds_capacity;
+        }
+        for (int e = 0; e < pollfds_count; e++) {
+            if (pollfds[e].revents & POLLOUT) {
+                // Room in the send buffer, the datagrams kept for the socket go first
+                batch_send_backlog(&batch, pollfds[e].fd);
+            }
+#ifdef USE_RECVERR
+            if (config.icmp_errors && (pollfds[e].revents & POLLERR)) {
+                read_socket_errors(poll_entries[e], pollfds[e].fd);
+            }
+#endif
+            if (!(pollfds[e].revents & POLLIN)) {
+                continue;
+            }
+            if (resolve_result_rd >= 0 && pollfds[e].fd == resolve_result_rd) {
+                resolve_ready = 1;
+                continue;
+            }
+            if (signal_wake_rd >= 0 && pollfds[e].fd == signal_wake_rd) {
+                drain_signal_wake();
+                continue;
+            }
+            ready[ready_count].client_entry = poll_entries[e];
+            ready[ready_count].sock = pollfds[e].fd;
+            ready[ready_count++].received = 0;
+        }
+#endif
+
+        // Drain the ready sockets in rounds, one batch from each per round, so neither the shared
+        // listening socket nor a busy client holds the others up. A socket leaves the rounds once
+        // it is empty or has used up its budget, the next wakeup comes right away for the rest.
+        while (ready_count > 0) {
+            int still_ready = 0;
+            for (int i = 0; i < ready_count; i++) {
+                drain_slot_t *d = &ready[i];
+                // The connected sockets of the clients are drained like the listening socket
+                uint8_t from_clients = (!d->client_entry && listen_sock_index(d->sock) >= 0) || (d->client_entry && d->sock == d->client_entry->client_sock);
+                int n = from_clients ? receive_client_batch(&config, &batch, d->client_entry, d->sock, now)
+                      : d->client_entry ? receive_server_batch(&config, &batch, d->client_entry, d->sock, now)
+                      : receive_raw_batch(&config, &batch, now);
+                if (n <= 0) {
+                    continue;
+                }
+                if (config.latency_mode) {
+                    latency_account(wake_ns, n);
+                }
+                d->received += n;
+                if (n < batch.size) {
+                    // Nothing left
+                    continue;
+                }
+                if (d->received >= config.drain_budget) {
+                    if (!from_clients) {
+                        stats.drain_server_exhausted++;
+                    } else {
+                        stats.drain_listen_exhausted++;
+                    }
+                    continue;
+                }
+                ready[still_ready++] = *d;
+            }
+            ready_count = still_ready;
+        }
+
+        // Only now, the results may rebind or remove the clients collected above
+        if (resolve_ready) {
+            drain_resolve_results(&forward_addr);
+        }
+
+#ifdef USE_AF_XDP
+        // One kick for all the responses queued to the AF_XDP sockets during this iteration
+        if (xdp_enabled) {
+            xdp_flush(&xdp);
+            if (config.latency_mode) {
+                latency_account(wake_ns, xdp_packets);
+            }
+        }
+#endif
+
+        int expired = check_clients(&config, &batch, now);
+        if (config.tickless) {
+            tickless_account(now - sleep_start, expired);
+        }
+        spare_refill_pending = config.socket_pool && refill_spare_entries(&config, now);
+    } // while (1)
+
+    // You should never reach this point, but just in case
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     obfuscator_config_t config = {0};
-    struct sockaddr_in 
-        listen_addr, // Address for listening socket, for receiving data from the client
-        forward_addr; // Address for forwarding socket, for sending data to the server
-    uint8_t full_buffer[BUFFER_SIZE + PREBUFFER_SIZE];
-    char target_host[256] = {0};
-    int target_port = -1;
-    int key_length = 0;
+    struct sockaddr_in listen_addr; // Address for listening socket, for receiving data from the client
     in_addr_t s_listen_addr_client = INADDR_ANY;
-    long now, last_cleanup_time = 0;
     struct addrinfo *addr;
     int err;
     struct addrinfo hints = { // for getaddrinfo
@@ -658,12 +3474,6 @@ int main(int argc, char *argv[]) {
        so that configuration errors are logged there too */
     log_init(config.log_file_set ? config.log_file : NULL, config.log_timestamps);
 
-#ifdef USE_EPOLL
-    struct epoll_event events[MAX_EVENTS];
-#else
-    struct pollfd pollfds[config.max_clients + 2];
-#endif
-
     /* Check the parameters */
     // Check the listening port
     if (!config.listen_port_set) {
@@ -707,6 +3517,16 @@ int main(int argc, char *argv[]) {
             log(LL_ERROR, "Invalid target port: %s", port_delimiter + 1);
             exit(EXIT_FAILURE);
         }
+        char *dash = strchr(port_delimiter + 1, '-');
+        if (dash) {
+            // A range of ports, the clients are spread over them and may hop between them
+            int last = atoi(dash + 1);
+            if (last < target_port || last > 65535) {
+                log(LL_ERROR, "Invalid target port range: %s", port_delimiter + 1);
+                exit(EXIT_FAILURE);
+            }
+            target_ports = last - target_port + 1;
+        }
     }
 
     // Check the key
@@ -715,6 +3535,9 @@ int main(int argc, char *argv[]) {
         log(LL_ERROR, "Key is not set");
         exit(EXIT_FAILURE);
     }
+    if (config.jumbo_cache) {
+        xor_data_jumbo((size_t)config.jumbo_cache * 1024);
+    }
 
     // 'allow-clean' is incompatible with static bindings: for a static binding
     // there is no way to know in advance whether the client's traffic must be obfuscated
@@ -737,44 +3560,150 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Workers are sharded by the client address, pinned ones by the CPU the datagram arrived on,
+    // and a static binding must be owned by the worker which receives its datagrams
+    if (config.pin_threads && config.threads > 1 && config.static_bindings_set) {
+        log(LL_ERROR, "'pin-threads' cannot be used together with 'static-bindings'");
+        exit(EXIT_FAILURE);
+    }
+
+    // Sharding by the client address and the pipeline are two different ways to use more CPUs
+    if (config.pipeline > 0 && config.threads > 1) {
+        log(LL_ERROR, "'pipeline' cannot be used together with 'threads'");
+        exit(EXIT_FAILURE);
+    }
+
+    // The AF_XDP sockets are bound to the interface queues, not to the worker threads
+    if (config.xdp_interface[0] && (config.threads > 1 || config.pipeline > 0)) {
+        log(LL_ERROR, "'xdp-interface' cannot be used together with '%s'", config.threads > 1 ? "threads" : "pipeline");
+        exit(EXIT_FAILURE);
+    }
+
+    // The AF_XDP fast path takes the packets of the handshaked clients before the TC program could see them
+    if (config.xdp_interface[0] && config.tc_offload[0]) {
+        log(LL_ERROR, "'xdp-interface' cannot be used together with 'tc-offload'");
+        exit(EXIT_FAILURE);
+    }
+
+    // The TC program sends the packets on right away, with the TOS byte they came with
+    if (config.tc_offload[0] && (config.pacing_rate || dscp_remapped(&config))) {
+        log(LL_ERROR, "'tc-offload' cannot be used together with '%s'", config.pacing_rate ? "pacing-rate" : "dscp-map");
+        exit(EXIT_FAILURE);
+    }
+
+    // The AF_XDP and TC programs know only one listening port
+    if (config.listen_ports > 1 && (config.xdp_interface[0] || config.tc_offload[0])) {
+        log(LL_ERROR, "A range of source ports cannot be used together with '%s'", config.xdp_interface[0] ? "xdp-interface" : "tc-offload");
+        exit(EXIT_FAILURE);
+    }
+
+    // The raw upstream socket and the TC program send to one target port
+    if (target_ports > 1 && (config.raw_upstream_ports || config.tc_offload[0])) {
+        log(LL_ERROR, "A range of target ports cannot be used together with '%s'", config.raw_upstream_ports ? "raw-upstream" : "tc-offload");
+        exit(EXIT_FAILURE);
+    }
+    if ((config.port_hopping || config.hop_on_drop) && target_ports == 1) {
+        log(LL_WARN, "Port hopping needs a range of target ports, it is disabled");
+        config.port_hopping = 0;
+        config.hop_on_drop = 0;
+    }
+    port_hopping = config.port_hopping || config.hop_on_drop;
+
     /* Set up signal handlers */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 #ifdef SIGHUP
     signal(SIGHUP, sighup_handler);
 #endif
+#ifdef SIGUSR1
+    signal(SIGUSR1, sigusr1_handler);
+#endif
 
-    /* Create listening socket */
-    if ((listen_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        serror("Can't create source socket to listen");
+    /* Set up the worker threads */
+    workers_count = config.threads;
+    workers = calloc((size_t)workers_count, sizeof(*workers));
+    if (!workers) {
+        log(LL_ERROR, "Failed to allocate memory for %d worker threads", workers_count);
         exit(EXIT_FAILURE);
     }
-
-#ifdef __linux__
-    /* Set "Don't Fragment" flag */
-    int optval = 1;
-    if (setsockopt(listen_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
-        serror("Failed to set 'don't fragment' flag for listening socket");
-        FAILURE();
+    for (int i = 0; i < workers_count; i++) {
+        workers[i].index = i;
+        workers[i].config = &config;
+        workers[i].resolve_result_rd = workers[i].resolve_result_wr = -1;
+        workers[i].cpu = -1;
     }
-    if (config.fwmark) {
-        if (setsockopt(listen_sock, SOL_SOCKET, SO_MARK, &config.fwmark, sizeof(config.fwmark)) < 0) {
-            log(LL_WARN, "Failed to set 'firewall mark' for listening socket: %s", strerror(errno));
+#ifdef __linux__
+    if (config.pin_threads) {
+        cpu_set_t cpu_set;
+        if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+            serror_level(LL_WARN, "Failed to get the CPU affinity, worker threads are not pinned");
+        } else {
+            int cpus[CPU_SETSIZE], cpus_count = 0;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &cpu_set)) {
+                    cpus[cpus_count++] = cpu;
+                }
+            }
+            for (int i = 0; i < workers_count; i++) {
+                workers[i].cpu = cpus[i % cpus_count];
+            }
+            if (workers_count > cpus_count) {
+                log(LL_WARN, "There are more worker threads (%d) than CPUs available (%d)", workers_count, cpus_count);
+            }
         }
     }
 #endif
 
-    /* Bind the listening socket to the specified address and port */
+    /* Create listening sockets, one per worker thread and port */
     memset(&listen_addr, 0, sizeof(listen_addr));
     listen_addr.sin_family = AF_INET;
     listen_addr.sin_addr.s_addr = s_listen_addr_client;
+    listen_ports = config.listen_ports > 1 ? config.listen_ports : 1;
+    for (int i = 0; i < workers_count; i++) {
+        for (int p = 0; p < listen_ports; p++) {
+            listen_addr.sin_port = htons(config.listen_port + p);
+            // The sockets connected to the clients join the same SO_REUSEPORT group
+            workers[i].listen_socks[p] = create_listen_socket(&config, &listen_addr, workers_count > 1 || config.connected_clients);
+#ifdef SO_INCOMING_CPU
+            // Only a hint for the kernel, the steering program below does the actual work
+            if (workers[i].cpu >= 0
+                && setsockopt(workers[i].listen_socks[p], SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(workers[i].cpu)) < 0) {
+                log(LL_WARN, "Failed to set incoming CPU for listening socket: %s", strerror(errno));
+            }
+#endif
+        }
+        workers[i].listen_sock = workers[i].listen_socks[0];
+        if (i == 0) {
+            // From now on FAILURE() closes it
+            listen_sock = workers[0].listen_sock;
+        }
+    }
     listen_addr.sin_port = htons(config.listen_port);
-    if (bind(listen_sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
-        serror("Failed to bind source socket to %s:%d", 
-            inet_ntoa(listen_addr.sin_addr), ntohs(listen_addr.sin_port));
-        FAILURE();
+    if (workers_count > 1) {
+        int cpus[THREADS_MAX];
+        for (int i = 0; i < workers_count; i++) {
+            cpus[i] = workers[i].cpu;
+        }
+        // The NIC picks the CPU by the port too, so a client hopping over the ports
+        // would move between the threads and lose its entry, the address does not change
+        uint8_t by_cpu = workers[0].cpu >= 0 && listen_ports == 1;
+        for (int p = 0; p < listen_ports; p++) {
+            if ((by_cpu ? reuseport_attach_cpu(workers[0].listen_socks[p], cpus, workers_count)
+                        : reuseport_attach_hash(workers[0].listen_socks[p], workers_count)) < 0) {
+                serror("Failed to attach the SO_REUSEPORT steering program");
+                FAILURE();
+            }
+        }
+    }
+    if (listen_ports > 1) {
+        log(LL_INFO, "Listening on ports %s:%d-%d for source", inet_ntoa(listen_addr.sin_addr),
+            config.listen_port, config.listen_port + listen_ports - 1);
+    } else {
+        log(LL_INFO, "Listening on port %s:%d for source", inet_ntoa(listen_addr.sin_addr), ntohs(listen_addr.sin_port));
+    }
+    if (workers_count > 1) {
+        log(LL_INFO, "Using %d worker threads%s", workers_count, workers[0].cpu >= 0 ? " pinned to CPUs" : "");
     }
-    log(LL_INFO, "Listening on port %s:%d for source", inet_ntoa(listen_addr.sin_addr), ntohs(listen_addr.sin_port));
 
     if (config.masking_handler_set) {
         log(LL_INFO, "Using masking type: %s", config.masking_handler ? config.masking_handler->name : "none");
@@ -784,24 +3713,113 @@ int main(int argc, char *argv[]) {
         log(LL_INFO, "Non-obfuscated (clean) clients are allowed, their traffic will be forwarded as is");
     }
 
-    /* Use epoll for events if enabled */
-#ifdef USE_EPOLL
-    epfd = epoll_create1(0);
-    if (epfd < 0) {
-        serror("epoll_create1");
-        FAILURE();
+#ifdef USE_AF_XDP
+    if (config.xdp_interface[0]) {
+        if (config.io_uring) {
+            log(LL_WARN, "io_uring is not used together with AF_XDP");
+            config.io_uring = 0;
+        }
+        if (config.connected_clients) {
+            // The datagrams of the handshaked clients never reach their sockets
+            log(LL_WARN, "Connected client sockets are not used together with AF_XDP");
+            config.connected_clients = 0;
+        }
+        if (xdp_init(&xdp, config.xdp_interface, config.xdp_skb_mode, &listen_addr, config.max_clients) != 0) {
+            FAILURE();
+        }
+        xdp_enabled = 1;
+        log(LL_INFO, "Using AF_XDP on %s (%s mode, %d queue%s) for the handshaked clients",
+            config.xdp_interface, xdp.skb_mode ? "generic" : "native", xdp.socket_count, xdp.socket_count > 1 ? "s" : "");
     }
-    {
-        struct epoll_event ev = {
-            .events = EPOLLIN,
-            .data.fd = listen_sock
-        };
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) != 0) {
-            serror("epoll_ctl for listen_sock");
+#endif
+
+    if (config.connected_clients) {
+        log(LL_INFO, "Every handshaked client gets its own socket connected to it");
+    }
+
+#ifdef USE_TC_OFFLOAD
+    if (config.tc_offload[0]) {
+        if (offload_init(&offload, config.tc_offload, &listen_addr, config.xor_key, key_length, config.max_clients) != 0) {
             FAILURE();
         }
+        offload_enabled = 1;
+        log(LL_INFO, "Forwarding the data packets of the handshaked clients in the kernel on %s", config.tc_offload);
+    }
+#endif
+
+    // The pipeline takes over every received buffer as a whole, so it works with plain batches only
+    if (config.pipeline > 0) {
+        if (config.io_uring) {
+            log(LL_WARN, "io_uring is not used in the pipeline mode");
+            config.io_uring = 0;
+        }
+        if (config.udp_offload) {
+            log(LL_WARN, "UDP offload is not used in the pipeline mode");
+            config.udp_offload = 0;
+        }
+    }
+
+#ifdef USE_IO_URING
+    if (config.io_uring && config.udp_offload) {
+        log(LL_WARN, "UDP offload is not used together with io_uring");
+        config.udp_offload = 0;
+    }
+#endif
+
+#ifdef USE_LATENCY_MODE
+    if (config.latency_mode) {
+        for (int i = 0; i < workers_count * listen_ports; i++) {
+            if (latency_enable_busy_poll(workers[i / listen_ports].listen_socks[i % listen_ports], config.latency_mode) < 0) {
+                log(LL_WARN, "Failed to enable busy polling (%s), the sockets are only polled by the event loop", strerror(errno));
+                break;
+            }
+        }
+        log(LL_INFO, "Latency mode: polling for %d us after every packet before sleeping", config.latency_mode);
+    }
+    if (config.realtime) {
+        if (latency_lock_memory() < 0) {
+            log(LL_WARN, "Failed to lock the memory: %s", strerror(errno));
+        }
+        log(LL_INFO, "Running the worker threads with the real-time priority");
     }
 #endif
+    if (config.tickless) {
+        int wake[2];
+        if (pipe(wake) < 0) {
+            log(LL_WARN, "Can't create a pipe for the signal wakeups, tickless mode is disabled");
+            config.tickless = 0;
+        } else {
+            signal_wake_rd = wake[0];
+            signal_wake_wr = wake[1];
+            fcntl(signal_wake_rd, F_SETFL, O_NONBLOCK);
+            fcntl(signal_wake_wr, F_SETFL, O_NONBLOCK);
+            log(LL_INFO, "Tickless mode: sleeping until the next client timer");
+        }
+    }
+
+    if (config.udp_offload) {
+        for (int i = 0; i < workers_count * listen_ports && config.udp_offload; i++) {
+            if (batch_enable_gro(workers[i / listen_ports].listen_socks[i % listen_ports]) < 0) {
+                log(LL_WARN, "UDP GRO is not supported by the kernel (%s), UDP offload is disabled", strerror(errno));
+                config.udp_offload = 0;
+            }
+        }
+        if (config.udp_offload) {
+            log(LL_INFO, "UDP offload (GRO/GSO) is enabled");
+        }
+    }
+
+    if (config.pacing_rate) {
+        for (int i = 0; i < workers_count * listen_ports && config.pacing_rate; i++) {
+            if (batch_enable_txtime(workers[i / listen_ports].listen_socks[i % listen_ports]) < 0) {
+                log(LL_WARN, "SO_TXTIME is not supported by the kernel (%s), pacing is disabled", strerror(errno));
+                config.pacing_rate = 0;
+            }
+        }
+        if (config.pacing_rate) {
+            log(LL_INFO, "Pacing every client at %d kbit/s, needs the fq qdisc on the outgoing interfaces", config.pacing_rate);
+        }
+    }
 
     /* Set up forward address */
     memset(&forward_addr, 0, sizeof(forward_addr));
@@ -818,10 +3836,48 @@ int main(int argc, char *argv[]) {
         FAILURE();
     }
     forward_addr.sin_port = htons(target_port);
-    log(LL_INFO, "Target: %s:%d", target_host, target_port);
+    if (target_ports > 1) {
+        log(LL_INFO, "Target: %s:%d-%d", target_host, target_port, target_port + target_ports - 1);
+    } else {
+        log(LL_INFO, "Target: %s:%d", target_host, target_port);
+    }
+    if (config.port_hopping) {
+        log(LL_INFO, "Hopping to another target port every %d seconds", config.port_hopping);
+    }
+    if (config.hop_on_drop) {
+        log(LL_INFO, "Hopping to another target port when the throughput falls %d%% below its average", config.hop_on_drop);
+    }
     strncpy(resolve_target_host, target_host, sizeof(resolve_target_host) - 1);
     resolve_target_is_name = !is_ipv4_literal(target_host);
-
+    for (int i = 0; i < workers_count; i++) {
+        workers[i].forward_addr = forward_addr;
+    }
+    if (config.raw_upstream_ports) {
+        for (int i = 0; i < workers_count; i++) {
+            if (rawudp_init(&workers[i].raw, config.raw_upstream_port, config.raw_upstream_ports, i, workers_count, config.fwmark) != 0
+                || rawudp_set_target(&workers[i].raw, &forward_addr) != 0) {
+                serror("Failed to open the raw upstream socket (needs CAP_NET_RAW)");
+                FAILURE();
+            }
+            if (setup_socket_buffers(&config, workers[i].raw.sock) < 0) {
+                serror_level(LL_WARN, "Failed to set socket buffer sizes for raw upstream socket");
+            }
+        }
+        log(LL_INFO, "Sending to the target through a raw socket, from ports %d-%d",
+            config.raw_upstream_port, config.raw_upstream_port + config.raw_upstream_ports - 1);
+    }
+    if (config.socket_pool && config.raw_upstream_ports) {
+        log(LL_WARN, "Socket pool is not used with the raw upstream mode");
+        config.socket_pool = 0;
+    }
+    if (config.source_pool[0] && config.raw_upstream_ports) {
+        log(LL_WARN, "Source pool is not used with the raw upstream mode");
+    } else if (config.source_pool[0]) {
+        if (srcpool_parse(&source_pool, config.source_pool) != 0) {
+            FAILURE();
+        }
+        log(LL_INFO, "Binding the sockets to the target to %d source addresses", source_pool.count);
+    }
     /* Add static bindings if provided */
     if (config.static_bindings) {
         // Parse static bindings
@@ -864,8 +3920,16 @@ int main(int argc, char *argv[]) {
                 FAILURE();
             }
             client_addr.sin_port = htons(remote_port);
+            if (config.raw_upstream_ports && local_port >= config.raw_upstream_port
+                && local_port < config.raw_upstream_port + config.raw_upstream_ports) {
+                log(LL_ERROR, "Port '%s' for static binding '%s:%s:%s' is in the raw upstream port range",
+                    colon2 + 1, binding, colon1 + 1, colon2 + 1);
+                FAILURE();
+            }
 
-            if (!new_client_entry_static(&config, &client_addr, &forward_addr, local_port, binding)) {
+            // The worker thread which receives the datagrams from the client owns the binding
+            worker_t *owner = &workers[reuseport_worker_for(&client_addr, workers_count)];
+            if (!new_client_entry_static(&config, &owner->conn_table, &client_addr, &forward_addr, local_port, binding)) {
                 log(LL_ERROR, "Failed to create static binding: %s:%s:%s",
                     binding, colon1 + 1, colon2 + 1);
                 FAILURE();
@@ -884,454 +3948,46 @@ int main(int argc, char *argv[]) {
     {
         client_entry_t *e, *tmp;
         int n = 0;
-        HASH_ITER(hh, conn_table, e, tmp) {
-            if (e->is_static && e->bind_host[0]) {
-                n++;
+        for (int i = 0; i < workers_count; i++) {
+            HASH_ITER(hh, workers[i].conn_table, e, tmp) {
+                if (e->is_static && e->bind_host[0]) {
+                    n++;
+                }
             }
         }
         if (n > 0) {
             resolve_bindings = calloc((size_t)n, sizeof(*resolve_bindings));
-            if (!resolve_bindings) {
+            resolve_bindings_worker = calloc((size_t)n, sizeof(*resolve_bindings_worker));
+            if (!resolve_bindings || !resolve_bindings_worker) {
                 log(LL_WARN, "Out of memory, static binding hostnames will not be re-resolved");
+                free(resolve_bindings);
+                free(resolve_bindings_worker);
+                resolve_bindings = NULL;
+                resolve_bindings_worker = NULL;
             } else {
-                HASH_ITER(hh, conn_table, e, tmp) {
-                    if (e->is_static && e->bind_host[0]) {
-                        resolve_bindings[resolve_bindings_count++] = e;
+                for (int i = 0; i < workers_count; i++) {
+                    HASH_ITER(hh, workers[i].conn_table, e, tmp) {
+                        if (e->is_static && e->bind_host[0]) {
+                            resolve_bindings_worker[resolve_bindings_count] = i;
+                            resolve_bindings[resolve_bindings_count++] = e;
+                        }
                     }
                 }
             }
         }
         resolve_start_thread();
-#ifdef USE_EPOLL
-        if (resolve_result_rd >= 0) {
-            struct epoll_event ev = {
-                .events = EPOLLIN,
-                .data.fd = resolve_result_rd
-            };
-            if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolve_result_rd, &ev) != 0) {
-                serror("epoll_ctl for hostname resolver");
-                FAILURE();
-            }
-        }
-#endif
     }
 
     log(LL_INFO, "WireGuard obfuscator successfully started");
 
-    /* Main loop */
-    while (1) {
-        // Reopen the log file after it has been rotated, requested by SIGHUP
-        if (log_reopen_pending) {
-            log_reopen_pending = 0;
-            log_reopen();
-        }
-
-        // Using epoll or poll to wait for events
-#ifdef USE_EPOLL
-        int events_n = epoll_wait(epfd, events, MAX_EVENTS, POLL_TIMEOUT);
-        if (events_n < 0) {
-            if (errno == EINTR) {
-                // Interrupted by a signal, e.g. SIGHUP
-                continue;
-            }
-            serror("epoll_wait");
-            FAILURE();
-        }
-#else
-        int nfds = 0;
-        pollfds[nfds].fd = listen_sock;
-        pollfds[nfds].events = POLLIN;
-        nfds++;
-        if (resolve_result_rd >= 0) {
-            pollfds[nfds].fd = resolve_result_rd;
-            pollfds[nfds].events = POLLIN;
-            nfds++;
-        }
-        client_entry_t *entry, *tmp;
-        HASH_ITER(hh, conn_table, entry, tmp) {
-            if (nfds >= config.max_clients + 2) {
-                log(LL_DEBUG, "Too many clients, cannot add more");
-                break;
-            }
-            pollfds[nfds].fd = entry->server_sock;
-            pollfds[nfds].events = POLLIN;
-            nfds++;
-        }
-        int ret = poll(pollfds, nfds, POLL_TIMEOUT);
-        if (ret < 0) {
-            if (errno == EINTR) {
-                // Interrupted by a signal, e.g. SIGHUP
-                continue;
-            }
-            serror("poll");
+    /* Start the worker threads, the main thread runs the first one */
+    for (int i = 1; i < workers_count; i++) {
+        if ((err = start_thread(&workers[i].thread, worker_run, &workers[i])) != 0) {
+            log(LL_ERROR, "Failed to start worker thread: %s", strerror(err));
             FAILURE();
         }
-#endif
-
-        // Get the current time
-        struct timespec now_ts;
-        clock_gettime(CLOCK_MONOTONIC, &now_ts);
-        now = now_ts.tv_sec * 1000 + now_ts.tv_nsec / 1000000;
-
-#ifdef USE_EPOLL
-        for (int e = 0; e < events_n; e++) {
-            struct epoll_event *event = &events[e];
-            if (resolve_result_rd >= 0 && event->data.fd == resolve_result_rd) {
-                drain_resolve_results(&forward_addr);
-                continue;
-            }
-            if (event->data.fd == listen_sock) {
-#else
-        for (int e = 0; e < nfds; e++) if (pollfds[e].revents & POLLIN) {
-            if (resolve_result_rd >= 0 && pollfds[e].fd == resolve_result_rd) {
-                drain_resolve_results(&forward_addr);
-                continue;
-            }
-            if (pollfds[e].fd == listen_sock) {
-#endif
-                /* *** Handle incoming data from the clients *** */
-                uint8_t *buffer = full_buffer + PREBUFFER_SIZE;
-                struct sockaddr_in sender_addr = {0};
-                socklen_t sender_addr_len = sizeof(sender_addr);
-                int length = recvfrom(listen_sock, buffer, BUFFER_SIZE, MSG_TRUNC | MSG_DONTWAIT, (struct sockaddr *)&sender_addr, &sender_addr_len);
-                if (length < 0) {
-                    // A readiness notification does not guarantee that there is something
-                    // to read by the time we get here, so an empty socket is not an error
-                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        serror_level(LL_DEBUG, "recvfrom client");
-                    }
-                    continue;
-                }
-                if (length > BUFFER_SIZE) {
-                    log(LL_DEBUG, "Received packet from %s:%d is too large (%d bytes), while buffer size is %d bytes, ignoring",
-                        inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port), length, BUFFER_SIZE);
-                    continue;
-                }
-
-                // Find the client entry if any
-                client_entry_t *client_entry;
-                HASH_FIND(hh, conn_table, &sender_addr, sizeof(sender_addr), client_entry);
-
-                uint8_t obfuscated = length >= 4 && is_obfuscated(buffer);
-                // Is it masked packet maybe?
-                masking_handler_t *masking_handler = config.masking_handler;
-                if (obfuscated) {
-                    length = masking_unwrap_from_client(&buffer, length, &config, client_entry, listen_sock, &sender_addr, &forward_addr, &masking_handler);
-                    if (length <= 0) {
-                        // Nothing to do
-                        continue;
-                    }
-                }
-                // Check the length
-                if (length < 4) {
-                    log(LL_DEBUG, "Received too short packet from %s:%d (%d bytes), ignoring", inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port), length);
-                    continue;
-                }
-
-                uint8_t version = client_entry ? client_entry->version : OBFUSCATION_VERSION;
-
-                if (verbose >= LL_TRACE) {
-                    log(LL_TRACE, "Received %d bytes from %s:%d to %s:%d (known=%s, obfuscated=%s)",
-                        length,
-                        inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
-                        target_host, target_port,
-                        client_entry ? "yes" : "no", obfuscated ? "yes" : "no");
-                    log_hexdump(LL_TRACE, obfuscated ? "X->: " : "O->: ", buffer, length);
-                }
-
-                if (obfuscated) {
-                    // decode
-                    int original_length = length;
-                    length = decode(buffer, length, config.xor_key, key_length, &version);
-                    if (length < 4 || length > original_length) {
-                        log(LL_DEBUG, "Failed to decode packet from %s:%d (original_length=%d, decoded_length=%d)",
-                            inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port), original_length, length);
-                        continue;
-                    }
-                }
-
-                // Is it handshake?
-                if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE) {
-                    log(LL_DEBUG, "Received WireGuard handshake from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
-                        inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
-                        target_host, target_port,
-                        length, 
-                        obfuscated ? "yes" : "no");
-
-                    if (!client_entry) {
-                        client_entry = new_client_entry(&config, &sender_addr, &forward_addr);
-                        if (!client_entry) {
-                            continue;
-                        }
-                        client_entry->last_activity_time = now;
-                        client_entry->last_incoming_time = 0;
-                        client_entry->masking_handler = masking_handler;
-                    }
-                    if (config.allow_clean) {
-                        // Remember whether this client speaks plain WireGuard,
-                        // its traffic will be forwarded as is in both directions
-                        if (!obfuscated && !client_entry->client_clean) {
-                            log(LL_INFO, "Client %s:%d is not obfuscated, forwarding its traffic as is",
-                                inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port));
-                        }
-                        client_entry->client_clean = !obfuscated;
-                        if (client_entry->client_clean) {
-                            // No masking for clean clients
-                            client_entry->masking_handler = NULL;
-                        }
-                    }
-                    if (!obfuscated && !client_entry->client_clean) {
-                        masking_on_handshake_req_from_client(&config, client_entry, listen_sock, &sender_addr, &forward_addr);
-                    }
-                    client_entry->handshake_direction = DIR_CLIENT_TO_SERVER;
-                    client_entry->last_handshake_request_time = now;
-                }
-                // Is it handshake response?
-                else if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE_RESP) {
-                    if (!client_entry) {
-                        log(LL_DEBUG, "Received WireGuard handshake response from %s:%d, but no connection entry found for this client",
-                            inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port));
-                        continue;
-                    }
-
-                    log(LL_DEBUG, "Received WireGuard handshake response from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-                        target_host, target_port,
-                        length, obfuscated ? "yes" : "no");
-
-                    // Check handshake timeout
-                    if (now - client_entry->last_handshake_request_time > HANDSHAKE_TIMEOUT) {
-                        log(LL_DEBUG, "Ignoring WireGuard handshake response, handshake timeout");
-                        continue;
-                    }
-
-                    if (client_entry->handshake_direction != DIR_SERVER_TO_CLIENT) {
-                        log(LL_DEBUG, "Received handshake response from %s:%d to %s:%d, but the handshake direction is not set to server-to-client",
-                            inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
-                            target_host, target_port);
-                        continue;;
-                    }
-
-                    log(!client_entry->handshaked ? LL_INFO : LL_DEBUG, "Handshake established with %s:%d to %s:%d (reverse)",
-                        inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
-                        target_host, target_port);
-                    client_entry->handshaked = 1;
-                    client_entry->client_obfuscated = obfuscated;
-                    client_entry->server_obfuscated = !obfuscated;
-                    client_entry->last_handshake_time = now;
-                }
-                // If it's not a handshake or handshake response, connection is not established yet
-                else if (!client_entry || !client_entry->handshaked) {
-                    log(LL_DEBUG, "Ignoring data (packet type #%u) from %s:%d to %s:%d until the handshake is completed",
-                        WG_TYPE(buffer),
-                        inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
-                        target_host, target_port);
-                    continue;
-                }
-
-                // Version downgrade check
-                if (version < client_entry->version) {
-                    log(LL_WARN, "Client %s:%d uses old obfuscation version, downgrading from %d to %d", inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port), 
-                        client_entry->version, version);
-                    client_entry->version = version;
-                }
-
-                if (!obfuscated && !client_entry->client_clean) {
-                    // If the packet is not obfuscated, we need to encode it
-                    length = encode(buffer, length, config.xor_key, key_length, client_entry->version, config.max_dummy_length_data);
-                    if (length < 4) {
-                        log(LL_ERROR, "Failed to encode packet from %s:%d (too short, length=%d)",
-                            inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port), length);
-                        continue;
-                    }
-                    length = masking_data_wrap_to_server(&buffer, length, &config, client_entry, listen_sock, &forward_addr);
-                }
-
-                log_hexdump(LL_TRACE, (!obfuscated && !client_entry->client_clean) ? "X->: " : "O->: ", buffer, length);
-
-                length = send(client_entry->server_sock, buffer, length, 0);
-                if (length < 0) {
-                    serror_level(LL_DEBUG, "sendto %s:%d", target_host, target_port);
-                    continue;
-                }
-                client_entry->last_activity_time = now;
-            } else { // if (event->data.fd == listen_sock)
-                /* *** Handle data from the server *** */
-#ifdef USE_EPOLL
-                client_entry_t *client_entry = event->data.ptr;
-#else
-                client_entry_t *client_entry = find_by_server_sock(pollfds[e].fd);
-#endif
-                uint8_t *buffer = full_buffer + PREBUFFER_SIZE;
-                int length = recv(client_entry->server_sock, buffer, BUFFER_SIZE, MSG_TRUNC | MSG_DONTWAIT);
-                if (length < 0) {
-                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        serror_level(LL_DEBUG, "recv from server");
-                    }
-                    continue;
-                }
-                if (length > BUFFER_SIZE) {
-                    log(LL_DEBUG, "Received packet from %s:%d is too large (%d bytes), while buffer size is %d bytes, ignoring",
-                        target_host, target_port, length, BUFFER_SIZE);
-                    continue;
-                }
-                uint8_t obfuscated = length >= 4 && is_obfuscated(buffer);
-                if (obfuscated) {
-                    // Is it masked packet maybe?
-                    length = masking_unwrap_from_server(&buffer, length, &config, client_entry, listen_sock, &forward_addr);
-                    if (length <= 0) {
-                        // Nothing to do
-                        continue;
-                    }
-                }
-                // Check the length
-                if (length < 4) {
-                    log(LL_DEBUG, "Received too short packet from %s:%d (%d bytes), ignoring", target_host, target_port, length);
-                    continue;
-                }
-
-                uint8_t version = client_entry->version;
-
-                if (verbose >= LL_TRACE) {
-                    log(LL_TRACE, "Received %d bytes from %s:%d to %s:%d (obfuscated=%s)",
-                        length,
-                        target_host, target_port, 
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-                        obfuscated ? "yes" : "no");
-                    log_hexdump(LL_TRACE, obfuscated ? "<-X: " : "<-O: ", buffer, length);
-                }
-
-                if (obfuscated) {
-                    // decode
-                    int original_length = length;
-                    length = decode(buffer, length, config.xor_key, key_length, &version);
-                    if (length < 4 || length > original_length) {
-                        log(LL_DEBUG, "Failed to decode packet from %s:%d (original_length=%d, decoded_length=%d)", target_host, target_port, original_length, length);
-                        continue;
-                    }
-                }
-
-                // Is it handshake?
-                if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE) {
-                    log(LL_DEBUG, "Received WireGuard handshake from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
-                        target_host, target_port,
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-                        length, 
-                        obfuscated ? "yes" : "no");
-                    if (!obfuscated && !client_entry->client_clean) {
-                        // Send STUN binding request before the obfuscated handshake
-                        masking_on_handshake_req_from_server(&config, client_entry, listen_sock, &client_entry->client_addr, &forward_addr);
-                    }
-                    client_entry->handshake_direction = DIR_SERVER_TO_CLIENT;
-                    client_entry->last_handshake_request_time = now;
-                }
-                // Is it handshake response?
-                else if (WG_TYPE(buffer) == WG_TYPE_HANDSHAKE_RESP) {
-                    log(LL_DEBUG, "Received WireGuard handshake response from %s:%d to %s:%d (%d bytes, obfuscated=%s)",
-                        target_host, target_port,
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-                        length, obfuscated ? "yes" : "no");
-
-                    // Check handshake timeout
-                    if (now - client_entry->last_handshake_request_time > HANDSHAKE_TIMEOUT) {
-                        log(LL_DEBUG, "Ignoring WireGuard handshake response, handshake timeout");
-                        continue;
-                    }
-
-                    if (client_entry->handshake_direction != DIR_CLIENT_TO_SERVER) {
-                        log(LL_DEBUG, "Received handshake response from %s:%d to %s:%d, but the handshake direction is not set to client-to-server",
-                            target_host, target_port,
-                            inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
-                        continue;
-                    }
-
-                    log(!client_entry->handshaked ? LL_INFO : LL_DEBUG, "Handshake established with %s:%d to %s:%d (direct)",
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port),
-                        target_host, target_port);
-                    if (!client_entry->handshaked && client_entry->masking_handler && !config.masking_handler_set) {
-                        log(LL_INFO, "Autodetected masking handler for client %s:%d: %s", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port), client_entry->masking_handler->name);
-                    }
-                    client_entry->handshaked = 1;
-                    client_entry->client_obfuscated = !obfuscated && !client_entry->client_clean;
-                    client_entry->server_obfuscated = obfuscated;
-                    client_entry->last_handshake_time = now;
-                }
-                // If it's not a handshake or handshake response, connection is not established yet
-                else if (!client_entry->handshaked) {
-                    log(LL_DEBUG, "Ignoring response (packet type #%u) from %s:%d to %s:%d until the handshake is completed",
-                        WG_TYPE(buffer),
-                        target_host, target_port,
-                        inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
-                    continue;
-                }
-
-                // Version downgrade check
-                if (version < client_entry->version) {
-                    log(LL_WARN, "Server %s:%d uses old obfuscation version, downgrading from %d to %d", 
-                        target_host, target_port, client_entry->version, version);
-                    client_entry->version = version;
-                }
-
-                if (!obfuscated && !client_entry->client_clean) {
-                    // If the packet is not obfuscated, we need to encode it
-                    length = encode(buffer, length, config.xor_key, key_length, client_entry->version, config.max_dummy_length_data);
-                    if (length < 4) {
-                        log(LL_ERROR, "Failed to encode packet from %s:%d", target_host, target_port);
-                        continue;
-                    }
-                    length = masking_data_wrap_to_client(&buffer, length, &config, client_entry, listen_sock, &forward_addr);
-                }
-                
-                log_hexdump(LL_TRACE, (!obfuscated && !client_entry->client_clean) ? "<-X: " : "<-O: ", buffer, length);
-
-                // Send the response back to the original client
-                length = sendto(listen_sock, buffer, length, 0, (struct sockaddr *)&client_entry->client_addr, sizeof(client_entry->client_addr));
-                if (length < 0) {
-                    serror_level(LL_DEBUG, "sendto %s:%d", inet_ntoa(client_entry->client_addr.sin_addr), ntohs(client_entry->client_addr.sin_port));
-                    continue;
-                }
-                client_entry->last_activity_time = now;
-                client_entry->last_incoming_time = now;
-            } // if (event->data.fd != listen_sock)
-        } // for (int e = 0; e < events_n; e++)
-
-        if (now - last_cleanup_time >= ITERATE_INTERVAL) {
-            client_entry_t *current_entry, *tmp;
-            // Iterate over all client entries
-            HASH_ITER(hh, conn_table, current_entry, tmp) {
-                // Check if the entry is idle for too long
-                uint8_t idle = now - current_entry->last_activity_time >= config.idle_timeout;
-                uint8_t incoming_timeout = config.in_timeout > 0 && now - current_entry->last_incoming_time >= config.in_timeout;
-                uint8_t handshake_timeout = !current_entry->handshaked && now - current_entry->last_activity_time >= HANDSHAKE_TIMEOUT;
-                if ((idle || incoming_timeout || handshake_timeout) && !current_entry->is_static) { // Do not remove static entries
-                    // Remove old entry
-                    if (idle) {
-                        log(LL_INFO, "Removing idle client %s:%d", inet_ntoa(current_entry->client_addr.sin_addr), ntohs(current_entry->client_addr.sin_port));
-                    } else if (incoming_timeout) {
-                        log(LL_INFO, "Removing client %s:%d due to incoming timeout", inet_ntoa(current_entry->client_addr.sin_addr), ntohs(current_entry->client_addr.sin_port));
-                    } else if (handshake_timeout) {
-                        log(LL_DEBUG, "Removing client %s:%d due to handshake timeout", inet_ntoa(current_entry->client_addr.sin_addr), ntohs(current_entry->client_addr.sin_port));
-                    }
-#ifdef USE_EPOLL
-                    epoll_ctl(epfd, EPOLL_CTL_DEL, current_entry->server_sock, NULL);
-#endif
-                    close(current_entry->server_sock);
-                    HASH_DEL(conn_table, current_entry);
-                    free(current_entry);
-                    continue;
-                }
-
-                // Check if we need to call masking timer
-                if (current_entry->masking_handler && current_entry->masking_handler->timer_interval_s > 0
-                    && now - current_entry->last_masking_timer_time >= current_entry->masking_handler->timer_interval_s * 1000) {
-                    current_entry->last_masking_timer_time = now;
-                    masking_on_timer(&config, current_entry, listen_sock, &forward_addr);
-                }
-            }
-            // Update the last cleanup time
-            last_cleanup_time = now;
-        }
-    } // while (1)
+    }
+    worker_run(&workers[0]);
 
     // You should never reach this point, but just in case
     return 0;
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include "uthash.h"
+#include "wheel.h"
 
 // on Linux, use epoll for better performance
 #ifdef __linux__
@@ -19,6 +20,26 @@
 #include <poll.h>
 #endif
 
+// on Linux, use recvmmsg()/sendmmsg() to move several datagrams per syscall
+#ifdef __linux__
+#define USE_MMSG
+#endif
+
+// on Linux, the sockets report how many datagrams the kernel has dropped with the received ones (SO_RXQ_OVFL)
+#if defined(USE_MMSG) && defined(SO_RXQ_OVFL)
+#define USE_RXQ_OVFL
+#endif
+
+// on Linux, the datagrams can be given a departure time, the fq qdisc holds them until then (SO_TXTIME)
+#if defined(USE_MMSG) && defined(SO_TXTIME)
+#define USE_TXTIME
+#endif
+
+// on Linux, the ICMP errors about the sent datagrams are queued to their sockets (IP_RECVERR)
+#if defined(__linux__) && defined(IP_RECVERR)
+#define USE_RECVERR
+#endif
+
 #define WG_OBFUSCATOR_VERSION "1.6"
 #define WG_OBFUSCATOR_GIT_REPO "https://github.com/ClusterM/wg-obfuscator"
 
@@ -31,6 +52,7 @@
 #define POLL_TIMEOUT                    5000    // in milliseconds
 #define HANDSHAKE_TIMEOUT               5000    // in milliseconds
 #define ITERATE_INTERVAL                1000    // in milliseconds
+#define TICKLESS_SLACK                  1000    // in milliseconds, the timeouts are rounded up to it in the tickless mode
 #define MAX_DUMMY_LENGTH_TOTAL          1024    // maximum length of a packet after dummy data extension
 #define MAX_DUMMY_LENGTH_HANDSHAKE      512     // maximum length of dummy data for handshake packets
 
@@ -38,6 +60,30 @@
 #define IDLE_TIMEOUT_DEFAULT            300000  // in milliseconds
 #define IN_TIMEOUT_DEFAULT              0       // in milliseconds
 #define MAX_DUMMY_LENGTH_DATA_DEFAULT   4       // maximum length of dummy data for data packets
+#define BATCH_SIZE_DEFAULT              16      // maximum number of datagrams received/sent per syscall
+#define BATCH_SIZE_MAX                  1024    // upper limit for the batch size (UIO_MAXIOV)
+#define THREADS_MAX                     256     // upper limit for the number of worker threads
+#define PIPELINE_MAX                    64      // upper limit for the number of pipeline processing threads
+#define DRAIN_BUDGET_DEFAULT            64      // maximum number of datagrams received from one socket per wakeup
+#define DRAIN_BUDGET_MAX                65536   // upper limit for the drain budget
+#define SEND_QUEUE_DEFAULT              256     // maximum number of datagrams kept per socket while its send buffer is full
+#define SEND_QUEUE_MAX                  65536   // upper limit for the send queue
+#define SOCKET_POOL_MAX                 65536   // upper limit for the number of spare server sockets per worker thread
+#define SOCKET_POOL_REFILL              8       // maximum number of spare server sockets opened per wakeup
+#define SOCKET_BUFFER_MAX               (1 << 30) // upper limit for the socket buffer sizes, in bytes
+#define SOCKET_POOL_RETRY               1000    // in milliseconds, delay before opening spare server sockets again after a failure
+#define PACING_RATE_MAX                 100000000 // upper limit for the pacing rate, in kbit/s
+#define PACING_HORIZON                  100     // in milliseconds, the furthest ahead a datagram is scheduled, the later ones are dropped
+#define ICMP_ERRORS_MAX                 64      // maximum number of queued ICMP errors read from a socket per wakeup
+#define PATH_MTU_INTERVAL               10000   // in milliseconds, how often the path MTU of the connected sockets is read again
+#define IP_UDP_HEADERS_SIZE             28      // IPv4 and UDP headers, counted in the path MTU
+#define JUMBO_CACHE_MAX                 1048576 // upper limit for the keystream cache of the jumbo mode, in KiB per thread
+#define LISTEN_PORTS_MAX                64      // upper limit for the number of ports listened on
+#define PORT_HOPPING_MAX                86400   // upper limit for the port hopping interval, in seconds
+#define HOP_WINDOW                      1000    // in milliseconds, the throughput from the server is measured over it (hop-on-drop)
+#define HOP_DROP_MIN_RATE               16384   // in bytes per second, lower average throughputs never count as dropped (hop-on-drop)
+#define HOP_RETIRE_DELAY                1000    // in milliseconds, the old server socket of a source port hop still forwards the replies on their way to it
+#define XDP_HEADERS_SIZE                42      // Ethernet, IPv4 and UDP headers of a datagram received through AF_XDP
 
 // Default instance name
 #define DEFAULT_INSTANCE_NAME   "main"
@@ -68,6 +114,7 @@ typedef struct masking_handler masking_handler_t;
 // Structure to hold obfuscator configuration
 typedef struct {
     int listen_port;                            // Listening port for the obfuscator
+    int listen_ports;                           // Number of ports listened on, from listen_port on
     char forward_host_port[256];                // Host and port to forward the data to
     char xor_key[256];                          // Key for obfuscation
     char client_interface[256];                 // Client interface as a string
@@ -82,6 +129,35 @@ typedef struct {
     char log_file[512];                         // Path of the log file
     int8_t log_timestamps;                      // 1 to force timestamps on, 0 to force them off, -1 for auto
     long resolve_interval;                      // Hostname re-resolve interval in milliseconds, 0 to disable periodic refresh
+    int batch_size;                             // Maximum number of datagrams received/sent per syscall
+    int drain_budget;                           // Maximum number of datagrams received from one socket per wakeup of the event loop
+    int send_queue;                             // Maximum number of datagrams kept per socket while its send buffer is full, 0 to block instead
+    uint8_t udp_offload;                        // 1 to receive with UDP GRO and send with UDP GSO
+    uint8_t io_uring;                           // 1 to use the io_uring event loop instead of epoll
+    int threads;                                // Number of worker threads, each with its own listening socket
+    uint8_t pin_threads;                        // 1 to pin the worker threads to CPUs and steer packets by CPU
+    int pipeline;                               // Number of pipeline processing threads, 0 to process packets on the receiving thread
+    char xdp_interface[256];                    // Interface to receive the packets of the handshaked clients on through AF_XDP, empty to disable
+    uint8_t xdp_skb_mode;                       // 1 to attach the XDP program in the generic (SKB) mode
+    char tc_offload[256];                       // Interfaces to forward the data packets of the handshaked clients on in the kernel, empty to disable
+    int latency_mode;                           // Microseconds to keep polling the sockets without sleeping after a packet, 0 to disable
+    uint8_t realtime;                           // 1 to lock the memory and run the worker threads with the real-time priority
+    uint8_t tickless;                           // 1 to sleep until the next timer and expire the timers of many clients together
+    uint8_t connected_clients;                  // 1 to give every handshaked client its own socket connected to it
+    uint16_t raw_upstream_port;                 // First source port of the raw upstream mode
+    int raw_upstream_ports;                     // Number of source ports of the raw upstream mode, 0 to give every client its own socket
+    char source_pool[512];                      // Local addresses (and port ranges) to bind the server sockets of the dynamic clients to, empty for any
+    int socket_pool;                            // Number of ready server sockets every worker thread keeps for new clients, 0 to disable
+    int rcvbuf;                                 // Receive buffer size of the sockets in bytes, 0 to keep the system default
+    int sndbuf;                                 // Send buffer size of the sockets in bytes, 0 to keep the system default
+    uint8_t latency_histograms;                 // 1 to timestamp the received datagrams and keep histograms of the forwarding latency
+    int pacing_rate;                            // Rate every client is paced at in each direction, in kbit/s, 0 to send right away
+    uint8_t preserve_tos;                       // 1 to send every datagram with the TOS byte (DSCP and ECN) it was received with
+    uint8_t dscp_map[2][64];                    // DSCP to send with by direction and received DSCP, applied if preserve_tos is set
+    uint8_t icmp_errors;                        // 1 to read the ICMP errors about the sent datagrams and remove the clients with a dead path
+    int jumbo_cache;                            // Memory of the keystream cache per thread in KiB for packets longer than KEYSTREAM_ROW_MAX, 0 to not cache them
+    int port_hopping;                           // Seconds between the hops of every client to another port of the target range, 0 to not hop on a schedule
+    int hop_on_drop;                            // Percentage the throughput from the server has to fall below its average to hop, 0 to disable
 
     uint8_t log_file_set;                       // 1 if the log file is set, 0 otherwise
     uint8_t listen_port_set;                    // 1 if the listen port is set, 0 otherwise
@@ -110,7 +186,42 @@ typedef struct {
     uint8_t server_obfuscated   : 1;            // 1 if the server is obfuscated, 0 otherwise
     uint8_t client_clean        : 1;            // 1 if the client speaks plain (non-obfuscated) WireGuard, traffic is passed through as is (allow-clean mode)
     uint8_t is_static           : 1;            // 1 if this is a static binding entry, 0 otherwise
+    uint8_t offloaded           : 1;            // 1 if the data packets are forwarded by the TC offload program
+    uint8_t raw_upstream        : 1;            // 1 if the datagrams to the server go through the raw socket of the worker, server_sock is -1
+    uint8_t spare               : 1;            // 1 if the entry is a ready server socket waiting for a new client in the socket pool
+    uint8_t path_dead           : 1;            // 1 if an ICMP error has reported the server or the client unreachable, removed with the next timer
+    uint8_t hop_source          : 1;            // 1 to move the server connection to a new source port with the next handshake from the client
+    uint8_t listen_moved        : 1;            // 1 if the client sends to another listening port now, its connected socket is replaced with the next timer
     char bind_host[256];                        // Original hostname of a static binding, empty if the address is a literal or the entry is dynamic
+    uint8_t xdp_ready;                          // 1 if the datagrams to the client can be sent through AF_XDP
+    uint16_t xdp_queue;                         // AF_XDP socket the client's datagrams arrive on
+    uint8_t xdp_headers[XDP_HEADERS_SIZE];      // Ethernet, IPv4 and UDP headers of the last datagram from the client
+    uint64_t offload_packets;                   // datagrams forwarded by the TC offload program so far
+    int poll_index;                             // position of the server socket in the poll() descriptor set (non-epoll builds)
+    int client_sock;                            // socket connected to the client, -1 if its datagrams go through the listening socket
+    int client_poll_index;                      // position of the client socket in the poll() descriptor set (non-epoll builds)
+    int source_index;                           // address of the source pool the server socket is bound to, -1 if none
+    uint32_t server_drops_seen;                 // last drop counter reported by the server socket
+    uint32_t client_drops_seen;                 // last drop counter reported by the socket connected to the client
+    uint64_t kernel_drops;                      // datagrams of this client dropped by the kernel on its own sockets
+    uint64_t pace_next_ns[2];                   // pacing: earliest departure of the next datagram by direction, CLOCK_MONOTONIC
+    uint32_t icmp_errors;                       // ICMP errors reported about the datagrams of this client
+    uint16_t path_mtu[2];                       // MTU of the path by direction, from IP_MTU or ICMP "fragmentation needed", 0 if unknown
+    long path_mtu_time;                         // last time the path MTU was read from the connected sockets
+    uint16_t sent_length[2];                    // IP length of the last encoded datagram by direction
+    uint16_t sent_padding[2];                   // of it, dummy data and masking overhead added by us
+    int listen_sock;                            // listening socket the client sends to, 0 for the first one of the worker
+    uint16_t target_port;                       // port of the target range the server socket is connected to, network order, 0 for the first one
+    int retired_sock;                           // server socket left by a source port hop, still watched until retire_time, -1 if none
+    int retired_source_index;                   // address of the source pool it is bound to, -1 if none
+    int retired_poll_index;                     // position of the retired socket in the poll() descriptor set (non-epoll builds)
+    long retire_time;                           // time the retired socket is closed
+    long hop_time;                              // last time the client hopped to another target port, 0 if not yet
+    long hop_window_start;                      // start of the current throughput measurement (hop-on-drop)
+    uint64_t hop_rx_bytes;                      // bytes received from the server since then
+    uint32_t hop_tx_packets;                    // datagrams sent to the server since then
+    uint64_t hop_rx_avg;                        // average throughput from the server in bytes per second, 0 if not known yet
+    wheel_timer_t timer;                        // expiry timer, armed for the nearest timeout or masking timer
     UT_hash_handle hh;
 } client_entry_t;
 
@@ -122,6 +233,7 @@ extern char section_name[256];
 const char *version_string(void);
 void print_version(void);
 void register_child_instance(pid_t pid);
+ssize_t send_to_server(client_entry_t *client_entry, uint8_t *buffer, int length);
 
 void log_init(const char *path, int8_t timestamps_mode);
 void log_reopen(void);
@@ -0,0 +1,182 @@
+#include <string.h>
+#include "wheel.h"
+
+#define WHEEL_MASK              (WHEEL_SLOTS - 1)
+#define WHEEL_NEVER             UINT64_MAX
+
+static void link_timer(wheel_timer_t **head, wheel_timer_t *timer)
+{
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void unlink_timer(wheel_timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * @brief Puts the timer into the slot of the lowest level which reaches its tick.
+ */
+static void place(wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (timer->expires < wheel->current) {
+        timer->expires = wheel->current;
+    }
+    uint64_t delta = timer->expires - wheel->current;
+    uint64_t tick = timer->expires;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >= 1ULL << (WHEEL_BITS * WHEEL_LEVELS)) {
+        // Too far, the farthest slot of the top level, it is placed again when the slot comes
+        tick = wheel->current + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int shift = WHEEL_BITS * level;
+    link_timer(&wheel->slots[level][(tick >> shift) & WHEEL_MASK], timer);
+    // The slot is processed at the start of its span, nothing happens to the timer before that
+    uint64_t wake = (tick >> shift) << shift;
+    if (wake < wheel->next) {
+        wheel->next = wake;
+    }
+}
+
+/**
+ * @brief Finds the first tick with a non-empty slot to process, after it has passed.
+ */
+static void find_next(wheel_t *wheel)
+{
+    wheel->next = WHEEL_NEVER;
+    if (!wheel->pending) {
+        return;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        // First span of the level which is not processed yet
+        uint64_t first = (wheel->current + (1ULL << shift) - 1) >> shift;
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            uint64_t span = first + i;
+            if (wheel->slots[level][span & WHEEL_MASK]) {
+                if (span << shift < wheel->next) {
+                    wheel->next = span << shift;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Processes the current tick: moves the timers of the higher levels down and expires the due ones.
+ */
+static int step(wheel_t *wheel, wheel_callback_t callback, void *arg)
+{
+    uint64_t tick = wheel->current;
+
+    // The highest level first, its timers may go down to the slot of the next level processed right now
+    int top = 0;
+    while (top < WHEEL_LEVELS - 1 && (tick & ((1ULL << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+        top++;
+    }
+    for (int level = top; level > 0; level--) {
+        wheel_timer_t **head = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        wheel_timer_t *timer = *head;
+        *head = NULL;
+        while (timer) {
+            wheel_timer_t *next = timer->next;
+            place(wheel, timer);
+            timer = next;
+        }
+    }
+
+    // Detached, so the callbacks can add timers to the same slot and remove any timer
+    wheel_timer_t *expired = NULL;
+    wheel_timer_t **head = &wheel->slots[0][tick & WHEEL_MASK];
+    if (*head) {
+        expired = *head;
+        expired->pprev = &expired;
+        *head = NULL;
+    }
+    wheel->current = tick + 1;
+
+    int count = 0;
+    while (expired) {
+        wheel_timer_t *timer = expired;
+        unlink_timer(timer);
+        wheel->pending--;
+        count++;
+        callback(timer, arg);
+    }
+    return count;
+}
+
+void wheel_init(wheel_t *wheel, long now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = (uint64_t)now / WHEEL_TICK_MS;
+    wheel->next = WHEEL_NEVER;
+}
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, long when)
+{
+    if (wheel_pending(timer)) {
+        unlink_timer(timer);
+    } else {
+        wheel->pending++;
+    }
+    // Rounded up, the timer never expires early
+    timer->expires = when > 0 ? ((uint64_t)when + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS : 0;
+    place(wheel, timer);
+}
+
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!wheel_pending(timer)) {
+        return;
+    }
+    unlink_timer(timer);
+    wheel->pending--;
+}
+
+int wheel_advance(wheel_t *wheel, long now, wheel_callback_t callback, void *arg)
+{
+    uint64_t target = (uint64_t)now / WHEEL_TICK_MS;
+    int count = 0;
+    while (wheel->current <= target) {
+        if (wheel->next < wheel->current) {
+            find_next(wheel);
+        }
+        if (wheel->next > wheel->current) {
+            // All the slots are empty up to the next tick with work
+            if (wheel->next > target) {
+                wheel->current = target + 1;
+                break;
+            }
+            wheel->current = wheel->next;
+        }
+        count += step(wheel, callback, arg);
+    }
+    return count;
+}
+
+long wheel_timeout(wheel_t *wheel, long now)
+{
+    if (wheel->next < wheel->current) {
+        find_next(wheel);
+    }
+    if (wheel->next == WHEEL_NEVER) {
+        return -1;
+    }
+    uint64_t at = wheel->next * WHEEL_TICK_MS;
+    return at > (uint64_t)now ? (long)(at - (uint64_t)now) : 0;
+}
@@ -0,0 +1,90 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+
+// Hierarchical timer wheel: every level has WHEEL_SLOTS slots, a slot of a level spans all
+// the slots of the level below. The timers of a higher level are moved down when their slot comes.
+#define WHEEL_TICK_MS           100     // resolution of the timers, in milliseconds
+#define WHEEL_BITS              6
+#define WHEEL_SLOTS             (1 << WHEEL_BITS)
+#define WHEEL_LEVELS            4       // 100 ms * 64^4, about 19 days, later timers are moved down early
+
+// Timer, embedded into the structure it belongs to
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev;                 // NULL if the timer is not pending
+    uint64_t expires;                           // tick the timer expires at
+} wheel_timer_t;
+
+typedef struct {
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current;                           // next tick to process
+    uint64_t next;                              // no timer expires before this tick
+    int pending;                                // number of the pending timers
+} wheel_t;
+
+/**
+ * @brief Called for every expired timer, the timer is not pending anymore and may be added again.
+ *
+ * @param timer Expired timer.
+ * @param arg Argument passed to wheel_advance().
+ */
+typedef void (*wheel_callback_t)(wheel_timer_t *timer, void *arg);
+
+/**
+ * @brief Initializes an empty wheel.
+ *
+ * @param wheel Wheel.
+ * @param now Current time in milliseconds.
+ */
+void wheel_init(wheel_t *wheel, long now);
+
+/**
+ * @brief Adds the timer to the wheel, or moves it if it is pending already.
+ * A time in the past expires on the next wheel_advance().
+ *
+ * @param wheel Wheel.
+ * @param timer Timer.
+ * @param when Time to expire at, in milliseconds.
+ */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, long when);
+
+/**
+ * @brief Removes the timer from the wheel, does nothing if it is not pending.
+ *
+ * @param wheel Wheel.
+ * @param timer Timer.
+ */
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer);
+
+/**
+ * @brief Returns 1 if the timer is in the wheel.
+ */
+static inline int wheel_pending(const wheel_timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/**
+ * @brief Expires all the timers due by 'now', in the order of their ticks.
+ *
+ * @param wheel Wheel.
+ * @param now Current time in milliseconds.
+ * @param callback Function to call for every expired timer.
+ * @param arg Argument for the callback.
+ * @return Number of expired timers.
+ */
+int wheel_advance(wheel_t *wheel, long now, wheel_callback_t callback, void *arg);
+
+/**
+ * @brief Returns how long the event loop may sleep before wheel_advance() has work to do.
+ * It may be earlier than the first timer, when the timers of a higher level are moved down.
+ *
+ * @param wheel Wheel.
+ * @param now Current time in milliseconds.
+ * @return Time in milliseconds, -1 if there are no timers.
+ */
+long wheel_timeout(wheel_t *wheel, long now);
+
+#endif // _WHEEL_H_
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include "xdp.h"
+
+#ifdef USE_AF_XDP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "stats.h"
+#include "ebpf.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP                 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP                  44
+#endif
+
+#define XDP_FRAME_SIZE          4096    // one frame per datagram, jumbo frames do not fit
+#define XDP_FRAMES              4096    // per socket, half of them receive and the other half send
+#define XDP_RING_SIZE           (XDP_FRAMES / 2)
+#define XDP_KICKS_MAX           64      // the generic mode sends a limited number of frames per kick
+
+// Key of the clients map, must match the program
+typedef struct {
+    uint32_t addr;
+    uint32_t port;
+} xdp_client_key_t;
+
+/**
+ * @brief Loads the program which redirects the datagrams from the known clients
+ * to the listening port into the AF_XDP socket of the receive queue. Everything
+ * else goes on to the kernel stack.
+ */
+static int load_program(xdp_t *xdp, const struct sockaddr_in *listen_addr)
+{
+    static ebpf_prog_t prog;
+    ebpf_prog_t *p = &prog;
+    ebpf_init(p);
+    int pass = ebpf_label(p);
+    // r6 = ctx, r2 = data, r3 = data_end
+    EBPF_MOV(p, BPF_REG_6, BPF_REG_1);
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data));
+    EBPF_LDX(p, BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end));
+    // Ethernet, IPv4 without options and UDP headers must be there
+    EBPF_MOV(p, BPF_REG_4, BPF_REG_2);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_4, XDP_HEADERS_SIZE);
+    EBPF_JMP(p, BPF_JGT, BPF_REG_4, BPF_REG_3, pass);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 12);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, htons(0x0800), pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_2, 14);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, 0x45, pass);
+    EBPF_LDX(p, BPF_B, BPF_REG_4, BPF_REG_2, 23);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, IPPROTO_UDP, pass);
+    // Fragments are left to the kernel
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 20);
+    EBPF_ALU32_IMM(p, BPF_AND, BPF_REG_4, htons(0x3FFF));
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, 0, pass);
+    // Destination port and address
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 36);
+    EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, listen_addr->sin_port, pass);
+    if (listen_addr->sin_addr.s_addr != INADDR_ANY) {
+        EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 30);
+        EBPF_JMP32_IMM(p, BPF_JNE, BPF_REG_4, (int32_t)listen_addr->sin_addr.s_addr, pass);
+    }
+    // Look the source address up in the clients map, the key is on the stack
+    EBPF_LDX(p, BPF_W, BPF_REG_4, BPF_REG_2, 26);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, -8);
+    EBPF_LDX(p, BPF_H, BPF_REG_4, BPF_REG_2, 34);
+    EBPF_STX(p, BPF_W, BPF_REG_10, BPF_REG_4, -4);
+    ebpf_map_fd(p, BPF_REG_1, xdp->clients_map_fd);
+    EBPF_MOV(p, BPF_REG_2, BPF_REG_10);
+    EBPF_ALU_IMM(p, BPF_ADD, BPF_REG_2, -8);
+    EBPF_CALL(p, BPF_FUNC_map_lookup_elem);
+    EBPF_JMP_IMM(p, BPF_JEQ, BPF_REG_0, 0, pass);
+    // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)
+    EBPF_LDX(p, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index));
+    ebpf_map_fd(p, BPF_REG_1, xdp->xsks_map_fd);
+    EBPF_MOV_IMM(p, BPF_REG_3, XDP_PASS);
+    EBPF_CALL(p, BPF_FUNC_redirect_map);
+    EBPF_EXIT(p);
+    ebpf_place(p, pass);
+    EBPF_MOV_IMM(p, BPF_REG_0, XDP_PASS);
+    EBPF_EXIT(p);
+
+    xdp->prog_fd = ebpf_load(p, BPF_PROG_TYPE_XDP);
+    return xdp->prog_fd;
+}
+
+static int attach_program(xdp_t *xdp, uint32_t flags)
+{
+    xdp->link_fd = ebpf_link_create(xdp->prog_fd, xdp->ifindex, BPF_XDP, flags);
+    return xdp->link_fd;
+}
+
+/**
+ * @brief Returns the number of receive queues of the interface.
+ */
+static int count_queues(const char *ifname)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 1;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "rx-", 3) == 0) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+static int map_ring(xsk_ring_t *ring, int fd, const struct xdp_ring_offset *off, size_t desc_size, uint64_t pgoff)
+{
+    ring->map_size = off->desc + XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+    return 0;
+}
+
+static void unmap_ring(xsk_ring_t *ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->map_size);
+        ring->map = NULL;
+    }
+}
+
+/**
+ * @brief Creates the AF_XDP socket for one receive queue and hands all the receive frames to the kernel.
+ */
+static int open_socket(xdp_t *xdp, xdp_socket_t *s, int queue)
+{
+    int ring_size = XDP_RING_SIZE;
+    s->queue = queue;
+    s->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (s->fd < 0) {
+        return -1;
+    }
+    s->umem_size = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+    s->umem = mmap(NULL, s->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    s->rx_held = calloc(XDP_RING_SIZE, sizeof(*s->rx_held));
+    s->tx_free = calloc(XDP_RING_SIZE, sizeof(*s->tx_free));
+    if (s->umem == MAP_FAILED || !s->rx_held || !s->tx_free) {
+        if (s->umem == MAP_FAILED) {
+            s->umem = NULL;
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t)(uintptr_t)s->umem,
+        .len = s->umem_size,
+        .chunk_size = XDP_FRAME_SIZE,
+        .headroom = PREBUFFER_SIZE, // room for masking handlers to prepend headers
+    };
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0
+        || setsockopt(s->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0
+        || setsockopt(s->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0
+        || setsockopt(s->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0
+        || setsockopt(s->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0
+        || getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0) {
+        return -1;
+    }
+    if (map_ring(&s->fill, s->fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0
+        || map_ring(&s->completion, s->fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0
+        || map_ring(&s->rx, s->fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0
+        || map_ring(&s->tx, s->fd, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0) {
+        return -1;
+    }
+
+    // The first half of the frames receive, the second half send
+    uint64_t *fill = s->fill.descs;
+    for (int i = 0; i < XDP_RING_SIZE; i++) {
+        fill[i] = (uint64_t)i * XDP_FRAME_SIZE;
+        s->tx_free[i] = (uint64_t)(XDP_RING_SIZE + i) * XDP_FRAME_SIZE;
+    }
+    s->tx_free_count = XDP_RING_SIZE;
+    __atomic_store_n(s->fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = (xdp->skb_mode ? XDP_COPY : 0) | XDP_USE_NEED_WAKEUP,
+        .sxdp_ifindex = xdp->ifindex,
+        .sxdp_queue_id = queue,
+    };
+    if (bind(s->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        return -1;
+    }
+    return ebpf_map_update(xdp->xsks_map_fd, &queue, &s->fd);
+}
+
+int xdp_init(xdp_t *xdp, const char *ifname, int skb_mode, const struct sockaddr_in *listen_addr, int max_clients)
+{
+    memset(xdp, 0, sizeof(*xdp));
+    xdp->prog_fd = xdp->link_fd = xdp->clients_map_fd = xdp->xsks_map_fd = -1;
+    xdp->ifindex = if_nametoindex(ifname);
+    if (!xdp->ifindex) {
+        serror("Unknown XDP interface '%s'", ifname);
+        return -1;
+    }
+    int queues = count_queues(ifname);
+
+    xdp->clients_map_fd = ebpf_map_create(BPF_MAP_TYPE_HASH, sizeof(xdp_client_key_t), sizeof(uint32_t), max_clients);
+    xdp->xsks_map_fd = ebpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(int), sizeof(int), queues);
+    if (xdp->clients_map_fd < 0 || xdp->xsks_map_fd < 0) {
+        serror("Failed to create XDP maps");
+        xdp_free(xdp);
+        return -1;
+    }
+    if (load_program(xdp, listen_addr) < 0) {
+        serror("Failed to load XDP program");
+        xdp_free(xdp);
+        return -1;
+    }
+    if (!skb_mode && attach_program(xdp, XDP_FLAGS_DRV_MODE) < 0) {
+        log(LL_WARN, "Native XDP is not supported by '%s' (%s), using the generic mode", ifname, strerror(errno));
+        skb_mode = 1;
+    }
+    if (skb_mode && attach_program(xdp, XDP_FLAGS_SKB_MODE) < 0) {
+        serror("Failed to attach XDP program to '%s'", ifname);
+        xdp_free(xdp);
+        return -1;
+    }
+    xdp->skb_mode = skb_mode;
+
+    xdp->sockets = calloc((size_t)queues, sizeof(*xdp->sockets));
+    if (!xdp->sockets) {
+        errno = ENOMEM;
+        serror("Failed to create AF_XDP sockets");
+        xdp_free(xdp);
+        return -1;
+    }
+    for (int i = 0; i < queues; i++) {
+        xdp->socket_count++;
+        if (open_socket(xdp, &xdp->sockets[i], i) < 0) {
+            serror("Failed to create AF_XDP socket for queue %d of '%s'", i, ifname);
+            xdp_free(xdp);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void xdp_free(xdp_t *xdp)
+{
+    // Detach first, so nothing is redirected to the sockets being closed
+    if (xdp->link_fd >= 0) {
+        close(xdp->link_fd);
+    }
+    for (int i = 0; i < xdp->socket_count; i++) {
+        xdp_socket_t *s = &xdp->sockets[i];
+        unmap_ring(&s->fill);
+        unmap_ring(&s->completion);
+        unmap_ring(&s->rx);
+        unmap_ring(&s->tx);
+        if (s->fd >= 0) {
+            close(s->fd);
+        }
+        if (s->umem) {
+            munmap(s->umem, s->umem_size);
+        }
+        free(s->rx_held);
+        free(s->tx_free);
+    }
+    free(xdp->sockets);
+    if (xdp->prog_fd >= 0) {
+        close(xdp->prog_fd);
+    }
+    if (xdp->clients_map_fd >= 0) {
+        close(xdp->clients_map_fd);
+    }
+    if (xdp->xsks_map_fd >= 0) {
+        close(xdp->xsks_map_fd);
+    }
+    memset(xdp, 0, sizeof(*xdp));
+    xdp->prog_fd = xdp->link_fd = xdp->clients_map_fd = xdp->xsks_map_fd = -1;
+}
+
+int xdp_socket_index(xdp_t *xdp, int fd)
+{
+    for (int i = 0; i < xdp->socket_count; i++) {
+        if (xdp->sockets[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int xdp_recv(xdp_t *xdp, int index, xdp_frame_t *frames, int max)
+{
+    xdp_socket_t *s = &xdp->sockets[index];
+    struct xdp_desc *descs = s->rx.descs;
+    uint32_t consumer = *s->rx.consumer;
+    uint32_t available = __atomic_load_n(s->rx.producer, __ATOMIC_ACQUIRE) - consumer;
+    if ((int)available > max) {
+        available = max;
+    }
+    if ((int)available > XDP_RING_SIZE - s->rx_held_count) {
+        available = XDP_RING_SIZE - s->rx_held_count;
+    }
+    int n = 0;
+    for (uint32_t i = 0; i < available; i++) {
+        const struct xdp_desc *desc = &descs[(consumer + i) & s->rx.mask];
+        uint8_t *frame = s->umem + desc->addr;
+        s->rx_held[s->rx_held_count++] = desc->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        // The program has checked the headers, only the UDP length is left
+        int udp_length = ntohs(*(uint16_t *)(frame + 38));
+        if (desc->len < XDP_HEADERS_SIZE || udp_length < 8 || udp_length - 8 > (int)desc->len - XDP_HEADERS_SIZE) {
+            continue;
+        }
+        xdp_frame_t *f = &frames[n++];
+        f->headers = frame;
+        f->data = frame + XDP_HEADERS_SIZE;
+        f->length = udp_length - 8;
+        memset(&f->addr, 0, sizeof(f->addr));
+        f->addr.sin_family = AF_INET;
+        memcpy(&f->addr.sin_addr.s_addr, frame + 26, 4);
+        memcpy(&f->addr.sin_port, frame + 34, 2);
+    }
+    __atomic_store_n(s->rx.consumer, consumer + available, __ATOMIC_RELEASE);
+    if (available > 0) {
+        stats.rx_calls++;
+        stats.rx_packets += n;
+        stats.xdp_rx_packets += n;
+    }
+    return n;
+}
+
+void xdp_release(xdp_t *xdp, int index)
+{
+    xdp_socket_t *s = &xdp->sockets[index];
+    if (s->rx_held_count == 0) {
+        return;
+    }
+    // The fill ring can hold every receive frame, so there is always room
+    uint64_t *fill = s->fill.descs;
+    uint32_t producer = *s->fill.producer;
+    for (int i = 0; i < s->rx_held_count; i++) {
+        fill[(producer + i) & s->fill.mask] = s->rx_held[i];
+    }
+    __atomic_store_n(s->fill.producer, producer + s->rx_held_count, __ATOMIC_RELEASE);
+    s->rx_held_count = 0;
+    if (__atomic_load_n(s->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+        recvfrom(s->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+/**
+ * @brief Takes back the frames the kernel has finished sending.
+ */
+static void reap_completions(xdp_socket_t *s)
+{
+    uint64_t *completed = s->completion.descs;
+    uint32_t consumer = *s->completion.consumer;
+    uint32_t producer = __atomic_load_n(s->completion.producer, __ATOMIC_ACQUIRE);
+    for (; consumer != producer; consumer++) {
+        s->tx_free[s->tx_free_count++] = completed[consumer & s->completion.mask] & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(s->completion.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief RFC 1071 checksum of the IPv4 header.
+ */
+static uint16_t ip_checksum(const uint8_t *header)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2) {
+        sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons((uint16_t)~sum);
+}
+
+int xdp_send(xdp_t *xdp, int index, const uint8_t *headers, int tos, const uint8_t *data, int length)
+{
+    xdp_socket_t *s = &xdp->sockets[index];
+    if (length > XDP_FRAME_SIZE - XDP_HEADERS_SIZE) {
+        return -1;
+    }
+    if (s->tx_free_count == 0) {
+        reap_completions(s);
+        if (s->tx_free_count == 0) {
+            return -1;
+        }
+    }
+    uint64_t addr = s->tx_free[--s->tx_free_count];
+    uint8_t *frame = s->umem + addr;
+
+    // Ethernet: back to where the datagram came from
+    memcpy(frame, headers + 6, 6);
+    memcpy(frame + 6, headers, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+    // IPv4, "don't fragment" like the listening socket
+    uint8_t *ip = frame + 14;
+    uint16_t total_length = htons(20 + 8 + length);
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[1] = tos;
+    memcpy(ip + 2, &total_length, 2);
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, headers + 30, 4);
+    memcpy(ip + 16, headers + 26, 4);
+    uint16_t checksum = ip_checksum(ip);
+    memcpy(ip + 10, &checksum, 2);
+    // UDP, the checksum is optional for IPv4
+    uint8_t *udp = frame + 34;
+    uint16_t udp_length = htons(8 + length);
+    memcpy(udp, headers + 36, 2);
+    memcpy(udp + 2, headers + 34, 2);
+    memcpy(udp + 4, &udp_length, 2);
+    udp[6] = udp[7] = 0;
+    memcpy(frame + XDP_HEADERS_SIZE, data, length);
+
+    // The ring can hold every send frame, so there is always room
+    struct xdp_desc *descs = s->tx.descs;
+    uint32_t producer = *s->tx.producer;
+    descs[producer & s->tx.mask] = (struct xdp_desc){ .addr = addr, .len = XDP_HEADERS_SIZE + length };
+    __atomic_store_n(s->tx.producer, producer + 1, __ATOMIC_RELEASE);
+    s->tx_pending++;
+    return 0;
+}
+
+void xdp_flush(xdp_t *xdp)
+{
+    for (int i = 0; i < xdp->socket_count; i++) {
+        xdp_socket_t *s = &xdp->sockets[i];
+        if (s->tx_pending == 0) {
+            continue;
+        }
+        if (xdp->skb_mode || (__atomic_load_n(s->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+            // Every kick sends a limited number of frames in the generic mode
+            for (int kick = 0; kick < XDP_KICKS_MAX; kick++) {
+                stats.tx_calls++;
+                if (sendto(s->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0 || errno != EAGAIN) {
+                    break;
+                }
+            }
+        }
+        stats.tx_packets += s->tx_pending;
+        stats.xdp_tx_packets += s->tx_pending;
+        s->tx_pending = 0;
+        reap_completions(s);
+    }
+}
+
+int xdp_add_client(xdp_t *xdp, const struct sockaddr_in *addr)
+{
+    xdp_client_key_t key = { .addr = addr->sin_addr.s_addr, .port = addr->sin_port };
+    uint32_t value = 1;
+    return ebpf_map_update(xdp->clients_map_fd, &key, &value);
+}
+
+void xdp_remove_client(xdp_t *xdp, const struct sockaddr_in *addr)
+{
+    xdp_client_key_t key = { .addr = addr->sin_addr.s_addr, .port = addr->sin_port };
+    ebpf_map_delete(xdp->clients_map_fd, &key);
+}
+
+#endif // USE_AF_XDP
@@ -0,0 +1,141 @@
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wg-obfuscator.h"
+#include "ebpf.h"
+
+// AF_XDP fast path for the listening port, needs the epoll event loop and kernel headers 5.9+.
+// Can be left out of the build with "make AF_XDP=0".
+#if defined(USE_EBPF) && defined(USE_EPOLL) && !defined(NO_AF_XDP)
+#if __has_include(<linux/if_xdp.h>)
+#include <linux/if_xdp.h>
+#ifdef XDP_USE_NEED_WAKEUP
+#define USE_AF_XDP
+#endif
+#endif
+#endif
+
+#ifdef USE_AF_XDP
+
+// One of the rings shared with the kernel
+typedef struct {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;                    // struct xdp_desc for RX/TX, uint64_t frame addresses for FILL/COMPLETION
+    uint32_t mask;
+    void *map;
+    size_t map_size;
+} xsk_ring_t;
+
+// AF_XDP socket bound to one receive queue of the interface, with its own UMEM
+typedef struct {
+    int fd;
+    int queue;
+    uint8_t *umem;
+    size_t umem_size;
+    xsk_ring_t fill;
+    xsk_ring_t completion;
+    xsk_ring_t rx;
+    xsk_ring_t tx;
+    uint64_t *rx_held;              // frames handed out by xdp_recv(), given back by xdp_release()
+    int rx_held_count;
+    uint64_t *tx_free;              // frames free for sending
+    int tx_free_count;
+    int tx_pending;                 // frames queued since the last kick
+} xdp_socket_t;
+
+// A datagram received through AF_XDP
+typedef struct {
+    uint8_t *headers;               // Ethernet, IPv4 and UDP headers, XDP_HEADERS_SIZE bytes
+    uint8_t *data;                  // UDP payload, PREBUFFER_SIZE bytes of headroom are available before the headers
+    int length;
+    struct sockaddr_in addr;        // sender address
+} xdp_frame_t;
+
+typedef struct {
+    int ifindex;
+    int prog_fd;
+    int link_fd;                    // the program stays attached while this is open
+    int clients_map_fd;             // addresses redirected to the AF_XDP sockets
+    int xsks_map_fd;                // AF_XDP socket of every receive queue
+    uint8_t skb_mode;               // 1 if attached in the generic (SKB) mode, the frames are copied then
+    xdp_socket_t *sockets;
+    int socket_count;
+} xdp_t;
+
+/**
+ * @brief Attaches the XDP program to the interface and opens an AF_XDP socket for every receive queue.
+ *
+ * @param xdp Context to initialize.
+ * @param ifname Interface the clients are connected through.
+ * @param skb_mode 1 to use the generic (SKB) mode, 0 to try the native driver mode first.
+ * @param listen_addr Address and port the obfuscator listens on.
+ * @param max_clients Maximum number of client addresses to redirect.
+ * @return 0 on success, -1 on error (errno is set, the reason is logged).
+ */
+int xdp_init(xdp_t *xdp, const char *ifname, int skb_mode, const struct sockaddr_in *listen_addr, int max_clients);
+
+/**
+ * @brief Detaches the program and releases all the resources.
+ */
+void xdp_free(xdp_t *xdp);
+
+/**
+ * @brief Returns the index of the AF_XDP socket with the given descriptor, -1 if it is not one of them.
+ */
+int xdp_socket_index(xdp_t *xdp, int fd);
+
+/**
+ * @brief Takes up to 'max' received datagrams from the socket. The frames stay valid
+ * and can be modified in place until xdp_release().
+ *
+ * @param xdp Context.
+ * @param index Socket index.
+ * @param frames Filled with the datagrams.
+ * @param max Maximum number of datagrams.
+ * @return Number of datagrams.
+ */
+int xdp_recv(xdp_t *xdp, int index, xdp_frame_t *frames, int max);
+
+/**
+ * @brief Gives the frames handed out by xdp_recv() back to the kernel.
+ */
+void xdp_release(xdp_t *xdp, int index);
+
+/**
+ * @brief Queues a datagram back to a client through the socket it was received on.
+ * Goes out with the next xdp_flush().
+ *
+ * @param xdp Context.
+ * @param index Socket index.
+ * @param headers Headers of a datagram received from the client, the reply gets them swapped.
+ * @param tos TOS byte of the reply.
+ * @param data Data to send.
+ * @param length Length of the data.
+ * @return 0 if queued, -1 if there is no free frame or the datagram does not fit, the caller must send it by itself then.
+ */
+int xdp_send(xdp_t *xdp, int index, const uint8_t *headers, int tos, const uint8_t *data, int length);
+
+/**
+ * @brief Kicks the transmission of the queued datagrams and takes back the sent frames.
+ */
+void xdp_flush(xdp_t *xdp);
+
+/**
+ * @brief Starts redirecting the datagrams from the address to the AF_XDP sockets.
+ *
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int xdp_add_client(xdp_t *xdp, const struct sockaddr_in *addr);
+
+/**
+ * @brief Stops redirecting the datagrams from the address, they come through the listening socket again.
+ */
+void xdp_remove_client(xdp_t *xdp, const struct sockaddr_in *addr);
+
+#endif // USE_AF_XDP
+
+#endif // _XDP_H_